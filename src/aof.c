@@ -1497,6 +1497,10 @@ int loadSingleAppendOnlyFile(char *filename) {
             cmd->proc(fakeClient);
         }
 
+        /* afterCommand() is not called while loading, compact the values
+         * set by the command now rather than queueing every loaded key. */
+        compactPendingValues();
+
         /* The fake client should not have a reply */
         serverAssert(fakeClient->bufpos == 0 &&
                      listLength(fakeClient->reply) == 0);
@@ -1978,21 +1982,18 @@ int rioWriteBulkStreamID(rio *r,streamID *id) {
 }
 
 /* Helper for rewriteStreamObject(): emit the XCLAIM needed in order to
- * add the message described by 'nack' having the id 'rawid', into the pending
- * list of the specified consumer. All this in the context of the specified
- * key and group. */
-int rioWriteStreamPendingEntry(rio *r, robj *key, const char *groupname, size_t groupname_len, streamConsumer *consumer, unsigned char *rawid, streamNACK *nack) {
+ * add the message described by 'nack' into the pending list of the specified
+ * consumer. All this in the context of the specified key and group. */
+int rioWriteStreamPendingEntry(rio *r, robj *key, const char *groupname, size_t groupname_len, streamConsumer *consumer, streamNACK *nack) {
      /* XCLAIM <key> <group> <consumer> 0 <id> TIME <milliseconds-unix-time>
                RETRYCOUNT <count> JUSTID FORCE. */
-    streamID id;
-    streamDecodeID(rawid,&id);
     if (rioWriteBulkCount(r,'*',12) == 0) return 0;
     if (rioWriteBulkString(r,"XCLAIM",6) == 0) return 0;
     if (rioWriteBulkObject(r,key) == 0) return 0;
     if (rioWriteBulkString(r,groupname,groupname_len) == 0) return 0;
     if (rioWriteBulkString(r,consumer->name,sdslen(consumer->name)) == 0) return 0;
     if (rioWriteBulkString(r,"0",1) == 0) return 0;
-    if (rioWriteBulkStreamID(r,&id) == 0) return 0;
+    if (rioWriteBulkStreamID(r,&nack->id) == 0) return 0;
     if (rioWriteBulkString(r,"TIME",4) == 0) return 0;
     if (rioWriteBulkLongLong(r,nack->delivery_time) == 0) return 0;
     if (rioWriteBulkString(r,"RETRYCOUNT",10) == 0) return 0;
@@ -2052,6 +2053,11 @@ int rewriteStreamObject(rio *r, robj *key, robj *o) {
                 }
             }
         }
+        /* Entries that can't be read from disk must not be skipped. */
+        if (si.error) {
+            streamIteratorStop(&si);
+            return 0;
+        }
     } else {
         /* Use the XADD MAXLEN 0 trick to generate an empty stream if
          * the key we are serializing is an empty string, which is possible
@@ -2135,10 +2141,12 @@ int rewriteStreamObject(rio *r, robj *key, robj *o) {
                 raxStart(&ri_pel,consumer->pel);
                 raxSeek(&ri_pel,"^",NULL,0);
                 while(raxNext(&ri_pel)) {
-                    streamNACK *nack = ri_pel.data;
+                    streamNACK nack;
+                    streamDecodeID(ri_pel.key,&nack.id);
+                    serverAssert(streamPelLookup(group,&nack.id,&nack));
                     if (rioWriteStreamPendingEntry(r,key,(char*)ri.key,
                                                    ri.key_len,consumer,
-                                                   ri_pel.key,nack) == 0)
+                                                   &nack) == 0)
                     {
                         raxStop(&ri_pel);
                         raxStop(&ri_cons);
@@ -2226,9 +2234,10 @@ int rewriteAppendOnlyFileRio(rio *aof) {
             robj key, *o;
             long long expiretime;
             size_t aof_bytes_before_key = aof->processed_bytes;
+            compactValueView view;
 
             keystr = dictGetKey(de);
-            o = dictGetVal(de);
+            o = dbValueView(de,&view);
             initStaticStringObject(key,keystr);
 
             expiretime = getExpire(db,&key);
@@ -2261,7 +2270,7 @@ int rewriteAppendOnlyFileRio(rio *aof) {
              * OS and possibly avoid or decrease COW. We guve the dismiss
              * mechanism a hint about an estimated size of the object we stored. */
             size_t dump_size = aof->processed_bytes - aof_bytes_before_key;
-            if (server.in_fork_child) dismissObject(o, dump_size);
+            if (server.in_fork_child && o != &view.o) dismissObject(o, dump_size);
 
             /* Save the expire time */
             if (expiretime != -1) {
@@ -22,7 +22,9 @@
  *
  * Jobs of the same type are guaranteed to be processed from the least
  * recently inserted to the most recently inserted (older jobs processed
- * first).
+ * first). The exception are lazy free jobs, which can be served by a pool of
+ * threads (lazyfree-threads) sharing the same queue, and may complete in any
+ * order.
  *
  * Currently there is no way for the creator of the job to be notified about
  * the completion of the operation, this will only be added when/if needed.
@@ -61,7 +63,8 @@
 #include "server.h"
 #include "bio.h"
 
-static pthread_t bio_threads[BIO_NUM_OPS];
+static pthread_t bio_threads[BIO_NUM_OPS][BIO_MAX_THREADS_PER_OP];
+static int bio_threads_num[BIO_NUM_OPS];
 static pthread_mutex_t bio_mutex[BIO_NUM_OPS];
 static pthread_cond_t bio_newjob_cond[BIO_NUM_OPS];
 static pthread_cond_t bio_step_cond[BIO_NUM_OPS];
@@ -79,7 +82,8 @@ static unsigned long long bio_pending[BIO_NUM_OPS];
 struct bio_job {
     /* Job specific arguments.*/
     int fd; /* Fd for file based background jobs */
-    lazy_free_fn *free_fn; /* Function that will free the provided arguments */
+    lazy_free_fn *free_fn; /* Function that will free the provided arguments,
+                              or defrag them for BIO_DEFRAG jobs. */
     void *free_args[]; /* List of arguments to be passed to the free function */
 };
 
@@ -103,7 +107,11 @@ void bioInit(void) {
         pthread_cond_init(&bio_step_cond[j],NULL);
         bio_jobs[j] = listCreate();
         bio_pending[j] = 0;
+        bio_threads_num[j] = 1;
     }
+    /* Lazy free jobs don't depend on each other, so they are the only ones
+     * that can be served by more than a thread. */
+    bio_threads_num[BIO_LAZY_FREE] = server.lazyfree_threads;
 
     /* Set the stack size as by default it may be small in some system */
     pthread_attr_init(&attr);
@@ -117,11 +125,13 @@ void bioInit(void) {
      * responsible of. */
     for (j = 0; j < BIO_NUM_OPS; j++) {
         void *arg = (void*)(unsigned long) j;
-        if (pthread_create(&thread,&attr,bioProcessBackgroundJobs,arg) != 0) {
-            serverLog(LL_WARNING,"Fatal: Can't initialize Background Jobs.");
-            exit(1);
+        for (int i = 0; i < bio_threads_num[j]; i++) {
+            if (pthread_create(&thread,&attr,bioProcessBackgroundJobs,arg) != 0) {
+                serverLog(LL_WARNING,"Fatal: Can't initialize Background Jobs.");
+                exit(1);
+            }
+            bio_threads[j][i] = thread;
         }
-        bio_threads[j] = thread;
     }
 }
 
@@ -133,21 +143,34 @@ void bioSubmitJob(int type, struct bio_job *job) {
     pthread_mutex_unlock(&bio_mutex[type]);
 }
 
-void bioCreateLazyFreeJob(lazy_free_fn free_fn, int arg_count, ...) {
-    va_list valist;
+static struct bio_job *bioCreateFnJob(lazy_free_fn fn, int arg_count, va_list valist) {
     /* Allocate memory for the job structure and all required
      * arguments */
     struct bio_job *job = zmalloc(sizeof(*job) + sizeof(void *) * (arg_count));
-    job->free_fn = free_fn;
+    job->free_fn = fn;
 
-    va_start(valist, arg_count);
     for (int i = 0; i < arg_count; i++) {
         job->free_args[i] = va_arg(valist, void *);
     }
+    return job;
+}
+
+void bioCreateLazyFreeJob(lazy_free_fn free_fn, int arg_count, ...) {
+    va_list valist;
+    va_start(valist, arg_count);
+    struct bio_job *job = bioCreateFnJob(free_fn, arg_count, valist);
     va_end(valist);
     bioSubmitJob(BIO_LAZY_FREE, job);
 }
 
+void bioCreateDefragJob(defrag_fn defrag_fn, int arg_count, ...) {
+    va_list valist;
+    va_start(valist, arg_count);
+    struct bio_job *job = bioCreateFnJob(defrag_fn, arg_count, valist);
+    va_end(valist);
+    bioSubmitJob(BIO_DEFRAG, job);
+}
+
 void bioCreateCloseJob(int fd) {
     struct bio_job *job = zmalloc(sizeof(*job));
     job->fd = fd;
@@ -184,6 +207,9 @@ void *bioProcessBackgroundJobs(void *arg) {
     case BIO_LAZY_FREE:
         redis_set_thread_title("bio_lazy_free");
         break;
+    case BIO_DEFRAG:
+        redis_set_thread_title("bio_defrag");
+        break;
     }
 
     redisSetCpuAffinity(server.bio_cpulist);
@@ -207,9 +233,11 @@ void *bioProcessBackgroundJobs(void *arg) {
             pthread_cond_wait(&bio_newjob_cond[type],&bio_mutex[type]);
             continue;
         }
-        /* Pop the job from the queue. */
+        /* Pop the job from the queue. The node is unlinked right away since
+         * other threads may serve the same queue. */
         ln = listFirst(bio_jobs[type]);
         job = ln->value;
+        listDelNode(bio_jobs[type],ln);
         /* It is now possible to unlock the background system as we know have
          * a stand alone job structure to process.*/
         pthread_mutex_unlock(&bio_mutex[type]);
@@ -235,7 +263,7 @@ void *bioProcessBackgroundJobs(void *arg) {
             } else {
                 atomicSet(server.aof_bio_fsync_status,C_OK);
             }
-        } else if (type == BIO_LAZY_FREE) {
+        } else if (type == BIO_LAZY_FREE || type == BIO_DEFRAG) {
             job->free_fn(job->free_args);
         } else {
             serverPanic("Wrong job type in bioProcessBackgroundJobs().");
@@ -245,7 +273,6 @@ void *bioProcessBackgroundJobs(void *arg) {
         /* Lock again before reiterating the loop, if there are no longer
          * jobs to process we'll block again in pthread_cond_wait(). */
         pthread_mutex_lock(&bio_mutex[type]);
-        listDelNode(bio_jobs[type],ln);
         bio_pending[type]--;
 
         /* Unblock threads blocked on bioWaitStepOfType() if any. */
@@ -292,15 +319,18 @@ void bioKillThreads(void) {
     int err, j;
 
     for (j = 0; j < BIO_NUM_OPS; j++) {
-        if (bio_threads[j] == pthread_self()) continue;
-        if (bio_threads[j] && pthread_cancel(bio_threads[j]) == 0) {
-            if ((err = pthread_join(bio_threads[j],NULL)) != 0) {
-                serverLog(LL_WARNING,
-                    "Bio thread for job type #%d can not be joined: %s",
-                        j, strerror(err));
-            } else {
-                serverLog(LL_WARNING,
-                    "Bio thread for job type #%d terminated",j);
+        for (int i = 0; i < bio_threads_num[j]; i++) {
+            pthread_t thread = bio_threads[j][i];
+            if (thread == pthread_self()) continue;
+            if (thread && pthread_cancel(thread) == 0) {
+                if ((err = pthread_join(thread,NULL)) != 0) {
+                    serverLog(LL_WARNING,
+                        "Bio thread for job type #%d can not be joined: %s",
+                            j, strerror(err));
+                } else {
+                    serverLog(LL_WARNING,
+                        "Bio thread for job type #%d terminated",j);
+                }
             }
         }
     }
@@ -31,6 +31,7 @@
 #define __BIO_H
 
 typedef void lazy_free_fn(void *args[]);
+typedef void defrag_fn(void *args[]);
 
 /* Exported API */
 void bioInit(void);
@@ -40,11 +41,16 @@ void bioKillThreads(void);
 void bioCreateCloseJob(int fd);
 void bioCreateFsyncJob(int fd);
 void bioCreateLazyFreeJob(lazy_free_fn free_fn, int arg_count, ...);
+void bioCreateDefragJob(defrag_fn defrag_fn, int arg_count, ...);
 
 /* Background job opcodes */
 #define BIO_CLOSE_FILE    0 /* Deferred close(2) syscall. */
 #define BIO_AOF_FSYNC     1 /* Deferred AOF fsync. */
 #define BIO_LAZY_FREE     2 /* Deferred objects freeing. */
-#define BIO_NUM_OPS       3
+#define BIO_DEFRAG        3 /* Values reallocation for active defrag. */
+#define BIO_NUM_OPS       4
+
+/* Max number of threads serving the same job type, see lazyfree-threads. */
+#define BIO_MAX_THREADS_PER_OP 16
 
 #endif
@@ -81,8 +81,21 @@ int getListPositionFromObjectOrReply(client *c, robj *arg, int *position);
 typedef struct bkinfo {
     listNode *listnode;     /* List node for db->blocking_keys[key] list. */
     streamID stream_id;     /* Stream ID if we blocked in a stream. */
+    listNode *waitnode;     /* List node in db->stream_waiters[key]. */
 } bkinfo;
 
+/* Clients blocked on a stream key, indexed by the kind of read they are
+ * waiting for, so that serving them does not require to visit all the
+ * clients blocked for the key: every XREAD client is served with the new
+ * entries, while only as many XREADGROUP clients of a group are served as
+ * needed to consume the new entries of the group, in the order they
+ * blocked. */
+typedef struct streamWaiters {
+    list *readers;          /* Clients blocked by XREAD. */
+    dict *groups;           /* Group name -> list of clients blocked by
+                               XREADGROUP with this group. */
+} streamWaiters;
+
 /* Block a client for the specific operation type. Once the CLIENT_BLOCKED
  * flag is set client query buffer is not longer processed, but accumulated,
  * and will be processed when the client is unblocked. */
@@ -311,6 +324,9 @@ void serveClientsBlockedOnListKey(robj *o, readyList *rl) {
             if (dstkey) incrRefCount(dstkey);
 
             long long prev_error_replies = server.stat_total_error_replies;
+            /* The invalidations pending for the receiver precede its reply,
+             * see prepareClientToWrite(). */
+            trackingFlushPendingInvalidations(receiver);
             client *old_client = server.current_client;
             server.current_client = receiver;
             monotime replyTimer;
@@ -363,6 +379,7 @@ void serveClientsBlockedOnSortedSetKey(robj *o, readyList *rl) {
             int reply_nil_when_empty = use_nested_array;
 
             long long prev_error_replies = server.stat_total_error_replies;
+            trackingFlushPendingInvalidations(receiver);
             client *old_client = server.current_client;
             server.current_client = receiver;
             monotime replyTimer;
@@ -396,6 +413,81 @@ void serveClientsBlockedOnSortedSetKey(robj *o, readyList *rl) {
     }
 }
 
+/* Serve a client blocked by XREAD or XREADGROUP on the stream 'o' with the
+ * entries following the ID it is waiting for, and unblock it. For XREADGROUP
+ * 'group' is the consumer group the client blocked for, or NULL if it no
+ * longer exists, in which case the client receives an error. */
+static void serveClientBlockedOnStream(client *receiver, robj *o, readyList *rl, streamCG *group) {
+    stream *s = o->ptr;
+    bkinfo *bki = dictFetchValue(receiver->bpop.keys,rl->key);
+
+    long long prev_error_replies = server.stat_total_error_replies;
+    trackingFlushPendingInvalidations(receiver);
+    client *old_client = server.current_client;
+    server.current_client = receiver;
+    monotime replyTimer;
+    elapsedStart(&replyTimer);
+
+    if (receiver->bpop.xread_group && !group) {
+        addReplyError(receiver,
+            "-NOGROUP the consumer group this client "
+            "was blocked on no longer exists");
+    } else {
+        /* Clients blocked in the context of a consumer group are always
+         * blocked for the ">" ID: we need to deliver only the messages
+         * after the group last ID, that serving other clients in the same
+         * consumer group may have altered. */
+        streamID start = group ? group->last_id : bki->stream_id;
+        streamIncrID(&start);
+
+        /* Lookup the consumer for the group, if any. */
+        streamConsumer *consumer = NULL;
+        int noack = 0;
+
+        if (group) {
+            noack = receiver->bpop.xread_group_noack;
+            sds name = receiver->bpop.xread_consumer->ptr;
+            consumer = streamLookupConsumer(group,name,SLC_DEFAULT);
+            if (consumer == NULL) {
+                consumer = streamCreateConsumer(group,name,rl->key,
+                                                rl->db->id,SCC_DEFAULT);
+                if (noack) {
+                    streamPropagateConsumerCreation(receiver,rl->key,
+                                                    receiver->bpop.xread_group,
+                                                    consumer->name);
+                }
+            }
+        }
+
+        /* Emit the two elements sub-array consisting of
+         * the name of the stream and the data we
+         * extracted from it. Wrapped in a single-item
+         * array, since we have just one key. */
+        if (receiver->resp == 2) {
+            addReplyArrayLen(receiver,1);
+            addReplyArrayLen(receiver,2);
+        } else {
+            addReplyMapLen(receiver,1);
+        }
+        addReplyBulk(receiver,rl->key);
+
+        streamPropInfo pi = {
+            rl->key,
+            receiver->bpop.xread_group
+        };
+        streamReplyWithRange(receiver,s,&start,NULL,
+                             receiver->bpop.xread_count,
+                             0, group, consumer, noack, &pi);
+    }
+
+    /* Note that after we unblock the client, 'bki' and other
+     * receiver->bpop stuff are no longer valid. */
+    updateStatsOnUnblock(receiver, 0, elapsedUs(replyTimer), server.stat_total_error_replies != prev_error_replies);
+    unblockClient(receiver);
+    afterCommand(receiver);
+    server.current_client = old_client;
+}
+
 /* Helper function for handleClientsBlockedOnKeys(). This function is called
  * when there may be clients blocked on a stream key, and there may be new
  * data to fetch (the key is ready). */
@@ -404,110 +496,57 @@ void serveClientsBlockedOnStreamKey(robj *o, readyList *rl) {
      * we can skip this loop. */
     if (!server.blocked_clients_by_type[BLOCKED_STREAM]) return;
 
-    dictEntry *de = dictFind(rl->db->blocking_keys,rl->key);
+    streamWaiters *sw = dictFetchValue(rl->db->stream_waiters,rl->key);
     stream *s = o->ptr;
+    if (sw == NULL) return;
 
     /* We need to provide the new data arrived on the stream
-     * to all the clients that are waiting for an offset smaller
-     * than the current top item. */
-    if (de) {
-        list *clients = dictGetVal(de);
-        listNode *ln;
-        listIter li;
-        listRewind(clients,&li);
-
-        while((ln = listNext(&li))) {
-            client *receiver = listNodeValue(ln);
-            if (receiver->btype != BLOCKED_STREAM) continue;
-            bkinfo *bki = dictFetchValue(receiver->bpop.keys,rl->key);
-            streamID *gt = &bki->stream_id;
-
-            long long prev_error_replies = server.stat_total_error_replies;
-            client *old_client = server.current_client;
-            server.current_client = receiver;
-            monotime replyTimer;
-            elapsedStart(&replyTimer);
+     * to all the XREAD clients that are waiting for an offset smaller
+     * than the current top item. Note that when the last client is
+     * unblocked the waiters are released, but the iterator already
+     * points to the NULL next node. */
+    listNode *ln;
+    listIter li;
+    listRewind(sw->readers,&li);
+    while((ln = listNext(&li))) {
+        client *receiver = listNodeValue(ln);
+        bkinfo *bki = dictFetchValue(receiver->bpop.keys,rl->key);
+        if (streamCompareID(&s->last_id,&bki->stream_id) > 0)
+            serveClientBlockedOnStream(receiver,o,rl,NULL);
+    }
 
-            /* If we blocked in the context of a consumer
-             * group, we need to resolve the group and update the
-             * last ID the client is blocked for: this is needed
-             * because serving other clients in the same consumer
-             * group will alter the "last ID" of the consumer
-             * group, and clients blocked in a consumer group are
-             * always blocked for the ">" ID: we need to deliver
-             * only new messages and avoid unblocking the client
-             * otherwise. */
-            streamCG *group = NULL;
-            if (receiver->bpop.xread_group) {
-                group = streamLookupCG(s,
-                        receiver->bpop.xread_group->ptr);
-                /* If the group was not found, send an error
-                 * to the consumer. */
-                if (!group) {
-                    addReplyError(receiver,
-                        "-NOGROUP the consumer group this client "
-                        "was blocked on no longer exists");
-                    goto unblock_receiver;
-                } else {
-                    *gt = group->last_id;
-                }
-            }
+    /* Instead the XREADGROUP clients of a group are served one after the
+     * other, just until the group consumed the stream. Serving the clients
+     * may release the waiters, so we first take the group names, and then
+     * look the clients up again every time. */
+    sw = dictFetchValue(rl->db->stream_waiters,rl->key);
+    if (sw == NULL) return;
 
-            if (streamCompareID(&s->last_id, gt) > 0) {
-                streamID start = *gt;
-                streamIncrID(&start);
-
-                /* Lookup the consumer for the group, if any. */
-                streamConsumer *consumer = NULL;
-                int noack = 0;
-
-                if (group) {
-                    noack = receiver->bpop.xread_group_noack;
-                    sds name = receiver->bpop.xread_consumer->ptr;
-                    consumer = streamLookupConsumer(group,name,SLC_DEFAULT);
-                    if (consumer == NULL) {
-                        consumer = streamCreateConsumer(group,name,rl->key,
-                                                        rl->db->id,SCC_DEFAULT);
-                        if (noack) {
-                            streamPropagateConsumerCreation(receiver,rl->key,
-                                                            receiver->bpop.xread_group,
-                                                            consumer->name);
-                        }
-                    }
-                }
+    unsigned long numgroups = 0;
+    robj **groupnames = zmalloc(sizeof(robj*)*dictSize(sw->groups));
+    dictIterator *di = dictGetIterator(sw->groups);
+    dictEntry *de;
+    while((de = dictNext(di)) != NULL) {
+        groupnames[numgroups] = dictGetKey(de);
+        incrRefCount(groupnames[numgroups++]);
+    }
+    dictReleaseIterator(di);
 
-                /* Emit the two elements sub-array consisting of
-                 * the name of the stream and the data we
-                 * extracted from it. Wrapped in a single-item
-                 * array, since we have just one key. */
-                if (receiver->resp == 2) {
-                    addReplyArrayLen(receiver,1);
-                    addReplyArrayLen(receiver,2);
-                } else {
-                    addReplyMapLen(receiver,1);
-                }
-                addReplyBulk(receiver,rl->key);
-
-                streamPropInfo pi = {
-                    rl->key,
-                    receiver->bpop.xread_group
-                };
-                streamReplyWithRange(receiver,s,&start,NULL,
-                                     receiver->bpop.xread_count,
-                                     0, group, consumer, noack, &pi);
-                /* Note that after we unblock the client, 'gt'
-                 * and other receiver->bpop stuff are no longer
-                 * valid, so we must do the setup above before
-                 * the unblockClient call. */
-
-unblock_receiver:
-                updateStatsOnUnblock(receiver, 0, elapsedUs(replyTimer), server.stat_total_error_replies != prev_error_replies);
-                unblockClient(receiver);
-                afterCommand(receiver);
-                server.current_client = old_client;
-            }
+    for (unsigned long j = 0; j < numgroups; j++) {
+        streamCG *group = streamLookupCG(s,groupnames[j]->ptr);
+        list *clients;
+
+        while((sw = dictFetchValue(rl->db->stream_waiters,rl->key)) &&
+              (clients = dictFetchValue(sw->groups,groupnames[j])))
+        {
+            if (group && streamCompareID(&s->last_id,&group->last_id) <= 0)
+                break;
+            serveClientBlockedOnStream(listNodeValue(listFirst(clients)),
+                                       o,rl,group);
         }
+        decrRefCount(groupnames[j]);
     }
+    zfree(groupnames);
 }
 
 /* Helper function for handleClientsBlockedOnKeys(). This function is called
@@ -541,6 +580,7 @@ void serveClientsBlockedOnKeyByModule(readyList *rl) {
              * is ready or not. This means we can't exit the loop but need
              * to continue after the first failure. */
             long long prev_error_replies = server.stat_total_error_replies;
+            trackingFlushPendingInvalidations(receiver);
             client *old_client = server.current_client;
             server.current_client = receiver;
             monotime replyTimer;
@@ -584,6 +624,7 @@ void unblockDeletedStreamReadgroupClients(readyList *rl) {
                 continue;
 
             long long prev_error_replies = server.stat_total_error_replies;
+            trackingFlushPendingInvalidations(receiver);
             client *old_client = server.current_client;
             server.current_client = receiver;
             monotime replyTimer;
@@ -715,6 +756,59 @@ void handleClientsBlockedOnKeys(void) {
  *   to the number of elements we have in the ready list.
  */
 
+/* Add the client, blocked by XREAD or XREADGROUP, to the waiters of the
+ * stream 'key', returning its list node. For XREADGROUP the group name
+ * must be already set in the client. */
+static listNode *addStreamWaiter(client *c, robj *key) {
+    streamWaiters *sw = dictFetchValue(c->db->stream_waiters,key);
+    list *l;
+
+    if (sw == NULL) {
+        sw = zmalloc(sizeof(*sw));
+        sw->readers = listCreate();
+        sw->groups = dictCreate(&objectKeyPointerValueDictType);
+        incrRefCount(key);
+        serverAssert(dictAdd(c->db->stream_waiters,key,sw) == DICT_OK);
+    }
+    if (c->bpop.xread_group) {
+        l = dictFetchValue(sw->groups,c->bpop.xread_group);
+        if (l == NULL) {
+            l = listCreate();
+            incrRefCount(c->bpop.xread_group);
+            serverAssert(dictAdd(sw->groups,c->bpop.xread_group,l) == DICT_OK);
+        }
+    } else {
+        l = sw->readers;
+    }
+    listAddNodeTail(l,c);
+    return listLast(l);
+}
+
+/* Remove the client from the waiters of the stream 'key', releasing the
+ * waiters when no client is left. */
+static void removeStreamWaiter(client *c, robj *key, listNode *waitnode) {
+    streamWaiters *sw = dictFetchValue(c->db->stream_waiters,key);
+    serverAssertWithInfo(c,key,sw != NULL);
+
+    if (c->bpop.xread_group) {
+        list *l = dictFetchValue(sw->groups,c->bpop.xread_group);
+        serverAssertWithInfo(c,key,l != NULL);
+        listDelNode(l,waitnode);
+        if (listLength(l) == 0) {
+            listRelease(l);
+            dictDelete(sw->groups,c->bpop.xread_group);
+        }
+    } else {
+        listDelNode(sw->readers,waitnode);
+    }
+    if (listLength(sw->readers) == 0 && dictSize(sw->groups) == 0) {
+        listRelease(sw->readers);
+        dictRelease(sw->groups);
+        zfree(sw);
+        dictDelete(c->db->stream_waiters,key);
+    }
+}
+
 /* Set a client in blocking mode for the specified key (list, zset or stream),
  * with the specified timeout. The 'type' argument is BLOCKED_LIST,
  * BLOCKED_ZSET or BLOCKED_STREAM depending on the kind of operation we are
@@ -768,6 +862,8 @@ void blockForKeys(client *c, int btype, robj **keys, int numkeys, long count, ms
         }
         listAddNodeTail(l,c);
         bki->listnode = listLast(l);
+        if (btype == BLOCKED_STREAM)
+            bki->waitnode = addStreamWaiter(c,keys[j]);
     }
     blockClient(c,btype);
 }
@@ -790,6 +886,8 @@ void unblockClientWaitingData(client *c) {
         l = dictFetchValue(c->db->blocking_keys,key);
         serverAssertWithInfo(c,key,l != NULL);
         listDelNode(l,bki->listnode);
+        if (c->btype == BLOCKED_STREAM)
+            removeStreamWaiter(c,key,bki->waitnode);
         /* If the list is empty we need to remove it to avoid wasting memory */
         if (listLength(l) == 0)
             dictDelete(c->db->blocking_keys,key);
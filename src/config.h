@@ -154,6 +154,12 @@
 #define REDIS_NO_SANITIZE(sanitizer)
 #endif
 
+/* Test for sendfile(2), used to send files to sockets without copying them
+ * to user space. */
+#ifdef __linux__
+#define HAVE_SENDFILE 1
+#endif
+
 /* Define rdb_fsync_range to sync_file_range() on Linux, otherwise we use
  * the plain fsync() call. */
 #if (defined(__linux__) && defined(SYNC_FILE_RANGE_WAIT_BEFORE))
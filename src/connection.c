@@ -30,6 +30,10 @@
 #include "server.h"
 #include "connhelpers.h"
 
+#ifdef HAVE_SENDFILE
+#include <sys/sendfile.h>
+#endif
+
 /* The connections module provides a lean abstraction of network connections
  * to avoid direct socket and async event management across the Redis code base.
  *
@@ -193,6 +197,25 @@ static int connSocketWritev(connection *conn, const struct iovec *iov, int iovcn
     return ret;
 }
 
+static ssize_t connSocketSendfile(connection *conn, int fd, off_t offset, size_t count) {
+#ifdef HAVE_SENDFILE
+    ssize_t ret = sendfile(conn->fd, fd, &offset, count);
+    if (ret < 0 && errno != EAGAIN) {
+        conn->last_errno = errno;
+
+        /* Don't overwrite the state of a connection that is not already
+         * connected, not to mess with handler callbacks.
+         */
+        if (errno != EINTR && conn->state == CONN_STATE_CONNECTED)
+            conn->state = CONN_STATE_ERROR;
+    }
+
+    return ret;
+#else
+    return connGenericSendfile(conn, fd, offset, count);
+#endif
+}
+
 static int connSocketRead(connection *conn, void *buf, size_t buf_len) {
     int ret = read(conn->fd, buf, buf_len);
     if (!ret) {
@@ -365,6 +388,7 @@ ConnectionType CT_Socket = {
     .close = connSocketClose,
     .write = connSocketWrite,
     .writev = connSocketWritev,
+    .sendfile = connSocketSendfile,
     .read = connSocketRead,
     .accept = connSocketAccept,
     .connect = connSocketConnect,
@@ -379,6 +403,24 @@ ConnectionType CT_Socket = {
 };
 
 
+/* Implements connSendfile() by reading the file into a buffer and writing
+ * it with connWrite(), for the connection types that can't use sendfile(2). */
+ssize_t connGenericSendfile(connection *conn, int fd, off_t offset, size_t count) {
+    char buf[PROTO_IOBUF_LEN];
+
+    if (count > sizeof(buf)) count = sizeof(buf);
+    ssize_t nread = pread(fd, buf, count, offset);
+    if (nread <= 0) {
+        if (nread == -1) {
+            conn->last_errno = errno;
+            if (conn->state == CONN_STATE_CONNECTED)
+                conn->state = CONN_STATE_ERROR;
+        }
+        return nread;
+    }
+    return connWrite(conn, buf, nread);
+}
+
 int connGetSocketError(connection *conn) {
     int sockerr = 0;
     socklen_t errlen = sizeof(sockerr);
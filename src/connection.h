@@ -67,6 +67,7 @@ typedef struct ConnectionType {
     int (*connect)(struct connection *conn, const char *addr, int port, const char *source_addr, ConnectionCallbackFunc connect_handler);
     int (*write)(struct connection *conn, const void *data, size_t data_len);
     int (*writev)(struct connection *conn, const struct iovec *iov, int iovcnt);
+    ssize_t (*sendfile)(struct connection *conn, int fd, off_t offset, size_t count);
     int (*read)(struct connection *conn, void *buf, size_t buf_len);
     void (*close)(struct connection *conn);
     int (*accept)(struct connection *conn, ConnectionCallbackFunc accept_handler);
@@ -78,6 +79,8 @@ typedef struct ConnectionType {
     ssize_t (*sync_read)(struct connection *conn, char *ptr, ssize_t size, long long timeout);
     ssize_t (*sync_readline)(struct connection *conn, char *ptr, ssize_t size, long long timeout);
     int (*get_type)(struct connection *conn);
+    void (*postpone_update_state)(struct connection *conn, int postpone);
+    void (*update_state)(struct connection *conn);
 } ConnectionType;
 
 struct connection {
@@ -162,6 +165,18 @@ static inline int connWritev(connection *conn, const struct iovec *iov, int iovc
     return conn->type->writev(conn, iov, iovcnt);
 }
 
+/* Write up to 'count' bytes of the file 'fd', starting at 'offset', to the
+ * connection, behaves like sendfile(2) with an explicit offset: the file
+ * offset is not changed. The connection types that can't hand the transfer
+ * to the kernel copy the file in user space, see connGenericSendfile().
+ *
+ * A short write is possible, a return value of 0 means the end of the file
+ * was reached and -1 indicates an error. The caller should NOT rely on
+ * errno, like for connWrite(). */
+static inline ssize_t connSendfile(connection *conn, int fd, off_t offset, size_t count) {
+    return conn->type->sendfile(conn, fd, offset, count);
+}
+
 /* Read from the connection, behaves the same as read(2).
  * 
  * Like read(2), a short read is possible.  A return value of 0 will indicate the
@@ -175,6 +190,20 @@ static inline int connRead(connection *conn, void *buf, size_t buf_len) {
     return ret;
 }
 
+/* Connections read and written by the I/O threads can't update their state
+ * in the event loop, that is not thread safe: when 'postpone' is set, the
+ * connection defers such updates until connUpdateState() is called, by the
+ * main thread, once the I/O threads are done. */
+static inline void connSetPostponeUpdateState(connection *conn, int postpone) {
+    if (conn->type->postpone_update_state)
+        conn->type->postpone_update_state(conn, postpone);
+}
+
+static inline void connUpdateState(connection *conn) {
+    if (conn->type->update_state)
+        conn->type->update_state(conn);
+}
+
 /* Register a write handler, to be called when the connection is writable.
  * If NULL, the existing handler is removed.
  */
@@ -246,6 +275,7 @@ int connGetState(connection *conn);
 int connHasWriteHandler(connection *conn);
 int connHasReadHandler(connection *conn);
 int connGetSocketError(connection *conn);
+ssize_t connGenericSendfile(connection *conn, int fd, off_t offset, size_t count);
 
 /* anet-style wrappers to conns */
 int connBlock(connection *conn);
@@ -81,8 +81,11 @@ void updateLFU(robj *val) {
 robj *lookupKey(redisDb *db, robj *key, int flags) {
     dictEntry *de = dictFind(db->dict,key->ptr);
     robj *val = NULL;
+    /* The admission filter counts the accesses to missing keys as well. */
+    if (server.maxmemory_admission_filter && !(flags & LOOKUP_NOTOUCH))
+        admissionFilterRecord(key->ptr);
     if (de) {
-        val = dictGetVal(de);
+        val = dbExpandValue(db,de);
         /* Forcing deletion of expired keys on a replica makes the replica
          * inconsistent with the master. We forbid it on readonly replicas, but
          * we have to allow it on writable replicas to make write commands
@@ -106,6 +109,7 @@ robj *lookupKey(redisDb *db, robj *key, int flags) {
         if (!hasActiveChildProcess() && !(flags & LOOKUP_NOTOUCH)){
             if (server.maxmemory_policy & MAXMEMORY_FLAG_LFU) {
                 updateLFU(val);
+                if (db->eviction_queues) evictionQueueTouchEntry(de, db);
             } else {
                 val->lru = LRU_CLOCK();
             }
@@ -181,7 +185,11 @@ void dbAdd(redisDb *db, robj *key, robj *val) {
     serverAssertWithInfo(NULL, key, de != NULL);
     dictSetVal(db->dict, de, val);
     signalKeyAsReady(db, key, val->type);
+    if (server.maxmemory_admission_filter) admissionFilterAdmit(db, copy, val);
     if (server.cluster_enabled) slotToKeyAddEntry(de, db);
+    if (db->eviction_queues) evictionQueueAddEntry(de, db);
+    if (db->memory_prefixes) memoryPrefixAddEntry(de, db);
+    dbCompactValueLater(db, de);
     notifyKeyspaceEvent(NOTIFY_NEW,"new",key,db->id);
 }
 
@@ -201,6 +209,9 @@ int dbAddRDBLoad(redisDb *db, sds key, robj *val) {
     if (de == NULL) return 0;
     dictSetVal(db->dict, de, val);
     if (server.cluster_enabled) slotToKeyAddEntry(de, db);
+    if (db->eviction_queues) evictionQueueAddEntry(de, db);
+    if (db->memory_prefixes) memoryPrefixAddEntry(de, db);
+    dbCompactValue(db, de);
     return 1;
 }
 
@@ -214,7 +225,8 @@ void dbOverwrite(redisDb *db, robj *key, robj *val) {
 
     serverAssertWithInfo(NULL,key,de != NULL);
     dictEntry auxentry = *de;
-    robj *old = dictGetVal(de);
+    compactValueView view;
+    robj *old = dbValueView(de,&view);
     if (server.maxmemory_policy & MAXMEMORY_FLAG_LFU) {
         val->lru = old->lru;
     }
@@ -226,8 +238,12 @@ void dbOverwrite(redisDb *db, robj *key, robj *val) {
     if (old->type == OBJ_STREAM)
         signalKeyAsReady(db,key,old->type);
     dictSetVal(db->dict, de, val);
+    if (db->memory_prefixes) memoryPrefixUpdateEntry(de, db);
+    dbCompactValueLater(db, de);
 
-    if (server.lazyfree_lazy_server_del) {
+    if (old == &view.o) db->compact_values--;
+
+    if (server.lazyfree_lazy_server_del && old != &view.o) {
         freeObjAsync(key,old,db->id);
         dictSetVal(db->dict, &auxentry, NULL);
     }
@@ -305,24 +321,39 @@ robj *dbRandomKey(redisDb *db) {
     }
 }
 
-/* Helper for sync and async delete. */
-static int dbGenericDelete(redisDb *db, robj *key, int async) {
+/* Remove the expire of 'key' both from db->expires and from the expire
+ * index. Returns 1 if the key had an expire, otherwise 0. */
+static int dbDeleteExpire(redisDb *db, sds key) {
     /* Deleting an entry from the expires dict will not free the sds of
      * the key, because it is shared with the main dictionary. */
-    if (dictSize(db->expires) > 0) dictDelete(db->expires,key->ptr);
+    dictEntry *de = dictUnlink(db->expires,key);
+    if (de == NULL) return 0;
+    expireIndexDel(db->expires_index,dictGetKey(de),
+                   dictGetSignedIntegerVal(de));
+    dictFreeUnlinkedEntry(db->expires,de);
+    return 1;
+}
+
+/* Helper for sync and async delete. */
+static int dbGenericDelete(redisDb *db, robj *key, int async) {
+    if (dictSize(db->expires) > 0) dbDeleteExpire(db,key->ptr);
     dictEntry *de = dictUnlink(db->dict,key->ptr);
     if (de) {
-        robj *val = dictGetVal(de);
+        compactValueView view;
+        robj *val = dbValueView(de,&view);
         /* Tells the module that the key has been unlinked from the database. */
         moduleNotifyKeyUnlink(key,val,db->id);
         /* We want to try to unblock any client using a blocking XREADGROUP */
         if (val->type == OBJ_STREAM)
             signalKeyAsReady(db,key,val->type);
-        if (async) {
+        if (async && val != &view.o) {
             freeObjAsync(key, val, db->id);
             dictSetVal(db->dict, de, NULL);
         }
         if (server.cluster_enabled) slotToKeyDelEntry(de, db);
+        if (db->eviction_queues) evictionQueueDelEntry(de, db);
+        if (db->memory_prefixes) memoryPrefixDelEntry(de, db);
+        if (val == &view.o) db->compact_values--;
         dictFreeUnlinkedEntry(db->dict,de);
         return 1;
     } else {
@@ -411,10 +442,13 @@ long long emptyDbStructure(redisDb *dbarray, int dbnum, int async,
         } else {
             dictEmpty(dbarray[j].dict,callback);
             dictEmpty(dbarray[j].expires,callback);
+            expireIndexEmpty(dbarray[j].expires_index);
         }
+        evictionQueuesFlush(&dbarray[j]);
+        memoryPrefixesFlush(&dbarray[j]);
         /* Because all keys of database are removed, reset average ttl. */
         dbarray[j].avg_ttl = 0;
-        dbarray[j].expires_cursor = 0;
+        dbarray[j].compact_values = 0;
     }
 
     return removed;
@@ -486,7 +520,12 @@ redisDb *initTempDb(void) {
     for (int i=0; i<server.dbnum; i++) {
         tempDb[i].dict = dictCreate(&dbDictType);
         tempDb[i].expires = dictCreate(&dbExpiresDictType);
+        tempDb[i].expires_index = expireIndexCreate();
         tempDb[i].slots_to_keys = NULL;
+        tempDb[i].eviction_queues = NULL;
+        evictionQueuesInit(&tempDb[i]);
+        tempDb[i].memory_prefixes = NULL;
+        memoryPrefixesInit(&tempDb[i]);
     }
 
     if (server.cluster_enabled) {
@@ -506,6 +545,9 @@ void discardTempDb(redisDb *tempDb, void(callback)(dict*)) {
     for (int i=0; i<server.dbnum; i++) {
         dictRelease(tempDb[i].dict);
         dictRelease(tempDb[i].expires);
+        expireIndexRelease(tempDb[i].expires_index);
+        evictionQueuesDestroy(&tempDb[i]);
+        memoryPrefixesDestroy(&tempDb[i]);
     }
 
     if (server.cluster_enabled) {
@@ -546,6 +588,7 @@ long long dbTotalServerKeyCount() {
 void signalModifiedKey(client *c, redisDb *db, robj *key) {
     touchWatchedKey(db,key);
     trackingInvalidateKey(c,key,1);
+    if (db->memory_prefixes) memoryPrefixUpdateKey(db,key);
 }
 
 void signalFlushedDb(int dbid, int async) {
@@ -1290,7 +1333,13 @@ void copyCommand(client *c) {
         case OBJ_SET: newobj = setTypeDup(o); break;
         case OBJ_ZSET: newobj = zsetDup(o); break;
         case OBJ_HASH: newobj = hashTypeDup(o); break;
-        case OBJ_STREAM: newobj = streamDup(o); break;
+        case OBJ_STREAM:
+            newobj = streamDup(o);
+            if (!newobj) {
+                addReplyError(c, "Error reading the stream from disk");
+                return;
+            }
+            break;
         case OBJ_MODULE:
             newobj = moduleTypeDupOrReply(c, key, newkey, dst->id, o);
             if (!newobj) return;
@@ -1326,7 +1375,8 @@ void scanDatabaseForReadyKeys(redisDb *db) {
         robj *key = dictGetKey(de);
         dictEntry *kde = dictFind(db->dict,key->ptr);
         if (kde) {
-            robj *value = dictGetVal(kde);
+            compactValueView view;
+            robj *value = dbValueView(kde,&view);
             signalKeyAsReady(db, key, value->type);
         }
     }
@@ -1349,13 +1399,15 @@ void scanDatabaseForDeletedStreams(redisDb *emptied, redisDb *replaced_with) {
 
         dictEntry *kde = dictFind(emptied->dict, key->ptr);
         if (kde) {
-            robj *value = dictGetVal(kde);
+            compactValueView view;
+            robj *value = dbValueView(kde,&view);
             was_stream = value->type == OBJ_STREAM;
         }
         if (replaced_with) {
             dictEntry *kde = dictFind(replaced_with->dict, key->ptr);
             if (kde) {
-                robj *value = dictGetVal(kde);
+                compactValueView view;
+                robj *value = dbValueView(kde,&view);
                 is_stream = value->type == OBJ_STREAM;
             }
         }
@@ -1396,12 +1448,18 @@ int dbSwapDatabases(int id1, int id2) {
     db1->dict = db2->dict;
     db1->expires = db2->expires;
     db1->avg_ttl = db2->avg_ttl;
-    db1->expires_cursor = db2->expires_cursor;
+    db1->compact_values = db2->compact_values;
+    db1->expires_index = db2->expires_index;
+    db1->eviction_queues = db2->eviction_queues;
+    db1->memory_prefixes = db2->memory_prefixes;
 
     db2->dict = aux.dict;
     db2->expires = aux.expires;
     db2->avg_ttl = aux.avg_ttl;
-    db2->expires_cursor = aux.expires_cursor;
+    db2->compact_values = aux.compact_values;
+    db2->expires_index = aux.expires_index;
+    db2->eviction_queues = aux.eviction_queues;
+    db2->memory_prefixes = aux.memory_prefixes;
 
     /* Now we need to handle clients blocked on lists: as an effect
      * of swapping the two DBs, a client that was waiting for list
@@ -1445,12 +1503,18 @@ void swapMainDbWithTempDb(redisDb *tempDb) {
         activedb->dict = newdb->dict;
         activedb->expires = newdb->expires;
         activedb->avg_ttl = newdb->avg_ttl;
-        activedb->expires_cursor = newdb->expires_cursor;
+        activedb->compact_values = newdb->compact_values;
+        activedb->expires_index = newdb->expires_index;
+        activedb->eviction_queues = newdb->eviction_queues;
+        activedb->memory_prefixes = newdb->memory_prefixes;
 
         newdb->dict = aux.dict;
         newdb->expires = aux.expires;
         newdb->avg_ttl = aux.avg_ttl;
-        newdb->expires_cursor = aux.expires_cursor;
+        newdb->compact_values = aux.compact_values;
+        newdb->expires_index = aux.expires_index;
+        newdb->eviction_queues = aux.eviction_queues;
+        newdb->memory_prefixes = aux.memory_prefixes;
 
         /* Now we need to handle clients blocked on lists: as an effect
          * of swapping the two DBs, a client that was waiting for list
@@ -1507,7 +1571,7 @@ int removeExpire(redisDb *db, robj *key) {
     /* An expire may only be removed if there is a corresponding entry in the
      * main dict. Otherwise, the key will never be freed. */
     serverAssertWithInfo(NULL,key,dictFind(db->dict,key->ptr) != NULL);
-    return dictDelete(db->expires,key->ptr) == DICT_OK;
+    return dbDeleteExpire(db,key->ptr);
 }
 
 /* Set an expire to the specified key. If the expire is set in the context
@@ -1515,12 +1579,19 @@ int removeExpire(redisDb *db, robj *key) {
  * to NULL. The 'when' parameter is the absolute unix time in milliseconds
  * after which the key will no longer be considered valid. */
 void setExpire(client *c, redisDb *db, robj *key, long long when) {
-    dictEntry *kde, *de;
+    dictEntry *kde, *de, *existing;
 
     /* Reuse the sds from the main dict in the expire dict */
     kde = dictFind(db->dict,key->ptr);
     serverAssertWithInfo(NULL,key,kde != NULL);
-    de = dictAddOrFind(db->expires,dictGetKey(kde));
+    de = dictAddRaw(db->expires,dictGetKey(kde),&existing);
+    if (de) {
+        expireIndexAdd(db->expires_index,dictGetKey(de),when);
+    } else {
+        de = existing;
+        expireIndexUpdate(db->expires_index,dictGetKey(de),
+                          dictGetSignedIntegerVal(de),when);
+    }
     dictSetSignedIntegerVal(de,when);
 
     int writable_slave = server.masterhost && server.repl_slave_ro == 0;
@@ -296,6 +296,7 @@ void computeDatasetDigest(unsigned char *final) {
         while((de = dictNext(di)) != NULL) {
             sds key;
             robj *keyobj, *o;
+            compactValueView view;
 
             memset(digest,0,20); /* This key-val digest */
             key = dictGetKey(de);
@@ -303,7 +304,7 @@ void computeDatasetDigest(unsigned char *final) {
 
             mixDigest(digest,key,sdslen(key));
 
-            o = dictGetVal(de);
+            o = dbValueView(de,&view);
             xorObjectDigest(db,keyobj,digest,o);
 
             /* We can finally xor the key-val digest to the final digest */
@@ -597,12 +598,13 @@ NULL
         dictEntry *de;
         robj *val;
         char *strenc;
+        compactValueView view;
 
         if ((de = dictFind(c->db->dict,c->argv[2]->ptr)) == NULL) {
             addReplyErrorObject(c,shared.nokeyerr);
             return;
         }
-        val = dictGetVal(de);
+        val = dbValueView(de,&view);
         strenc = strEncoding(val->encoding);
 
         char extra[138] = {0};
@@ -654,7 +656,7 @@ NULL
             addReplyErrorObject(c,shared.nokeyerr);
             return;
         }
-        val = dictGetVal(de);
+        val = dbExpandValue(c->db,de);
         key = dictGetKey(de);
 
         if (val->type != OBJ_STRING || !sdsEncodedObject(val)) {
@@ -751,7 +753,8 @@ NULL
             /* We don't use lookupKey because a debug command should
              * work on logically expired keys */
             dictEntry *de;
-            robj *o = ((de = dictFind(c->db->dict,c->argv[j]->ptr)) == NULL) ? NULL : dictGetVal(de);
+            compactValueView view;
+            robj *o = ((de = dictFind(c->db->dict,c->argv[j]->ptr)) == NULL) ? NULL : dbValueView(de,&view);
             if (o) xorObjectDigest(c->db,c->argv[j],digest,o);
 
             sds d = sdsempty();
@@ -1773,11 +1776,12 @@ void logCurrentClient(void) {
     if (cc->argc > 1) {
         robj *val, *key;
         dictEntry *de;
+        compactValueView view;
 
         key = getDecodedObject(cc->argv[1]);
         de = dictFind(cc->db->dict, key->ptr);
         if (de) {
-            val = dictGetVal(de);
+            val = dbValueView(de,&view);
             serverLog(LL_WARNING,"key '%s' found in DB containing the following object:", (char*)key->ptr);
             serverLogObjectDebugInfo(val);
         }
@@ -35,6 +35,7 @@
 
 #include "server.h"
 #include "cluster.h"
+#include "bio.h"
 #include <time.h>
 #include <assert.h>
 #include <stddef.h>
@@ -128,6 +129,124 @@ robj *activeDefragStringOb(robj* ob, long *defragged) {
     return ret;
 }
 
+/* Background defrag of string values.
+ *
+ * Copying a large sds is the expensive part of defragging it, so when
+ * active-defrag-threaded is enabled, RAW strings of at least
+ * DEFRAG_BG_MIN_BYTES are handed to the BIO_DEFRAG thread instead: the
+ * thread asks jemalloc whether the allocation is worth moving, copies it to a
+ * new allocation and queues the job back. The main thread then only swaps the
+ * pointer and releases the old allocation in activeDefragDrainJobs().
+ *
+ * While a job is in flight the value holds an extra reference, so any write to
+ * the key goes through dbUnshareStringValue() and creates a new object rather
+ * than touching the buffer the thread is reading. At drain time the new buffer
+ * is adopted only if the key still maps to the same object with the same
+ * buffer and nobody else took a reference meanwhile; otherwise it's dropped.
+ *
+ * Other encodings (listpacks, quicklist nodes, stream listpacks) are edited in
+ * place by writers regardless of refcount, so they're still moved inline. */
+#define DEFRAG_BG_MIN_BYTES 1024    /* Smaller strings are cheaper inline. */
+#define DEFRAG_BG_MAX_PENDING 1024  /* Max jobs in flight. */
+
+typedef struct defragValueJob {
+    int dbid;
+    sds key;
+    robj *val;
+    void *oldptr;   /* Allocation of val->ptr when the job was created. */
+    void *newptr;   /* Copy made by the thread, NULL if not worth moving. */
+    struct defragValueJob *next;
+} defragValueJob;
+
+static pthread_mutex_t defrag_done_mutex = PTHREAD_MUTEX_INITIALIZER;
+static defragValueJob *defrag_done_jobs = NULL; /* Protected by the mutex. */
+static unsigned long defrag_pending_jobs = 0;   /* Main thread only. */
+
+/* Runs in the BIO_DEFRAG thread. */
+void defragValueJobRun(void *args[]) {
+    defragValueJob *job = args[0];
+    if (je_get_defrag_hint(job->oldptr)) {
+        size_t size = zmalloc_size(job->oldptr);
+        job->newptr = zmalloc_no_tcache(size);
+        memcpy(job->newptr, job->oldptr, size);
+    }
+    pthread_mutex_lock(&defrag_done_mutex);
+    job->next = defrag_done_jobs;
+    defrag_done_jobs = job;
+    pthread_mutex_unlock(&defrag_done_mutex);
+}
+
+/* Returns true if the value of the key should be handed to the background
+ * thread rather than defragged inline. */
+int defragValueInBackground(robj *ob) {
+    return server.active_defrag_threaded &&
+           defrag_pending_jobs < DEFRAG_BG_MAX_PENDING &&
+           ob->type == OBJ_STRING && ob->encoding == OBJ_ENCODING_RAW &&
+           ob->refcount == 1 &&
+           sdsAllocSize(ob->ptr) >= DEFRAG_BG_MIN_BYTES;
+}
+
+void defragValueSubmit(redisDb *db, sds key, robj *ob) {
+    defragValueJob *job = zmalloc(sizeof(*job));
+    job->dbid = db->id;
+    job->key = sdsdup(key);
+    job->val = ob;
+    job->oldptr = sdsAllocPtr(ob->ptr);
+    job->newptr = NULL;
+    incrRefCount(ob);
+    defrag_pending_jobs++;
+    bioCreateDefragJob(defragValueJobRun,1,job);
+}
+
+/* Adopt the copies made by the background thread. Called by the main thread
+ * from activeDefragCycle(), and before anything else may release values
+ * outside of the main thread. */
+void activeDefragDrainJobs(void) {
+    if (!defrag_pending_jobs) return;
+
+    pthread_mutex_lock(&defrag_done_mutex);
+    defragValueJob *job = defrag_done_jobs;
+    defrag_done_jobs = NULL;
+    pthread_mutex_unlock(&defrag_done_mutex);
+
+    while (job) {
+        defragValueJob *next = job->next;
+        robj *ob = job->val;
+        int adopted = 0;
+
+        if (job->newptr && ob->refcount == 2 &&
+            sdsAllocPtr(ob->ptr) == job->oldptr)
+        {
+            dictEntry *de = dictFind(server.db[job->dbid].dict, job->key);
+            if (de && dictGetVal(de) == ob) {
+                size_t offset = (char*)ob->ptr - (char*)job->oldptr;
+                ob->ptr = (char*)job->newptr + offset;
+                zfree_no_tcache(job->oldptr);
+                adopted = 1;
+            }
+        }
+        if (adopted) {
+            server.stat_active_defrag_hits++;
+        } else {
+            if (job->newptr) zfree_no_tcache(job->newptr);
+            server.stat_active_defrag_misses++;
+        }
+        decrRefCount(ob);
+        sdsfree(job->key);
+        zfree(job);
+        defrag_pending_jobs--;
+        job = next;
+    }
+}
+
+/* Wait for all the jobs in flight and drain them. */
+void activeDefragFlushJobs(void) {
+    if (!defrag_pending_jobs) return;
+    while (bioPendingJobsOfType(BIO_DEFRAG))
+        bioWaitStepOfType(BIO_DEFRAG);
+    activeDefragDrainJobs();
+}
+
 /* Defrag helper for lua scripts
  *
  * returns NULL in case the allocation wasn't moved.
@@ -697,7 +816,9 @@ int scanLaterStreamListpacks(robj *ob, unsigned long *cursor, long long endtime,
 
     (*cursor)++;
     while (raxNext(&ri)) {
-        void *newdata = activeDefragAlloc(ri.data);
+        void *newdata = NULL;
+        if (!STREAM_NODE_IS_SPILLED(ri.data))
+            newdata = activeDefragAlloc(ri.data);
         if (newdata)
             raxSetData(ri.node, ri.data=newdata), (*defragged)++;
         server.stat_active_defrag_scanned++;
@@ -748,27 +869,6 @@ long defragRadixTree(rax **raxref, int defrag_data, raxDefragFunction *element_c
     return defragged;
 }
 
-typedef struct {
-    streamCG *cg;
-    streamConsumer *c;
-} PendingEntryContext;
-
-void* defragStreamConsumerPendingEntry(raxIterator *ri, void *privdata, long *defragged) {
-    UNUSED(defragged);
-    PendingEntryContext *ctx = privdata;
-    streamNACK *nack = ri->data, *newnack;
-    nack->consumer = ctx->c; /* update nack pointer to consumer */
-    newnack = activeDefragAlloc(nack);
-    if (newnack) {
-        /* update consumer group pointer to the nack */
-        void *prev;
-        raxInsert(ctx->cg->pel, ri->key, ri->key_len, newnack, &prev);
-        serverAssert(prev==nack);
-        /* note: we don't increment 'defragged' that's done by the caller */
-    }
-    return newnack;
-}
-
 void* defragStreamConsumer(raxIterator *ri, void *privdata, long *defragged) {
     streamConsumer *c = ri->data;
     streamCG *cg = privdata;
@@ -776,27 +876,43 @@ void* defragStreamConsumer(raxIterator *ri, void *privdata, long *defragged) {
     if (newc) {
         /* note: we don't increment 'defragged' that's done by the caller */
         c = newc;
+        /* update the consumers by ID pointer to the consumer */
+        void *prev;
+        uint64_t idkey = htonu64(c->id);
+        raxInsert(cg->consumers_by_id, (unsigned char*)&idkey, sizeof(idkey), c, &prev);
+        serverAssert(prev==ri->data);
     }
     sds newsds = activeDefragSds(c->name);
     if (newsds)
         (*defragged)++, c->name = newsds;
-    if (c->pel) {
-        PendingEntryContext pel_ctx = {cg, c};
-        *defragged += defragRadixTree(&c->pel, 0, defragStreamConsumerPendingEntry, &pel_ctx);
-    }
+    if (c->pel)
+        *defragged += defragRadixTree(&c->pel, 0, NULL, NULL);
     return newc; /* returns NULL if c was not defragged */
 }
 
 void* defragStreamConsumerGroup(raxIterator *ri, void *privdata, long *defragged) {
     streamCG *cg = ri->data;
     UNUSED(privdata);
+    if (cg->consumers_by_id)
+        *defragged += defragRadixTree(&cg->consumers_by_id, 0, NULL, NULL);
     if (cg->consumers)
         *defragged += defragRadixTree(&cg->consumers, 0, defragStreamConsumer, cg);
-    if (cg->pel)
-        *defragged += defragRadixTree(&cg->pel, 0, NULL, NULL);
+    /* The PEL blocks are listpacks, that don't reference other allocations. */
+    if (cg->pel.blocks)
+        *defragged += defragRadixTree(&cg->pel.blocks, 1, NULL, NULL);
+    if (cg->pel.idle)
+        *defragged += defragRadixTree(&cg->pel.idle, 0, NULL, NULL);
     return NULL;
 }
 
+/* Defrag the listpack of a stream node, skipping the nodes spilled to disk. */
+void* defragStreamNode(raxIterator *ri, void *privdata, long *defragged) {
+    UNUSED(privdata);
+    UNUSED(defragged);
+    if (STREAM_NODE_IS_SPILLED(ri->data)) return NULL;
+    return activeDefragAlloc(ri->data);
+}
+
 long defragStream(redisDb *db, dictEntry *kde) {
     long defragged = 0;
     robj *ob = dictGetVal(kde);
@@ -813,7 +929,7 @@ long defragStream(redisDb *db, dictEntry *kde) {
             defragged++, s->rax = newrax;
         defragLater(db, kde);
     } else
-        defragged += defragRadixTree(&s->rax, 1, NULL, NULL);
+        defragged += defragRadixTree(&s->rax, 0, defragStreamNode, NULL);
 
     if (s->cgroups)
         defragged += defragRadixTree(&s->cgroups, 1, defragStreamConsumerGroup, NULL);
@@ -853,12 +969,27 @@ long defragKey(redisDb *db, dictEntry *de) {
           * I can't search in db->expires for that key after i already released
           * the pointer it holds it won't be able to do the string compare */
         uint64_t hash = dictGetHash(db->dict, de->key);
-        replaceSatelliteDictKeyPtrAndOrDefragDictEntry(db->expires, keysds, newsds, hash, &defragged);
+        dictEntry *ede = replaceSatelliteDictKeyPtrAndOrDefragDictEntry(db->expires, keysds, newsds, hash, &defragged);
+        /* The expire index references the key by address as well. */
+        if (ede && newsds)
+            expireIndexReplaceKey(db->expires_index, keysds, newsds,
+                                  dictGetSignedIntegerVal(ede));
     }
 
+    /* Compact values live in the dict entry itself. */
+    if (isCompactValue(dictGetVal(de))) return defragged;
+
     /* Try to defrag robj and / or string value. */
     ob = dictGetVal(de);
-    if ((newob = activeDefragStringOb(ob, &defragged))) {
+    if (defragValueInBackground(ob)) {
+        /* Move the robj here, the sds is copied by the background thread. */
+        if ((newob = activeDefragAlloc(ob))) {
+            de->v.val = newob;
+            ob = newob;
+            defragged++;
+        }
+        defragValueSubmit(db, de->key, ob);
+    } else if ((newob = activeDefragStringOb(ob, &defragged))) {
         de->v.val = newob;
         ob = newob;
     }
@@ -931,6 +1062,14 @@ void defragDictBucketCallback(dict *d, dictEntry **bucketref) {
                 /* Cluster keyspace dict. Update slot-to-entries mapping. */
                 slotToKeyReplaceEntry(newde, server.db);
             }
+            if (server.maxmemory_eviction_engine == EVICTION_ENGINE_ORDERED) {
+                /* Keyspace dict. Update the eviction queues. */
+                for (int j = 0; j < server.dbnum; j++) {
+                    if (d != server.db[j].dict) continue;
+                    evictionQueueReplaceEntry(newde, server.db+j);
+                    break;
+                }
+            }
         }
         bucketref = &(*bucketref)->next;
     }
@@ -973,7 +1112,7 @@ long defragOtherGlobals() {
 /* returns 0 more work may or may not be needed (see non-zero cursor),
  * and 1 if time is up and more work is needed. */
 int defragLaterItem(dictEntry *de, unsigned long *cursor, long long endtime, int dbid) {
-    if (de) {
+    if (de && !isCompactValue(dictGetVal(de))) {
         robj *ob = dictGetVal(de);
         if (ob->type == OBJ_LIST) {
             return scanLaterList(ob, cursor, endtime, &server.stat_active_defrag_hits);
@@ -1110,6 +1249,8 @@ void activeDefragCycle(void) {
     mstime_t latency;
     int quit = 0;
 
+    activeDefragDrainJobs();
+
     if (!server.active_defrag_enabled) {
         if (server.active_defrag_running) {
             /* if active defrag was disabled mid-run, start from fresh next time. */
@@ -1233,6 +1374,10 @@ void activeDefragCycle(void) {
     /* Not implemented yet. */
 }
 
+void activeDefragFlushJobs(void) {
+    /* Not implemented yet. */
+}
+
 void *activeDefragAlloc(void *ptr) {
     UNUSED(ptr);
     return NULL;
@@ -324,6 +324,7 @@ ConnectionType CT_DemiSocket = {
     .close = demiSocketClose,
     .write = demiSocketWrite,
     .writev = demiSocketWritev,
+    .sendfile = connGenericSendfile,
     .read = demiSocketRead,
     .accept = demiSocketAccept,
     .connect = demiSocketConnect,
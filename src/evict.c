@@ -31,6 +31,7 @@
  */
 
 #include "server.h"
+#include "cluster.h"
 #include "bio.h"
 #include "atomicvar.h"
 #include "script.h"
@@ -153,6 +154,7 @@ void evictionPoolPopulate(int dbid, dict *sampledict, dict *keydict, struct evic
         sds key;
         robj *o;
         dictEntry *de;
+        compactValueView view;
 
         de = samples[j];
         key = dictGetKey(de);
@@ -162,7 +164,7 @@ void evictionPoolPopulate(int dbid, dict *sampledict, dict *keydict, struct evic
          * again in the key dictionary to obtain the value object. */
         if (server.maxmemory_policy != MAXMEMORY_VOLATILE_TTL) {
             if (sampledict != keydict) de = dictFind(keydict, key);
-            o = dictGetVal(de);
+            o = dbValueView(de,&view);
         }
 
         /* Calculate the idle time according to the policy. This is called
@@ -325,6 +327,261 @@ unsigned long LFUDecrAndReturn(robj *o) {
     return counter;
 }
 
+/* ----------------------------------------------------------------------------
+ * Ordered eviction engine
+ *
+ * When "maxmemory-eviction-engine" is set to "ordered", every key of a DB is
+ * linked, using the dict entry metadata, into eviction queues that are kept
+ * in an approximate eviction order as keys are added and accessed, so that
+ * allkeys-lru and allkeys-lfu can find the victim in constant amortized time
+ * without sampling the key space.
+ *
+ * LRU uses a single queue managed with the CLOCK (second chance) algorithm:
+ * keys are appended to the tail when created, remembering the LRU clock at
+ * that time. When a victim is needed we look at the head: if the key was
+ * accessed after it was queued it is moved again to the tail, otherwise it is
+ * the key with the oldest access time among the ones not accessed since the
+ * queue was rotated the last time, and it is evicted. Accessing a key does
+ * nothing more than what lookupKey() already does, updating the object LRU
+ * clock.
+ *
+ * LFU uses one queue for every value of the logarithmic counter. Keys move
+ * to the queue of their new counter when it changes on access, which is rare
+ * for keys with high counters. The victim is the head of the lowest non
+ * empty queue. Since counters decay without the key being accessed, keys are
+ * lazily moved to the queue of their real counter when they are found in
+ * the wrong queue, both while looking for a victim and incrementally by
+ * evictionQueuesCron().
+ *
+ * When the policy is switched at runtime the queues are not rebuilt: the
+ * keys are moved into the right place lazily as well.
+ * --------------------------------------------------------------------------*/
+
+#define EVICTION_QUEUE_MAX_MOVES 1000   /* Max keys moved to find a victim. */
+#define EVICTION_QUEUE_CRON_MOVES 100   /* Max keys aged per DB by the cron. */
+
+static evictionDictEntryMetadata *evictionMetadata(dictEntry *de) {
+    char *meta = (char*)dictMetadata(de);
+    if (server.cluster_enabled) meta += sizeof(clusterDictEntryMetadata);
+    return (evictionDictEntryMetadata*)meta;
+}
+
+/* Return the LRU clock 'lru' aged relative to the current clock, handling
+ * the clock wrapping around like estimateObjectIdleTime(). */
+static unsigned long long lruClockAge(unsigned long long lruclock,
+                                      unsigned long long lru)
+{
+    if (lruclock >= lru) return lruclock - lru;
+    return lruclock + (LRU_CLOCK_MAX - lru);
+}
+
+static void evictionQueueLink(evictionQueues *eq, dictEntry *de, int q) {
+    evictionDictEntryMetadata *meta = evictionMetadata(de);
+    evictionQueue *queue = &eq->queue[q];
+
+    meta->queue = q;
+    meta->stamp = LRU_CLOCK();
+    meta->next = NULL;
+    meta->prev = queue->tail;
+    if (queue->tail)
+        evictionMetadata(queue->tail)->next = de;
+    else
+        queue->head = de;
+    queue->tail = de;
+    queue->len++;
+    if (q < eq->lowest) eq->lowest = q;
+}
+
+static void evictionQueueUnlink(evictionQueues *eq, dictEntry *de) {
+    evictionDictEntryMetadata *meta = evictionMetadata(de);
+    evictionQueue *queue = &eq->queue[meta->queue];
+
+    if (meta->prev)
+        evictionMetadata(meta->prev)->next = meta->next;
+    else
+        queue->head = meta->next;
+    if (meta->next)
+        evictionMetadata(meta->next)->prev = meta->prev;
+    else
+        queue->tail = meta->prev;
+    meta->prev = meta->next = NULL;
+    queue->len--;
+}
+
+/* The queue where a key should be, according to the current policy. */
+static int evictionQueueFor(robj *o) {
+    if (server.maxmemory_policy & MAXMEMORY_FLAG_LFU)
+        return LFUDecrAndReturn(o);
+    return 0;
+}
+
+void evictionQueuesInit(redisDb *db) {
+    if (server.maxmemory_eviction_engine != EVICTION_ENGINE_ORDERED) return;
+    db->eviction_queues = zcalloc(sizeof(evictionQueues));
+    db->eviction_queues->lowest = EVICTION_QUEUES;
+}
+
+/* Empty the eviction queues of given db: called when all the keys were
+ * removed from the DB dict. */
+void evictionQueuesFlush(redisDb *db) {
+    if (db->eviction_queues == NULL) return;
+    memset(db->eviction_queues,0,sizeof(evictionQueues));
+    db->eviction_queues->lowest = EVICTION_QUEUES;
+}
+
+void evictionQueuesDestroy(redisDb *db) {
+    zfree(db->eviction_queues);
+    db->eviction_queues = NULL;
+}
+
+/* Called when a new key is added to the DB dict. */
+void evictionQueueAddEntry(dictEntry *de, redisDb *db) {
+    if (db->eviction_queues == NULL) return;
+    compactValueView view;
+    evictionQueueLink(db->eviction_queues,de,
+                      evictionQueueFor(dbValueView(de,&view)));
+}
+
+/* Called before an entry is removed from the DB dict. */
+void evictionQueueDelEntry(dictEntry *de, redisDb *db) {
+    if (db->eviction_queues == NULL) return;
+    evictionQueueUnlink(db->eviction_queues,de);
+}
+
+/* Updates neighbour entries when an entry has been replaced (e.g. reallocated
+ * during active defrag). */
+void evictionQueueReplaceEntry(dictEntry *de, redisDb *db) {
+    if (db->eviction_queues == NULL) return;
+    evictionDictEntryMetadata *meta = evictionMetadata(de);
+    evictionQueue *queue = &db->eviction_queues->queue[meta->queue];
+
+    if (meta->prev)
+        evictionMetadata(meta->prev)->next = de;
+    else
+        queue->head = de;
+    if (meta->next)
+        evictionMetadata(meta->next)->prev = de;
+    else
+        queue->tail = de;
+}
+
+/* Called by lookupKey() after the access time of the key was updated. Only
+ * LFU needs to move the key, when its counter changed. */
+void evictionQueueTouchEntry(dictEntry *de, redisDb *db) {
+    if (db->eviction_queues == NULL ||
+        !(server.maxmemory_policy & MAXMEMORY_FLAG_LFU)) return;
+    compactValueView view;
+    robj *o = dbValueView(de,&view);
+    unsigned int q = o->lru & 255;
+    if (evictionMetadata(de)->queue == q) return;
+    evictionQueueUnlink(db->eviction_queues,de);
+    evictionQueueLink(db->eviction_queues,de,q);
+}
+
+/* Find the best key to evict in the DB according to the current policy,
+ * rotating or moving the keys found out of place. On success the dict entry
+ * is returned and '*score' is set to a value where greater means a better
+ * candidate, like the idle field of the eviction pool. */
+static dictEntry *evictionQueuesGetVictim(redisDb *db, unsigned long long *score) {
+    evictionQueues *eq = db->eviction_queues;
+    int lfu = server.maxmemory_policy & MAXMEMORY_FLAG_LFU;
+    unsigned long long lruclock = LRU_CLOCK();
+    int moves = 0;
+
+    while (eq->lowest < EVICTION_QUEUES) {
+        int q = eq->lowest;
+        dictEntry *de = eq->queue[q].head;
+        if (de == NULL) {
+            eq->lowest++;
+            continue;
+        }
+
+        evictionDictEntryMetadata *meta = evictionMetadata(de);
+        compactValueView view;
+        robj *o = dbValueView(de,&view);
+        int move = 0, target = 0;
+
+        if (lfu) {
+            /* The key counter may be greater than the one of the queue,
+             * for instance after a RESTORE or a policy change. */
+            target = LFUDecrAndReturn(o);
+            if (target > q) move = 1;
+        } else {
+            /* Second chance for keys accessed after being queued. Keys
+             * in queues other than the first are left there by LFU. */
+            if (q != 0 ||
+                lruClockAge(lruclock,o->lru) < lruClockAge(lruclock,meta->stamp))
+                move = 1;
+        }
+
+        if (move && moves < EVICTION_QUEUE_MAX_MOVES) {
+            evictionQueueUnlink(eq,de);
+            evictionQueueLink(eq,de,target);
+            moves++;
+            continue;
+        }
+
+        *score = lfu ? 255-LFUDecrAndReturn(o) : estimateObjectIdleTime(o);
+        return de;
+    }
+    return NULL;
+}
+
+/* Return the best key to evict across all the DBs, setting '*dbid' to the
+ * DB of the key, or NULL if there are no keys. */
+static sds evictionQueuesBestKey(int *dbid) {
+    sds bestkey = NULL;
+    unsigned long long bestscore = 0;
+
+    for (int j = 0; j < server.dbnum; j++) {
+        redisDb *db = server.db+j;
+        unsigned long long score;
+        dictEntry *de;
+
+        if (dictSize(db->dict) == 0) continue;
+        de = evictionQueuesGetVictim(db,&score);
+        if (de && (bestkey == NULL || score > bestscore)) {
+            bestkey = dictGetKey(de);
+            bestscore = score;
+            *dbid = j;
+        }
+    }
+    return bestkey;
+}
+
+/* Move incrementally the keys whose LFU counter decayed to the right queue,
+ * so that keys that were popular in the past but are no longer accessed can
+ * be found when looking for a victim. Called by databasesCron(). */
+void evictionQueuesCron(void) {
+    if (server.maxmemory_eviction_engine != EVICTION_ENGINE_ORDERED ||
+        !(server.maxmemory_policy & MAXMEMORY_FLAG_LFU) ||
+        hasActiveChildProcess()) return;
+
+    for (int j = 0; j < server.dbnum; j++) {
+        evictionQueues *eq = server.db[j].eviction_queues;
+        int moves = 0;
+
+        /* Look at the heads of the queues, where the keys that were moved
+         * there less recently are. */
+        for (int k = 1; k < EVICTION_QUEUES && moves < EVICTION_QUEUE_CRON_MOVES; k++) {
+            int q = (eq->cron_cursor + k) % EVICTION_QUEUES;
+            if (q == 0) continue;
+            dictEntry *de;
+            while ((de = eq->queue[q].head) != NULL &&
+                   moves < EVICTION_QUEUE_CRON_MOVES)
+            {
+                compactValueView view;
+                int target = LFUDecrAndReturn(dbValueView(de,&view));
+                if (target == q) break;
+                evictionQueueUnlink(eq,de);
+                evictionQueueLink(eq,de,target);
+                moves++;
+            }
+            eq->cron_cursor = q;
+        }
+    }
+}
+
 /* We don't want to count AOF buffers and slaves output buffers as
  * used memory: the eviction should use mostly data size, because
  * it can cause feedback-loop when we push DELs into them, putting
@@ -513,6 +770,514 @@ static unsigned long evictionTimeLimitUs() {
     return ULONG_MAX;   /* No limit to eviction time */
 }
 
+/* Select the best key to evict according to the current maxmemory policy.
+ * The key is returned as the sds stored in the main dictionary of the DB
+ * whose ID is stored into '*dbid', or NULL if there is nothing to evict. */
+static sds evictionSelectKey(int *dbid) {
+    int j, k, i;
+    static unsigned int next_db = 0;
+    sds bestkey = NULL;
+    int bestdbid = 0;
+    redisDb *db;
+    dict *dict;
+    dictEntry *de;
+
+    if (server.maxmemory_eviction_engine == EVICTION_ENGINE_ORDERED &&
+        (server.maxmemory_policy == MAXMEMORY_ALLKEYS_LRU ||
+         server.maxmemory_policy == MAXMEMORY_ALLKEYS_LFU))
+    {
+        /* The ordered eviction engine knows the victim already. */
+        bestkey = evictionQueuesBestKey(&bestdbid);
+    }
+
+    else if (server.maxmemory_policy & (MAXMEMORY_FLAG_LRU|MAXMEMORY_FLAG_LFU) ||
+        server.maxmemory_policy == MAXMEMORY_VOLATILE_TTL)
+    {
+        struct evictionPoolEntry *pool = EvictionPoolLRU;
+
+        while(bestkey == NULL) {
+            unsigned long total_keys = 0, keys;
+
+            /* We don't want to make local-db choices when expiring keys,
+             * so to start populate the eviction pool sampling keys from
+             * every DB. */
+            for (i = 0; i < server.dbnum; i++) {
+                db = server.db+i;
+                dict = (server.maxmemory_policy & MAXMEMORY_FLAG_ALLKEYS) ?
+                        db->dict : db->expires;
+                if ((keys = dictSize(dict)) != 0) {
+                    evictionPoolPopulate(i, dict, db->dict, pool);
+                    total_keys += keys;
+                }
+            }
+            if (!total_keys) break; /* No keys to evict. */
+
+            /* Go backward from best to worst element to evict. */
+            for (k = EVPOOL_SIZE-1; k >= 0; k--) {
+                if (pool[k].key == NULL) continue;
+                bestdbid = pool[k].dbid;
+
+                if (server.maxmemory_policy & MAXMEMORY_FLAG_ALLKEYS) {
+                    de = dictFind(server.db[bestdbid].dict,
+                        pool[k].key);
+                } else {
+                    de = dictFind(server.db[bestdbid].expires,
+                        pool[k].key);
+                }
+
+                /* Remove the entry from the pool. */
+                if (pool[k].key != pool[k].cached)
+                    sdsfree(pool[k].key);
+                pool[k].key = NULL;
+                pool[k].idle = 0;
+
+                /* If the key exists, is our pick. Otherwise it is
+                 * a ghost and we need to try the next element. */
+                if (de) {
+                    bestkey = dictGetKey(de);
+                    break;
+                } else {
+                    /* Ghost... Iterate again. */
+                }
+            }
+        }
+    }
+
+    /* volatile-random and allkeys-random policy */
+    else if (server.maxmemory_policy == MAXMEMORY_ALLKEYS_RANDOM ||
+             server.maxmemory_policy == MAXMEMORY_VOLATILE_RANDOM)
+    {
+        /* When evicting a random key, we try to evict a key for
+         * each DB, so we use the static 'next_db' variable to
+         * incrementally visit all DBs. */
+        for (i = 0; i < server.dbnum; i++) {
+            j = (++next_db) % server.dbnum;
+            db = server.db+j;
+            dict = (server.maxmemory_policy == MAXMEMORY_ALLKEYS_RANDOM) ?
+                    db->dict : db->expires;
+            if (dictSize(dict) != 0) {
+                de = dictGetRandomKey(dict);
+                bestkey = dictGetKey(de);
+                bestdbid = j;
+                break;
+            }
+        }
+    }
+
+    *dbid = bestdbid;
+    return bestkey;
+}
+
+/* Evict the specified key, freeing the value in the lazyfree thread if
+ * 'lazy' is true, and propagate the deletion. Returns the amount of memory
+ * released by the deletion itself.
+ *
+ * It is possible that actually the memory needed to propagate the DEL in
+ * AOF and replication link is greater than the one we are freeing removing
+ * the key, but we can't account for that otherwise we would never exit the
+ * eviction loop.
+ *
+ * Same for CSC invalidation messages generated by signalModifiedKey.
+ *
+ * AOF and Output buffer memory will be freed eventually so we only care
+ * about memory used by the key space. */
+static long long evictKey(redisDb *db, sds key, int lazy) {
+    mstime_t eviction_latency;
+    long long delta;
+    robj *keyobj = createStringObject(key,sdslen(key));
+
+    delta = (long long) zmalloc_used_memory();
+    latencyStartMonitor(eviction_latency);
+    if (lazy)
+        dbAsyncDelete(db,keyobj);
+    else
+        dbSyncDelete(db,keyobj);
+    latencyEndMonitor(eviction_latency);
+    latencyAddSampleIfNeeded("eviction-del",eviction_latency);
+    delta -= (long long) zmalloc_used_memory();
+    server.stat_evictedkeys++;
+    signalModifiedKey(NULL,db,keyobj);
+    notifyKeyspaceEvent(NOTIFY_EVICTED, "evicted",
+        keyobj, db->id);
+    propagateDeletion(db,keyobj,lazy);
+    decrRefCount(keyobj);
+    return delta;
+}
+
+/* ----------------------------------------------------------------------------
+ * Proactive eviction
+ *
+ * When "maxmemory-eviction-headroom" is non zero, the server tries to keep
+ * the used memory below a low watermark, that is "maxmemory" minus the
+ * configured percentage of it. Keys are evicted incrementally by the cron
+ * and their values are released by the lazyfree thread, so that the memory
+ * limit is rarely reached and performEvictions() almost never needs to evict
+ * keys in the context of a client command.
+ * --------------------------------------------------------------------------*/
+
+/* Percentage of the cron period the proactive eviction may use. */
+#define PROACTIVE_EVICTION_CYCLE_PERC 25
+/* Max number of keys evicted by a single proactive eviction cycle. */
+#define PROACTIVE_EVICTION_CYCLE_KEYS 10000
+
+/* Values evicted by the last cycle that are still being released in
+ * background: their estimated size, and the range of the lazyfreed objects
+ * counter in which they are expected to be released. */
+static struct {
+    size_t bytes;
+    size_t freed_from;
+    size_t freed_to;
+} proactive_lazy_victims;
+
+/* Return the low watermark proactive eviction tries to keep the used memory
+ * under, or 0 if proactive eviction is disabled. */
+size_t proactiveEvictionTarget(void) {
+    if (!server.maxmemory || !server.maxmemory_eviction_headroom) return 0;
+    return server.maxmemory -
+           (server.maxmemory/100)*server.maxmemory_eviction_headroom;
+}
+
+/* Return the memory the lazily freed values of the last cycle are still
+ * expected to release. Once the lazyfree threads released all the objects
+ * that were pending at the end of the cycle, it is assumed to be done. */
+static size_t proactiveEvictionPendingLazyfree(void) {
+    size_t freed = lazyfreeGetFreedObjectsCount();
+    if (freed >= proactive_lazy_victims.freed_to ||
+        freed < proactive_lazy_victims.freed_from) /* CONFIG RESETSTAT */
+    {
+        proactive_lazy_victims.bytes = 0;
+    }
+    return proactive_lazy_victims.bytes;
+}
+
+/* Called from serverCron(): if the memory used (not counting the replicas
+ * and AOF buffers) is over the low watermark, evict keys according to the
+ * maxmemory policy until we are under it again, or the time or key limit of
+ * the cycle is reached.
+ *
+ * The values of large victims are released in background, so the memory
+ * they take is counted as freed using its estimate, taken before the key is
+ * deleted. The next cycles discount it from the used memory until the
+ * lazyfree threads released it, so keys are not evicted twice for it. */
+void proactiveEvictionCycle(void) {
+    size_t target = proactiveEvictionTarget();
+    size_t mem_used, overhead, pending;
+    long long mem_freed = 0;
+    int keys_freed = 0, slaves = listLength(server.slaves);
+    mstime_t latency;
+
+    if (!target || server.maxmemory_policy == MAXMEMORY_NO_EVICTION) return;
+    if (!isSafeToPerformEvictions()) return;
+
+    mem_used = zmalloc_used_memory();
+    if (mem_used <= target) return;
+    overhead = freeMemoryGetNotCountedMemory();
+    pending = proactiveEvictionPendingLazyfree();
+    mem_used = (mem_used > overhead+pending) ? mem_used-overhead-pending : 0;
+    if (mem_used <= target) return;
+
+    unsigned long time_limit_us =
+        1000000*PROACTIVE_EVICTION_CYCLE_PERC/server.hz/100;
+    monotime timer;
+    elapsedStart(&timer);
+    latencyStartMonitor(latency);
+
+    serverAssert(server.also_propagate.numops == 0);
+    server.core_propagates = 1;
+    server.propagate_no_multi = 1;
+
+    size_t lazy_bytes = 0, lazy_victims = 0;
+    while (mem_freed < (long long)(mem_used-target) &&
+           keys_freed < PROACTIVE_EVICTION_CYCLE_KEYS)
+    {
+        int dbid;
+        sds key = evictionSelectKey(&dbid);
+        if (!key) break; /* Nothing to evict. */
+
+        redisDb *db = server.db+dbid;
+        dictEntry *de = dictFind(db->dict,key);
+        robj keyobj, *val = dictGetVal(de);
+        initStaticStringObject(keyobj,key);
+        long long size = isCompactValue(val) ? 0 :
+            (long long)objectComputeSize(&keyobj,val,OBJ_COMPUTE_SIZE_DEF_SAMPLES,dbid);
+
+        long long delta = evictKey(db,key,1);
+        /* The value went to the lazyfree threads if deleting the key
+         * released less than its size. */
+        if (delta < size) {
+            lazy_bytes += size-delta;
+            lazy_victims++;
+            delta = size;
+        }
+        mem_freed += delta;
+        server.stat_proactive_evictedkeys++;
+        keys_freed++;
+
+        if (keys_freed % 16 == 0) {
+            if (slaves) flushSlavesOutputBuffers();
+            if (elapsedUs(timer) > time_limit_us) break;
+        }
+    }
+
+    if (lazy_victims) {
+        size_t freed = lazyfreeGetFreedObjectsCount();
+        proactive_lazy_victims.bytes = pending + lazy_bytes;
+        if (!pending) proactive_lazy_victims.freed_from = freed;
+        proactive_lazy_victims.freed_to = freed + lazyfreeGetPendingObjectsCount();
+    }
+
+    serverAssert(server.core_propagates); /* This function should not be re-entrant */
+
+    /* Propagate all DELs */
+    propagatePendingCommands();
+
+    server.core_propagates = 0;
+    server.propagate_no_multi = 0;
+
+    latencyEndMonitor(latency);
+    latencyAddSampleIfNeeded("eviction-proactive",latency);
+}
+
+/* ----------------------------------------------------------------------------
+ * TinyLFU admission filter
+ *
+ * With allkeys-lfu every new key starts with the LFU_INIT_VAL counter, so a
+ * burst of keys accessed only once (like a scan of the backing store) can
+ * push out keys that are accessed often but not often enough to climb the
+ * logarithmic counter. When "maxmemory-admission-filter" is enabled, the
+ * accesses to all the keys, including the ones not in the dataset, are
+ * counted in a count-min sketch. When a new key is created while the memory
+ * is near the limit, its estimated frequency is compared with the one of the
+ * key that would be evicted next: if the new key is not more popular, its LFU
+ * counter is set to zero so that it is the next key to be evicted instead.
+ * The key is still created, so the semantics of the commands don't change.
+ *
+ * The sketch uses 4 rows of 4 bit counters. The counters of the 4 rows for
+ * a given key are all in the same 32 bytes block, so that updating or reading
+ * them touches a single cache line. A bloom filter (the "doorkeeper") in
+ * front of the sketch absorbs the first access of each key, so that the many
+ * keys accessed only once don't pollute the counters. After a number of
+ * accesses proportional to the sketch size, all the counters are halved and
+ * the doorkeeper is cleared, so that the sketch follows changes in the access
+ * pattern. Aging is incremental: a few blocks are aged at every access and
+ * more of them by the cron, so that big sketches don't block the server.
+ * The sketch is sized by the cron according to the number of keys.
+ * --------------------------------------------------------------------------*/
+
+#define ADMISSION_SKETCH_MIN_CAPACITY 1024 /* Min counters per row. */
+#define ADMISSION_SKETCH_ROWS 4
+#define ADMISSION_SKETCH_SAMPLE_FACTOR 10  /* Accesses before aging, per counter. */
+#define ADMISSION_SKETCH_AGE_BLOCKS 8      /* Blocks aged at every access. */
+#define ADMISSION_SKETCH_CRON_AGE_BLOCKS 4096 /* Blocks aged by the cron. */
+#define ADMISSION_PRESSURE_PERC 95         /* Memory % at which the filter kicks in. */
+
+typedef struct admissionSketch {
+    uint64_t *table;            /* Blocks of ADMISSION_SKETCH_ROWS words, each
+                                   word holds 16 counters of a row. */
+    uint64_t *doorkeeper;       /* Bloom filter of keys seen once. */
+    unsigned long capacity;     /* Counters per row, power of two. */
+    unsigned long block_mask;   /* Number of blocks - 1. */
+    unsigned long door_mask;    /* Number of doorkeeper bits - 1. */
+    unsigned long long additions; /* Accesses since last aging. */
+    int aging;                  /* True while the sketch is being aged. */
+    unsigned long age_cursor;   /* Next block to age. */
+} admissionSketch;
+
+static admissionSketch *AdmissionSketch = NULL;
+
+static void admissionSketchFree(void) {
+    if (AdmissionSketch == NULL) return;
+    zfree(AdmissionSketch->table);
+    zfree(AdmissionSketch->doorkeeper);
+    zfree(AdmissionSketch);
+    AdmissionSketch = NULL;
+}
+
+static void admissionSketchCreate(unsigned long keys) {
+    unsigned long capacity = ADMISSION_SKETCH_MIN_CAPACITY;
+    while (capacity < keys) capacity <<= 1;
+
+    admissionSketchFree();
+    AdmissionSketch = zmalloc(sizeof(admissionSketch));
+    AdmissionSketch->capacity = capacity;
+    /* Each word of a block holds 16 counters of the same row. */
+    AdmissionSketch->block_mask = capacity/16-1;
+    AdmissionSketch->table = zcalloc(capacity/16*ADMISSION_SKETCH_ROWS*sizeof(uint64_t));
+    /* 8 bits per counter for the doorkeeper. */
+    AdmissionSketch->door_mask = capacity*8-1;
+    AdmissionSketch->doorkeeper = zcalloc(capacity*8/64*sizeof(uint64_t));
+    AdmissionSketch->additions = 0;
+    AdmissionSketch->aging = 0;
+    AdmissionSketch->age_cursor = 0;
+}
+
+/* Return the doorkeeper bits and the sketch counters of the key. */
+static void admissionSketchIndexes(sds key, uint64_t *dk, uint64_t **words,
+                                   int *shifts)
+{
+    admissionSketch *as = AdmissionSketch;
+    uint64_t hash = dictGenHashFunction(key,sdslen(key));
+    uint64_t mix = hash * 0x9E3779B97F4A7C15ULL;
+    uint64_t *block = as->table +
+                      (hash & as->block_mask)*ADMISSION_SKETCH_ROWS;
+
+    dk[0] = mix & as->door_mask;
+    dk[1] = (mix >> 32) & as->door_mask;
+    for (int r = 0; r < ADMISSION_SKETCH_ROWS; r++) {
+        words[r] = block+r;
+        shifts[r] = ((hash >> (32+r*8)) & 15)*4;
+    }
+}
+
+/* Halve the counters of up to 'count' blocks starting at the aging cursor,
+ * and clear the same fraction of the doorkeeper. The aging ends once the
+ * cursor reaches the end of the table. */
+static void admissionSketchAgeBlocks(unsigned long count) {
+    admissionSketch *as = AdmissionSketch;
+    unsigned long blocks = as->block_mask+1;
+    /* The doorkeeper has 8 bits per counter, that is two words per block. */
+    unsigned long door_words = (as->door_mask+1)/64/blocks;
+    unsigned long start = as->age_cursor, end = start+count;
+
+    if (end > blocks) end = blocks;
+    for (unsigned long j = start*ADMISSION_SKETCH_ROWS;
+         j < end*ADMISSION_SKETCH_ROWS; j++)
+    {
+        as->table[j] = (as->table[j] >> 1) & 0x7777777777777777ULL;
+    }
+    memset(as->doorkeeper+start*door_words,0,
+           (end-start)*door_words*sizeof(uint64_t));
+    as->age_cursor = end;
+    if (end == blocks) as->aging = 0;
+}
+
+/* Count an access to the key, which may not exist, in the sketch. Called by
+ * lookupKey(). */
+void admissionFilterRecord(sds key) {
+    admissionSketch *as = AdmissionSketch;
+    uint64_t dk[2], *words[ADMISSION_SKETCH_ROWS];
+    int shifts[ADMISSION_SKETCH_ROWS];
+
+    if (as == NULL) return;
+    admissionSketchIndexes(key,dk,words,shifts);
+    if (!(as->doorkeeper[dk[0]/64] & (1ULL << (dk[0]%64))) ||
+        !(as->doorkeeper[dk[1]/64] & (1ULL << (dk[1]%64))))
+    {
+        as->doorkeeper[dk[0]/64] |= 1ULL << (dk[0]%64);
+        as->doorkeeper[dk[1]/64] |= 1ULL << (dk[1]%64);
+    } else {
+        for (int r = 0; r < ADMISSION_SKETCH_ROWS; r++) {
+            if (((*words[r] >> shifts[r]) & 15) != 15)
+                *words[r] += 1ULL << shifts[r];
+        }
+    }
+    as->additions++;
+    if (as->aging) {
+        admissionSketchAgeBlocks(ADMISSION_SKETCH_AGE_BLOCKS);
+    } else if (as->additions >= as->capacity*ADMISSION_SKETCH_SAMPLE_FACTOR) {
+        as->aging = 1;
+        as->age_cursor = 0;
+        as->additions /= 2;
+    }
+}
+
+/* Return the estimated number of recent accesses to the key. */
+static unsigned int admissionFilterEstimate(sds key) {
+    admissionSketch *as = AdmissionSketch;
+    uint64_t dk[2], *words[ADMISSION_SKETCH_ROWS];
+    int shifts[ADMISSION_SKETCH_ROWS];
+    unsigned int freq = 15;
+
+    admissionSketchIndexes(key,dk,words,shifts);
+    for (int r = 0; r < ADMISSION_SKETCH_ROWS; r++) {
+        unsigned int c = (*words[r] >> shifts[r]) & 15;
+        if (c < freq) freq = c;
+    }
+    if ((as->doorkeeper[dk[0]/64] & (1ULL << (dk[0]%64))) &&
+        (as->doorkeeper[dk[1]/64] & (1ULL << (dk[1]%64)))) freq++;
+    return freq;
+}
+
+/* Return the key that is likely to be evicted next, without changing the
+ * eviction state, or NULL if not known. */
+static sds admissionFilterCandidate(redisDb *db) {
+    if (db->eviction_queues) {
+        evictionQueues *eq = db->eviction_queues;
+        for (int q = eq->lowest; q < EVICTION_QUEUES; q++) {
+            if (eq->queue[q].head) return dictGetKey(eq->queue[q].head);
+        }
+        return NULL;
+    }
+    /* The best candidate found by the last sampling. */
+    for (int k = EVPOOL_SIZE-1; k >= 0; k--) {
+        if (EvictionPoolLRU[k].key) return EvictionPoolLRU[k].key;
+    }
+    return NULL;
+}
+
+/* Return 1 if the memory usage is close enough to the limit that creating a
+ * key will cause another one to be evicted. */
+static int admissionFilterUnderPressure(void) {
+    size_t threshold = proactiveEvictionTarget();
+    size_t mem_used = zmalloc_used_memory(), overhead;
+
+    if (!threshold) threshold = server.maxmemory/100*ADMISSION_PRESSURE_PERC;
+    if (mem_used < threshold) return 0;
+    overhead = freeMemoryGetNotCountedMemory();
+    return mem_used > overhead && mem_used-overhead >= threshold;
+}
+
+/* Called by dbAdd() for a new key whose value is 'val'. If the key is less
+ * popular than the current eviction candidate, its LFU counter is reset so
+ * that it is evicted first. Returns 1 if the key was admitted, 0 otherwise. */
+int admissionFilterAdmit(redisDb *db, sds key, robj *val) {
+    sds candidate;
+
+    if (AdmissionSketch == NULL ||
+        server.maxmemory_policy != MAXMEMORY_ALLKEYS_LFU ||
+        !admissionFilterUnderPressure()) return 1;
+
+    candidate = admissionFilterCandidate(db);
+    if (candidate == NULL ||
+        admissionFilterEstimate(key) > admissionFilterEstimate(candidate))
+        return 1;
+
+    val->lru = LFUGetTimeInMinutes()<<8;
+    server.stat_admission_rejected_keys++;
+    return 0;
+}
+
+/* Create, resize or release the sketch according to the configuration and
+ * the number of keys, and make progress with the aging. Called by
+ * serverCron(). */
+void admissionFilterCron(void) {
+    unsigned long long keys = 0;
+
+    if (!server.maxmemory_admission_filter || !server.maxmemory ||
+        server.maxmemory_policy != MAXMEMORY_ALLKEYS_LFU)
+    {
+        admissionSketchFree();
+        return;
+    }
+
+    for (int j = 0; j < server.dbnum; j++) keys += dictSize(server.db[j].dict);
+    /* Resizing loses the access history, so do it only when the number of
+     * keys grew a lot. */
+    if (AdmissionSketch == NULL || keys > AdmissionSketch->capacity*2)
+        admissionSketchCreate(keys);
+    else if (AdmissionSketch->aging)
+        admissionSketchAgeBlocks(ADMISSION_SKETCH_CRON_AGE_BLOCKS);
+}
+
+/* Return the memory used by the sketch, for INFO. */
+size_t admissionFilterMemory(void) {
+    admissionSketch *as = AdmissionSketch;
+    if (as == NULL) return 0;
+    return sizeof(*as) +
+           (as->block_mask+1)*ADMISSION_SKETCH_ROWS*sizeof(uint64_t) +
+           (as->door_mask+1)/8;
+}
+
 /* Check that memory usage is within the current "maxmemory" limit.  If over
  * "maxmemory", attempt to free memory by evicting data (if it's safe to do so).
  *
@@ -545,8 +1310,7 @@ int performEvictions(void) {
     int keys_freed = 0;
     size_t mem_reported, mem_tofree;
     long long mem_freed; /* May be negative */
-    mstime_t latency, eviction_latency;
-    long long delta;
+    mstime_t latency;
     int slaves = listLength(server.slaves);
     int result = EVICT_FAIL;
 
@@ -555,6 +1319,25 @@ int performEvictions(void) {
         goto update_metrics;
     }
 
+    /* The free reply buffers kept for reuse are the cheapest memory to give
+     * back before evicting keys. */
+    if (replyBufferPoolMemory()) {
+        trimReplyBufferPool(0);
+        if (getMaxmemoryState(&mem_reported,NULL,&mem_tofree,NULL) == C_OK) {
+            result = EVICT_OK;
+            goto update_metrics;
+        }
+    }
+
+    /* So are the stream nodes loaded from disk, that can be read again. */
+    if (streamSpillCacheMemory()) {
+        streamSpillCacheClear();
+        if (getMaxmemoryState(&mem_reported,NULL,&mem_tofree,NULL) == C_OK) {
+            result = EVICT_OK;
+            goto update_metrics;
+        }
+    }
+
     if (server.maxmemory_policy == MAXMEMORY_NO_EVICTION) {
         result = EVICT_FAIL;  /* We need to free memory, but policy forbids. */
         goto update_metrics;
@@ -577,118 +1360,13 @@ int performEvictions(void) {
     server.propagate_no_multi = 1;
 
     while (mem_freed < (long long)mem_tofree) {
-        int j, k, i;
-        static unsigned int next_db = 0;
-        sds bestkey = NULL;
         int bestdbid;
-        redisDb *db;
-        dict *dict;
-        dictEntry *de;
-
-        if (server.maxmemory_policy & (MAXMEMORY_FLAG_LRU|MAXMEMORY_FLAG_LFU) ||
-            server.maxmemory_policy == MAXMEMORY_VOLATILE_TTL)
-        {
-            struct evictionPoolEntry *pool = EvictionPoolLRU;
-
-            while(bestkey == NULL) {
-                unsigned long total_keys = 0, keys;
-
-                /* We don't want to make local-db choices when expiring keys,
-                 * so to start populate the eviction pool sampling keys from
-                 * every DB. */
-                for (i = 0; i < server.dbnum; i++) {
-                    db = server.db+i;
-                    dict = (server.maxmemory_policy & MAXMEMORY_FLAG_ALLKEYS) ?
-                            db->dict : db->expires;
-                    if ((keys = dictSize(dict)) != 0) {
-                        evictionPoolPopulate(i, dict, db->dict, pool);
-                        total_keys += keys;
-                    }
-                }
-                if (!total_keys) break; /* No keys to evict. */
-
-                /* Go backward from best to worst element to evict. */
-                for (k = EVPOOL_SIZE-1; k >= 0; k--) {
-                    if (pool[k].key == NULL) continue;
-                    bestdbid = pool[k].dbid;
-
-                    if (server.maxmemory_policy & MAXMEMORY_FLAG_ALLKEYS) {
-                        de = dictFind(server.db[bestdbid].dict,
-                            pool[k].key);
-                    } else {
-                        de = dictFind(server.db[bestdbid].expires,
-                            pool[k].key);
-                    }
-
-                    /* Remove the entry from the pool. */
-                    if (pool[k].key != pool[k].cached)
-                        sdsfree(pool[k].key);
-                    pool[k].key = NULL;
-                    pool[k].idle = 0;
-
-                    /* If the key exists, is our pick. Otherwise it is
-                     * a ghost and we need to try the next element. */
-                    if (de) {
-                        bestkey = dictGetKey(de);
-                        break;
-                    } else {
-                        /* Ghost... Iterate again. */
-                    }
-                }
-            }
-        }
-
-        /* volatile-random and allkeys-random policy */
-        else if (server.maxmemory_policy == MAXMEMORY_ALLKEYS_RANDOM ||
-                 server.maxmemory_policy == MAXMEMORY_VOLATILE_RANDOM)
-        {
-            /* When evicting a random key, we try to evict a key for
-             * each DB, so we use the static 'next_db' variable to
-             * incrementally visit all DBs. */
-            for (i = 0; i < server.dbnum; i++) {
-                j = (++next_db) % server.dbnum;
-                db = server.db+j;
-                dict = (server.maxmemory_policy == MAXMEMORY_ALLKEYS_RANDOM) ?
-                        db->dict : db->expires;
-                if (dictSize(dict) != 0) {
-                    de = dictGetRandomKey(dict);
-                    bestkey = dictGetKey(de);
-                    bestdbid = j;
-                    break;
-                }
-            }
-        }
+        sds bestkey = evictionSelectKey(&bestdbid);
 
         /* Finally remove the selected key. */
         if (bestkey) {
-            db = server.db+bestdbid;
-            robj *keyobj = createStringObject(bestkey,sdslen(bestkey));
-            /* We compute the amount of memory freed by db*Delete() alone.
-             * It is possible that actually the memory needed to propagate
-             * the DEL in AOF and replication link is greater than the one
-             * we are freeing removing the key, but we can't account for
-             * that otherwise we would never exit the loop.
-             *
-             * Same for CSC invalidation messages generated by signalModifiedKey.
-             *
-             * AOF and Output buffer memory will be freed eventually so
-             * we only care about memory used by the key space. */
-            delta = (long long) zmalloc_used_memory();
-            latencyStartMonitor(eviction_latency);
-            if (server.lazyfree_lazy_eviction)
-                dbAsyncDelete(db,keyobj);
-            else
-                dbSyncDelete(db,keyobj);
-            latencyEndMonitor(eviction_latency);
-            latencyAddSampleIfNeeded("eviction-del",eviction_latency);
-            delta -= (long long) zmalloc_used_memory();
-            mem_freed += delta;
-            server.stat_evictedkeys++;
-            signalModifiedKey(NULL,db,keyobj);
-            notifyKeyspaceEvent(NOTIFY_EVICTED, "evicted",
-                keyobj, db->id);
-            propagateDeletion(db,keyobj,server.lazyfree_lazy_eviction);
-            decrRefCount(keyobj);
+            mem_freed += evictKey(server.db+bestdbid,bestkey,
+                                  server.lazyfree_lazy_eviction);
             keys_freed++;
 
             if (keys_freed % 16 == 0) {
@@ -751,6 +1429,14 @@ cant_free:
     latencyEndMonitor(latency);
     latencyAddSampleIfNeeded("eviction-cycle",latency);
 
+    /* When proactive eviction is enabled, the cron is supposed to keep the
+     * memory below the low watermark, so that clients never have to wait
+     * for keys to be evicted. Track the cases where it failed to do so. */
+    if (keys_freed && proactiveEvictionTarget()) {
+        server.stat_inline_evictions++;
+        latencyAddSampleIfNeeded("eviction-inline",latency);
+    }
+
 update_metrics:
     if (result == EVICT_RUNNING || result == EVICT_FAIL) {
         if (server.stat_last_eviction_exceeded_time == 0)
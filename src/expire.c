@@ -64,10 +64,287 @@ int activeExpireCycleTryExpire(redisDb *db, dictEntry *de, long long now) {
     }
 }
 
-/* Try to expire a few timed out keys. The algorithm used is adaptive and
- * will use few CPU cycles if there are few expiring keys, otherwise
- * it will get more aggressive to avoid that too much memory is used by
- * keys that can be removed from the keyspace.
+/*-----------------------------------------------------------------------------
+ * Expire index
+ *
+ * Every key with an expire set is also referenced by a time ordered index,
+ * so that the active expire cycle can find the keys that are already
+ * logically expired without sampling db->expires at random.
+ *
+ * The index is a radix tree mapping the 64 bit big endian bucket id, that
+ * is the expire time in milliseconds shifted right by EXPIRE_INDEX_BUCKET_BITS,
+ * to a bucket holding the keys expiring in that time frame. The keys are not
+ * copied: the bucket stores the same SDS pointer used by the main dictionary
+ * and by db->expires, so the key is never accessed unless it has to be
+ * expired.
+ *
+ * Small buckets are unordered vectors of pointers, so the overhead is just
+ * 8 bytes per key. When a bucket grows over EXPIRE_INDEX_VECTOR_MAX keys it
+ * is converted into a set keyed by pointer, in order to remove keys in
+ * constant time: in this case the overhead is the same of an additional
+ * dictEntry, which is also the worst case for the whole index.
+ *----------------------------------------------------------------------------*/
+
+#define EXPIRE_INDEX_BUCKET_BITS 7      /* 128 milliseconds buckets. */
+#define EXPIRE_INDEX_VECTOR_MAX 128     /* Max keys before using a set. */
+#define EXPIRE_INDEX_BATCH 128          /* Keys collected at every step. */
+
+typedef struct expireBucket {
+    dict *set;              /* Keys of the bucket, or NULL if 'keys' is used. */
+    unsigned long cursor;   /* dictScan() cursor for 'set'. */
+    uint32_t count;         /* Number of keys in the bucket. */
+    uint32_t alloc;         /* Number of slots allocated in 'keys'. */
+    sds keys[];             /* Unordered vector of keys. */
+} expireBucket;
+
+static uint64_t expireBucketHash(const void *key) {
+    return dictGenHashFunction(&key,sizeof(key));
+}
+
+/* Set of SDS pointers: keys are compared by address and never freed. */
+static dictType expireBucketDictType = {
+    expireBucketHash,           /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    NULL,                       /* key compare */
+    NULL,                       /* key destructor */
+    NULL,                       /* val destructor */
+    NULL                        /* allow to expand */
+};
+
+static uint64_t expireIndexBucketId(long long when) {
+    if (when < 0) when = 0;
+    return (uint64_t)when >> EXPIRE_INDEX_BUCKET_BITS;
+}
+
+/* Seconds component used to maintain the TTL sum of the index. */
+static long long expireIndexSeconds(expireIndex *ei, long long when) {
+    return when/1000 - ei->base;
+}
+
+expireIndex *expireIndexCreate(void) {
+    expireIndex *ei = zmalloc(sizeof(*ei));
+    ei->buckets = raxNew();
+    ei->keys = 0;
+    ei->when_sum = 0;
+    ei->base = server.unixtime;
+    return ei;
+}
+
+static void expireBucketFree(void *ptr) {
+    expireBucket *b = ptr;
+    if (b->set) dictRelease(b->set);
+    zfree(b);
+}
+
+void expireIndexRelease(expireIndex *ei) {
+    raxFreeWithCallback(ei->buckets,expireBucketFree);
+    zfree(ei);
+}
+
+/* Remove all the keys from the index. */
+void expireIndexEmpty(expireIndex *ei) {
+    raxFreeWithCallback(ei->buckets,expireBucketFree);
+    ei->buckets = raxNew();
+    ei->keys = 0;
+    ei->when_sum = 0;
+}
+
+/* Add 'key' to the bucket of the 'when' expire time. The caller must make
+ * sure the key is not already indexed. */
+void expireIndexAdd(expireIndex *ei, sds key, long long when) {
+    uint64_t id = htonu64(expireIndexBucketId(when));
+    expireBucket *b = raxFind(ei->buckets,(unsigned char*)&id,sizeof(id));
+
+    if (b == raxNotFound) {
+        size_t usable;
+        b = zmalloc_usable(sizeof(*b)+sizeof(sds),&usable);
+        b->set = NULL;
+        b->cursor = 0;
+        b->count = 0;
+        b->alloc = (usable-sizeof(*b))/sizeof(sds);
+        raxInsert(ei->buckets,(unsigned char*)&id,sizeof(id),b,NULL);
+    }
+
+    if (b->set == NULL && b->count == b->alloc) {
+        if (b->alloc >= EXPIRE_INDEX_VECTOR_MAX) {
+            /* Convert the bucket into a set. */
+            dict *set = dictCreate(&expireBucketDictType);
+            dictExpand(set,b->count+1);
+            for (uint32_t j = 0; j < b->count; j++)
+                dictAdd(set,b->keys[j],NULL);
+            expireBucket *nb = zrealloc(b,sizeof(*b));
+            nb->set = set;
+            nb->alloc = 0;
+            b = nb;
+        } else {
+            size_t usable;
+            b = zrealloc_usable(b,sizeof(*b)+sizeof(sds)*b->alloc*2,&usable);
+            b->alloc = (usable-sizeof(*b))/sizeof(sds);
+        }
+        raxInsert(ei->buckets,(unsigned char*)&id,sizeof(id),b,NULL);
+    }
+
+    if (b->set) {
+        dictAdd(b->set,key,NULL);
+    } else {
+        b->keys[b->count] = key;
+    }
+    b->count++;
+    ei->keys++;
+    ei->when_sum += expireIndexSeconds(ei,when);
+}
+
+/* Remove 'key' from the bucket of the 'when' expire time, that must be the
+ * same expire time used when the key was added. */
+void expireIndexDel(expireIndex *ei, sds key, long long when) {
+    uint64_t id = htonu64(expireIndexBucketId(when));
+    expireBucket *b = raxFind(ei->buckets,(unsigned char*)&id,sizeof(id));
+    serverAssert(b != raxNotFound);
+
+    if (b->set) {
+        serverAssert(dictDelete(b->set,key) == DICT_OK);
+    } else {
+        uint32_t j;
+        for (j = 0; j < b->count; j++)
+            if (b->keys[j] == key) break;
+        serverAssert(j != b->count);
+        b->keys[j] = b->keys[b->count-1];
+    }
+    b->count--;
+    ei->keys--;
+    ei->when_sum -= expireIndexSeconds(ei,when);
+
+    if (b->count == 0) {
+        raxRemove(ei->buckets,(unsigned char*)&id,sizeof(id),NULL);
+        expireBucketFree(b);
+    } else if (b->set == NULL && b->alloc > 8 && b->count <= b->alloc/4) {
+        /* Release memory of vectors that were left mostly empty. */
+        size_t usable;
+        b = zrealloc_usable(b,sizeof(*b)+sizeof(sds)*b->alloc/2,&usable);
+        b->alloc = (usable-sizeof(*b))/sizeof(sds);
+        raxInsert(ei->buckets,(unsigned char*)&id,sizeof(id),b,NULL);
+    }
+}
+
+/* Move 'key' from the 'oldwhen' to the 'newwhen' expire time. */
+void expireIndexUpdate(expireIndex *ei, sds key, long long oldwhen, long long newwhen) {
+    if (expireIndexBucketId(oldwhen) == expireIndexBucketId(newwhen)) {
+        ei->when_sum += expireIndexSeconds(ei,newwhen) -
+                        expireIndexSeconds(ei,oldwhen);
+        return;
+    }
+    expireIndexDel(ei,key,oldwhen);
+    expireIndexAdd(ei,key,newwhen);
+}
+
+/* Called when the SDS string of an indexed key was reallocated, for
+ * instance by active defragmentation. */
+void expireIndexReplaceKey(expireIndex *ei, sds oldkey, sds newkey, long long when) {
+    uint64_t id = htonu64(expireIndexBucketId(when));
+    expireBucket *b = raxFind(ei->buckets,(unsigned char*)&id,sizeof(id));
+    serverAssert(b != raxNotFound);
+
+    if (b->set) {
+        serverAssert(dictDelete(b->set,oldkey) == DICT_OK);
+        dictAdd(b->set,newkey,NULL);
+    } else {
+        for (uint32_t j = 0; j < b->count; j++) {
+            if (b->keys[j] == oldkey) {
+                b->keys[j] = newkey;
+                return;
+            }
+        }
+        serverPanic("Key not found in the expire index");
+    }
+}
+
+/* Return the average TTL in milliseconds of the indexed keys. The sum of
+ * the expire times is kept with a resolution of one second, which is good
+ * enough for the INFO keyspace statistics. */
+long long expireIndexAvgTTL(expireIndex *ei, long long now) {
+    if (ei->keys == 0) return 0;
+    long long avg = (ei->when_sum/(long long)ei->keys + ei->base)*1000 - now;
+    return avg > 0 ? avg : 0;
+}
+
+static void expireBucketScanCallback(void *privdata, const dictEntry *de) {
+    void **pd = privdata;
+    sds *keys = pd[0];
+    unsigned long *count = pd[1];
+    if (*count < EXPIRE_INDEX_BATCH) keys[(*count)++] = dictGetKey(de);
+}
+
+/* Fill 'keys' with up to EXPIRE_INDEX_BATCH keys of the bucket. Sets are
+ * visited incrementally with dictScan() so that keys that are left in the
+ * bucket are not returned again and again. Returns the number of keys. */
+static unsigned long expireBucketGetKeys(expireBucket *b, sds *keys) {
+    unsigned long count = 0;
+
+    if (b->set) {
+        void *pd[2] = {keys,&count};
+        do {
+            b->cursor = dictScan(b->set,b->cursor,expireBucketScanCallback,
+                                 NULL,pd);
+        } while (count < EXPIRE_INDEX_BATCH/2 && b->cursor != 0);
+    } else {
+        count = b->count < EXPIRE_INDEX_BATCH ? b->count : EXPIRE_INDEX_BATCH;
+        memcpy(keys,b->keys+b->count-count,sizeof(sds)*count);
+    }
+    return count;
+}
+
+/* Expire up to about 'max' keys of 'db' whose expire time is in the past,
+ * starting from the oldest bucket of the expire index. The number of keys
+ * checked and expired is added to '*sampled' and '*expired'.
+ *
+ * Returns 1 if the limit was reached and there may be other keys to
+ * expire, otherwise 0 is returned. */
+static int activeExpireIndexedKeys(redisDb *db, long long now,
+                                   unsigned long max, unsigned long *sampled,
+                                   unsigned long *expired)
+{
+    expireIndex *ei = db->expires_index;
+    uint64_t now_id = expireIndexBucketId(now), from = 0;
+    unsigned long checked = 0;
+    sds keys[EXPIRE_INDEX_BATCH];
+
+    while (checked < max && ei->keys) {
+        raxIterator ri;
+        uint64_t id, seek = htonu64(from);
+        expireBucket *b = NULL;
+
+        raxStart(&ri,ei->buckets);
+        raxSeek(&ri,">=",(unsigned char*)&seek,sizeof(seek));
+        if (raxNext(&ri)) {
+            memcpy(&id,ri.key,sizeof(id));
+            id = ntohu64(id);
+            b = ri.data;
+        }
+        raxStop(&ri);
+        if (b == NULL || id > now_id) return 0;
+
+        /* All the keys of buckets before the current one are expired, so
+         * every batch makes progress. Keys of the current bucket may be
+         * still valid: this bucket is visited only once per call. */
+        unsigned long count = expireBucketGetKeys(b,keys);
+        unsigned long expired_now = 0;
+        for (unsigned long j = 0; j < count; j++) {
+            dictEntry *de = dictFind(db->expires,keys[j]);
+            if (de && activeExpireCycleTryExpire(db,de,now)) expired_now++;
+        }
+        checked += count;
+        *sampled += count;
+        *expired += expired_now;
+        if (id == now_id || expired_now == 0) from = id+1;
+    }
+    return checked >= max;
+}
+
+/* Try to expire the timed out keys. The algorithm will use few CPU cycles
+ * if there are few expiring keys, otherwise it will get more aggressive,
+ * within the configured time limits, to avoid that too much memory is
+ * used by keys that can be removed from the keyspace.
  *
  * Every expire cycle tests multiple databases: the next call will start
  * again from the next db. No more than CRON_DBS_PER_CALL databases are
@@ -94,11 +371,11 @@ int activeExpireCycleTryExpire(redisDb *db, dictEntry *de, long long now) {
  *
  * If type is ACTIVE_EXPIRE_CYCLE_SLOW, that normal expire cycle is
  * executed, where the time limit is a percentage of the REDIS_HZ period
- * as specified by the ACTIVE_EXPIRE_CYCLE_SLOW_TIME_PERC define. In the
- * fast cycle, the check of every database is interrupted once the number
- * of already expired keys in the database is estimated to be lower than
- * a given percentage, in order to avoid doing too much work to gain too
- * little memory.
+ * as specified by the ACTIVE_EXPIRE_CYCLE_SLOW_TIME_PERC define. In both
+ * cycles every database is processed walking its expire index from the
+ * oldest bucket, so that only keys already logically expired (and the few
+ * keys sharing the bucket of the current time) are checked, and the work
+ * on a database stops as soon as there are no more keys to reclaim.
  *
  * The configured expire "effort" will modify the baseline parameters in
  * order to do more work in both the fast and slow expire cycles.
@@ -189,9 +466,6 @@ void activeExpireCycle(int type) {
     server.propagate_no_multi = 1;
 
     for (j = 0; j < dbs_per_call && timelimit_exit == 0; j++) {
-        /* Expired and checked in a single loop. */
-        unsigned long expired, sampled;
-
         redisDb *db = server.db+(current_db % server.dbnum);
 
         /* Increment the DB now so we are sure if we run out of time
@@ -199,101 +473,31 @@ void activeExpireCycle(int type) {
          * distribute the time evenly across DBs. */
         current_db++;
 
-        /* Continue to expire if at the end of the cycle there are still
-         * a big percentage of keys to expire, compared to the number of keys
-         * we scanned. The percentage, stored in config_cycle_acceptable_stale
-         * is not fixed, but depends on the Redis configured "expire effort". */
+        /* Reclaim the keys found in the buckets of the expire index that
+         * are already in the past, a few keys at a time, checking the time
+         * limit from time to time. */
+        int more;
         do {
-            unsigned long num, slots;
-            long long now, ttl_sum;
-            int ttl_samples;
+            unsigned long expired = 0, sampled = 0;
+            long long now;
             iteration++;
 
             /* If there is nothing to expire try next DB ASAP. */
-            if ((num = dictSize(db->expires)) == 0) {
+            if (dictSize(db->expires) == 0) {
                 db->avg_ttl = 0;
                 break;
             }
-            slots = dictSlots(db->expires);
             now = mstime();
-
-            /* When there are less than 1% filled slots, sampling the key
-             * space is expensive, so stop here waiting for better times...
-             * The dictionary will be resized asap. */
-            if (slots > DICT_HT_INITIAL_SIZE &&
-                (num*100/slots < 1)) break;
-
-            /* The main collection cycle. Sample random keys among keys
-             * with an expire set, checking for expired ones. */
-            expired = 0;
-            sampled = 0;
-            ttl_sum = 0;
-            ttl_samples = 0;
-
-            if (num > config_keys_per_loop)
-                num = config_keys_per_loop;
-
-            /* Here we access the low level representation of the hash table
-             * for speed concerns: this makes this code coupled with dict.c,
-             * but it hardly changed in ten years.
-             *
-             * Note that certain places of the hash table may be empty,
-             * so we want also a stop condition about the number of
-             * buckets that we scanned. However scanning for free buckets
-             * is very fast: we are in the cache line scanning a sequential
-             * array of NULL pointers, so we can scan a lot more buckets
-             * than keys in the same time. */
-            long max_buckets = num*20;
-            long checked_buckets = 0;
-
-            while (sampled < num && checked_buckets < max_buckets) {
-                for (int table = 0; table < 2; table++) {
-                    if (table == 1 && !dictIsRehashing(db->expires)) break;
-
-                    unsigned long idx = db->expires_cursor;
-                    idx &= DICTHT_SIZE_MASK(db->expires->ht_size_exp[table]);
-                    dictEntry *de = db->expires->ht_table[table][idx];
-                    long long ttl;
-
-                    /* Scan the current bucket of the current table. */
-                    checked_buckets++;
-                    while(de) {
-                        /* Get the next entry now since this entry may get
-                         * deleted. */
-                        dictEntry *e = de;
-                        de = de->next;
-
-                        ttl = dictGetSignedIntegerVal(e)-now;
-                        if (activeExpireCycleTryExpire(db,e,now)) expired++;
-                        if (ttl > 0) {
-                            /* We want the average TTL of keys yet
-                             * not expired. */
-                            ttl_sum += ttl;
-                            ttl_samples++;
-                        }
-                        sampled++;
-                    }
-                }
-                db->expires_cursor++;
-            }
+            more = activeExpireIndexedKeys(db,now,config_keys_per_loop,
+                                           &sampled,&expired);
             total_expired += expired;
             total_sampled += sampled;
-
-            /* Update the average TTL stats for this database. */
-            if (ttl_samples) {
-                long long avg_ttl = ttl_sum/ttl_samples;
-
-                /* Do a simple running average with a few samples.
-                 * We just use the current estimate with a weight of 2%
-                 * and the previous estimate with a weight of 98%. */
-                if (db->avg_ttl == 0) db->avg_ttl = avg_ttl;
-                db->avg_ttl = (db->avg_ttl/50)*49 + (avg_ttl/50);
-            }
+            db->avg_ttl = expireIndexAvgTTL(db->expires_index,now);
 
             /* We can't block forever here even if there are many keys to
              * expire. So after a given amount of milliseconds return to the
              * caller waiting for the other active expire cycle. */
-            if ((iteration & 0xf) == 0) { /* check once every 16 iterations. */
+            if ((iteration & 0x3) == 0) { /* check once every 4 iterations. */
                 elapsed = ustime()-start;
                 if (elapsed > timelimit) {
                     timelimit_exit = 1;
@@ -301,11 +505,7 @@ void activeExpireCycle(int type) {
                     break;
                 }
             }
-            /* We don't repeat the cycle for the current database if there are
-             * an acceptable amount of stale keys (logically expired but yet
-             * not reclaimed). */
-        } while (sampled == 0 ||
-                 (expired*100/sampled) > config_cycle_acceptable_stale);
+        } while (more);
     }
 
     serverAssert(server.core_propagates); /* This function should not be re-entrant */
@@ -321,9 +521,10 @@ void activeExpireCycle(int type) {
     latencyAddSampleIfNeeded("expire-cycle",elapsed/1000);
 
     /* Update our estimate of keys existing but yet to be expired.
-     * Running average with this sample accounting for 5%. */
+     * Running average with this sample accounting for 5%. When the cycle
+     * was able to drain all the due buckets there are no stale keys. */
     double current_perc;
-    if (total_sampled) {
+    if (total_sampled && timelimit_exit) {
         current_perc = (double)total_expired/total_sampled;
     } else
         current_perc = 0;
@@ -388,7 +388,8 @@ sds createLatencyReport(void) {
             advices++;
         }
 
-        if (!strcasecmp(event,"eviction-cycle")) {
+        if (!strcasecmp(event,"eviction-cycle") ||
+            !strcasecmp(event,"eviction-inline")) {
             advise_mass_eviction = 1;
             advices++;
         }
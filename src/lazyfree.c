@@ -21,8 +21,10 @@ void lazyfreeFreeObject(void *args[]) {
 void lazyfreeFreeDatabase(void *args[]) {
     dict *ht1 = (dict *) args[0];
     dict *ht2 = (dict *) args[1];
+    expireIndex *ei = (expireIndex *) args[2];
 
     size_t numkeys = dictSize(ht1);
+    expireIndexRelease(ei);
     dictRelease(ht1);
     dictRelease(ht2);
     atomicDecr(lazyfree_objects,numkeys);
@@ -122,9 +124,9 @@ size_t lazyfreeGetFreeEffort(robj *key, robj *obj, int dbid) {
          * node in the Stream is one allocation. */
         effort += s->rax->numnodes;
 
-        /* Every consumer group is an allocation and so are the entries in its
-         * PEL. We use size of the first group's PEL as an estimate for all
-         * others. */
+        /* Every consumer group is an allocation and so are the entries in the
+         * PELs of its consumers. We use size of the first group's PEL as an
+         * estimate for all others. */
         if (s->cgroups && raxSize(s->cgroups)) {
             raxIterator ri;
             streamCG *cg;
@@ -134,7 +136,7 @@ size_t lazyfreeGetFreeEffort(robj *key, robj *obj, int dbid) {
              * work. */
             serverAssert(raxNext(&ri));
             cg = ri.data;
-            effort += raxSize(s->cgroups)*(1+raxSize(cg->pel));
+            effort += raxSize(s->cgroups)*(1+cg->pel.size);
             raxStop(&ri);
         }
         return effort;
@@ -155,6 +157,148 @@ size_t lazyfreeGetFreeEffort(robj *key, robj *obj, int dbid) {
  * slower... So under a certain limit we just free the object synchronously. */
 #define LAZYFREE_THRESHOLD 64
 
+/* ----------------------------------------------------------------------------
+ * Incremental freeing in the main thread.
+ *
+ * When the lazyfree threads are saturated (more than lazyfree-max-pending-jobs
+ * jobs queued), huge objects are not queued but released by the main thread
+ * in small chunks, so that a single free never blocks the server. Like the
+ * active expire cycle, there is a slow cycle called from serverCron() and a
+ * fast one called from beforeSleep(). The time of the slow cycle grows with
+ * the number of elements waiting to be released, up to a fraction of the
+ * cron period, so the main thread spends more time freeing as the backlog
+ * grows.
+ * ------------------------------------------------------------------------- */
+
+/* Elements released between two checks of the time limit. */
+#define LAZYFREE_INCREMENTAL_CHUNK 64
+/* Time limit in microseconds of a fast cycle, and of a slow cycle for every
+ * LAZYFREE_INCREMENTAL_BACKLOG_STEP elements waiting to be released. */
+#define LAZYFREE_INCREMENTAL_CYCLE_US 1000
+#define LAZYFREE_INCREMENTAL_BACKLOG_STEP 1000
+/* Max % of the cron period used by a slow cycle. */
+#define LAZYFREE_INCREMENTAL_SLOW_TIME_PERC 25
+
+typedef struct lazyfreeIncrementalJob {
+    robj *obj;
+    dictIterator *di;   /* Iterator for dict encoded objects, or NULL. */
+    size_t elements;    /* Elements left when the last step was done. */
+} lazyfreeIncrementalJob;
+
+static list *lazyfree_incremental = NULL;
+/* Elements of all the objects in lazyfree_incremental. */
+static size_t lazyfree_incremental_elements = 0;
+
+/* Return true if the object can be released in chunks by
+ * lazyfreeIncrementalStep(). */
+static int lazyfreeCanFreeIncrementally(robj *obj) {
+    return obj->type == OBJ_LIST ||
+           (obj->type == OBJ_SET && obj->encoding == OBJ_ENCODING_HT) ||
+           (obj->type == OBJ_ZSET && obj->encoding == OBJ_ENCODING_SKIPLIST) ||
+           (obj->type == OBJ_HASH && obj->encoding == OBJ_ENCODING_HT);
+}
+
+/* Return the number of elements of an object that can be freed
+ * incrementally. */
+static size_t lazyfreeIncrementalElements(robj *obj) {
+    if (obj->type == OBJ_LIST) return ((quicklist *)obj->ptr)->count;
+    if (obj->type == OBJ_ZSET) return ((zset *)obj->ptr)->zsl->length;
+    return dictSize((dict *)obj->ptr);
+}
+
+/* Release up to 'count' elements of the object. Returns 1 when the object
+ * was released completely, 0 otherwise. */
+static int lazyfreeIncrementalStep(lazyfreeIncrementalJob *job, long count) {
+    robj *obj = job->obj;
+
+    if (obj->type == OBJ_LIST) {
+        quicklist *ql = obj->ptr;
+        quicklistDelRange(ql,0,count);
+    } else if (obj->type == OBJ_ZSET) {
+        zset *zs = obj->ptr;
+        zslDeleteRangeByRank(zs->zsl,1,count,zs->dict);
+    } else {
+        /* Sets and hashes: deleting the entry just returned by a safe
+         * iterator is allowed. The dict is detached from the keyspace, so
+         * nobody else touches it while the iterator is paused. */
+        dict *d = obj->ptr;
+        dictEntry *de;
+        if (!job->di) job->di = dictGetSafeIterator(d);
+        while (count-- && (de = dictNext(job->di)) != NULL)
+            dictDelete(d,dictGetKey(de));
+    }
+
+    size_t elements = lazyfreeIncrementalElements(obj);
+    lazyfree_incremental_elements -= job->elements - elements;
+    job->elements = elements;
+    if (elements) return 0;
+
+    /* The object is now empty, releasing it is cheap. */
+    if (job->di) dictReleaseIterator(job->di);
+    decrRefCount(obj);
+    return 1;
+}
+
+static void lazyfreeIncrementalAdd(robj *obj) {
+    if (lazyfree_incremental == NULL) lazyfree_incremental = listCreate();
+    lazyfreeIncrementalJob *job = zmalloc(sizeof(*job));
+    job->obj = obj;
+    job->di = NULL;
+    job->elements = lazyfreeIncrementalElements(obj);
+    lazyfree_incremental_elements += job->elements;
+    listAddNodeTail(lazyfree_incremental,job);
+    atomicIncr(lazyfree_objects,1);
+}
+
+/* Release the objects queued for incremental freeing, oldest first. 'type'
+ * is LAZYFREE_CYCLE_SLOW when called from serverCron(), and
+ * LAZYFREE_CYCLE_FAST when called from beforeSleep(): like for
+ * activeExpireCycle(), a fast cycle runs for LAZYFREE_INCREMENTAL_CYCLE_US
+ * at most, and not more often than every two times that. */
+void lazyfreeIncrementalCycle(int type) {
+    static long long last_fast_cycle = 0; /* When last fast cycle ran. */
+    long long start, timelimit;
+
+    if (lazyfree_incremental == NULL || !listLength(lazyfree_incremental))
+        return;
+
+    start = ustime();
+    if (type == LAZYFREE_CYCLE_FAST) {
+        if (start < last_fast_cycle + LAZYFREE_INCREMENTAL_CYCLE_US*2) return;
+        last_fast_cycle = start;
+        timelimit = LAZYFREE_INCREMENTAL_CYCLE_US;
+    } else {
+        long long maxtime = LAZYFREE_INCREMENTAL_SLOW_TIME_PERC*1000000/server.hz/100;
+        timelimit = LAZYFREE_INCREMENTAL_CYCLE_US *
+            (1 + lazyfree_incremental_elements/LAZYFREE_INCREMENTAL_BACKLOG_STEP);
+        if (timelimit > maxtime) timelimit = maxtime;
+        if (timelimit < LAZYFREE_INCREMENTAL_CYCLE_US)
+            timelimit = LAZYFREE_INCREMENTAL_CYCLE_US;
+    }
+
+    while (listLength(lazyfree_incremental)) {
+        listNode *ln = listFirst(lazyfree_incremental);
+        lazyfreeIncrementalJob *job = ln->value;
+        if (lazyfreeIncrementalStep(job,LAZYFREE_INCREMENTAL_CHUNK)) {
+            zfree(job);
+            listDelNode(lazyfree_incremental,ln);
+            atomicDecr(lazyfree_objects,1);
+            atomicIncr(lazyfreed_objects,1);
+        }
+        if (ustime()-start > timelimit) break;
+    }
+}
+
+/* Return the number of objects waiting to be released by the main thread. */
+size_t lazyfreeGetIncrementalObjectsCount(void) {
+    return lazyfree_incremental ? listLength(lazyfree_incremental) : 0;
+}
+
+/* Return the number of lazy free jobs queued to the lazyfree threads. */
+unsigned long long lazyfreeGetPendingJobsCount(void) {
+    return bioPendingJobsOfType(BIO_LAZY_FREE);
+}
+
 /* Free an object, if the object is huge enough, free it in async way. */
 void freeObjAsync(robj *key, robj *obj, int dbid) {
     size_t free_effort = lazyfreeGetFreeEffort(key,obj,dbid);
@@ -163,6 +307,19 @@ void freeObjAsync(robj *key, robj *obj, int dbid) {
      * of parts of the Redis core may call incrRefCount() to protect
      * objects, and then call dbDelete(). */
     if (free_effort > LAZYFREE_THRESHOLD && obj->refcount == 1) {
+        /* The cache of stream nodes spilled to disk belongs to the main
+         * thread. */
+        if (obj->type == OBJ_STREAM && ((stream*)obj->ptr)->spill)
+            streamSpillCacheClear();
+        /* Apply backpressure when the lazyfree threads can't keep up. Objects
+         * that can't be split in chunks are queued anyway. */
+        if (server.lazyfree_max_pending_jobs &&
+            lazyfreeCanFreeIncrementally(obj) &&
+            lazyfreeGetPendingJobsCount() >= server.lazyfree_max_pending_jobs)
+        {
+            lazyfreeIncrementalAdd(obj);
+            return;
+        }
         atomicIncr(lazyfree_objects,1);
         bioCreateLazyFreeJob(lazyfreeFreeObject,1,obj);
     } else {
@@ -175,10 +332,16 @@ void freeObjAsync(robj *key, robj *obj, int dbid) {
  * lazy freeing. */
 void emptyDbAsync(redisDb *db) {
     dict *oldht1 = db->dict, *oldht2 = db->expires;
+    expireIndex *oldei = db->expires_index;
+    /* Values may be referenced by background defrag jobs: release them
+     * before the lazyfree thread gets to touch their refcount. */
+    activeDefragFlushJobs();
+    streamSpillCacheClear();
     db->dict = dictCreate(&dbDictType);
     db->expires = dictCreate(&dbExpiresDictType);
+    db->expires_index = expireIndexCreate();
     atomicIncr(lazyfree_objects,dictSize(oldht1));
-    bioCreateLazyFreeJob(lazyfreeFreeDatabase,2,oldht1,oldht2);
+    bioCreateLazyFreeJob(lazyfreeFreeDatabase,3,oldht1,oldht2,oldei);
 }
 
 /* Free the key tracking table.
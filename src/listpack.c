@@ -684,6 +684,52 @@ unsigned char *lpGetValue(unsigned char *p, unsigned int *slen, long long *lval)
     return vstr;
 }
 
+/* Decode 'count' consecutive elements starting at 'p' into the 'entries'
+ * array, using the same representation of lpGetValue(): 'sval' points to the
+ * string inside the listpack itself, or is NULL and 'lval' holds the integer
+ * value. This is faster than calling lpGetValue() and lpNext() for every
+ * element, since the size of each element is computed a single time while
+ * decoding it, and the listpack header is read only once.
+ *
+ * The listpack must hold at least 'count' elements starting at 'p'. The
+ * function returns the element following the last decoded one, or NULL if
+ * the end of the listpack was reached. */
+unsigned char *lpBatchDecode(unsigned char *lp, unsigned char *p, listpackEntry *entries, unsigned long count) {
+    uint32_t lp_bytes = lpBytes(lp);
+    uint64_t entry_size;
+    unsigned char *value;
+    int64_t ll;
+
+    assert(p);
+    for (unsigned long i = 0; i < count; i++) {
+        /* The next call to lpGetWithSize could read at most 8 bytes past `p`
+         * We use the slower validation call only when necessary. */
+        if (p + 8 >= lp + lp_bytes)
+            lpAssertValidEntry(lp, lp_bytes, p);
+        else
+            assert(p >= lp + LP_HDR_SIZE && p < lp + lp_bytes);
+        assert(p[0] != LP_EOF);
+
+        entry_size = 0; /* Not set for invalid encodings. */
+        value = lpGetWithSize(p, &ll, NULL, &entry_size);
+        assert(entry_size != 0 && p + entry_size < lp + lp_bytes);
+        if (value) {
+            entries[i].sval = value;
+            entries[i].slen = ll;
+        } else {
+            entries[i].sval = NULL;
+            entries[i].lval = ll;
+        }
+        p += entry_size;
+    }
+
+    if (p + 8 >= lp + lp_bytes)
+        lpAssertValidEntry(lp, lp_bytes, p);
+    else
+        assert(p >= lp + LP_HDR_SIZE && p < lp + lp_bytes);
+    return (p[0] == LP_EOF) ? NULL : p;
+}
+
 /* Find pointer to the entry equal to the specified entry. Skip 'skip' entries
  * between every comparison. Returns NULL when the field could not be found. */
 unsigned char *lpFind(unsigned char *lp, unsigned char *p, unsigned char *s, 
@@ -2229,6 +2275,18 @@ int listpackTest(int argc, char *argv[], int flags) {
         lpFree(lp);
     }
 
+    TEST("Test lpBatchDecode") {
+        listpackEntry entries[4];
+        lp = createList();
+        assert(lpBatchDecode(lp, lpFirst(lp), entries, 2) == lpSeek(lp, 2));
+        assert(entries[1].slen == 3 && !memcmp(entries[1].sval, "foo", 3));
+        assert(lpBatchDecode(lp, lpFirst(lp), entries, 4) == NULL);
+        assert(entries[0].slen == 5 && !memcmp(entries[0].sval, "hello", 5));
+        assert(entries[2].slen == 4 && !memcmp(entries[2].sval, "quux", 4));
+        assert(entries[3].sval == NULL && entries[3].lval == 1024);
+        lpFree(lp);
+    }
+
     TEST("Test lpValidateIntegrity") {
         lp = createList();
         long count = 0;
@@ -5044,6 +5044,7 @@ int RM_StreamAdd(RedisModuleKey *key, int flags, RedisModuleStreamID *id, RedisM
  * - EBADF if the key was not opened for writing or if a stream iterator is
  *   associated with the key
  * - ENOENT if no entry with the given stream ID exists
+ * - EIO if the entry could not be read from disk
  *
  * See also RM_StreamIteratorDelete() for deleting the current entry while
  * iterating using a stream iterator.
@@ -5062,10 +5063,11 @@ int RM_StreamDelete(RedisModuleKey *key, RedisModuleStreamID *id) {
     }
     stream *s = key->value->ptr;
     streamID streamid = {id->ms, id->seq};
-    if (streamDeleteItem(s, &streamid)) {
+    int deleted = streamDeleteItem(s, &streamid);
+    if (deleted == 1) {
         return REDISMODULE_OK;
     } else {
-        errno = ENOENT; /* no entry with this id */
+        errno = deleted == 0 ? ENOENT : EIO; /* no entry with this id, or a read error */
         return REDISMODULE_ERR;
     }
 }
@@ -5238,7 +5240,7 @@ int RM_StreamIteratorNextID(RedisModuleKey *key, RedisModuleStreamID *id, long *
         key->u.stream.currentid.ms = 0; /* for RM_StreamIteratorDelete() */
         key->u.stream.currentid.seq = 0;
         key->u.stream.numfieldsleft = 0; /* for RM_StreamIteratorNextField() */
-        errno = ENOENT;
+        errno = si->error ? EIO : ENOENT;
         return REDISMODULE_ERR;
     }
 }
@@ -9816,7 +9818,8 @@ typedef struct RedisModuleScanCursor{
 static void moduleScanCallback(void *privdata, const dictEntry *de) {
     ScanCBData *data = privdata;
     sds key = dictGetKey(de);
-    robj* val = dictGetVal(de);
+    compactValueView view;
+    robj* val = dbValueView((dictEntry*)de,&view);
     RedisModuleString *keyname = createObject(OBJ_STRING,sdsdup(key));
 
     /* Setup the key handle. */
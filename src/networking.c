@@ -78,13 +78,29 @@ size_t getStringObjectLen(robj *o) {
 /* Client.reply list dup and free methods. */
 void *dupClientReplyValue(void *o) {
     clientReplyBlock *old = o;
+    int refcount;
+
+    atomicGet(old->refcount,refcount);
+    if (refcount) {
+        atomicIncr(old->refcount,1);
+        return old;
+    }
     clientReplyBlock *buf = zmalloc(sizeof(clientReplyBlock) + old->size);
     memcpy(buf, o, sizeof(clientReplyBlock) + old->size);
     return buf;
 }
 
 void freeClientReplyValue(void *o) {
-    zfree(o);
+    clientReplyBlock *block = o;
+    int refcount;
+
+    if (block == NULL) return; /* Placeholder of addReplyDeferredLen(). */
+    atomicGet(block->refcount,refcount);
+    if (refcount) {
+        releaseSharedReplyBlock(block);
+        return;
+    }
+    replyBufferFree(block,sizeof(clientReplyBlock)+block->size);
 }
 
 int listMatchObjects(void *a, void *b) {
@@ -136,7 +152,6 @@ client *createClient(connection *conn) {
         connSetReadHandler(conn, readQueryFromClient);
         connSetPrivateData(conn, c);
     }
-    c->buf = zmalloc(PROTO_REPLY_CHUNK_BYTES);
     selectDb(c,0);
     uint64_t client_id;
     atomicGetIncr(server.next_client_id, client_id, 1);
@@ -145,13 +160,15 @@ client *createClient(connection *conn) {
     c->conn = conn;
     c->name = NULL;
     c->bufpos = 0;
-    c->buf_usable_size = zmalloc_usable_size(c->buf);
-    c->buf_peak = c->buf_usable_size;
+    c->buf = NULL;
+    c->buf_usable_size = 0;
+    c->buf_target_size = PROTO_REPLY_CHUNK_BYTES;
+    c->buf_peak = c->buf_target_size;
     c->buf_peak_last_reset_time = server.unixtime;
     c->ref_repl_buf_node = NULL;
     c->ref_block_pos = 0;
     c->qb_pos = 0;
-    c->querybuf = sdsempty();
+    c->querybuf = NULL;
     c->querybuf_peak = 0;
     c->reqtype = 0;
     c->argc = 0;
@@ -207,6 +224,9 @@ client *createClient(connection *conn) {
     c->pending_read_list_node = NULL;
     c->client_tracking_redirection = 0;
     c->client_tracking_prefixes = NULL;
+    c->client_tracking_slot = -1;
+    c->client_tracking_pending_keys = NULL;
+    c->client_tracking_pending_node = NULL;
     c->last_memory_usage = 0;
     c->last_memory_type = CLIENT_TYPE_NORMAL;
     c->auth_callback = NULL;
@@ -304,6 +324,18 @@ int prepareClientToWrite(client *c) {
 
     if (!c->conn) return C_ERR; /* Fake client for AOF loading. */
 
+    /* The keys invalidated for the client are coalesced until we return to
+     * the event loop, but the invalidation must precede anything sent to
+     * the client after the change, like the reply of a blocked client or a
+     * Pub/Sub message. The client running a command (or being served while
+     * blocked) gets them after its reply instead, so that they are not
+     * interleaved with it, see trackingHandlePendingKeyInvalidations(). */
+    if (c->client_tracking_pending_keys && c != server.current_client &&
+        io_threads_op == IO_THREADS_OP_IDLE)
+    {
+        trackingFlushPendingInvalidations(c);
+    }
+
     /* Schedule the client to write the output buffers to the socket, unless
      * it should already be setup to do so (it has already pending data).
      *
@@ -322,6 +354,22 @@ int prepareClientToWrite(client *c) {
  * Low level functions to add more data to output buffers.
  * -------------------------------------------------------------------------- */
 
+/* Borrow the static reply buffer from the reply buffer pool, with the size
+ * the client needed recently, see clientsCronResizeOutputBuffer(). */
+static void borrowClientReplyBuffer(client *c) {
+    c->buf = replyBufferAlloc(c->buf_target_size);
+    c->buf_usable_size = c->buf_target_size;
+}
+
+/* Return the static reply buffer to the pool, once its content was sent, so
+ * that idle clients don't hold any reply buffer. */
+static void releaseClientReplyBuffer(client *c) {
+    if (c->buf == NULL) return;
+    replyBufferFree(c->buf,c->buf_usable_size);
+    c->buf = NULL;
+    c->buf_usable_size = 0;
+}
+
 /* Attempts to add the reply to the static buffer in the client struct.
  * Returns the length of data that is added to the reply buffer.
  *
@@ -330,12 +378,16 @@ int prepareClientToWrite(client *c) {
  * sanitizer and generates a false positive out-of-bounds error */
 REDIS_NO_SANITIZE("bounds")
 size_t _addReplyToBuffer(client *c, const char *s, size_t len) {
-    size_t available = c->buf_usable_size - c->bufpos;
-
     /* If there already are entries in the reply list, we cannot
      * add anything more to the static buffer. */
     if (listLength(c->reply) > 0) return 0;
 
+    if (c->buf == NULL) {
+        if (len == 0) return 0;
+        borrowClientReplyBuffer(c);
+    }
+    size_t available = c->buf_usable_size - c->bufpos;
+
     size_t reply_len = len > available ? available : len;
     memcpy(c->buf+c->bufpos,s,reply_len);
     c->bufpos+=reply_len;
@@ -368,13 +420,19 @@ void _addReplyProtoToList(client *c, const char *s, size_t len) {
     }
     if (len) {
         /* Create a new node, make sure it is allocated to at
-         * least PROTO_REPLY_CHUNK_BYTES */
-        size_t usable_size;
-        size_t size = len < PROTO_REPLY_CHUNK_BYTES? PROTO_REPLY_CHUNK_BYTES: len;
-        tail = zmalloc_usable(size + sizeof(clientReplyBlock), &usable_size);
-        /* take over the allocation's internal fragmentation */
-        tail->size = usable_size - sizeof(clientReplyBlock);
+         * least PROTO_REPLY_CHUNK_BYTES. Nodes of this size are borrowed
+         * from the reply buffer pool. */
+        if (len <= PROTO_REPLY_CHUNK_BYTES - sizeof(clientReplyBlock)) {
+            tail = replyBufferAlloc(PROTO_REPLY_CHUNK_BYTES);
+            tail->size = PROTO_REPLY_CHUNK_BYTES - sizeof(clientReplyBlock);
+        } else {
+            size_t usable_size;
+            tail = zmalloc_usable(len + sizeof(clientReplyBlock), &usable_size);
+            /* take over the allocation's internal fragmentation */
+            tail->size = usable_size - sizeof(clientReplyBlock);
+        }
         tail->used = len;
+        tail->refcount = 0;
         memcpy(tail->buf, s, len);
         listAddNodeTail(c->reply, tail);
         c->reply_bytes += tail->size;
@@ -406,6 +464,60 @@ void _addReplyToBufferOrList(client *c, const char *s, size_t len) {
  * The following functions are the ones that commands implementations will call.
  * -------------------------------------------------------------------------- */
 
+/* Room needed by formatReplyLenHeader() and formatReplyDouble(). */
+#define REPLY_LEN_HDR_MAX_LEN 24
+#define REPLY_DOUBLE_MAX_LEN 64
+
+/* Write the "<prefix><len>\r\n" header of an aggregate or bulk reply to 'buf',
+ * that must have room for REPLY_LEN_HDR_MAX_LEN bytes, and return its
+ * length. Small lengths are copied from the shared headers. */
+static inline size_t formatReplyLenHeader(char *buf, char prefix, unsigned long long len) {
+    robj **hdr = NULL;
+
+    if (len < OBJ_SHARED_BULKHDR_LEN) {
+        switch(prefix) {
+        case '*': hdr = shared.mbulkhdr; break;
+        case '$': hdr = shared.bulkhdr; break;
+        case '%': hdr = shared.maphdr; break;
+        case '~': hdr = shared.sethdr; break;
+        }
+    }
+    if (hdr) {
+        /* Always copy 5 bytes: for one digit lengths the last one is the
+         * null term, that the caller overwrites. */
+        memcpy(buf,hdr[len]->ptr,5);
+        return OBJ_SHARED_HDR_STRLEN(len);
+    }
+
+    buf[0] = prefix;
+    size_t digits = ull2string(buf+1,REPLY_LEN_HDR_MAX_LEN-3,len);
+    buf[digits+1] = '\r';
+    buf[digits+2] = '\n';
+    return digits+3;
+}
+
+/* Write the protocol of the double 'd' reply to 'buf', that must have room
+ * for REPLY_DOUBLE_MAX_LEN bytes, and return its length. */
+static size_t formatReplyDouble(char *buf, int resp, double d) {
+    char dbuf[MAX_D2STRING_CHARS];
+    int dlen;
+
+    dlen = shortestd2string(dbuf,sizeof(dbuf),d);
+
+    size_t len;
+    if (resp == 2) {
+        len = formatReplyLenHeader(buf,'$',dlen);
+    } else {
+        buf[0] = ',';
+        len = 1;
+    }
+    memcpy(buf+len,dbuf,dlen);
+    len += dlen;
+    buf[len++] = '\r';
+    buf[len++] = '\n';
+    return len;
+}
+
 /* Add the object 'obj' string representation to the client output buffer. */
 void addReply(client *c, robj *obj) {
     if (prepareClientToWrite(c) != C_OK) return;
@@ -449,6 +561,60 @@ void addReplyProto(client *c, const char *s, size_t len) {
     _addReplyToBufferOrList(c,s,len);
 }
 
+/* Create a read only reply block holding the protocol 's', that can be
+ * added to the output buffer of many clients with addReplySharedBlock()
+ * without copying it. The caller owns a reference, to release with
+ * releaseSharedReplyBlock() when done. */
+clientReplyBlock *createSharedReplyBlock(const char *s, size_t len) {
+    clientReplyBlock *block = zmalloc(sizeof(clientReplyBlock) + len);
+    /* No free space: clients never append to a shared block. */
+    block->size = block->used = len;
+    block->refcount = 1;
+    memcpy(block->buf, s, len);
+    return block;
+}
+
+void releaseSharedReplyBlock(clientReplyBlock *block) {
+    int refcount;
+    atomicGetIncr(block->refcount,refcount,-1);
+    if (refcount == 1) zfree(block);
+}
+
+/* Append the shared reply block to the output buffer of the client, without
+ * any of the checks of addReplySharedBlock(). Only the client is touched, so
+ * this is also used by the I/O threads, see fanoutSlice(). Returns 1 if the
+ * block was linked in the reply list, 0 if it was copied in the static
+ * buffer. */
+static int _addReplySharedBlock(client *c, clientReplyBlock *block) {
+    if (listLength(c->reply) == 0 &&
+        c->buf_usable_size - c->bufpos >= block->used)
+    {
+        _addReplyToBuffer(c,block->buf,block->used);
+        return 0;
+    }
+    atomicIncr(block->refcount,1);
+    listAddNodeTail(c->reply,block);
+    c->reply_bytes += block->size;
+    return 1;
+}
+
+/* Add the protocol of a shared reply block to the client output buffer.
+ * Small replies that fit the static buffer are copied there, otherwise the
+ * block is linked by reference in the reply list. The client is accounted
+ * for the whole block, like if it was its own copy, so the output buffer
+ * limits work as usual. */
+void addReplySharedBlock(client *c, clientReplyBlock *block) {
+    if (prepareClientToWrite(c) != C_OK) return;
+    if (c->flags & CLIENT_CLOSE_AFTER_REPLY) return;
+
+    if (getClientType(c) == CLIENT_TYPE_SLAVE) {
+        _addReplyToBufferOrList(c,block->buf,block->used);
+        return;
+    }
+    if (_addReplySharedBlock(c,block))
+        closeClientOnOutputBufferLimitReached(c, 1);
+}
+
 /* Low level function called by the addReplyError...() functions.
  * It emits the protocol for a Redis error, in the form:
  *
@@ -769,6 +935,7 @@ void setDeferredReply(client *c, void *node, const char *s, size_t length) {
         /* Take over the allocation's internal fragmentation */
         buf->size = zmalloc_usable_size(buf) - sizeof(clientReplyBlock);
         buf->used = length;
+        buf->refcount = 0;
         memcpy(buf->buf, s, length);
         listNodeValue(ln) = buf;
         c->reply_bytes += buf->size;
@@ -803,8 +970,8 @@ void setDeferredAggregateLen(client *c, void *node, long length, char prefix) {
         return;
     }
 
-    char lenstr[128];
-    size_t lenstr_len = sprintf(lenstr, "%c%ld\r\n", prefix, length);
+    char lenstr[REPLY_LEN_HDR_MAX_LEN];
+    size_t lenstr_len = formatReplyLenHeader(lenstr, prefix, length);
     setDeferredReply(c, node, lenstr, lenstr_len);
 }
 
@@ -835,28 +1002,8 @@ void setDeferredPushLen(client *c, void *node, long length) {
 
 /* Add a double as a bulk reply */
 void addReplyDouble(client *c, double d) {
-    if (isinf(d)) {
-        /* Libc in odd systems (Hi Solaris!) will format infinite in a
-         * different way, so better to handle it in an explicit way. */
-        if (c->resp == 2) {
-            addReplyBulkCString(c, d > 0 ? "inf" : "-inf");
-        } else {
-            addReplyProto(c, d > 0 ? ",inf\r\n" : ",-inf\r\n",
-                              d > 0 ? 6 : 7);
-        }
-    } else {
-        char dbuf[MAX_LONG_DOUBLE_CHARS+3],
-             sbuf[MAX_LONG_DOUBLE_CHARS+32];
-        int dlen, slen;
-        if (c->resp == 2) {
-            dlen = snprintf(dbuf,sizeof(dbuf),"%.17g",d);
-            slen = snprintf(sbuf,sizeof(sbuf),"$%d\r\n%s\r\n",dlen,dbuf);
-            addReplyProto(c,sbuf,slen);
-        } else {
-            dlen = snprintf(dbuf,sizeof(dbuf),",%.17g\r\n",d);
-            addReplyProto(c,dbuf,dlen);
-        }
-    }
+    char buf[REPLY_DOUBLE_MAX_LEN];
+    addReplyProto(c,buf,formatReplyDouble(buf,c->resp,d));
 }
 
 void addReplyBigNum(client *c, const char* num, size_t len) {
@@ -1039,6 +1186,168 @@ void addReplyBulkLongLong(client *c, long long ll) {
     addReplyBulkCBuffer(c,buf,len);
 }
 
+/* -----------------------------------------------------------------------------
+ * Reply writer.
+ *
+ * Commands replying with many small elements, like LRANGE or HGETALL, spend
+ * most of their time checking the output buffers and copying every element
+ * in three fragments (header, value and CRLF). A reply writer reserves the
+ * free space at the tail of the output buffers once, and formats the elements
+ * straight into it, checking only that the next element fits:
+ *
+ *   replyWriter w;
+ *   addReplyArrayLen(c,count);
+ *   replyWriterStart(&w,c);
+ *   ... replyWriterBulkCBuffer(&w,p,len) for every element ...
+ *   replyWriterEnd(&w);
+ *
+ * Until replyWriterEnd() is called, no other reply may be added to the client.
+ * -------------------------------------------------------------------------- */
+
+void replyWriterStart(replyWriter *w, client *c) {
+    w->c = prepareClientToWrite(c) == C_OK ? c : NULL;
+    w->block = NULL;
+    w->pos = w->end = NULL;
+}
+
+/* Account the data written in the reserved space to the output buffer. */
+static void replyWriterCommit(replyWriter *w) {
+    if (w->pos == NULL) return;
+    client *c = w->c;
+    if (w->block) {
+        w->block->used = w->pos - w->block->buf;
+    } else {
+        c->bufpos = w->pos - c->buf;
+        if (c->buf_peak < (size_t)c->bufpos)
+            c->buf_peak = (size_t)c->bufpos;
+    }
+}
+
+/* Commit what was written so far, and reserve the free space at the tail of
+ * the output buffers, adding a new reply block if there are less than 'len'
+ * bytes. Returns C_ERR if the writer can't reserve space: the caller should
+ * then use _addReplyToBufferOrList(), that handles the replies bigger than a
+ * block and the clients that shouldn't get replies. */
+static int replyWriterReserve(replyWriter *w, size_t len) {
+    client *c = w->c;
+
+    if (c == NULL) return C_ERR;
+    replyWriterCommit(w);
+    w->block = NULL;
+    w->pos = w->end = NULL;
+
+    /* Stop writing if a new block made the client reach the output buffer
+     * limits, like prepareClientToWrite() does. */
+    if (c->flags & CLIENT_CLOSE_ASAP) {
+        w->c = NULL;
+        return C_ERR;
+    }
+    if (c->flags & CLIENT_CLOSE_AFTER_REPLY ||
+        getClientType(c) == CLIENT_TYPE_SLAVE ||
+        len > PROTO_REPLY_CHUNK_BYTES - sizeof(clientReplyBlock))
+    {
+        return C_ERR;
+    }
+
+    if (listLength(c->reply) == 0) {
+        if (c->buf == NULL) borrowClientReplyBuffer(c);
+        if (c->buf_usable_size - c->bufpos >= len) {
+            w->pos = c->buf + c->bufpos;
+            w->end = c->buf + c->buf_usable_size;
+            return C_OK;
+        }
+    } else {
+        /* The tail is NULL after addReplyDeferredLen(), while shared blocks
+         * never have free space. */
+        clientReplyBlock *tail = listNodeValue(listLast(c->reply));
+        if (tail && tail->size - tail->used >= len) {
+            w->block = tail;
+            w->pos = tail->buf + tail->used;
+            w->end = tail->buf + tail->size;
+            return C_OK;
+        }
+    }
+
+    clientReplyBlock *tail = replyBufferAlloc(PROTO_REPLY_CHUNK_BYTES);
+    tail->size = PROTO_REPLY_CHUNK_BYTES - sizeof(clientReplyBlock);
+    tail->used = 0;
+    tail->refcount = 0;
+    listAddNodeTail(c->reply, tail);
+    c->reply_bytes += tail->size;
+    closeClientOnOutputBufferLimitReached(c, 1);
+
+    w->block = tail;
+    w->pos = tail->buf;
+    w->end = tail->buf + tail->size;
+    return C_OK;
+}
+
+/* Make sure 'len' bytes are reserved, see replyWriterReserve(). */
+static inline int replyWriterEnsure(replyWriter *w, size_t len) {
+    if ((size_t)(w->end - w->pos) >= len) return C_OK;
+    return replyWriterReserve(w,len);
+}
+
+/* Commit the written replies. The writer can't be used afterwards. */
+void replyWriterEnd(replyWriter *w) {
+    if (w->c) replyWriterCommit(w);
+    w->c = NULL;
+    w->block = NULL;
+    w->pos = w->end = NULL;
+}
+
+void replyWriterAggregateLen(replyWriter *w, long length, int prefix) {
+    serverAssert(length >= 0);
+    if (replyWriterEnsure(w,REPLY_LEN_HDR_MAX_LEN) == C_ERR) {
+        if (w->c) {
+            char buf[REPLY_LEN_HDR_MAX_LEN];
+            _addReplyToBufferOrList(w->c,buf,formatReplyLenHeader(buf,prefix,length));
+        }
+        return;
+    }
+    w->pos += formatReplyLenHeader(w->pos,prefix,length);
+}
+
+void replyWriterArrayLen(replyWriter *w, long length) {
+    replyWriterAggregateLen(w,length,'*');
+}
+
+void replyWriterBulkCBuffer(replyWriter *w, const void *p, size_t len) {
+    if (replyWriterEnsure(w,REPLY_LEN_HDR_MAX_LEN+len+2) == C_ERR) {
+        if (w->c) {
+            char buf[REPLY_LEN_HDR_MAX_LEN];
+            _addReplyToBufferOrList(w->c,buf,formatReplyLenHeader(buf,'$',len));
+            _addReplyToBufferOrList(w->c,p,len);
+            _addReplyToBufferOrList(w->c,"\r\n",2);
+        }
+        return;
+    }
+    char *pos = w->pos;
+    pos += formatReplyLenHeader(pos,'$',len);
+    memcpy(pos,p,len);
+    pos += len;
+    pos[0] = '\r';
+    pos[1] = '\n';
+    w->pos = pos+2;
+}
+
+void replyWriterBulkLongLong(replyWriter *w, long long ll) {
+    char buf[LONG_STR_SIZE];
+    int len = ll2string(buf,sizeof(buf),ll);
+    replyWriterBulkCBuffer(w,buf,len);
+}
+
+void replyWriterDouble(replyWriter *w, double d) {
+    if (replyWriterEnsure(w,REPLY_DOUBLE_MAX_LEN) == C_ERR) {
+        if (w->c) {
+            char buf[REPLY_DOUBLE_MAX_LEN];
+            _addReplyToBufferOrList(w->c,buf,formatReplyDouble(buf,w->c->resp,d));
+        }
+        return;
+    }
+    w->pos += formatReplyDouble(w->pos,w->c->resp,d);
+}
+
 /* Reply with a verbatim type having the specified extension.
  *
  * The 'ext' is the "extension" of the file, actually just a three
@@ -1624,6 +1933,7 @@ void freeClient(client *c) {
     }
 
     /* Free the query buffer */
+    if (c->flags & CLIENT_SHARED_QUERYBUF) releaseSharedQueryBuffer(c);
     sdsfree(c->querybuf);
     c->querybuf = NULL;
 
@@ -1645,7 +1955,7 @@ void freeClient(client *c) {
 
     /* Free data structures. */
     listRelease(c->reply);
-    zfree(c->buf);
+    releaseClientReplyBuffer(c);
     freeReplicaReferencedReplBuffer(c);
     freeClientArgv(c);
     freeClientOriginalArgv(c);
@@ -1995,6 +2305,7 @@ int writeToClient(client *c, int handler_installed) {
     }
     if (!clientHasPendingReplies(c)) {
         c->sentlen = 0;
+        releaseClientReplyBuffer(c);
         /* Note that writeToClient() is called in a threaded way, but
          * aeDeleteFileEvent() is not thread safe: however writeToClient()
          * is always called with handler_installed set to 0 from threads
@@ -2340,7 +2651,7 @@ int processMultibulkBuffer(client *c) {
             }
 
             c->qb_pos = newline-c->querybuf+2;
-            if (!(c->flags & CLIENT_MASTER) && ll >= PROTO_MBULK_BIG_ARG) {
+            if (!(c->flags & CLIENT_MASTER) && ll >= server.proto_big_arg_len) {
                 /* When the client is not a master client (because master
                  * client's querybuf can only be trimmed after data applied
                  * and sent to replicas).
@@ -2353,13 +2664,34 @@ int processMultibulkBuffer(client *c) {
                  * But only when the data we have not parsed is less than
                  * or equal to ll+2. If the data length is greater than
                  * ll+2, trimming querybuf is just a waste of time, because
-                 * at this time the querybuf contains not only our bulk. */
-                if (sdslen(c->querybuf)-c->qb_pos <= (size_t)ll+2) {
-                    sdsrange(c->querybuf,c->qb_pos,-1);
+                 * at this time the querybuf contains not only our bulk.
+                 *
+                 * Bulks smaller than PROTO_MBULK_BIG_ARG (when the threshold
+                 * was lowered) that were already received entirely are just
+                 * copied: moving them would cost the same copy, plus the
+                 * allocation of a new query buffer. */
+                size_t avail = sdslen(c->querybuf)-c->qb_pos;
+                if (avail < (size_t)ll+2 ||
+                    (avail == (size_t)ll+2 && ll >= PROTO_MBULK_BIG_ARG))
+                {
+                    if (sdsalloc(c->querybuf) > ((size_t)ll+2)*2) {
+                        /* The query buffer is way bigger than the bulk: move
+                         * what we have of the bulk into a buffer of the right
+                         * size, so that it does not need to be trimmed when
+                         * it is stored in the key space. */
+                        sds arg = sdsnewlen(SDS_NOINIT,ll+2);
+                        memcpy(arg,c->querybuf+c->qb_pos,avail);
+                        sdssetlen(arg,avail);
+                        arg[avail] = '\0';
+                        sdsfree(c->querybuf);
+                        c->querybuf = arg;
+                    } else {
+                        sdsrange(c->querybuf,c->qb_pos,-1);
+                        /* Hint the sds library about the amount of bytes this string is
+                         * going to contain. */
+                        c->querybuf = sdsMakeRoomForNonGreedy(c->querybuf,ll+2-sdslen(c->querybuf));
+                    }
                     c->qb_pos = 0;
-                    /* Hint the sds library about the amount of bytes this string is
-                     * going to contain. */
-                    c->querybuf = sdsMakeRoomForNonGreedy(c->querybuf,ll+2-sdslen(c->querybuf));
                 }
             }
             c->bulklen = ll;
@@ -2381,7 +2713,7 @@ int processMultibulkBuffer(client *c) {
              * just use the current sds string. */
             if (!(c->flags & CLIENT_MASTER) &&
                 c->qb_pos == 0 &&
-                c->bulklen >= PROTO_MBULK_BIG_ARG &&
+                c->bulklen >= server.proto_big_arg_len &&
                 sdslen(c->querybuf) == (size_t)(c->bulklen+2))
             {
                 c->argv[c->argc++] = createObject(OBJ_STRING,c->querybuf);
@@ -2389,7 +2721,8 @@ int processMultibulkBuffer(client *c) {
                 sdsIncrLen(c->querybuf,-2); /* remove CRLF */
                 /* Assume that if we saw a fat argument we'll see another one
                  * likely... */
-                c->querybuf = sdsnewlen(SDS_NOINIT,c->bulklen+2);
+                c->querybuf = sdsnewlen(SDS_NOINIT,
+                    max(c->bulklen+2,PROTO_IOBUF_LEN));
                 sdsclear(c->querybuf);
             } else {
                 c->argv[c->argc++] =
@@ -2511,7 +2844,7 @@ int processPendingCommandAndInputBuffer(client *c) {
  * return C_ERR in case the client was freed during the processing */
 int processInputBuffer(client *c) {
     /* Keep processing while there is something in the input buffer */
-    while(c->qb_pos < sdslen(c->querybuf)) {
+    while(c->querybuf && c->qb_pos < sdslen(c->querybuf)) {
         /* Immediately abort if the client is in the middle of something. */
         if (c->flags & CLIENT_BLOCKED) break;
 
@@ -2605,6 +2938,36 @@ int processInputBuffer(client *c) {
     return C_OK;
 }
 
+/* Every thread reading from clients has a shared query buffer, so that
+ * clients with no pending input don't need a query buffer of their own:
+ * the data read is processed from the shared buffer, and only the clients
+ * left with a partial command keep it for the next read. The buffer is lent
+ * to the client, so that a client read while another one is processing its
+ * command (see processEventsWhileBlocked()) just gets a new one. */
+static __thread sds thread_shared_qb = NULL;
+
+static void takeSharedQueryBuffer(client *c) {
+    c->querybuf = thread_shared_qb ? thread_shared_qb : sdsempty();
+    c->flags |= CLIENT_SHARED_QUERYBUF;
+    thread_shared_qb = NULL;
+}
+
+/* Give the shared query buffer back to the thread, unless the client is in
+ * the middle of a command, in which case it becomes the client's own. */
+void releaseSharedQueryBuffer(client *c) {
+    c->flags &= ~CLIENT_SHARED_QUERYBUF;
+    if (c->qb_pos < sdslen(c->querybuf) || c->multibulklen) return;
+
+    if (thread_shared_qb == NULL && sdsalloc(c->querybuf) <= PROTO_IOBUF_LEN*2) {
+        sdsclear(c->querybuf);
+        thread_shared_qb = c->querybuf;
+    } else {
+        sdsfree(c->querybuf);
+    }
+    c->querybuf = NULL;
+    c->qb_pos = 0;
+}
+
 void readQueryFromClient(connection *conn) {
     client *c = connGetPrivateData(conn);
     int nread, big_arg = 0;
@@ -2625,7 +2988,7 @@ void readQueryFromClient(connection *conn) {
      * processMultiBulkBuffer() can avoid copying buffers to create the
      * Redis Object representing the argument. */
     if (c->reqtype == PROTO_REQ_MULTIBULK && c->multibulklen && c->bulklen != -1
-        && c->bulklen >= PROTO_MBULK_BIG_ARG)
+        && c->bulklen >= server.proto_big_arg_len)
     {
         ssize_t remaining = (size_t)(c->bulklen+2)-(sdslen(c->querybuf)-c->qb_pos);
         big_arg = 1;
@@ -2640,6 +3003,15 @@ void readQueryFromClient(connection *conn) {
             readlen = PROTO_IOBUF_LEN;
     }
 
+    if (c->querybuf == NULL) {
+        /* Master client's querybuf is also used to proxy the replication
+         * stream to sub-replicas, so it always has its own. */
+        if (c->flags & CLIENT_MASTER)
+            c->querybuf = sdsempty();
+        else
+            takeSharedQueryBuffer(c);
+    }
+
     qblen = sdslen(c->querybuf);
     if (!(c->flags & CLIENT_MASTER) && // master client's querybuf can grow greedy.
         (big_arg || sdsalloc(c->querybuf) < PROTO_IOBUF_LEN)) {
@@ -2658,7 +3030,9 @@ void readQueryFromClient(connection *conn) {
     nread = connRead(c->conn, c->querybuf+qblen, readlen);
     if (nread == -1) {
         if (connGetState(conn) == CONN_STATE_CONNECTED) {
-            return;
+            /* Nothing to read (common with TLS): the shared query buffer,
+             * if the client took it, must still be given back. */
+            goto done;
         } else {
             serverLog(LL_VERBOSE, "Reading from client: %s",connGetLastError(c->conn));
             freeClientAsync(c);
@@ -2698,6 +3072,7 @@ void readQueryFromClient(connection *conn) {
          c = NULL;
 
 done:
+    if (c && c->flags & CLIENT_SHARED_QUERYBUF) releaseSharedQueryBuffer(c);
     beforeNextClient(c);
 }
 
@@ -2811,11 +3186,11 @@ sds catClientInfoString(sds s, client *client) {
         (int) dictSize(client->pubsub_channels),
         (int) listLength(client->pubsub_patterns),
         (client->flags & CLIENT_MULTI) ? client->mstate.count : -1,
-        (unsigned long long) sdslen(client->querybuf),
-        (unsigned long long) sdsavail(client->querybuf),
+        (unsigned long long) (client->querybuf ? sdslen(client->querybuf) : 0),
+        (unsigned long long) (client->querybuf ? sdsavail(client->querybuf) : 0),
         (unsigned long long) client->argv_len_sum,
         (unsigned long long) client->mstate.argv_len_sums,
-        (unsigned long long) client->buf_usable_size,
+        (unsigned long long) client->buf_target_size,
         (unsigned long long) client->buf_peak,
         (unsigned long long) client->bufpos,
         (unsigned long long) listLength(client->reply) + used_blocks_of_repl_buf,
@@ -3663,7 +4038,9 @@ size_t getClientMemoryUsage(client *c, size_t *output_buffer_mem_usage) {
     size_t mem = getClientOutputBufferMemoryUsage(c);
     if (output_buffer_mem_usage != NULL)
         *output_buffer_mem_usage = mem;
-    mem += sdsZmallocSize(c->querybuf);
+    /* The shared query buffer is only lent while processing the input. */
+    if (c->querybuf && !(c->flags & CLIENT_SHARED_QUERYBUF))
+        mem += sdsZmallocSize(c->querybuf);
     mem += zmalloc_size(c);
     mem += c->buf_usable_size;
     /* For efficiency (less work keeping track of the argv memory), it doesn't include the used memory
@@ -3681,6 +4058,8 @@ size_t getClientMemoryUsage(client *c, size_t *output_buffer_mem_usage) {
     /* Add memory overhead of the tracking prefixes, this is an underestimation so we don't need to traverse the entire rax */
     if (c->client_tracking_prefixes)
         mem += c->client_tracking_prefixes->numnodes * (sizeof(raxNode) * sizeof(raxNode*));
+    if (c->client_tracking_pending_keys)
+        mem += c->client_tracking_pending_keys->numnodes * (sizeof(raxNode) * sizeof(raxNode*));
 
     return mem;
 }
@@ -4015,7 +4394,7 @@ void processEventsWhileBlocked(void) {
 pthread_t io_threads[IO_THREADS_MAX_NUM];
 pthread_mutex_t io_threads_mutex[IO_THREADS_MAX_NUM];
 redisAtomic unsigned long io_threads_pending[IO_THREADS_MAX_NUM];
-int io_threads_op;      /* IO_THREADS_OP_IDLE, IO_THREADS_OP_READ or IO_THREADS_OP_WRITE. */ // TODO: should access to this be atomic??!
+int io_threads_op;      /* IO_THREADS_OP_IDLE, IO_THREADS_OP_READ, IO_THREADS_OP_WRITE or IO_THREADS_OP_FANOUT. */ // TODO: should access to this be atomic??!
 
 /* This is the list of clients each thread will serve when threaded I/O is
  * used. We spawn io_threads_num-1 threads, since one is the main thread
@@ -4032,6 +4411,186 @@ static inline void setIOPendingCount(int i, unsigned long count) {
     atomicSetWithSync(io_threads_pending[i], count);
 }
 
+/* Fan-out of shared reply blocks to many clients using the I/O threads, see
+ * fanoutSharedBlocksUsingThreads(). */
+static struct {
+    clientReplyBlock **blocks;  /* Blocks for RESP2 and RESP3 clients. */
+    listNode *first[IO_THREADS_MAX_NUM];    /* First client of each slice. */
+    unsigned long count[IO_THREADS_MAX_NUM]; /* Clients in each slice. */
+    list *pending[IO_THREADS_MAX_NUM];  /* Clients to queue for write. */
+    list *updated[IO_THREADS_MAX_NUM];  /* Clients to check on the main thread. */
+    list *skipped[IO_THREADS_MAX_NUM];  /* Clients left to the main thread. */
+} io_threads_fanout;
+
+/* Reply buffers pool.
+ *
+ * Clients don't own a reply buffer while idle: the static reply buffer and
+ * the reply list nodes of PROTO_REPLY_CHUNK_BYTES are borrowed from a pool
+ * of free chunks when there is something to send, and returned to the pool
+ * as soon as they are written, so that many idle clients don't waste memory
+ * and bursty clients don't churn the allocator.
+ *
+ * Chunks are size-classed, in powers of two from PROTO_REPLY_MIN_BYTES to
+ * PROTO_REPLY_CHUNK_BYTES. Every I/O thread returns the chunks of the clients
+ * it writes to its own pool, so no locking is needed, and the main thread
+ * moves them to its pool once the threads are done. Other threads (modules)
+ * just use the allocator. */
+
+#define REPLY_POOL_MIN_SHIFT 10 /* log2(PROTO_REPLY_MIN_BYTES) */
+#define REPLY_POOL_CLASSES 5    /* 1k, 2k, 4k, 8k and 16k chunks. */
+static_assert(PROTO_REPLY_MIN_BYTES == 1 << REPLY_POOL_MIN_SHIFT, "unexpected min reply size");
+static_assert(PROTO_REPLY_CHUNK_BYTES == PROTO_REPLY_MIN_BYTES << (REPLY_POOL_CLASSES-1), "unexpected reply chunk size");
+
+typedef struct replyBufferPool {
+    void *free[REPLY_POOL_CLASSES]; /* Free chunks, linked by their first word. */
+    size_t bytes;                   /* Memory of the free chunks. */
+} replyBufferPool;
+
+static replyBufferPool reply_buffer_pools[IO_THREADS_MAX_NUM];
+static __thread replyBufferPool *thread_reply_buffer_pool = NULL;
+
+/* Return the pool class of chunks of 'size' bytes, or -1 if not pooled. */
+static int replyBufferClass(size_t size) {
+    if (size < PROTO_REPLY_MIN_BYTES || size > PROTO_REPLY_CHUNK_BYTES ||
+        (size & (size-1))) return -1;
+    return __builtin_ctzl(size) - REPLY_POOL_MIN_SHIFT;
+}
+
+static void replyBufferPoolPush(replyBufferPool *pool, int class, void *p) {
+    *(void**)p = pool->free[class];
+    pool->free[class] = p;
+    pool->bytes += (size_t)PROTO_REPLY_MIN_BYTES << class;
+}
+
+static void *replyBufferPoolPop(replyBufferPool *pool, int class) {
+    void *p = pool->free[class];
+    if (p) {
+        pool->free[class] = *(void**)p;
+        pool->bytes -= (size_t)PROTO_REPLY_MIN_BYTES << class;
+    }
+    return p;
+}
+
+/* Return the size of the smallest pool class able to hold 'size' bytes,
+ * or of the largest class when none is big enough. */
+size_t replyBufferSizeClass(size_t size) {
+    size_t class_size = PROTO_REPLY_MIN_BYTES;
+    while (class_size < size && class_size < PROTO_REPLY_CHUNK_BYTES)
+        class_size <<= 1;
+    return class_size;
+}
+
+/* Get a chunk of 'size' bytes, that must be the size of a pool class. */
+void *replyBufferAlloc(size_t size) {
+    int class = replyBufferClass(size);
+    serverAssert(class != -1);
+
+    void *p = NULL;
+    if (thread_reply_buffer_pool)
+        p = replyBufferPoolPop(thread_reply_buffer_pool,class);
+    return p ? p : zmalloc(size);
+}
+
+/* Give back a chunk of 'size' bytes: it goes to the pool of the calling
+ * thread when it has the size of a pool class and the pool isn't full,
+ * otherwise it is freed. */
+void replyBufferFree(void *p, size_t size) {
+    replyBufferPool *pool = thread_reply_buffer_pool;
+    int class = replyBufferClass(size);
+
+    if (pool == NULL || class == -1 ||
+        pool->bytes + size > server.reply_buffer_pool_size)
+    {
+        zfree(p);
+        return;
+    }
+    replyBufferPoolPush(pool,class,p);
+}
+
+/* Move the chunks given back by the I/O threads to the pool of the main
+ * thread. Must be called when the threads are idle. */
+static void collectReplyBufferPools(void) {
+    replyBufferPool *main_pool = &reply_buffer_pools[0];
+
+    for (int j = 1; j < server.io_threads_num; j++) {
+        replyBufferPool *pool = &reply_buffer_pools[j];
+        if (pool->bytes == 0) continue;
+        for (int class = 0; class < REPLY_POOL_CLASSES; class++) {
+            size_t size = (size_t)PROTO_REPLY_MIN_BYTES << class;
+            void *p;
+            while ((p = replyBufferPoolPop(pool,class)) != NULL) {
+                if (main_pool->bytes + size > server.reply_buffer_pool_size)
+                    zfree(p);
+                else
+                    replyBufferPoolPush(main_pool,class,p);
+            }
+        }
+    }
+}
+
+/* Free the pooled chunks exceeding 'max_bytes', starting from the biggest
+ * ones. */
+void trimReplyBufferPool(size_t max_bytes) {
+    replyBufferPool *pool = &reply_buffer_pools[0];
+    int class = REPLY_POOL_CLASSES-1;
+
+    while (pool->bytes > max_bytes && class >= 0) {
+        void *p = replyBufferPoolPop(pool,class);
+        if (p) zfree(p);
+        else class--;
+    }
+}
+
+/* Return the memory held by the free chunks of the pools. */
+size_t replyBufferPoolMemory(void) {
+    size_t bytes = 0;
+    for (int j = 0; j < server.io_threads_num && j < IO_THREADS_MAX_NUM; j++)
+        bytes += reply_buffer_pools[j].bytes;
+    return bytes;
+}
+
+/* Append the shared blocks to the slice of the fan-out clients handled by
+ * the I/O thread 'id'. Nothing is written to the sockets here: the clients
+ * are only queued for write, and are written in beforeSleep() after the AOF
+ * is flushed, like for any other reply. Clients whose output buffer involves
+ * global state (the current client, replicas, clients being closed or not
+ * accepting replies) are left to the main thread. */
+static void fanoutSlice(int id) {
+    listNode *ln = io_threads_fanout.first[id];
+
+    for (unsigned long j = 0; j < io_threads_fanout.count[id];
+         j++, ln = listNextNode(ln))
+    {
+        client *c = listNodeValue(ln);
+
+        if (c == server.current_client || c->client_tracking_pending_keys ||
+            !c->conn || (c->flags & (CLIENT_SLAVE|CLIENT_MASTER|
+             CLIENT_REPLY_OFF|CLIENT_REPLY_SKIP|CLIENT_CLOSE_ASAP|
+             CLIENT_CLOSE_AFTER_REPLY|CLIENT_PROTECTED)))
+        {
+            listAddNodeTail(io_threads_fanout.skipped[id],c);
+            continue;
+        }
+
+        int had_replies = clientHasPendingReplies(c);
+        if (_addReplySharedBlock(c,io_threads_fanout.blocks[c->resp == 2 ? 0 : 1]) &&
+            checkClientOutputBufferLimits(c))
+        {
+            /* To be closed by the main thread. */
+            listAddNodeTail(io_threads_fanout.updated[id],c);
+        } else if (!had_replies && !(c->flags & CLIENT_PENDING_WRITE)) {
+            /* Like putClientInPendingWriteQueue(), the lists are joined
+             * to the global one by the main thread. */
+            c->flags |= CLIENT_PENDING_WRITE;
+            listAddNodeTail(io_threads_fanout.pending[id],c);
+        } else if (!(c->flags & CLIENT_PENDING_WRITE)) {
+            /* Waiting for its write handler: the memory usage is updated
+             * by the main thread, see fanoutSharedBlocksUsingThreads(). */
+            listAddNodeTail(io_threads_fanout.updated[id],c);
+        }
+    }
+}
+
 void *IOThreadMain(void *myid) {
     /* The ID is the thread number (from 0 to server.iothreads_num-1), and is
      * used by the thread to just manipulate a single sub-array of clients. */
@@ -4042,6 +4601,7 @@ void *IOThreadMain(void *myid) {
     redis_set_thread_title(thdname);
     redisSetCpuAffinity(server.server_cpulist);
     makeThreadKillable();
+    thread_reply_buffer_pool = &reply_buffer_pools[id];
 
     while(1) {
         /* Wait for start */
@@ -4058,6 +4618,12 @@ void *IOThreadMain(void *myid) {
 
         serverAssert(getIOPendingCount(id) != 0);
 
+        if (io_threads_op == IO_THREADS_OP_FANOUT) {
+            fanoutSlice(id);
+            setIOPendingCount(id, 0);
+            continue;
+        }
+
         /* Process: note that the main thread will never touch our list
          * before we drop the pending count to 0. */
         listIter li;
@@ -4085,6 +4651,9 @@ void initThreadedIO(void) {
     /* Indicate that io-threads are currently idle */
     io_threads_op = IO_THREADS_OP_IDLE;
 
+    /* The main thread gets reply buffers from the first pool. */
+    thread_reply_buffer_pool = &reply_buffer_pools[0];
+
     /* Don't spawn any thread if the user selected a single thread:
      * we'll handle I/O directly from the main thread. */
     if (server.io_threads_num == 1) return;
@@ -4215,6 +4784,8 @@ int handleClientsWithPendingWritesUsingThreads(void) {
             continue;
         }
 
+        /* The connection state is updated once the threads are done. */
+        connSetPostponeUpdateState(c->conn, 1);
         int target_id = item_id % server.io_threads_num;
         listAddNodeTail(io_threads_list[target_id],c);
         item_id++;
@@ -4245,6 +4816,7 @@ int handleClientsWithPendingWritesUsingThreads(void) {
     }
 
     io_threads_op = IO_THREADS_OP_IDLE;
+    collectReplyBufferPools();
 
     /* Run the list of clients again to install the write handler where
      * needed. */
@@ -4252,6 +4824,10 @@ int handleClientsWithPendingWritesUsingThreads(void) {
     while((ln = listNext(&li))) {
         client *c = listNodeValue(ln);
 
+        /* Update the connection state that the threads could not. */
+        connSetPostponeUpdateState(c->conn, 0);
+        connUpdateState(c->conn);
+
         /* Update the client in the mem usage after we're done processing it in the io-threads */
         updateClientMemUsage(c);
 
@@ -4269,6 +4845,98 @@ int handleClientsWithPendingWritesUsingThreads(void) {
     return processed;
 }
 
+/* Return 1 if the shared blocks for the clients should be appended using
+ * fanoutSharedBlocksUsingThreads(). */
+int canFanoutUsingThreads(list *clients) {
+    return server.io_threads_num > 1 &&
+           listLength(clients) >= (unsigned long)server.io_threads_fanout_min_clients &&
+           io_threads_op == IO_THREADS_OP_IDLE &&
+           !ProcessingEventsWhileBlocked;
+}
+
+/* Add the shared blocks to many clients, like calling addReplySharedBlock()
+ * for every client, but splitting the clients across the I/O threads. 'blocks'
+ * holds the block for RESP2 clients and the one for RESP3 clients.
+ *
+ * The threads only append to the output buffers and collect the clients to
+ * queue for write, that the main thread joins to the pending writes list in
+ * O(1). The sockets are written later by handleClientsWithPendingWrites*()
+ * in beforeSleep(), after the AOF flush, so appendfsync always still holds.
+ * The memory usage of the queued clients is updated there too, once they are
+ * written, so the main thread only handles the clients that were skipped,
+ * reached the output buffer limits, or wait for their write handler.
+ *
+ * Like handleClientsWithPendingWritesUsingThreads(), this uses a fan-out ->
+ * fan-in paradigm: the main thread waits for all the threads to be done
+ * before touching the clients again. */
+void fanoutSharedBlocksUsingThreads(list *clients, clientReplyBlock **blocks) {
+    if (!server.io_threads_active) startThreadedIO();
+
+    io_threads_fanout.blocks = blocks;
+    for (int j = 0; j < server.io_threads_num; j++) {
+        if (io_threads_fanout.pending[j] == NULL) {
+            io_threads_fanout.pending[j] = listCreate();
+            io_threads_fanout.updated[j] = listCreate();
+            io_threads_fanout.skipped[j] = listCreate();
+        }
+    }
+
+    /* Split the list in slices with a single walk, so that every thread
+     * starts from its first node instead of walking the ones before. */
+    unsigned long len = listLength(clients), pos = 0;
+    listNode *ln = listFirst(clients);
+    for (int j = 0; j < server.io_threads_num; j++) {
+        unsigned long start = len * j / server.io_threads_num;
+        unsigned long end = len * (j+1) / server.io_threads_num;
+        while (pos < start) {
+            ln = listNextNode(ln);
+            pos++;
+        }
+        io_threads_fanout.first[j] = ln;
+        io_threads_fanout.count[j] = end - start;
+    }
+
+    io_threads_op = IO_THREADS_OP_FANOUT;
+    for (int j = 1; j < server.io_threads_num; j++)
+        setIOPendingCount(j, 1);
+
+    /* Also use the main thread to process a slice of clients. */
+    fanoutSlice(0);
+
+    /* Wait for all the other threads to end their work. */
+    while(1) {
+        unsigned long pending = 0;
+        for (int j = 1; j < server.io_threads_num; j++)
+            pending += getIOPendingCount(j);
+        if (pending == 0) break;
+    }
+
+    io_threads_op = IO_THREADS_OP_IDLE;
+    collectReplyBufferPools();
+
+    listIter li;
+    for (int j = 0; j < server.io_threads_num; j++) {
+        listJoin(server.clients_pending_write,io_threads_fanout.pending[j]);
+
+        listRewind(io_threads_fanout.updated[j],&li);
+        while((ln = listNext(&li))) {
+            client *c = listNodeValue(ln);
+            if (closeClientOnOutputBufferLimitReached(c, 1)) continue;
+            updateClientMemUsage(c);
+        }
+        listEmpty(io_threads_fanout.updated[j]);
+
+        listRewind(io_threads_fanout.skipped[j],&li);
+        while((ln = listNext(&li))) {
+            client *c = listNodeValue(ln);
+            addReplySharedBlock(c,blocks[c->resp == 2 ? 0 : 1]);
+            updateClientMemUsage(c);
+        }
+        listEmpty(io_threads_fanout.skipped[j]);
+    }
+    io_threads_fanout.blocks = NULL;
+}
+
 /* Return 1 if we want to handle the client read later using threaded I/O.
  * This is called by the readable handler of the event loop.
  * As a side effect of calling this function the client is put in the
@@ -4312,6 +4980,8 @@ int handleClientsWithPendingReadsUsingThreads(void) {
     int item_id = 0;
     while((ln = listNext(&li))) {
         client *c = listNodeValue(ln);
+        /* The connection state is updated once the threads are done. */
+        connSetPostponeUpdateState(c->conn, 1);
         int target_id = item_id % server.io_threads_num;
         listAddNodeTail(io_threads_list[target_id],c);
         item_id++;
@@ -4350,6 +5020,10 @@ int handleClientsWithPendingReadsUsingThreads(void) {
         listDelNode(server.clients_pending_read,ln);
         c->pending_read_list_node = NULL;
 
+        /* Update the connection state that the threads could not. */
+        connSetPostponeUpdateState(c->conn, 0);
+        connUpdateState(c->conn);
+
         serverAssert(!(c->flags & CLIENT_BLOCKED));
 
         if (beforeNextClient(c) == C_ERR) {
@@ -29,6 +29,7 @@
  */
 
 #include "server.h"
+#include "cluster.h"
 #include "functions.h"
 #include <math.h>
 #include <ctype.h>
@@ -516,6 +517,7 @@ void dismissStreamObject(robj *o, size_t size_hint) {
         raxStart(&ri,rax);
         raxSeek(&ri,"^",NULL,0);
         while (raxNext(&ri)) {
+            if (STREAM_NODE_IS_SPILLED(ri.data)) continue;
             dismissMemory(ri.data, lpBytes(ri.data));
         }
         raxStop(&ri);
@@ -970,7 +972,6 @@ size_t streamRadixTreeMemoryUsage(rax *rax) {
  * Note that the returned value is just an approximation, especially in the
  * case of aggregated data types where only "sample_size" elements
  * are checked and averaged to estimate the total size. */
-#define OBJ_COMPUTE_SIZE_DEF_SAMPLES 5 /* Default sample size. */
 size_t objectComputeSize(robj *key, robj *o, size_t sample_size, int dbid) {
     sds ele, ele2;
     dict *d;
@@ -1067,58 +1068,87 @@ size_t objectComputeSize(robj *key, robj *o, size_t sample_size, int dbid) {
         /* Now we have to add the listpacks. The last listpack is often non
          * complete, so we estimate the size of the first N listpacks, and
          * use the average to compute the size of the first N-1 listpacks, and
-         * finally add the real size of the last node. */
+         * finally add the real size of the last node. The nodes spilled to
+         * disk only cost their streamSpilledNode, and the sampling starts
+         * after them. */
         raxIterator ri;
         raxStart(&ri,s->rax);
-        raxSeek(&ri,"^",NULL,0);
+        uint64_t nodes = s->rax->numele;
+        if (s->spill && s->spill->nodes) {
+            asize += s->spill->nodes*sizeof(streamSpilledNode);
+            nodes -= s->spill->nodes;
+            raxSeek(&ri,">",(unsigned char*)s->spill->last_key,
+                    sizeof(s->spill->last_key));
+        } else {
+            raxSeek(&ri,"^",NULL,0);
+        }
         size_t lpsize = 0, samples = 0;
         while(samples < sample_size && raxNext(&ri)) {
+            if (STREAM_NODE_IS_SPILLED(ri.data)) continue;
             unsigned char *lp = ri.data;
             lpsize += lpBytes(lp);
             samples++;
         }
-        if (s->rax->numele <= samples) {
+        if (nodes <= samples) {
             asize += lpsize;
         } else {
             if (samples) lpsize /= samples; /* Compute the average. */
-            asize += lpsize * (s->rax->numele-1);
+            asize += lpsize * (nodes-1);
             /* No need to check if seek succeeded, we enter this branch only
              * if there are a few elements in the radix tree. */
             raxSeek(&ri,"$",NULL,0);
             raxNext(&ri);
-            asize += lpBytes(ri.data);
+            if (!STREAM_NODE_IS_SPILLED(ri.data)) asize += lpBytes(ri.data);
         }
         raxStop(&ri);
 
         /* Consumer groups also have a non trivial memory overhead if there
          * are many consumers and many groups, let's count at least the
          * overhead of the pending entries in the groups and consumers
-         * PELs. */
+         * PELs. Like the elements of the other types, the groups and their
+         * consumers are sampled. */
         if (s->cgroups) {
+            size_t cgsize = 0, cgsamples = 0;
             raxStart(&ri,s->cgroups);
             raxSeek(&ri,"^",NULL,0);
-            while(raxNext(&ri)) {
+            while(cgsamples < sample_size && raxNext(&ri)) {
                 streamCG *cg = ri.data;
-                asize += sizeof(*cg);
-                asize += streamRadixTreeMemoryUsage(cg->pel);
-                asize += sizeof(streamNACK)*raxSize(cg->pel);
+                cgsamples++;
+                cgsize += sizeof(*cg);
+                cgsize += streamRadixTreeMemoryUsage(cg->pel.blocks);
+                cgsize += streamRadixTreeMemoryUsage(cg->pel.idle);
+
+                /* The PEL blocks are estimated like the listpacks above. */
+                raxIterator bri;
+                raxStart(&bri,cg->pel.blocks);
+                raxSeek(&bri,"^",NULL,0);
+                lpsize = samples = 0;
+                while(samples < sample_size && raxNext(&bri)) {
+                    lpsize += lpBytes(bri.data);
+                    samples++;
+                }
+                if (samples) cgsize += lpsize*raxSize(cg->pel.blocks)/samples;
+                raxStop(&bri);
 
                 /* For each consumer we also need to add the basic data
                  * structures and the PEL memory usage. */
                 raxIterator cri;
                 raxStart(&cri,cg->consumers);
                 raxSeek(&cri,"^",NULL,0);
-                while(raxNext(&cri)) {
+                size_t csize = 0;
+                samples = 0;
+                while(samples < sample_size && raxNext(&cri)) {
                     streamConsumer *consumer = cri.data;
-                    asize += sizeof(*consumer);
-                    asize += sdslen(consumer->name);
-                    asize += streamRadixTreeMemoryUsage(consumer->pel);
-                    /* Don't count NACKs again, they are shared with the
-                     * consumer group PEL. */
+                    csize += sizeof(*consumer);
+                    csize += sdslen(consumer->name);
+                    csize += streamRadixTreeMemoryUsage(consumer->pel);
+                    samples++;
                 }
+                if (samples) cgsize += csize*raxSize(cg->consumers)/samples;
                 raxStop(&cri);
             }
             raxStop(&ri);
+            if (cgsamples) asize += cgsize*raxSize(s->cgroups)/cgsamples;
         }
     } else if (o->type == OBJ_MODULE) {
         asize = moduleGetMemUsage(key, o, sample_size, dbid);
@@ -1221,9 +1251,12 @@ struct redisMemOverhead *getMemoryOverheadData(void) {
         mh->db = zrealloc(mh->db,sizeof(mh->db[0])*(mh->num_dbs+1));
         mh->db[mh->num_dbs].dbid = j;
 
+        /* Compact values have no object. */
         mem = dictSize(db->dict) * sizeof(dictEntry) +
               dictSlots(db->dict) * sizeof(dictEntry*) +
-              dictSize(db->dict) * sizeof(robj);
+              (dictSize(db->dict) - db->compact_values) * sizeof(robj);
+        if (db->eviction_queues)
+            mem += dictSize(db->dict) * sizeof(evictionDictEntryMetadata);
         mh->db[mh->num_dbs].overhead_ht_main = mem;
         mem_total+=mem;
 
@@ -1233,7 +1266,8 @@ struct redisMemOverhead *getMemoryOverheadData(void) {
         mem_total+=mem;
 
         /* Account for the slot to keys map in cluster mode */
-        mem = dictSize(db->dict) * dictMetadataSize(db->dict);
+        mem = server.cluster_enabled ?
+              dictSize(db->dict) * sizeof(clusterDictEntryMetadata) : 0;
         mh->db[mh->num_dbs].overhead_ht_slot_to_keys = mem;
         mem_total+=mem;
 
@@ -1479,6 +1513,313 @@ NULL
     }
 }
 
+/* ============================ Compact values ===============================
+ *
+ * When compact-values is enabled, string values that are small integers or
+ * strings of up to 4 bytes are not stored as objects, but directly in the
+ * value slot of the dict entry of the key, saving the allocation of the robj
+ * (and of the string). Object pointers are always aligned, so the low bit of
+ * the slot is used to tell compact values apart:
+ *
+ *   bit 0       always 1 (COMPACT_VALUE_TAG).
+ *   bit 1       0 for integers, 1 for strings.
+ *   bits 2-4    the length of strings.
+ *   bits 8-31   the LRU/LFU field of the value.
+ *   bits 32-63  the value: a 32 bit signed integer or the string bytes.
+ *
+ * The LRU/LFU field has to be kept, since eviction reads it from the values,
+ * so after the tag and the length only 32 bits are left for the payload:
+ * strings of 5 to 7 bytes would need 56 bits, and stay regular objects.
+ *
+ * The rest of the server only deals with objects: lookupKey() expands the
+ * value into a regular object stored back in the dict entry, and queues the
+ * key so that the value is compacted again after the command was executed
+ * (see compactPendingValues()). Code that reads values without lookupKey()
+ * uses dbValueView() to avoid expanding them.
+ * ========================================================================== */
+
+#define COMPACT_VALUE_STR 2
+#define COMPACT_VALUE_STR_MAXLEN 4
+
+typedef struct compactPendingKey {
+    redisDb *db;
+    sds key;
+} compactPendingKey;
+
+static compactPendingKey *compact_pending = NULL;
+static size_t compact_pending_count = 0, compact_pending_size = 0;
+
+/* Return the compact representation of the object, or NULL if it can't be
+ * represented as a compact value. */
+static void *compactValueEncode(robj *o) {
+    uint64_t v = ((uint64_t)(o->lru & 0xffffff) << 8) | COMPACT_VALUE_TAG;
+
+    if (o->type != OBJ_STRING) return NULL;
+    if (o->encoding == OBJ_ENCODING_INT) {
+        long long ll = (long)o->ptr;
+        if (ll < INT32_MIN || ll > INT32_MAX) return NULL;
+        v |= (uint64_t)(uint32_t)(int32_t)ll << 32;
+    } else {
+        size_t len = sdslen(o->ptr);
+        uint32_t bytes = 0;
+        if (len > COMPACT_VALUE_STR_MAXLEN) return NULL;
+        memcpy(&bytes,o->ptr,len);
+        v |= ((uint64_t)bytes << 32) | (len << 2) | COMPACT_VALUE_STR;
+    }
+    return (void*)v;
+}
+
+/* Return the value of the entry of a DB dict as an object. Compact values
+ * are expanded into 'view': the returned object can be read, but not modified
+ * nor retained, and is valid as long as 'view' is. Like shared objects, the
+ * view ignores incrRefCount() and decrRefCount(), so it can be passed to the
+ * functions that temporarily retain their argument, like getDecodedObject(). */
+robj *dbValueView(dictEntry *de, compactValueView *view) {
+    uint64_t v = (uint64_t)dictGetVal(de);
+    if (!isCompactValue(v)) return (robj*)v;
+
+    robj *o = &view->o;
+    o->type = OBJ_STRING;
+    o->lru = (v >> 8) & 0xffffff;
+    o->refcount = OBJ_SHARED_REFCOUNT;
+    if (v & COMPACT_VALUE_STR) {
+        struct sdshdr8 *sh = (void*)view->sds;
+        uint32_t bytes = v >> 32;
+        sh->flags = SDS_TYPE_8;
+        sh->len = sh->alloc = (v >> 2) & 7;
+        memcpy(sh->buf,&bytes,sh->len);
+        sh->buf[sh->len] = '\0';
+        o->encoding = OBJ_ENCODING_EMBSTR;
+        o->ptr = sh->buf;
+    } else {
+        o->encoding = OBJ_ENCODING_INT;
+        o->ptr = (void*)(long)(int32_t)(uint32_t)(v >> 32);
+    }
+    return o;
+}
+
+/* Like dictGetVal() but the compact value of the entry, if any, is replaced
+ * by a regular object, that will be compacted again by
+ * compactPendingValues(). */
+robj *dbExpandValue(redisDb *db, dictEntry *de) {
+    void *val = dictGetVal(de);
+    if (!isCompactValue(val)) return val;
+
+    compactValueView view;
+    robj *v = dbValueView(de,&view), *o;
+    if (v->encoding == OBJ_ENCODING_INT) {
+        o = createObject(OBJ_STRING,v->ptr);
+        o->encoding = OBJ_ENCODING_INT;
+    } else {
+        o = createEmbeddedStringObject(v->ptr,sdslen(v->ptr));
+    }
+    o->lru = v->lru;
+    de->v.val = o;
+    db->compact_values--;
+    if (db->memory_prefixes) memoryPrefixUpdateEntry(de,db);
+    dbCompactValueLater(db,de);
+    return o;
+}
+
+/* Replace the object of the entry with its compact representation, if
+ * possible. Strings are values, so if the object is also referenced
+ * elsewhere (for instance it is an argument of the client that set it) the
+ * DB just drops its reference. Returns 1 if the value was compacted. */
+int dbCompactValue(redisDb *db, dictEntry *de) {
+    robj *o = dictGetVal(de);
+    void *val;
+
+    if (!server.compact_values || isCompactValue(o)) return 0;
+    if ((val = compactValueEncode(o)) == NULL) return 0;
+    de->v.val = val;
+    decrRefCount(o);
+    db->compact_values++;
+    if (db->memory_prefixes) memoryPrefixUpdateEntry(de,db);
+    return 1;
+}
+
+/* Queue the key so that its value is compacted by compactPendingValues().
+ * Values can't be compacted right away when they are set or looked up since
+ * the caller is still using the object. The key name is copied, so that the
+ * queue stays valid whatever happens to the key meanwhile. */
+void dbCompactValueLater(redisDb *db, dictEntry *de) {
+    sds key = dictGetKey(de);
+
+    if (!server.compact_values) return;
+    /* Commands setting the same key many times, like a script in a loop. */
+    if (compact_pending_count &&
+        compact_pending[compact_pending_count-1].db == db &&
+        !sdscmp(compact_pending[compact_pending_count-1].key,key)) return;
+    if (compact_pending_count == compact_pending_size) {
+        compact_pending_size = compact_pending_size ? compact_pending_size*2 : 16;
+        compact_pending = zrealloc(compact_pending,
+            sizeof(compactPendingKey)*compact_pending_size);
+    }
+    compact_pending[compact_pending_count].db = db;
+    compact_pending[compact_pending_count].key = sdsdup(key);
+    compact_pending_count++;
+}
+
+/* Compact the values queued by dbCompactValueLater(). Called after every
+ * command executed at the top level, after every command loaded from the AOF,
+ * and before sleeping for the values accessed outside of commands. */
+void compactPendingValues(void) {
+    for (size_t j = 0; j < compact_pending_count; j++) {
+        compactPendingKey *pk = compact_pending+j;
+        dictEntry *de = dictFind(pk->db->dict,pk->key);
+        if (de) dbCompactValue(pk->db,de);
+        sdsfree(pk->key);
+    }
+    compact_pending_count = 0;
+    /* Don't keep a big queue around after a command that touched many
+     * keys. */
+    if (compact_pending_size > 1024) {
+        zfree(compact_pending);
+        compact_pending = NULL;
+        compact_pending_size = 0;
+    }
+}
+
+/* ======================= Memory accounting per prefix ======================
+ *
+ * When memory-prefix-delimiter is set, every DB keeps the number of keys and
+ * the memory used by the keys sharing the same prefix, that is the part of
+ * the key name up to (and including) the first occurrence of the delimiter.
+ * Keys without the delimiter are accounted to the empty prefix.
+ *
+ * The counters are kept in a radix tree per DB keyed by prefix, and are
+ * updated incrementally: the dict entry metadata of every key remembers the
+ * prefix it was accounted to and the size it contributed, so that when the
+ * value is modified (see signalModifiedKey()) only the difference between the
+ * new size estimate and the old one is applied. Sizes are estimated with
+ * objectComputeSize(), with the default number of samples: the estimate
+ * samples at most OBJ_COMPUTE_SIZE_DEF_SAMPLES elements (and consumer groups
+ * and consumers for streams), so the cost of an update doesn't depend on the
+ * size of the value, at the price of an approximate size for big aggregate
+ * values, like MEMORY USAGE.
+ * ========================================================================== */
+
+static prefixDictEntryMetadata *memoryPrefixMetadata(dictEntry *de) {
+    char *meta = (char*)dictMetadata(de);
+    if (server.cluster_enabled) meta += sizeof(clusterDictEntryMetadata);
+    if (server.maxmemory_eviction_engine == EVICTION_ENGINE_ORDERED)
+        meta += sizeof(evictionDictEntryMetadata);
+    return (prefixDictEntryMetadata*)meta;
+}
+
+/* Return the length of the prefix the key is accounted to. */
+static size_t memoryPrefixLen(sds key) {
+    char *p = memchr(key,server.memory_prefix_delimiter[0],sdslen(key));
+    return p ? (size_t)(p-key)+1 : 0;
+}
+
+/* Return the memory used by the key, including the key name and its dict
+ * entry. */
+static size_t memoryPrefixEntrySize(dictEntry *de, redisDb *db) {
+    robj keyobj, *val = dictGetVal(de);
+    initStaticStringObject(keyobj,dictGetKey(de));
+    return (isCompactValue(val) ? 0 :
+            objectComputeSize(&keyobj,val,OBJ_COMPUTE_SIZE_DEF_SAMPLES,db->id)) +
+           sdsZmallocSize(dictGetKey(de)) +
+           sizeof(dictEntry) + dictMetadataSize(db->dict);
+}
+
+void memoryPrefixesInit(redisDb *db) {
+    if (server.memory_prefix_delimiter == NULL) return;
+    db->memory_prefixes = raxNew();
+}
+
+/* Empty the prefixes of given db: called when all the keys were removed
+ * from the DB dict. */
+void memoryPrefixesFlush(redisDb *db) {
+    if (db->memory_prefixes == NULL) return;
+    raxFreeWithCallback(db->memory_prefixes,zfree);
+    db->memory_prefixes = raxNew();
+}
+
+void memoryPrefixesDestroy(redisDb *db) {
+    if (db->memory_prefixes == NULL) return;
+    raxFreeWithCallback(db->memory_prefixes,zfree);
+    db->memory_prefixes = NULL;
+}
+
+/* Called when a new key is added to the DB dict. */
+void memoryPrefixAddEntry(dictEntry *de, redisDb *db) {
+    if (db->memory_prefixes == NULL) return;
+    prefixDictEntryMetadata *meta = memoryPrefixMetadata(de);
+    sds key = dictGetKey(de);
+    size_t len = memoryPrefixLen(key);
+    memoryPrefix *mp = raxFind(db->memory_prefixes,(unsigned char*)key,len);
+
+    if (mp == raxNotFound) {
+        mp = zcalloc(sizeof(*mp));
+        raxInsert(db->memory_prefixes,(unsigned char*)key,len,mp,NULL);
+    }
+    meta->prefix = mp;
+    meta->size = memoryPrefixEntrySize(de,db);
+    mp->keys++;
+    mp->bytes += meta->size;
+}
+
+/* Called before an entry is removed from the DB dict. */
+void memoryPrefixDelEntry(dictEntry *de, redisDb *db) {
+    if (db->memory_prefixes == NULL) return;
+    prefixDictEntryMetadata *meta = memoryPrefixMetadata(de);
+    memoryPrefix *mp = meta->prefix;
+
+    mp->keys--;
+    mp->bytes -= meta->size;
+    if (mp->keys == 0) {
+        sds key = dictGetKey(de);
+        raxRemove(db->memory_prefixes,(unsigned char*)key,
+                  memoryPrefixLen(key),NULL);
+        zfree(mp);
+    }
+}
+
+/* Called when the value of the entry was replaced or modified. */
+void memoryPrefixUpdateEntry(dictEntry *de, redisDb *db) {
+    if (db->memory_prefixes == NULL) return;
+    prefixDictEntryMetadata *meta = memoryPrefixMetadata(de);
+    size_t size = memoryPrefixEntrySize(de,db);
+
+    meta->prefix->bytes += size;
+    meta->prefix->bytes -= meta->size;
+    meta->size = size;
+}
+
+/* Like memoryPrefixUpdateEntry() when only the key name is known. */
+void memoryPrefixUpdateKey(redisDb *db, robj *key) {
+    if (db->memory_prefixes == NULL) return;
+    dictEntry *de = dictFind(db->dict,key->ptr);
+    if (de) memoryPrefixUpdateEntry(de,db);
+}
+
+/* MEMORY PREFIXES: reply with the number of keys and memory used by every
+ * prefix of the selected DB. */
+static void memoryPrefixesReply(client *c) {
+    if (c->db->memory_prefixes == NULL) {
+        addReplyError(c,"Memory accounting per prefix is disabled, "
+                        "see memory-prefix-delimiter");
+        return;
+    }
+
+    raxIterator ri;
+    raxStart(&ri,c->db->memory_prefixes);
+    raxSeek(&ri,"^",NULL,0);
+    addReplyMapLen(c,raxSize(c->db->memory_prefixes));
+    while (raxNext(&ri)) {
+        memoryPrefix *mp = ri.data;
+        addReplyBulkCBuffer(c,ri.key,ri.key_len);
+        addReplyMapLen(c,2);
+        addReplyBulkCString(c,"keys");
+        addReplyLongLong(c,mp->keys);
+        addReplyBulkCString(c,"bytes");
+        addReplyLongLong(c,mp->bytes);
+    }
+    raxStop(&ri);
+}
+
 /* The memory command will eventually be a complete interface for the
  * memory introspection capabilities of Redis.
  *
@@ -1490,6 +1831,9 @@ void memoryCommand(client *c) {
 "    Return memory problems reports.",
 "MALLOC-STATS",
 "    Return internal statistics report from the memory allocator.",
+"PREFIXES",
+"    Return the number of keys and memory used by every key prefix of the",
+"    selected database, see memory-prefix-delimiter.",
 "PURGE",
 "    Attempt to purge dirty pages for reclamation by the allocator.",
 "STATS",
@@ -1524,11 +1868,16 @@ NULL
             addReplyNull(c);
             return;
         }
-        size_t usage = objectComputeSize(c->argv[2],dictGetVal(de),samples,c->db->id);
+        /* Compact values take no memory beyond the dict entry. */
+        robj *val = dictGetVal(de);
+        size_t usage = isCompactValue(val) ? 0 :
+                       objectComputeSize(c->argv[2],val,samples,c->db->id);
         usage += sdsZmallocSize(dictGetKey(de));
         usage += sizeof(dictEntry);
         usage += dictMetadataSize(c->db->dict);
         addReplyLongLong(c,usage);
+    } else if (!strcasecmp(c->argv[1]->ptr,"prefixes") && c->argc == 2) {
+        memoryPrefixesReply(c);
     } else if (!strcasecmp(c->argv[1]->ptr,"stats") && c->argc == 2) {
         struct redisMemOverhead *mh = getMemoryOverheadData();
 
@@ -125,6 +125,93 @@ void addReplyPubsubPatMessage(client *c, robj *pat, robj *channel, robj *msg) {
     addReplyBulk(c,msg);
 }
 
+/* Messages at least this big are serialized once per publish, and the same
+ * reply block is shared by all the subscribers, see addReplySharedBlock(). */
+#define PUBSUB_SHARED_REPLY_MIN_BYTES 1024
+
+static sds pubsubCatBulk(sds s, robj *o) {
+    o = getDecodedObject(o);
+    s = sdscatfmt(s,"$%U\r\n",(unsigned long long)sdslen(o->ptr));
+    s = sdscatlen(s,o->ptr,sdslen(o->ptr));
+    s = sdscatlen(s,"\r\n",2);
+    decrRefCount(o);
+    return s;
+}
+
+/* Create the shared reply block with the same protocol emitted by
+ * addReplyPubsubMessage() or, if 'pat' is not NULL, by
+ * addReplyPubsubPatMessage(), for clients using the 'resp' protocol. */
+static clientReplyBlock *createPubsubMessageBlock(int resp, robj *pat, robj *channel, robj *msg) {
+    robj *type = pat ? shared.pmessagebulk : shared.messagebulk;
+    sds s = sdsnewlen(resp == 2 ? "*" : ">",1);
+
+    s = sdscatfmt(s,"%i\r\n",pat ? 4 : 3);
+    s = sdscatlen(s,type->ptr,sdslen(type->ptr));
+    if (pat) s = pubsubCatBulk(s,pat);
+    s = pubsubCatBulk(s,channel);
+    s = pubsubCatBulk(s,msg);
+
+    clientReplyBlock *block = createSharedReplyBlock(s,sdslen(s));
+    sdsfree(s);
+    return block;
+}
+
+/* Like addReplyPubsubMessage() / addReplyPubsubPatMessage() but using the
+ * shared reply blocks of the message for RESP2 and RESP3 clients, that are
+ * created on first use. */
+static void addReplyPubsubSharedMessage(client *c, clientReplyBlock **blocks,
+                                        robj *pat, robj *channel, robj *msg)
+{
+    int idx = c->resp == 2 ? 0 : 1;
+    if (blocks[idx] == NULL)
+        blocks[idx] = createPubsubMessageBlock(c->resp,pat,channel,msg);
+    addReplySharedBlock(c,blocks[idx]);
+}
+
+static void releasePubsubSharedMessage(clientReplyBlock **blocks) {
+    for (int j = 0; j < 2; j++) {
+        if (blocks[j]) releaseSharedReplyBlock(blocks[j]);
+        blocks[j] = NULL;
+    }
+}
+
+/* Deliver the message to all the 'clients' subscribed to the channel or,
+ * if 'pat' is not NULL, to the pattern. When I/O threads are enabled and
+ * there are many subscribers, the message is serialized once and the I/O
+ * threads append it to their own slice of the clients, see
+ * fanoutSharedBlocksUsingThreads(). The socket writes still happen in
+ * beforeSleep(), after the AOF is flushed. Returns the number of clients
+ * that received the message. */
+static int pubsubDeliverMessage(list *clients, robj *pat, robj *channel,
+                                robj *msg, int share)
+{
+    clientReplyBlock *blocks[2] = {NULL,NULL};
+    listNode *ln;
+    listIter li;
+
+    if (canFanoutUsingThreads(clients)) {
+        blocks[0] = createPubsubMessageBlock(2,pat,channel,msg);
+        blocks[1] = createPubsubMessageBlock(3,pat,channel,msg);
+        fanoutSharedBlocksUsingThreads(clients,blocks);
+        releasePubsubSharedMessage(blocks);
+        return listLength(clients);
+    }
+
+    listRewind(clients,&li);
+    while ((ln = listNext(&li)) != NULL) {
+        client *c = listNodeValue(ln);
+        if (share)
+            addReplyPubsubSharedMessage(c,blocks,pat,channel,msg);
+        else if (pat)
+            addReplyPubsubPatMessage(c,pat,channel,msg);
+        else
+            addReplyPubsubMessage(c,channel,msg);
+        updateClientMemUsage(c);
+    }
+    releasePubsubSharedMessage(blocks);
+    return listLength(clients);
+}
+
 /* Send the pubsub subscription notification to the client. */
 void addReplyPubsubSubscribed(client *c, robj *channel, pubsubtype type) {
     if (c->resp == 2)
@@ -318,6 +405,48 @@ void pubsubShardUnsubscribeAllClients(robj *channel) {
 }
 
 
+/* The patterns are indexed by their literal prefix, the part before the
+ * first special glob character, so that PUBLISH only needs to match the
+ * channel against the patterns whose prefix is a prefix of the channel,
+ * instead of all the patterns. The index maps every prefix to a dict of the
+ * patterns with that prefix, whose values are the lists of subscribed clients
+ * stored in server.pubsub_patterns. Patterns starting with a special
+ * character have an empty prefix and are always matched with
+ * stringmatchlen(). */
+static size_t pubsubPatternPrefixLen(robj *pattern) {
+    sds p = pattern->ptr;
+    size_t len = sdslen(p), j;
+
+    for (j = 0; j < len; j++) {
+        if (p[j] == '*' || p[j] == '?' || p[j] == '[' || p[j] == '\\') break;
+    }
+    return j;
+}
+
+static void pubsubPatternIndexAdd(robj *pattern, list *clients) {
+    size_t len = pubsubPatternPrefixLen(pattern);
+    dict *patterns = raxFind(server.pubsub_patterns_index,pattern->ptr,len);
+
+    if (patterns == raxNotFound) {
+        patterns = dictCreate(&objectKeyPointerValueDictType);
+        raxInsert(server.pubsub_patterns_index,pattern->ptr,len,patterns,NULL);
+    }
+    dictAdd(patterns,pattern,clients);
+    incrRefCount(pattern);
+}
+
+static void pubsubPatternIndexDel(robj *pattern) {
+    size_t len = pubsubPatternPrefixLen(pattern);
+    dict *patterns = raxFind(server.pubsub_patterns_index,pattern->ptr,len);
+
+    serverAssert(patterns != raxNotFound);
+    dictDelete(patterns,pattern);
+    if (dictSize(patterns) == 0) {
+        dictRelease(patterns);
+        raxRemove(server.pubsub_patterns_index,pattern->ptr,len,NULL);
+    }
+}
+
 /* Subscribe a client to a pattern. Returns 1 if the operation succeeded, or 0 if the client was already subscribed to that pattern. */
 int pubsubSubscribePattern(client *c, robj *pattern) {
     dictEntry *de;
@@ -334,6 +463,7 @@ int pubsubSubscribePattern(client *c, robj *pattern) {
             clients = listCreate();
             dictAdd(server.pubsub_patterns,pattern,clients);
             incrRefCount(pattern);
+            pubsubPatternIndexAdd(pattern,clients);
         } else {
             clients = dictGetVal(de);
         }
@@ -366,6 +496,7 @@ int pubsubUnsubscribePattern(client *c, robj *pattern, int notify) {
         if (listLength(clients) == 0) {
             /* Free the list and associated hash entry at all if this was
              * the latest client. */
+            pubsubPatternIndexDel(pattern);
             dictDelete(server.pubsub_patterns,pattern);
         }
     }
@@ -448,53 +579,44 @@ int pubsubPublishMessageInternal(robj *channel, robj *message, pubsubtype type)
     int receivers = 0;
     dictEntry *de;
     dictIterator *di;
-    listNode *ln;
-    listIter li;
+    /* Big messages are serialized once, for RESP2 and RESP3 clients. */
+    int share = sdsEncodedObject(message) &&
+                sdslen(message->ptr) >= PUBSUB_SHARED_REPLY_MIN_BYTES;
 
     /* Send to clients listening for that channel */
     de = dictFind(*type.serverPubSubChannels, channel);
-    if (de) {
-        list *list = dictGetVal(de);
-        listNode *ln;
-        listIter li;
-
-        listRewind(list,&li);
-        while ((ln = listNext(&li)) != NULL) {
-            client *c = ln->value;
-            addReplyPubsubMessage(c,channel,message);
-            updateClientMemUsage(c);
-            receivers++;
-        }
-    }
+    if (de)
+        receivers += pubsubDeliverMessage(dictGetVal(de),NULL,channel,message,share);
 
     if (type.shard) {
         /* Shard pubsub ignores patterns. */
         return receivers;
     }
 
-    /* Send to clients listening to matching channels */
-    di = dictGetIterator(server.pubsub_patterns);
-    if (di) {
-        channel = getDecodedObject(channel);
+    /* Send to clients listening to matching channels: only the patterns
+     * whose literal prefix is a prefix of the channel may match. */
+    if (raxSize(server.pubsub_patterns_index) == 0) return receivers;
+    channel = getDecodedObject(channel);
+    size_t chanlen = sdslen(channel->ptr);
+    dict *static_found[64], **found = static_found;
+    if (chanlen+1 > 64) found = zmalloc(sizeof(dict*)*(chanlen+1));
+    size_t numfound = raxFindPrefixes(server.pubsub_patterns_index,
+                                      channel->ptr,chanlen,(void**)found);
+    for (size_t j = 0; j < numfound; j++) {
+        di = dictGetIterator(found[j]);
         while((de = dictNext(di)) != NULL) {
             robj *pattern = dictGetKey(de);
             list *clients = dictGetVal(de);
             if (!stringmatchlen((char*)pattern->ptr,
                                 sdslen(pattern->ptr),
                                 (char*)channel->ptr,
-                                sdslen(channel->ptr),0)) continue;
-
-            listRewind(clients,&li);
-            while ((ln = listNext(&li)) != NULL) {
-                client *c = listNodeValue(ln);
-                addReplyPubsubPatMessage(c,pattern,channel,message);
-                updateClientMemUsage(c);
-                receivers++;
-            }
+                                chanlen,0)) continue;
+            receivers += pubsubDeliverMessage(clients,pattern,channel,message,share);
         }
-        decrRefCount(channel);
         dictReleaseIterator(di);
     }
+    if (found != static_found) zfree(found);
+    decrRefCount(channel);
     return receivers;
 }
 
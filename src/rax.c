@@ -926,6 +926,38 @@ void *raxFind(rax *rax, unsigned char *s, size_t len) {
     return raxGetData(h);
 }
 
+/* Find all the keys that are a prefix of 's', including the empty key and
+ * 's' itself, descending the tree a single time. The values of the keys
+ * found are stored in 'data', shortest key first, and their number is
+ * returned. 'data' must have room for len+1 elements. */
+size_t raxFindPrefixes(rax *rax, unsigned char *s, size_t len, void **data) {
+    raxNode *h = rax->head;
+    size_t i = 0, found = 0;
+
+    debugf("### Prefixes lookup: %.*s\n", (int)len, s);
+    while(1) {
+        /* Every node we enter represents the first 'i' bytes of 's'. */
+        if (h->iskey) data[found++] = raxGetData(h);
+        if (h->size == 0 || i == len) break;
+
+        unsigned char *v = h->data;
+        size_t j = 0;
+        if (h->iscompr) {
+            if (len-i < h->size || memcmp(v,s+i,h->size) != 0) break;
+            i += h->size;
+        } else {
+            for (j = 0; j < h->size; j++) {
+                if (v[j] == s[i]) break;
+            }
+            if (j == h->size) break;
+            i++;
+        }
+        raxNode **children = raxNodeFirstChildPtr(h);
+        memcpy(&h,children+j,sizeof(h));
+    }
+    return found;
+}
+
 /* Return the memory address where the 'parent' node stores the specified
  * 'child' pointer, so that the caller can update the pointer with another
  * one if needed. The function assumes it will find a match, otherwise the
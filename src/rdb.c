@@ -593,7 +593,7 @@ int rdbSaveDoubleValue(rio *rdb, double val) {
         if (double2ll(val, &lvalue))
             ll2string((char*)buf+1,sizeof(buf)-1,lvalue);
         else
-            snprintf((char*)buf+1,sizeof(buf)-1,"%.17g",val);
+            shortestd2string((char*)buf+1,sizeof(buf)-1,val);
         buf[0] = strlen((char*)buf+1);
         len = buf[0]+1;
     }
@@ -700,13 +700,48 @@ int rdbLoadObjectType(rio *rdb) {
 }
 
 /* This helper function serializes a consumer group Pending Entries List (PEL)
- * into the RDB file. The 'nacks' argument tells the function if also persist
- * the information about the not acknowledged message, or if to persist
- * just the IDs: this is useful because for the global consumer group PEL
- * we serialized the NACKs as well, but when serializing the local consumer
- * PELs we just add the ID, that will be resolved inside the global PEL to
- * put a reference to the same structure. */
-ssize_t rdbSaveStreamPEL(rio *rdb, rax *pel, int nacks) {
+ * into the RDB file, with the information about the not acknowledged
+ * messages, but without their consumer: we'll save the pending IDs for each
+ * consumer in the consumer PEL, and resolve the consumer at loading time. */
+ssize_t rdbSaveStreamPEL(rio *rdb, streamCG *cg) {
+    ssize_t n, nwritten = 0;
+
+    /* Number of entries in the PEL. */
+    if ((n = rdbSaveLen(rdb,cg->pel.size)) == -1) return -1;
+    nwritten += n;
+
+    /* Save each entry. */
+    streamPelIterator it;
+    streamNACK nack;
+    streamPelIteratorStart(&it,cg,NULL);
+    while(streamPelIteratorNext(&it,&nack)) {
+        /* We store IDs in raw form as 128 big big endian numbers, like
+         * they are inside the radix tree keys. */
+        unsigned char rawid[sizeof(streamID)];
+        streamEncodeID(rawid,&nack.id);
+        if ((n = rdbWriteRaw(rdb,rawid,sizeof(rawid))) == -1) {
+            streamPelIteratorStop(&it);
+            return -1;
+        }
+        nwritten += n;
+        if ((n = rdbSaveMillisecondTime(rdb,nack.delivery_time)) == -1) {
+            streamPelIteratorStop(&it);
+            return -1;
+        }
+        nwritten += n;
+        if ((n = rdbSaveLen(rdb,nack.delivery_count)) == -1) {
+            streamPelIteratorStop(&it);
+            return -1;
+        }
+        nwritten += n;
+    }
+    streamPelIteratorStop(&it);
+    return nwritten;
+}
+
+/* Serialize the PEL of a consumer: here we just add the IDs, that will be
+ * resolved inside the consumer group PEL at loading time. */
+ssize_t rdbSaveStreamConsumerPEL(rio *rdb, rax *pel) {
     ssize_t n, nwritten = 0;
 
     /* Number of entries in the PEL. */
@@ -718,30 +753,11 @@ ssize_t rdbSaveStreamPEL(rio *rdb, rax *pel, int nacks) {
     raxStart(&ri,pel);
     raxSeek(&ri,"^",NULL,0);
     while(raxNext(&ri)) {
-        /* We store IDs in raw form as 128 big big endian numbers, like
-         * they are inside the radix tree key. */
         if ((n = rdbWriteRaw(rdb,ri.key,sizeof(streamID))) == -1) {
             raxStop(&ri);
             return -1;
         }
         nwritten += n;
-
-        if (nacks) {
-            streamNACK *nack = ri.data;
-            if ((n = rdbSaveMillisecondTime(rdb,nack->delivery_time)) == -1) {
-                raxStop(&ri);
-                return -1;
-            }
-            nwritten += n;
-            if ((n = rdbSaveLen(rdb,nack->delivery_count)) == -1) {
-                raxStop(&ri);
-                return -1;
-            }
-            nwritten += n;
-            /* We don't save the consumer name: we'll save the pending IDs
-             * for each consumer in the consumer PEL, and resolve the consumer
-             * at loading time. */
-        }
     }
     raxStop(&ri);
     return nwritten;
@@ -778,11 +794,10 @@ size_t rdbSaveStreamConsumers(rio *rdb, streamCG *cg) {
         }
         nwritten += n;
 
-        /* Consumer PEL, without the ACKs (see last parameter of the function
-         * passed with value of 0), at loading time we'll lookup the ID
-         * in the consumer group global PEL and will put a reference in the
-         * consumer local PEL. */
-        if ((n = rdbSaveStreamPEL(rdb,consumer->pel,0)) == -1) {
+        /* Consumer PEL, without the ACKs: at loading time we'll lookup the
+         * ID in the consumer group global PEL and will assign the entry to
+         * the consumer. */
+        if ((n = rdbSaveStreamConsumerPEL(rdb,consumer->pel)) == -1) {
             raxStop(&ri);
             return -1;
         }
@@ -950,14 +965,20 @@ ssize_t rdbSaveObject(rio *rdb, robj *o, robj *key, int dbid) {
         raxStart(&ri,rax);
         raxSeek(&ri,"^",NULL,0);
         while (raxNext(&ri)) {
-            unsigned char *lp = ri.data;
-            size_t lp_bytes = lpBytes(lp);
             if ((n = rdbSaveRawString(rdb,ri.key,ri.key_len)) == -1) {
                 raxStop(&ri);
                 return -1;
             }
             nwritten += n;
-            if ((n = rdbSaveRawString(rdb,lp,lp_bytes)) == -1) {
+            /* Nodes spilled to disk are loaded back to be saved. */
+            unsigned char *lp = streamNodeAcquire(ri.data);
+            if (lp == NULL) {
+                raxStop(&ri);
+                return -1;
+            }
+            n = rdbSaveRawString(rdb,lp,lpBytes(lp));
+            streamNodeRelease(ri.data);
+            if (n == -1) {
                 raxStop(&ri);
                 return -1;
             }
@@ -1031,7 +1052,7 @@ ssize_t rdbSaveObject(rio *rdb, robj *o, robj *key, int dbid) {
                 nwritten += n;
 
                 /* Save the global PEL. */
-                if ((n = rdbSaveStreamPEL(rdb,cg->pel,1)) == -1) {
+                if ((n = rdbSaveStreamPEL(rdb,cg)) == -1) {
                     raxStop(&ri);
                     return -1;
                 }
@@ -1278,7 +1299,8 @@ ssize_t rdbSaveDb(rio *rdb, int dbid, int rdbflags, long *key_counter) {
     /* Iterate this DB writing every entry */
     while((de = dictNext(di)) != NULL) {
         sds keystr = dictGetKey(de);
-        robj key, *o = dictGetVal(de);
+        compactValueView view;
+        robj key, *o = dbValueView(de,&view);
         long long expire;
         size_t rdb_bytes_before_key = rdb->processed_bytes;
 
@@ -1291,7 +1313,7 @@ ssize_t rdbSaveDb(rio *rdb, int dbid, int rdbflags, long *key_counter) {
          * OS and possibly avoid or decrease COW. We give the dismiss
          * mechanism a hint about an estimated size of the object we stored. */
         size_t dump_size = rdb->processed_bytes - rdb_bytes_before_key;
-        if (server.in_fork_child) dismissObject(o, dump_size);
+        if (server.in_fork_child && o != &view.o) dismissObject(o, dump_size);
 
         /* Update child info every 1 second (approximately).
          * in order to avoid calling mstime() on each iteration, we will
@@ -2384,6 +2406,9 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key, int dbid, int *error) {
                 zfree(lp);
                 return NULL;
             }
+            /* Don't load in memory more than the last nodes of streams
+             * that are spilled to disk. */
+            streamSpillNodes(s);
         }
         /* Load total number of items inside the stream. */
         s->length = rdbLoadLen(rdb,NULL);
@@ -2499,20 +2524,20 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key, int dbid, int *error) {
                     decrRefCount(o);
                     return NULL;
                 }
-                streamNACK *nack = streamCreateNACK(NULL);
-                nack->delivery_time = rdbLoadMillisecondTime(rdb,RDB_VERSION);
-                nack->delivery_count = rdbLoadLen(rdb,NULL);
+                streamNACK nack;
+                streamDecodeID(rawid,&nack.id);
+                nack.delivery_time = rdbLoadMillisecondTime(rdb,RDB_VERSION);
+                nack.delivery_count = rdbLoadLen(rdb,NULL);
+                nack.consumer = NULL;
                 if (rioGetReadError(rdb)) {
                     rdbReportReadError("Stream PEL NACK loading failed.");
                     decrRefCount(o);
-                    streamFreeNACK(nack);
                     return NULL;
                 }
-                if (!raxTryInsert(cgroup->pel,rawid,sizeof(rawid),nack,NULL)) {
+                if (!streamPelInsert(cgroup,&nack)) {
                     rdbReportCorruptRDB("Duplicated global PEL entry "
                                             "loading stream consumer group");
                     decrRefCount(o);
-                    streamFreeNACK(nack);
                     return NULL;
                 }
             }
@@ -2565,8 +2590,10 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key, int dbid, int *error) {
                         decrRefCount(o);
                         return NULL;
                     }
-                    streamNACK *nack = raxFind(cgroup->pel,rawid,sizeof(rawid));
-                    if (nack == raxNotFound) {
+                    streamID id;
+                    streamNACK nack;
+                    streamDecodeID(rawid,&id);
+                    if (!streamPelLookup(cgroup,&id,&nack)) {
                         rdbReportCorruptRDB("Consumer entry not found in "
                                                 "group global PEL");
                         decrRefCount(o);
@@ -2574,35 +2601,34 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key, int dbid, int *error) {
                     }
 
                     /* Set the NACK consumer, that was left to NULL when
-                     * loading the global PEL. Then set the same shared
-                     * NACK structure also in the consumer-specific PEL. */
-                    nack->consumer = consumer;
-                    if (!raxTryInsert(consumer->pel,rawid,sizeof(rawid),nack,NULL)) {
+                     * loading the global PEL: this also adds the entry to
+                     * the consumer-specific PEL. */
+                    if (nack.consumer) {
                         rdbReportCorruptRDB("Duplicated consumer PEL entry "
                                                 " loading a stream consumer "
                                                 "group");
                         decrRefCount(o);
-                        streamFreeNACK(nack);
                         return NULL;
                     }
+                    nack.consumer = consumer;
+                    streamPelUpdate(cgroup,&nack);
                 }
             }
 
             /* Verify that each PEL eventually got a consumer assigned to it. */
             if (deep_integrity_validation) {
-                raxIterator ri_cg_pel;
-                raxStart(&ri_cg_pel,cgroup->pel);
-                raxSeek(&ri_cg_pel,"^",NULL,0);
-                while(raxNext(&ri_cg_pel)) {
-                    streamNACK *nack = ri_cg_pel.data;
-                    if (!nack->consumer) {
-                        raxStop(&ri_cg_pel);
+                streamPelIterator it_cg_pel;
+                streamNACK nack;
+                streamPelIteratorStart(&it_cg_pel,cgroup,NULL);
+                while(streamPelIteratorNext(&it_cg_pel,&nack)) {
+                    if (!nack.consumer) {
+                        streamPelIteratorStop(&it_cg_pel);
                         rdbReportCorruptRDB("Stream CG PEL entry without consumer");
                         decrRefCount(o);
                         return NULL;
                     }
                 }
-                raxStop(&ri_cg_pel);
+                streamPelIteratorStop(&it_cg_pel);
             }
         }
     } else if (rdbtype == RDB_TYPE_MODULE || rdbtype == RDB_TYPE_MODULE_2) {
@@ -3154,6 +3180,10 @@ int rdbLoadRioWithLoadingCtx(rio *rdb, int rdbflags, rdbSaveInfo *rsi, rdbLoadin
             robj keyobj;
             initStaticStringObject(keyobj,key);
 
+            /* Set usage information (for eviction). This is done before
+             * adding the key since the value may be compacted. */
+            objectSetLRUOrLFU(val,lfu_freq,lru_idle,lru_clock,1000);
+
             /* Add the new object in the hash table */
             int added = dbAddRDBLoad(db,key,val);
             server.rdb_last_load_keys_loaded++;
@@ -3176,9 +3206,6 @@ int rdbLoadRioWithLoadingCtx(rio *rdb, int rdbflags, rdbSaveInfo *rsi, rdbLoadin
                 setExpire(NULL,db,&keyobj,expiretime);
             }
 
-            /* Set usage information (for eviction). */
-            objectSetLRUOrLFU(val,lfu_freq,lru_idle,lru_clock,1000);
-
             /* call key space notification on key loaded for modules only */
             moduleNotifyKeyspaceEvent(NOTIFY_LOADED, "loaded", &keyobj, db->id);
         }
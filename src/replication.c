@@ -1343,8 +1343,7 @@ void removeRDBUsedToSyncReplicas(void) {
 
 void sendBulkToSlave(connection *conn) {
     client *slave = connGetPrivateData(conn);
-    char buf[PROTO_IOBUF_LEN];
-    ssize_t nwritten, buflen;
+    ssize_t nwritten;
 
     /* Before sending the RDB file, we send the preamble as configured by the
      * replication process. Currently the preamble is just the bulk count of
@@ -1369,16 +1368,16 @@ void sendBulkToSlave(connection *conn) {
         }
     }
 
-    /* If the preamble was already transferred, send the RDB bulk data. */
-    lseek(slave->repldbfd,slave->repldboff,SEEK_SET);
-    buflen = read(slave->repldbfd,buf,PROTO_IOBUF_LEN);
-    if (buflen <= 0) {
-        serverLog(LL_WARNING,"Read error sending DB to replica: %s",
-            (buflen == 0) ? "premature EOF" : strerror(errno));
+    /* If the preamble was already transferred, send the RDB bulk data.
+     * When possible the kernel copies the file to the socket directly. */
+    nwritten = connSendfile(conn,slave->repldbfd,slave->repldboff,
+                            slave->repldbsize - slave->repldboff);
+    if (nwritten == 0) {
+        serverLog(LL_WARNING,"Read error sending DB to replica: premature EOF");
         freeClient(slave);
         return;
     }
-    if ((nwritten = connWrite(conn,buf,buflen)) == -1) {
+    if (nwritten == -1) {
         if (connGetState(conn) != CONN_STATE_CONNECTED) {
             serverLog(LL_WARNING,"Write error sending DB to replica: %s",
                 connGetLastError(conn));
@@ -3206,7 +3205,7 @@ void replicationCacheMaster(client *c) {
      * we want to discard the non processed query buffers and non processed
      * offsets, including pending transactions, already populated arguments,
      * pending outputs to the master. */
-    sdsclear(server.master->querybuf);
+    if (server.master->querybuf) sdsclear(server.master->querybuf);
     server.master->qb_pos = 0;
     server.master->repl_applied = 0;
     server.master->read_reploff = server.master->reploff;
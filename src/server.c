@@ -257,6 +257,15 @@ void dictObjectDestructor(dict *d, void *val)
     decrRefCount(val);
 }
 
+/* Like dictObjectDestructor() but for the values of the DB dicts, that may
+ * be compact values, see object.c. */
+void dictDbValueDestructor(dict *d, void *val)
+{
+    UNUSED(d);
+    if (val == NULL || isCompactValue(val)) return;
+    decrRefCount(val);
+}
+
 void dictSdsDestructor(dict *d, void *val)
 {
     UNUSED(d);
@@ -368,12 +377,20 @@ int dictExpandAllowed(size_t moreMem, double usedRatio) {
 
 /* Returns the size of the DB dict entry metadata in bytes. In cluster mode, the
  * metadata is used for constructing a doubly linked list of the dict entries
- * belonging to the same cluster slot. See the Slot to Key API in cluster.c. */
+ * belonging to the same cluster slot. See the Slot to Key API in cluster.c.
+ * The ordered eviction engine links the entries in the eviction queues
+ * using the metadata that follows, see evict.c. Last is the metadata used
+ * for the memory accounting per key prefix, see object.c. */
 size_t dictEntryMetadataSize(dict *d) {
     UNUSED(d);
-    /* NOTICE: this also affect overhead_ht_slot_to_keys in getMemoryOverheadData.
-     * If we ever add non-cluster related data here, that code must be modified too. */
-    return server.cluster_enabled ? sizeof(clusterDictEntryMetadata) : 0;
+    /* NOTICE: this also affect overhead_ht_slot_to_keys and overhead_ht_main
+     * in getMemoryOverheadData. */
+    size_t size = server.cluster_enabled ? sizeof(clusterDictEntryMetadata) : 0;
+    if (server.maxmemory_eviction_engine == EVICTION_ENGINE_ORDERED)
+        size += sizeof(evictionDictEntryMetadata);
+    if (server.memory_prefix_delimiter)
+        size += sizeof(prefixDictEntryMetadata);
+    return size;
 }
 
 /* Generic hash table type where keys are Redis Objects, Values
@@ -428,7 +445,7 @@ dictType dbDictType = {
     NULL,                       /* val dup */
     dictSdsKeyCompare,          /* key compare */
     dictSdsDestructor,          /* key destructor */
-    dictObjectDestructor,       /* val destructor */
+    dictDbValueDestructor,      /* val destructor */
     dictExpandAllowed,          /* allow to expand */
     dictEntryMetadataSize       /* size of entry metadata in bytes */
 };
@@ -679,9 +696,24 @@ long long getInstantaneousMetric(int metric) {
  *
  * The function always returns 0 as it never terminates the client. */
 int clientsCronResizeQueryBuffer(client *c) {
+    /* Clients with no pending input use the shared query buffer, that may
+     * be lent to a client whose command is running (from whileBlockedCron()). */
+    if (c->querybuf == NULL || c->flags & CLIENT_SHARED_QUERYBUF) return 0;
+
     size_t querybuf_size = sdsalloc(c->querybuf);
     time_t idletime = server.unixtime - c->lastinteraction;
 
+    /* An idle client that kept its own query buffer for a command received
+     * in many reads, can go back to use the shared one. */
+    if (idletime > 2 && !(c->flags & CLIENT_MASTER) &&
+        sdslen(c->querybuf) == 0 && c->multibulklen == 0)
+    {
+        sdsfree(c->querybuf);
+        c->querybuf = NULL;
+        c->querybuf_peak = 0;
+        return 0;
+    }
+
     /* Only resize the query buffer if the buffer is actually wasting at least a
      * few kbytes */
     if (sdsavail(c->querybuf) > 1024*4) {
@@ -713,6 +745,8 @@ int clientsCronResizeQueryBuffer(client *c) {
 }
 
 /* The client output buffer can be adjusted to better fit the memory requirements.
+ * The buffer is borrowed from the reply buffer pool only while there is
+ * something to send, so what we adjust is the size to borrow next time.
  *
  * the logic is:
  * in case the last observed peak size of the buffer equals the buffer size - we double the size
@@ -720,11 +754,8 @@ int clientsCronResizeQueryBuffer(client *c) {
  * The buffer peak will be reset back to the buffer position every server.reply_buffer_peak_reset_time milliseconds
  * The function always returns 0 as it never terminates the client. */
 int clientsCronResizeOutputBuffer(client *c, mstime_t now_ms) {
-
-    size_t new_buffer_size = 0;
-    char *oldbuf = NULL;
-    const size_t buffer_target_shrink_size = c->buf_usable_size/2;
-    const size_t buffer_target_expand_size = c->buf_usable_size*2;
+    const size_t buffer_target_shrink_size = c->buf_target_size/2;
+    const size_t buffer_target_expand_size = c->buf_target_size*2;
 
     /* in case the resizing is disabled return immediately */
     if(!server.reply_buffer_resizing_enabled)
@@ -733,12 +764,12 @@ int clientsCronResizeOutputBuffer(client *c, mstime_t now_ms) {
     if (buffer_target_shrink_size >= PROTO_REPLY_MIN_BYTES &&
         c->buf_peak < buffer_target_shrink_size )
     {
-        new_buffer_size = max(PROTO_REPLY_MIN_BYTES,c->buf_peak+1);
+        c->buf_target_size = replyBufferSizeClass(c->buf_peak+1);
         server.stat_reply_buffer_shrinks++;
     } else if (buffer_target_expand_size < PROTO_REPLY_CHUNK_BYTES*2 &&
-        c->buf_peak == c->buf_usable_size)
+        c->buf_peak >= c->buf_target_size)
     {
-        new_buffer_size = min(PROTO_REPLY_CHUNK_BYTES,buffer_target_expand_size);
+        c->buf_target_size = min(PROTO_REPLY_CHUNK_BYTES,buffer_target_expand_size);
         server.stat_reply_buffer_expands++;
     }
 
@@ -751,13 +782,6 @@ int clientsCronResizeOutputBuffer(client *c, mstime_t now_ms) {
         c->buf_peak = c->bufpos;
         c->buf_peak_last_reset_time = now_ms;
     }
-
-    if (new_buffer_size) {
-        oldbuf = c->buf;
-        c->buf = zmalloc_usable(new_buffer_size, &c->buf_usable_size);
-        memcpy(c->buf,oldbuf,c->bufpos);
-        zfree(oldbuf);
-    }
     return 0;
 }
 
@@ -778,7 +802,7 @@ size_t ClientsPeakMemInput[CLIENTS_PEAK_MEM_USAGE_SLOTS] = {0};
 size_t ClientsPeakMemOutput[CLIENTS_PEAK_MEM_USAGE_SLOTS] = {0};
 
 int clientsCronTrackExpansiveClients(client *c, int time_idx) {
-    size_t in_usage = sdsZmallocSize(c->querybuf) + c->argv_len_sum +
+    size_t in_usage = (c->querybuf ? sdsZmallocSize(c->querybuf) : 0) + c->argv_len_sum +
 	              (c->argv ? zmalloc_size(c->argv) : 0);
     size_t out_usage = getClientOutputBufferMemoryUsage(c);
 
@@ -976,6 +1000,9 @@ void databasesCron(void) {
     /* Defrag keys gradually. */
     activeDefragCycle();
 
+    /* Age the LFU eviction queues of the ordered eviction engine. */
+    evictionQueuesCron();
+
     /* Perform hash tables rehashing if needed, but only if there are no
      * other processes saving the DB on disk. Otherwise rehashing is bad
      * as will cause a lot of copy-on-write of memory pages. */
@@ -1195,6 +1222,8 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
                 stat_net_input_bytes);
         trackInstantaneousMetric(STATS_METRIC_NET_OUTPUT,
                 stat_net_output_bytes);
+        trackInstantaneousMetric(STATS_METRIC_LAZYFREED,
+                lazyfreeGetFreedObjectsCount());
     }
 
     /* We have just LRU_BITS bits per object for LRU information.
@@ -1263,6 +1292,15 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
     /* Handle background operations on Redis databases. */
     databasesCron();
 
+    /* Evict keys ahead of time to keep the memory under the low watermark. */
+    proactiveEvictionCycle();
+
+    /* Release the objects the lazyfree threads couldn't take. */
+    lazyfreeIncrementalCycle(LAZYFREE_CYCLE_SLOW);
+
+    /* Size the admission filter according to the number of keys. */
+    admissionFilterCron();
+
     /* Start a scheduled AOF rewrite if this was requested by the user while
      * a BGSAVE was in progress. */
     if (!hasActiveChildProcess() &&
@@ -1530,6 +1568,9 @@ void beforeSleep(struct aeEventLoop *eventLoop) {
         return;
     }
 
+    /* Compact the values expanded outside of commands. */
+    compactPendingValues();
+
     /* Handle precise timeouts of blocked clients. */
     handleBlockedClientsTimeout();
 
@@ -1553,6 +1594,9 @@ void beforeSleep(struct aeEventLoop *eventLoop) {
     if (server.active_expire_enabled && server.masterhost == NULL)
         activeExpireCycle(ACTIVE_EXPIRE_CYCLE_FAST);
 
+    /* Run a fast incremental lazyfree cycle, if objects are waiting. */
+    lazyfreeIncrementalCycle(LAZYFREE_CYCLE_FAST);
+
     /* Unblock all the clients blocked for synchronous replication
      * in WAIT. */
     if (listLength(server.clients_waiting_acks))
@@ -1590,11 +1634,6 @@ void beforeSleep(struct aeEventLoop *eventLoop) {
      * our clients. */
     updateFailoverStatus();
 
-    /* Since we rely on current_client to send scheduled invalidation messages
-     * we have to flush them after each command, so when we get here, the list
-     * must be empty. */
-    serverAssert(listLength(server.tracking_pending_keys) == 0);
-
     /* Send the invalidation messages to clients participating to the
      * client side caching protocol in broadcasting (BCAST) mode. */
     trackingBroadcastInvalidationMessages();
@@ -1614,6 +1653,12 @@ void beforeSleep(struct aeEventLoop *eventLoop) {
     if (server.aof_state == AOF_ON || server.aof_state == AOF_WAIT_REWRITE)
         flushAppendOnlyFile(0);
 
+    /* Send the invalidation messages coalesced during this event loop
+     * cycle, a single message per client. This must be done after the
+     * last step that can execute commands, like handleClientsBlockedOnKeys(),
+     * so that their invalidations are not left for the next cycle. */
+    trackingFlushAllPendingInvalidations();
+
     /* Handle writes with pending output buffers. */
     handleClientsWithPendingWritesUsingThreads();
 
@@ -2089,19 +2134,21 @@ int setOOMScoreAdj(int process_class) {
 /* This function will try to raise the max number of open files accordingly to
  * the configured max number of clients. It also reserves a number of file
  * descriptors (CONFIG_MIN_RESERVED_FDS) for extra operations of
- * persistence, listening sockets, log files and so forth.
+ * persistence, listening sockets, log files and so forth, and the ones of
+ * the stream segment files (stream-spill-max-segments).
  *
  * If it will not be possible to set the limit accordingly to the configured
  * max number of clients, the function will do the reverse setting
  * server.maxclients to the value that we can actually handle. */
 void adjustOpenFilesLimit(void) {
-    rlim_t maxfiles = server.maxclients+CONFIG_MIN_RESERVED_FDS;
+    rlim_t reserved = CONFIG_MIN_RESERVED_FDS+server.stream_spill_max_segments;
+    rlim_t maxfiles = server.maxclients+reserved;
     struct rlimit limit;
 
     if (getrlimit(RLIMIT_NOFILE,&limit) == -1) {
         serverLog(LL_WARNING,"Unable to obtain the current NOFILE limit (%s), assuming 1024 and setting the max clients configuration accordingly.",
             strerror(errno));
-        server.maxclients = 1024-CONFIG_MIN_RESERVED_FDS;
+        server.maxclients = reserved < 1024 ? 1024-reserved : 1;
     } else {
         rlim_t oldlimit = limit.rlim_cur;
 
@@ -2137,11 +2184,11 @@ void adjustOpenFilesLimit(void) {
 
             if (bestlimit < maxfiles) {
                 unsigned int old_maxclients = server.maxclients;
-                server.maxclients = bestlimit-CONFIG_MIN_RESERVED_FDS;
+                server.maxclients = bestlimit-reserved;
                 /* maxclients is unsigned so may overflow: in order
                  * to check if maxclients is now logically less than 1
                  * we test indirectly via bestlimit. */
-                if (bestlimit <= CONFIG_MIN_RESERVED_FDS) {
+                if (bestlimit <= reserved) {
                     serverLog(LL_WARNING,"Your current 'ulimit -n' "
                         "of %llu is not enough for the server to start. "
                         "Please increase your open file limit to at least "
@@ -2328,6 +2375,9 @@ void resetServerStats(void) {
     server.stat_expired_time_cap_reached_count = 0;
     server.stat_expire_cycle_time_used = 0;
     server.stat_evictedkeys = 0;
+    server.stat_proactive_evictedkeys = 0;
+    server.stat_inline_evictions = 0;
+    server.stat_admission_rejected_keys = 0;
     server.stat_evictedclients = 0;
     server.stat_total_eviction_exceeded_time = 0;
     server.stat_last_eviction_exceeded_time = 0;
@@ -2369,6 +2419,7 @@ void resetServerStats(void) {
     server.aof_delayed_fsync = 0;
     server.stat_reply_buffer_shrinks = 0;
     server.stat_reply_buffer_expands = 0;
+    server.stat_stream_node_faults = 0;
     lazyfreeResetStats();
 }
 
@@ -2415,7 +2466,7 @@ void initServer(void) {
     server.slaveseldb = -1; /* Force to emit the first SELECT command. */
     server.unblocked_clients = listCreate();
     server.ready_keys = listCreate();
-    server.tracking_pending_keys = listCreate();
+    server.tracking_pending_clients = listCreate();
     server.clients_waiting_acks = listCreate();
     server.get_ack_from_slaves = 0;
     server.client_pause_type = CLIENT_PAUSE_OFF;
@@ -2448,7 +2499,8 @@ void initServer(void) {
     adjustOpenFilesLimit();
     const char *clk_msg = monotonicInit();
     serverLog(LL_NOTICE, "monotonic clock: %s", clk_msg);
-    server.el = aeCreateEventLoop(server.maxclients+CONFIG_FDSET_INCR);
+    server.el = aeCreateEventLoop(server.maxclients+
+                                  server.stream_spill_max_segments+CONFIG_FDSET_INCR);
     if (server.el == NULL) {
         serverLog(LL_WARNING,
             "Failed creating the event loop. Error message: '%s'",
@@ -2494,19 +2546,26 @@ void initServer(void) {
     for (j = 0; j < server.dbnum; j++) {
         server.db[j].dict = dictCreate(&dbDictType);
         server.db[j].expires = dictCreate(&dbExpiresDictType);
-        server.db[j].expires_cursor = 0;
+        server.db[j].expires_index = expireIndexCreate();
         server.db[j].blocking_keys = dictCreate(&keylistDictType);
+        server.db[j].stream_waiters = dictCreate(&objectKeyPointerValueDictType);
         server.db[j].ready_keys = dictCreate(&objectKeyPointerValueDictType);
         server.db[j].watched_keys = dictCreate(&keylistDictType);
         server.db[j].id = j;
         server.db[j].avg_ttl = 0;
+        server.db[j].compact_values = 0;
         server.db[j].defrag_later = listCreate();
         server.db[j].slots_to_keys = NULL; /* Set by clusterInit later on if necessary. */
+        server.db[j].eviction_queues = NULL;
+        evictionQueuesInit(&server.db[j]);
+        server.db[j].memory_prefixes = NULL;
+        memoryPrefixesInit(&server.db[j]);
         listSetFreeMethod(server.db[j].defrag_later,(void (*)(void*))sdsfree);
     }
     evictionPoolAlloc(); /* Initialize the LRU keys pool. */
     server.pubsub_channels = dictCreate(&keylistDictType);
     server.pubsub_patterns = dictCreate(&keylistDictType);
+    server.pubsub_patterns_index = raxNew();
     server.pubsubshard_channels = dictCreate(&keylistDictType);
     server.cronloops = 0;
     server.in_script = 0;
@@ -3481,7 +3540,6 @@ void rejectCommandFormat(client *c, const char *fmt, ...) {
 
 /* This is called after a command in call, we can do some maintenance job in it. */
 void afterCommand(client *c) {
-    UNUSED(c);
     if (!server.in_nested_call) {
         /* If we are at the top-most call() we can propagate what we accumulated.
          * Should be done before trackingHandlePendingKeyInvalidations so that we
@@ -3491,6 +3549,9 @@ void afterCommand(client *c) {
         /* Flush pending invalidation messages only when we are not in nested call.
          * So the messages are not interleaved with transaction response. */
         trackingHandlePendingKeyInvalidations();
+        /* Values looked up by modules outside of commands may still be in
+         * use after RM_Call() returns: these are compacted in beforeSleep(). */
+        if (!(c->flags & CLIENT_MODULE)) compactPendingValues();
     }
 }
 
@@ -3596,6 +3657,11 @@ int processCommand(client *c) {
         return C_ERR;
     }
 
+    /* Keys invalidated for this client by other clients are coalesced until
+     * we return to the event loop, however the invalidation messages must
+     * still precede the reply of any command executed after the change. */
+    trackingFlushPendingInvalidations(c);
+
     /* If we're inside a module blocked context yielding that wants to avoid
      * processing clients, postpone the command. */
     if (server.busy_module_yield_flags != BUSY_MODULE_YIELD_NONE &&
@@ -5386,10 +5452,16 @@ sds genRedisInfoString(dict *section_dict, int all_sections, int everything) {
             "mem_clients_normal:%zu\r\n"
             "mem_cluster_links:%zu\r\n"
             "mem_aof_buffer:%zu\r\n"
+            "mem_admission_filter:%zu\r\n"
+            "mem_reply_buffer_pool:%zu\r\n"
+            "mem_stream_spill_cache:%zu\r\n"
             "mem_allocator:%s\r\n"
             "active_defrag_running:%d\r\n"
             "lazyfree_pending_objects:%zu\r\n"
-            "lazyfreed_objects:%zu\r\n",
+            "lazyfreed_objects:%zu\r\n"
+            "lazyfree_pending_jobs:%llu\r\n"
+            "lazyfree_incremental_objects:%zu\r\n"
+            "lazyfree_reclaim_rate:%lld\r\n",
             zmalloc_used,
             hmem,
             server.cron_malloc_stats.process_rss,
@@ -5440,10 +5512,16 @@ sds genRedisInfoString(dict *section_dict, int all_sections, int everything) {
             mh->clients_normal,
             mh->cluster_links,
             mh->aof_buffer,
+            admissionFilterMemory(),
+            replyBufferPoolMemory(),
+            streamSpillCacheMemory(),
             ZMALLOC_LIB,
             server.active_defrag_running,
             lazyfreeGetPendingObjectsCount(),
-            lazyfreeGetFreedObjectsCount()
+            lazyfreeGetFreedObjectsCount(),
+            lazyfreeGetPendingJobsCount(),
+            lazyfreeGetIncrementalObjectsCount(),
+            getInstantaneousMetric(STATS_METRIC_LAZYFREED)
         );
         freeMemoryOverheadData(mh);
     }
@@ -5595,6 +5673,10 @@ sds genRedisInfoString(dict *section_dict, int all_sections, int everything) {
         atomicGet(server.stat_total_writes_processed, stat_total_writes_processed);
         atomicGet(server.stat_net_input_bytes, stat_net_input_bytes);
         atomicGet(server.stat_net_output_bytes, stat_net_output_bytes);
+        long long stream_spilled_nodes, stream_segments, stream_segments_bytes;
+        atomicGet(server.stream_spilled_nodes, stream_spilled_nodes);
+        atomicGet(server.stream_segments, stream_segments);
+        atomicGet(server.stream_segments_bytes, stream_segments_bytes);
 
         if (sections++) info = sdscat(info,"\r\n");
         info = sdscatprintf(info,
@@ -5615,6 +5697,9 @@ sds genRedisInfoString(dict *section_dict, int all_sections, int everything) {
             "expired_time_cap_reached_count:%lld\r\n"
             "expire_cycle_cpu_milliseconds:%lld\r\n"
             "evicted_keys:%lld\r\n"
+            "evicted_keys_proactive:%lld\r\n"
+            "inline_eviction_cycles:%lld\r\n"
+            "admission_rejected_keys:%lld\r\n"
             "evicted_clients:%lld\r\n"
             "total_eviction_exceeded_time:%lld\r\n"
             "current_eviction_exceeded_time:%lld\r\n"
@@ -5643,7 +5728,11 @@ sds genRedisInfoString(dict *section_dict, int all_sections, int everything) {
             "io_threaded_reads_processed:%lld\r\n"
             "io_threaded_writes_processed:%lld\r\n"
             "reply_buffer_shrinks:%lld\r\n"
-            "reply_buffer_expands:%lld\r\n",
+            "reply_buffer_expands:%lld\r\n"
+            "stream_spilled_nodes:%lld\r\n"
+            "stream_segments:%lld\r\n"
+            "stream_segments_bytes:%lld\r\n"
+            "stream_node_faults:%lld\r\n",
             server.stat_numconnections,
             server.stat_numcommands,
             getInstantaneousMetric(STATS_METRIC_COMMAND),
@@ -5660,6 +5749,9 @@ sds genRedisInfoString(dict *section_dict, int all_sections, int everything) {
             server.stat_expired_time_cap_reached_count,
             server.stat_expire_cycle_time_used/1000,
             server.stat_evictedkeys,
+            server.stat_proactive_evictedkeys,
+            server.stat_inline_evictions,
+            server.stat_admission_rejected_keys,
             server.stat_evictedclients,
             (server.stat_total_eviction_exceeded_time + current_eviction_exceeded_time) / 1000,
             current_eviction_exceeded_time / 1000,
@@ -5688,7 +5780,11 @@ sds genRedisInfoString(dict *section_dict, int all_sections, int everything) {
             server.stat_io_reads_processed,
             server.stat_io_writes_processed,
             server.stat_reply_buffer_shrinks,
-            server.stat_reply_buffer_expands);
+            server.stat_reply_buffer_expands,
+            stream_spilled_nodes,
+            stream_segments,
+            stream_segments_bytes,
+            server.stat_stream_node_faults);
     }
 
     /* Replication */
@@ -6507,7 +6603,7 @@ void dismissMemory(void* ptr, size_t size_hint) {
 void dismissClientMemory(client *c) {
     /* Dismiss client query buffer and static reply buffer. */
     dismissMemory(c->buf, c->buf_usable_size);
-    dismissSds(c->querybuf);
+    if (c->querybuf) dismissSds(c->querybuf);
     /* Dismiss argv array only if we estimate it contains a big buffer. */
     if (c->argc && c->argv_len_sum/c->argc >= server.page_size) {
         for (int i = 0; i < c->argc; i++) {
@@ -141,6 +141,9 @@ typedef long long ustime_t; /* microsecond time type. */
 #define ACTIVE_EXPIRE_CYCLE_SLOW 0
 #define ACTIVE_EXPIRE_CYCLE_FAST 1
 
+#define LAZYFREE_CYCLE_SLOW 0
+#define LAZYFREE_CYCLE_FAST 1
+
 /* Children process will exit with this status code to signal that the
  * process terminated without an error: this is useful in order to kill
  * a saving child (RDB or AOF one), without triggering in the parent the
@@ -159,13 +162,14 @@ typedef long long ustime_t; /* microsecond time type. */
 #define STATS_METRIC_COMMAND 0      /* Number of commands executed. */
 #define STATS_METRIC_NET_INPUT 1    /* Bytes read to network .*/
 #define STATS_METRIC_NET_OUTPUT 2   /* Bytes written to network. */
-#define STATS_METRIC_COUNT 3
+#define STATS_METRIC_LAZYFREED 3    /* Objects released by lazy free. */
+#define STATS_METRIC_COUNT 4
 
 /* Protocol and I/O related defines */
 #define PROTO_IOBUF_LEN         (1024*16)  /* Generic I/O buffer size */
 #define PROTO_REPLY_CHUNK_BYTES (16*1024) /* 16k output buffer */
 #define PROTO_INLINE_MAX_SIZE   (1024*64) /* Max size of inline reads */
-#define PROTO_MBULK_BIG_ARG     (1024*32)
+#define PROTO_MBULK_BIG_ARG     (1024*32) /* Default for proto-big-arg-len */
 #define PROTO_RESIZE_THRESHOLD  (1024*32) /* Threshold for determining whether to resize query buffer */
 #define PROTO_REPLY_MIN_BYTES   (1024) /* the lower limit on reply buffer size */
 #define REDIS_AUTOSYNC_BYTES (1024*1024*4) /* Sync file every 4MB. */
@@ -363,6 +367,8 @@ extern int configOOMScoreAdjValuesDefaults[CONFIG_OOM_COUNT];
                                           RDB without replication buffer. */
 #define CLIENT_NO_EVICT (1ULL<<43) /* This client is protected against client
                                       memory eviction. */
+#define CLIENT_SHARED_QUERYBUF (1ULL<<44) /* The query buffer is the shared one
+                                             of the reading thread. */
 
 /* Client block type (btype field in client structure)
  * if CLIENT_BLOCKED flag is set. */
@@ -531,6 +537,10 @@ typedef enum {
 #define MAXMEMORY_ALLKEYS_RANDOM ((6<<8)|MAXMEMORY_FLAG_ALLKEYS)
 #define MAXMEMORY_NO_EVICTION (7<<8)
 
+/* Eviction engines, see the maxmemory-eviction-engine config. */
+#define EVICTION_ENGINE_SAMPLING 0
+#define EVICTION_ENGINE_ORDERED 1
+
 /* Units */
 #define UNIT_SECONDS 0
 #define UNIT_MILLISECONDS 1
@@ -875,9 +885,16 @@ char *getObjectTypeName(robj*);
 struct evictionPoolEntry; /* Defined in evict.c */
 
 /* This structure is used in order to represent the output buffer of a client,
- * which is actually a linked list of blocks like that, that is: client->reply. */
+ * which is actually a linked list of blocks like that, that is: client->reply.
+ *
+ * Blocks are usually owned by a single client and have a zero refcount.
+ * Shared blocks (see createSharedReplyBlock()) are read only and may be
+ * linked in the reply list of many clients, that release them when the block
+ * is written. Since IO threads may write them concurrently, their refcount is
+ * atomic. */
 typedef struct clientReplyBlock {
     size_t size, used;
+    redisAtomic int refcount;
     char buf[];
 } clientReplyBlock;
 
@@ -911,6 +928,63 @@ typedef struct replBufBlock {
 /* Opaque type for the Slot to Key API. */
 typedef struct clusterSlotToKeyMapping clusterSlotToKeyMapping;
 
+/* Time ordered index of the keys with an expire set. Keys are grouped in
+ * buckets of EXPIRE_INDEX_BUCKET_BITS milliseconds stored in a radix tree,
+ * so that the active expire cycle can reclaim exactly the keys that are
+ * logically expired instead of sampling. See expire.c for more info. */
+typedef struct expireIndex {
+    rax *buckets;               /* Big endian bucket id -> expireBucket. */
+    unsigned long long keys;    /* Number of keys in the index. */
+    long long when_sum;         /* Sum of (when/1000 - base) of all keys. */
+    long long base;             /* Unix time in seconds 'when_sum' refers to. */
+} expireIndex;
+
+/* Dict entry metadata used by the ordered eviction engine to link the keys
+ * of a DB into the eviction queues. See evict.c for more info. */
+typedef struct evictionDictEntryMetadata {
+    dictEntry *prev;            /* Prev entry in the same eviction queue. */
+    dictEntry *next;            /* Next entry in the same eviction queue. */
+    unsigned int stamp;         /* LRU clock when the key was queued. */
+    unsigned int queue;         /* Eviction queue the key belongs to. */
+} evictionDictEntryMetadata;
+
+/* Memory accounted to the keys sharing the same prefix, see the
+ * memory-prefix-delimiter config and object.c. */
+typedef struct memoryPrefix {
+    unsigned long long keys;    /* Number of keys with this prefix. */
+    unsigned long long bytes;   /* Memory used by these keys. */
+} memoryPrefix;
+
+/* Dict entry metadata used to account the key to its prefix. */
+typedef struct prefixDictEntryMetadata {
+    memoryPrefix *prefix;       /* Prefix the key is accounted to. */
+    size_t size;                /* Memory accounted for the key. */
+} prefixDictEntryMetadata;
+
+/* Compact values: string values stored directly in the dict entry instead of
+ * an object, see the compact-values config and object.c. */
+#define COMPACT_VALUE_TAG 1
+#define isCompactValue(v) (((uintptr_t)(v)) & COMPACT_VALUE_TAG)
+
+/* Object expanded from a compact value by dbValueView(). */
+typedef struct compactValueView {
+    robj o;
+    char sds[sizeof(struct sdshdr8)+8];
+} compactValueView;
+
+#define EVICTION_QUEUES 256     /* One queue for every LFU counter value. */
+
+typedef struct evictionQueue {
+    dictEntry *head, *tail;
+    unsigned long len;
+} evictionQueue;
+
+typedef struct evictionQueues {
+    evictionQueue queue[EVICTION_QUEUES];
+    int lowest;                 /* No queue before this one has keys. */
+    int cron_cursor;            /* Last queue aged by evictionQueuesCron(). */
+} evictionQueues;
+
 /* Redis database representation. There are multiple databases identified
  * by integers from 0 (the default database) up to the max configured
  * database. The database number is the 'id' field in the structure. */
@@ -918,13 +992,17 @@ typedef struct redisDb {
     dict *dict;                 /* The keyspace for this DB */
     dict *expires;              /* Timeout of keys with a timeout set */
     dict *blocking_keys;        /* Keys with clients waiting for data (BLPOP)*/
+    dict *stream_waiters;       /* Stream keys with clients blocked by XREAD[GROUP] */
     dict *ready_keys;           /* Blocked keys that received a PUSH */
     dict *watched_keys;         /* WATCHED keys for MULTI/EXEC CAS */
     int id;                     /* Database ID */
     long long avg_ttl;          /* Average TTL, just for stats */
-    unsigned long expires_cursor; /* Cursor of the active expire cycle. */
+    long long compact_values;   /* Number of values stored in the dict entry. */
+    expireIndex *expires_index; /* Keys of 'expires' ordered by time. */
     list *defrag_later;         /* List of key names to attempt to defrag one by one, gradually. */
     clusterSlotToKeyMapping *slots_to_keys; /* Array of slots to keys. Only used in cluster mode (db 0). */
+    evictionQueues *eviction_queues; /* Only used by the ordered eviction engine. */
+    rax *memory_prefixes;       /* Prefix -> memoryPrefix, when accounting is on. */
 } redisDb;
 
 /* forward declaration for functions ctx */
@@ -1085,7 +1163,8 @@ typedef struct client {
     int resp;               /* RESP protocol version. Can be 2 or 3. */
     redisDb *db;            /* Pointer to currently SELECTed DB. */
     robj *name;             /* As set by CLIENT SETNAME. */
-    sds querybuf;           /* Buffer we use to accumulate client queries. */
+    sds querybuf;           /* Buffer we use to accumulate client queries,
+                               NULL when there is no pending input. */
     size_t qb_pos;          /* The position we have read in querybuf. */
     size_t querybuf_peak;   /* Recent (100ms or more) peak of querybuf size. */
     int argc;               /* Num of arguments of current command. */
@@ -1166,6 +1245,11 @@ typedef struct client {
     rax *client_tracking_prefixes; /* A dictionary of prefixes we are already
                                       subscribed to in BCAST mode, in the
                                       context of client side caching. */
+    int client_tracking_slot; /* Slot of the client in the tracking table,
+                                 or -1 if not assigned. */
+    rax *client_tracking_pending_keys; /* Invalidated keys not yet sent. */
+    listNode *client_tracking_pending_node; /* Node in the list of clients
+                                               with pending invalidations. */
     /* In updateClientMemUsage() we track the memory usage of
      * each client and add it to the sum of all the clients of a given type,
      * however we need to remember what was the old contribution of each
@@ -1184,12 +1268,24 @@ typedef struct client {
 
     /* Response buffer */
     size_t buf_peak; /* Peak used size of buffer in last 5 sec interval. */
+    size_t buf_target_size; /* Size of the buffer to borrow from the reply
+                               buffer pool when there is something to send. */
     mstime_t buf_peak_last_reset_time; /* keeps the last time the buffer peak value was reset */
     int bufpos;
-    size_t buf_usable_size; /* Usable size of buffer. */
-    char *buf;
+    size_t buf_usable_size; /* Usable size of buffer, 0 when not allocated. */
+    char *buf;              /* Borrowed from the reply buffer pool on demand
+                               and returned once the reply is sent. */
 } client;
 
+/* Writes the elements of an aggregate reply straight into the free space at
+ * the tail of the client output buffers, see replyWriterStart(). */
+typedef struct replyWriter {
+    client *c;                  /* NULL if the client gets no replies. */
+    clientReplyBlock *block;    /* Reply block holding the reserved space,
+                                   NULL for the static buffer c->buf. */
+    char *pos, *end;            /* Reserved space not written yet. */
+} replyWriter;
+
 struct saveparam {
     time_t seconds;
     int changes;
@@ -1392,6 +1488,7 @@ typedef struct redisTLSContextConfig {
     int session_caching;
     int session_cache_size;
     int session_cache_timeout;
+    int ktls;                       /* Offload TLS records to the kernel, if supported */
 } redisTLSContextConfig;
 
 /*-----------------------------------------------------------------------------
@@ -1535,6 +1632,8 @@ struct redisServer {
     int protected_mode;         /* Don't accept external connections. */
     int io_threads_num;         /* Number of IO threads to use. */
     int io_threads_do_reads;    /* Read and parse from IO threads? */
+    int io_threads_fanout_min_clients; /* Min subscribers to append a message
+                                          to from the IO threads. */
     int io_threads_active;      /* Is IO threads currently active? */
     long long events_processed_while_blocked; /* processEventsWhileBlocked() */
     int enable_protected_configs;    /* Enable the modification of protected configs, see PROTECTED_ACTION_ALLOWED_* */
@@ -1558,6 +1657,11 @@ struct redisServer {
     long long stat_expired_time_cap_reached_count; /* Early expire cycle stops.*/
     long long stat_expire_cycle_time_used; /* Cumulative microseconds used. */
     long long stat_evictedkeys;     /* Number of evicted keys (maxmemory) */
+    long long stat_proactive_evictedkeys; /* Keys evicted by the cron to keep the headroom */
+    long long stat_inline_evictions; /* Eviction cycles performed before commands
+                                        while proactive eviction is enabled */
+    long long stat_admission_rejected_keys; /* New keys not admitted by the
+                                               TinyLFU admission filter */
     long long stat_evictedclients;  /* Number of evicted clients */
     long long stat_total_eviction_exceeded_time;  /* Total time over the memory limit, unit us */
     monotime stat_last_eviction_exceeded_time;  /* Timestamp of current eviction start, unit us */
@@ -1616,6 +1720,10 @@ struct redisServer {
     } inst_metric[STATS_METRIC_COUNT];
     long long stat_reply_buffer_shrinks; /* Total number of output buffer shrinks */
     long long stat_reply_buffer_expands; /* Total number of output buffer expands */
+    long long stat_stream_node_faults; /* Stream nodes read back from disk. */
+    redisAtomic long long stream_spilled_nodes; /* Stream nodes on disk. */
+    redisAtomic long long stream_segments; /* Open stream segment files. */
+    redisAtomic long long stream_segments_bytes; /* Size of the segment files. */
 
     /* Configuration */
     int verbosity;                  /* Loglevel in redis.conf */
@@ -1633,6 +1741,7 @@ struct redisServer {
     int active_defrag_cycle_min;       /* minimal effort for defrag in CPU percentage */
     int active_defrag_cycle_max;       /* maximal effort for defrag in CPU percentage */
     unsigned long active_defrag_max_scan_fields; /* maximum number of fields of set/hash/zset/list to process from within the main dict scan */
+    int active_defrag_threaded;        /* copy large string values in a background thread */
     size_t client_max_querybuf_len; /* Limit for client query buffer length */
     int dbnum;                      /* Total number of configured DBs */
     int supervised;                 /* 1 if supervised, 0 otherwise. */
@@ -1808,10 +1917,19 @@ struct redisServer {
     ssize_t maxmemory_clients;       /* Memory limit for total client buffers */
     int maxmemory_policy;           /* Policy for key eviction */
     int maxmemory_samples;          /* Precision of random sampling */
+    int maxmemory_eviction_engine;  /* EVICTION_ENGINE_* */
+    char *memory_prefix_delimiter;  /* Account memory per key prefix. */
+    int compact_values;             /* Store small strings in the dict entry. */
     int maxmemory_eviction_tenacity;/* Aggressiveness of eviction processing */
+    int maxmemory_eviction_headroom;/* Percentage of maxmemory proactive eviction
+                                       keeps free, 0 if disabled. */
+    int maxmemory_admission_filter; /* TinyLFU admission filter for allkeys-lfu */
     int lfu_log_factor;             /* LFU logarithmic counter factor. */
     int lfu_decay_time;             /* LFU counter decay factor. */
     long long proto_max_bulk_len;   /* Protocol bulk length maximum size. */
+    long long proto_big_arg_len;    /* Bulk arguments at least this big are read
+                                       into their own buffer, then used as the
+                                       argument without copying. */
     int oom_score_adj_values[CONFIG_OOM_COUNT];   /* Linux oom_score_adj configuration */
     int oom_score_adj;                            /* If true, oom_score_adj is managed */
     int disable_thp;                              /* If true, disable THP by syscall */
@@ -1823,7 +1941,7 @@ struct redisServer {
     /* Client side caching. */
     unsigned int tracking_clients;  /* # of clients with tracking enabled.*/
     size_t tracking_table_max_keys; /* Max number of keys in tracking table. */
-    list *tracking_pending_keys; /* tracking invalidation keys pending to flush */
+    list *tracking_pending_clients; /* Clients with invalidated keys to send. */
     /* Sort parameters - qsort_r() is only available under BSD so we
      * have to take this state global, in order to pass it to sortCompare() */
     int sort_desc;
@@ -1839,6 +1957,13 @@ struct redisServer {
     size_t hll_sparse_max_bytes;
     size_t stream_node_max_bytes;
     long long stream_node_max_entries;
+    long long stream_spill_after_nodes; /* Nodes of a stream kept in memory
+                                           before moving older ones to disk,
+                                           0 to never spill. */
+    int stream_spill_cache_nodes;   /* Spilled nodes kept loaded in memory. */
+    int stream_spill_max_segments;  /* Max open segment files, whose file
+                                       descriptors are reserved, 0 to
+                                       never spill. */
     /* List parameters */
     int list_max_listpack_size;
     int list_compress_depth;
@@ -1853,6 +1978,7 @@ struct redisServer {
     /* Pubsub */
     dict *pubsub_channels;  /* Map channels to list of subscribed clients */
     dict *pubsub_patterns;  /* A dict of pubsub_patterns */
+    rax *pubsub_patterns_index; /* Patterns by literal prefix, see pubsub.c */
     int notify_keyspace_events; /* Events to propagate via Pub/Sub. This is an
                                    xor of NOTIFY_... flags. */
     dict *pubsubshard_channels;  /* Map channels to list of subscribed clients */
@@ -1896,6 +2022,8 @@ struct redisServer {
     int lazyfree_lazy_server_del;
     int lazyfree_lazy_user_del;
     int lazyfree_lazy_user_flush;
+    int lazyfree_threads;       /* Number of lazyfree threads. */
+    unsigned long lazyfree_max_pending_jobs; /* Lazyfree queue limit, 0 = no limit. */
     /* Latency monitor */
     long long latency_monitor_threshold;
     dict *latency_events;
@@ -1914,6 +2042,7 @@ struct redisServer {
     int tls_cluster;
     int tls_replication;
     int tls_auth_clients;
+    int tls_handshake_threads; /* Threads running the TLS handshakes, 0 = main thread. */
     redisTLSContextConfig tls_ctx_config;
     /* cpu affinity */
     char *server_cpulist; /* cpu affinity list of redis server main/io thread. */
@@ -1934,6 +2063,8 @@ struct redisServer {
                                                 is down, doesn't affect pubsub global. */
     long reply_buffer_peak_reset_time; /* The amount of time (in milliseconds) to wait between reply buffer peak resets */
     int reply_buffer_resizing_enabled; /* Is reply buffer resizing enabled (1 by default) */
+    size_t reply_buffer_pool_size; /* Max memory of free reply buffers kept
+                                      for reuse by the clients. */
 };
 
 #define MAX_KEYS_BUFFER 256
@@ -2330,6 +2461,7 @@ typedef struct {
 #define IO_THREADS_OP_IDLE 0
 #define IO_THREADS_OP_READ 1
 #define IO_THREADS_OP_WRITE 2
+#define IO_THREADS_OP_FANOUT 3
 extern int io_threads_op;
 
 /*-----------------------------------------------------------------------------
@@ -2450,17 +2582,33 @@ void acceptDemikernelHandler(aeEventLoop *el, int fd, void *privdata, int mask);
 #endif
 void acceptUnixHandler(aeEventLoop *el, int fd, void *privdata, int mask);
 void readQueryFromClient(connection *conn);
+void releaseSharedQueryBuffer(client *c);
 int prepareClientToWrite(client *c);
 void addReplyNull(client *c);
 void addReplyNullArray(client *c);
 void addReplyBool(client *c, int b);
 void addReplyVerbatim(client *c, const char *s, size_t len, const char *ext);
 void addReplyProto(client *c, const char *s, size_t len);
+clientReplyBlock *createSharedReplyBlock(const char *s, size_t len);
+void releaseSharedReplyBlock(clientReplyBlock *block);
+void addReplySharedBlock(client *c, clientReplyBlock *block);
 void AddReplyFromClient(client *c, client *src);
+void *replyBufferAlloc(size_t size);
+void replyBufferFree(void *p, size_t size);
+size_t replyBufferSizeClass(size_t size);
+void trimReplyBufferPool(size_t max_bytes);
+size_t replyBufferPoolMemory(void);
 void addReplyBulk(client *c, robj *obj);
 void addReplyBulkCString(client *c, const char *s);
 void addReplyBulkCBuffer(client *c, const void *p, size_t len);
 void addReplyBulkLongLong(client *c, long long ll);
+void replyWriterStart(replyWriter *w, client *c);
+void replyWriterEnd(replyWriter *w);
+void replyWriterAggregateLen(replyWriter *w, long length, int prefix);
+void replyWriterArrayLen(replyWriter *w, long length);
+void replyWriterBulkCBuffer(replyWriter *w, const void *p, size_t len);
+void replyWriterBulkLongLong(replyWriter *w, long long ll);
+void replyWriterDouble(replyWriter *w, double d);
 void addReply(client *c, robj *obj);
 void addReplySds(client *c, sds s);
 void addReplyBulkSds(client *c, sds s);
@@ -2525,6 +2673,8 @@ void blockingOperationEnds();
 int handleClientsWithPendingWrites(void);
 int handleClientsWithPendingWritesUsingThreads(void);
 int handleClientsWithPendingReadsUsingThreads(void);
+int canFanoutUsingThreads(list *clients);
+void fanoutSharedBlocksUsingThreads(list *clients, clientReplyBlock **blocks);
 int stopThreadedIOIfNeeded(void);
 int clientHasPendingReplies(client *c);
 int islocalClient(client *c);
@@ -2560,6 +2710,9 @@ void trackingRememberKeys(client *c);
 void trackingInvalidateKey(client *c, robj *keyobj, int bcast);
 void trackingScheduleKeyInvalidation(uint64_t client_id, robj *keyobj);
 void trackingHandlePendingKeyInvalidations(void);
+void trackingFlushPendingInvalidations(client *c);
+void trackingDiscardPendingInvalidations(client *c);
+void trackingFlushAllPendingInvalidations(void);
 void trackingInvalidateKeysOnFlush(int async);
 void freeTrackingRadixTree(rax *rt);
 void freeTrackingRadixTreeAsync(rax *rt);
@@ -2654,6 +2807,18 @@ int collateStringObjects(robj *a, robj *b);
 int equalStringObjects(robj *a, robj *b);
 unsigned long long estimateObjectIdleTime(robj *o);
 void trimStringObjectIfNeeded(robj *o);
+void memoryPrefixesInit(redisDb *db);
+void memoryPrefixesFlush(redisDb *db);
+void memoryPrefixesDestroy(redisDb *db);
+void memoryPrefixAddEntry(dictEntry *de, redisDb *db);
+void memoryPrefixDelEntry(dictEntry *de, redisDb *db);
+void memoryPrefixUpdateEntry(dictEntry *de, redisDb *db);
+void memoryPrefixUpdateKey(redisDb *db, robj *key);
+robj *dbValueView(dictEntry *de, compactValueView *view);
+robj *dbExpandValue(redisDb *db, dictEntry *de);
+int dbCompactValue(redisDb *db, dictEntry *de);
+void dbCompactValueLater(redisDb *db, dictEntry *de);
+void compactPendingValues(void);
 #define sdsEncodedObject(objptr) (objptr->encoding == OBJ_ENCODING_RAW || objptr->encoding == OBJ_ENCODING_EMBSTR)
 
 /* Synchronous I/O with timeout */
@@ -2840,6 +3005,7 @@ void zslFree(zskiplist *zsl);
 zskiplistNode *zslInsert(zskiplist *zsl, double score, sds ele);
 unsigned char *zzlInsert(unsigned char *zl, sds ele, double score);
 int zslDelete(zskiplist *zsl, double score, sds ele, zskiplistNode **node);
+unsigned long zslDeleteRangeByRank(zskiplist *zsl, unsigned int start, unsigned int end, dict *dict);
 zskiplistNode *zslFirstInRange(zskiplist *zsl, zrangespec *range);
 zskiplistNode *zslLastInRange(zskiplist *zsl, zrangespec *range);
 double zzlGetScore(unsigned char *sptr);
@@ -2929,6 +3095,7 @@ void closeListeningSockets(int unlink_unix_socket);
 void updateCachedTime(int update_daylight_info);
 void resetServerStats(void);
 void activeDefragCycle(void);
+void activeDefragFlushJobs(void);
 unsigned int getLRUClock(void);
 unsigned int LRU_CLOCK(void);
 const char *evictPolicyToString(void);
@@ -3088,6 +3255,8 @@ robj *objectCommandLookup(client *c, robj *key);
 robj *objectCommandLookupOrReply(client *c, robj *key, robj *reply);
 int objectSetLRUOrLFU(robj *val, long long lfu_freq, long long lru_idle,
                        long long lru_clock, int lru_multiplier);
+#define OBJ_COMPUTE_SIZE_DEF_SAMPLES 5 /* Default sample size. */
+size_t objectComputeSize(robj *key, robj *o, size_t sample_size, int dbid);
 #define LOOKUP_NONE 0
 #define LOOKUP_NOTOUCH (1<<0)  /* Don't update LRU. */
 #define LOOKUP_NONOTIFY (1<<1) /* Don't trigger keyspace event on key misses. */
@@ -3128,6 +3297,9 @@ int dbAsyncDelete(redisDb *db, robj *key);
 void emptyDbAsync(redisDb *db);
 size_t lazyfreeGetPendingObjectsCount(void);
 size_t lazyfreeGetFreedObjectsCount(void);
+size_t lazyfreeGetIncrementalObjectsCount(void);
+unsigned long long lazyfreeGetPendingJobsCount(void);
+void lazyfreeIncrementalCycle(int type);
 void lazyfreeResetStats(void);
 void freeObjAsync(robj *key, robj *obj, int dbid);
 void freeReplicationBacklogRefMemAsync(list *blocks, rax *index);
@@ -3226,6 +3398,14 @@ int clientsCronHandleTimeout(client *c, mstime_t now_ms);
 
 /* expire.c -- Handling of expired keys */
 void activeExpireCycle(int type);
+expireIndex *expireIndexCreate(void);
+void expireIndexRelease(expireIndex *ei);
+void expireIndexEmpty(expireIndex *ei);
+void expireIndexAdd(expireIndex *ei, sds key, long long when);
+void expireIndexDel(expireIndex *ei, sds key, long long when);
+void expireIndexUpdate(expireIndex *ei, sds key, long long oldwhen, long long newwhen);
+void expireIndexReplaceKey(expireIndex *ei, sds oldkey, sds newkey, long long when);
+long long expireIndexAvgTTL(expireIndex *ei, long long now);
 void expireSlaveKeys(void);
 void rememberSlaveKeyWithExpire(redisDb *db, robj *key);
 void flushSlaveKeysWithExpireList(void);
@@ -3233,6 +3413,14 @@ size_t getSlaveKeyWithExpireCount(void);
 
 /* evict.c -- maxmemory handling and LRU eviction. */
 void evictionPoolAlloc(void);
+void evictionQueuesInit(redisDb *db);
+void evictionQueuesFlush(redisDb *db);
+void evictionQueuesDestroy(redisDb *db);
+void evictionQueueAddEntry(dictEntry *de, redisDb *db);
+void evictionQueueDelEntry(dictEntry *de, redisDb *db);
+void evictionQueueReplaceEntry(dictEntry *de, redisDb *db);
+void evictionQueueTouchEntry(dictEntry *de, redisDb *db);
+void evictionQueuesCron(void);
 #define LFU_INIT_VAL 5
 unsigned long LFUGetTimeInMinutes(void);
 uint8_t LFULogIncr(uint8_t value);
@@ -3241,6 +3429,12 @@ unsigned long LFUDecrAndReturn(robj *o);
 #define EVICT_RUNNING 1
 #define EVICT_FAIL 2
 int performEvictions(void);
+size_t proactiveEvictionTarget(void);
+void proactiveEvictionCycle(void);
+void admissionFilterRecord(sds key);
+int admissionFilterAdmit(redisDb *db, sds key, robj *val);
+void admissionFilterCron(void);
+size_t admissionFilterMemory(void);
 void startEvictionTimeProc(void);
 
 /* Keys hashing / comparison functions for dict.c hash tables. */
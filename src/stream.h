@@ -3,6 +3,7 @@
 
 #include "rax.h"
 #include "listpack.h"
+#include "adlist.h"
 
 /* Stream item ID: a 128 bit number composed of a milliseconds time and
  * a sequence counter. IDs generated in the same millisecond (or in a past
@@ -21,8 +22,52 @@ typedef struct stream {
     streamID max_deleted_entry_id;  /* The maximal ID that was deleted. */
     uint64_t entries_added; /* All time count of elements added. */
     rax *cgroups;           /* Consumer groups dictionary: name -> streamCG */
+    struct streamSpill *spill; /* Nodes moved to disk, NULL if none was. */
 } stream;
 
+/* Segment file holding the listpacks of stream nodes spilled to disk. The
+ * file is unlinked as soon as it is created, so that closing it, when the
+ * last node stored there is trimmed, deleted or loaded back in memory,
+ * releases the disk space, and nothing is left behind on restarts. */
+typedef struct streamSegment {
+    int fd;                 /* File descriptor of the segment file. */
+    off_t size;             /* Bytes written: new nodes are appended here. */
+    uint64_t nodes;         /* Number of spilled nodes stored in the file. */
+} streamSegment;
+
+/* Spill state of a stream, see streamSpillNodes(). */
+typedef struct streamSpill {
+    streamSegment *segment; /* Segment new nodes are appended to, or NULL. */
+    uint64_t nodes;         /* Number of nodes on disk. */
+    uint64_t last_key[2];   /* Key of the last node spilled: the nodes after
+                               it are all in memory. */
+    uint64_t loaded;        /* Nodes before last_key that are in memory,
+                               because loaded back to be modified. This is
+                               an upper bound: the nodes may be gone since. */
+} streamSpill;
+
+/* A stream node spilled to disk. In the radix tree of the stream it takes
+ * the place of the listpack, as a pointer tagged with STREAM_NODE_SPILLED,
+ * so that streamNodeAcquire() is needed to access the listpack of a node.
+ * The node keeps what trimming needs to know to remove it as a whole
+ * without loading it. */
+typedef struct streamSpilledNode {
+    streamSegment *segment; /* Segment holding the listpack. */
+    off_t offset;           /* Offset of the listpack in the segment. */
+    size_t bytes;           /* Size of the listpack. */
+    uint64_t entries;       /* Valid entries in the node. */
+    streamID last_id;       /* ID of the last entry, deleted or not. */
+    unsigned char *lp;      /* The listpack if loaded in the cache, or NULL. */
+    listNode *cache_node;   /* Node in the cache LRU list when loaded. */
+    int pins;               /* Users of the loaded listpack: it is not
+                               evicted from the cache while not zero. */
+} streamSpilledNode;
+
+#define STREAM_NODE_SPILLED 1
+#define STREAM_NODE_IS_SPILLED(node) (((uintptr_t)(node)) & STREAM_NODE_SPILLED)
+#define STREAM_SPILLED_NODE(node) \
+    ((streamSpilledNode*)(((uintptr_t)(node)) & ~(uintptr_t)STREAM_NODE_SPILLED))
+
 /* We define an iterator to iterate stream items in an abstract way, without
  * caring about the radix tree + listpack representation. Technically speaking
  * the iterator is only used inside streamReplyWithRange(), so could just
@@ -38,9 +83,11 @@ typedef struct streamIterator {
     int entry_flags;                    /* Flags of entry we are emitting. */
     int rev;                /* True if iterating end to start (reverse). */
     int skip_tombstones;    /* True if not emitting tombstone entries. */
+    int error;              /* errno if a node could not be read from disk. */
     uint64_t start_key[2];  /* Start key as 128 bit big endian. */
     uint64_t end_key[2];    /* End key as 128 bit big endian. */
     raxIterator ri;         /* Rax iterator. */
+    void *node;             /* Current radix tree node value. */
     unsigned char *lp;      /* Current listpack. */
     unsigned char *lp_ele;  /* Current listpack cursor. */
     unsigned char *lp_flags; /* Current entry flags pointer. */
@@ -51,6 +98,54 @@ typedef struct streamIterator {
     unsigned char value_buf[LP_INTBUF_SIZE];
 } streamIterator;
 
+/* Entries of a stream node decoded in a single pass by
+ * streamIteratorGetBatch(). The fields and values of an entry are
+ * listpack elements referenced by their index in the 'spans' array: the
+ * fields of entries flagged with STREAM_ITEM_FLAG_SAMEFIELDS are the ones
+ * of the master entry, shared by all of them, so fields and values are
+ * 'stride' spans apart, that is 1 for such entries and 2 for the others,
+ * where fields and values are interleaved. The spans point inside the node
+ * listpack, and are valid until the next call to the iterator. */
+typedef struct streamBatchEntry {
+    streamID id;            /* Entry ID. */
+    int64_t numfields;      /* Number of field-value pairs. */
+    size_t fields;          /* Index of the first field span. */
+    size_t values;          /* Index of the first value span. */
+    int stride;             /* Distance between two fields or two values. */
+} streamBatchEntry;
+
+typedef struct streamBatch {
+    streamBatchEntry *entries;  /* Entries decoded by the last call. */
+    size_t count;               /* Number of entries decoded. */
+    size_t entries_size;        /* Allocated entries. */
+    listpackEntry *spans;       /* Fields and values of the entries. */
+    size_t spans_size;          /* Allocated spans. */
+} streamBatch;
+
+/* Pending entries list of a consumer group. The pending entries are packed,
+ * in ID order, into listpack blocks of up to STREAM_PEL_BLOCK_MAX_ENTRIES
+ * entries, so that an entry does not cost an allocation and two radix tree
+ * keys. Every block starts with a header made of the milliseconds part of
+ * the ID it was created with, that the IDs of the entries are delta encoded
+ * against, and of the minimum delivery time among its entries. Then for
+ * every entry there are five integers: the milliseconds delta and sequence
+ * of the ID, the delivery time as a delta from the ID milliseconds, the
+ * delivery count and the ID of the consumer owning the entry.
+ *
+ * The blocks are also indexed by their minimum delivery time, so that the
+ * entries idle for more than a given time can be found without scanning the
+ * whole PEL. */
+typedef struct streamPEL {
+    rax *blocks;            /* Blocks by key: the key of a block is smaller
+                               than or equal to the ID of its first entry,
+                               and greater than the ID of the last entry of
+                               the previous block. */
+    rax *idle;              /* Delivery time index: the keys are the minimum
+                               delivery time of a block followed by the key
+                               of the block, the values are NULL. */
+    uint64_t size;          /* Number of pending entries. */
+} streamPEL;
+
 /* Consumer group. */
 typedef struct streamCG {
     streamID last_id;       /* Last delivered (not acknowledged) ID for this
@@ -61,15 +156,17 @@ typedef struct streamCG {
                                group reads. In the real world, the reasoning behind
                                this value is detailed at the top comment of
                                streamEstimateDistanceFromFirstEverEntry(). */
-    rax *pel;               /* Pending entries list. This is a radix tree that
-                               has every message delivered to consumers (without
-                               the NOACK option) that was yet not acknowledged
-                               as processed. The key of the radix tree is the
-                               ID as a 64 bit big endian number, while the
-                               associated value is a streamNACK structure.*/
+    streamPEL pel;          /* Pending entries list. It has every message
+                               delivered to consumers (without the NOACK
+                               option) that was yet not acknowledged as
+                               processed. */
     rax *consumers;         /* A radix tree representing the consumers by name
                                and their associated representation in the form
                                of streamConsumer structures. */
+    rax *consumers_by_id;   /* Consumers by ID, as a 64 bit big endian number:
+                               the PEL references the owner of an entry by
+                               its ID. */
+    uint64_t last_consumer_id; /* ID of the last consumer created. */
 } streamCG;
 
 /* A specific consumer in a consumer group.  */
@@ -78,23 +175,39 @@ typedef struct streamConsumer {
     sds name;                   /* Consumer name. This is how the consumer
                                    will be identified in the consumer group
                                    protocol. Case sensitive. */
+    uint64_t id;                /* Consumer ID, unique inside the group. */
     rax *pel;                   /* Consumer specific pending entries list: all
                                    the pending messages delivered to this
                                    consumer not yet acknowledged. Keys are
                                    big endian message IDs, while values are
-                                   the same streamNACK structure referenced
-                                   in the "pel" of the consumer group structure
-                                   itself, so the value is shared. */
+                                   NULL: the details of the entries are
+                                   stored in the consumer group PEL. */
 } streamConsumer;
 
-/* Pending (yet not acknowledged) message in a consumer group. */
+/* Pending (yet not acknowledged) message in a consumer group. This is the
+ * unpacked form of a PEL entry, that the PEL functions fill and take. */
 typedef struct streamNACK {
+    streamID id;                /* ID of the message. */
     mstime_t delivery_time;     /* Last time this message was delivered. */
     uint64_t delivery_count;    /* Number of times this message was delivered.*/
     streamConsumer *consumer;   /* The consumer this message was delivered to
                                    in the last delivery. */
 } streamNACK;
 
+/* Iterator of the entries of a consumer group PEL, in ID order. The PEL
+ * must not be modified while it is iterated. */
+typedef struct streamPelIterator {
+    streamCG *cg;           /* The consumer group of the PEL. */
+    streamID start;         /* Entries with a smaller ID are skipped. */
+    raxIterator ri;         /* Blocks iterator. */
+    unsigned char *lp;      /* Current block, NULL if there is none. */
+    unsigned char *lp_ele;  /* Next entry in the current block. */
+    uint64_t master_ms;     /* The IDs of the current block are relative
+                               to this milliseconds time. */
+    uint64_t consumer_id;   /* ID of the last consumer looked up. */
+    streamConsumer *consumer; /* The last consumer looked up. */
+} streamPelIterator;
+
 /* Stream propagation information, passed to functions in order to propagate
  * XCLAIM commands to AOF and slaves. */
 typedef struct streamPropInfo {
@@ -124,15 +237,17 @@ void streamIteratorStart(streamIterator *si, stream *s, streamID *start, streamI
 int streamIteratorGetID(streamIterator *si, streamID *id, int64_t *numfields);
 void streamIteratorGetField(streamIterator *si, unsigned char **fieldptr, unsigned char **valueptr, int64_t *fieldlen, int64_t *valuelen);
 void streamIteratorRemoveEntry(streamIterator *si, streamID *current);
+void streamBatchInit(streamBatch *batch);
+void streamBatchFree(streamBatch *batch);
+size_t streamIteratorGetBatch(streamIterator *si, streamBatch *batch, size_t max);
 void streamIteratorStop(streamIterator *si);
 streamCG *streamLookupCG(stream *s, sds groupname);
 streamConsumer *streamLookupConsumer(streamCG *cg, sds name, int flags);
 streamConsumer *streamCreateConsumer(streamCG *cg, sds name, robj *key, int dbid, int flags);
 streamCG *streamCreateCG(stream *s, char *name, size_t namelen, streamID *id, long long entries_read);
-streamNACK *streamCreateNACK(streamConsumer *consumer);
+void streamEncodeID(void *buf, streamID *id);
 void streamDecodeID(void *buf, streamID *id);
 int streamCompareID(streamID *a, streamID *b);
-void streamFreeNACK(streamNACK *na);
 int streamIncrID(streamID *id);
 int streamDecrID(streamID *id);
 void streamPropagateConsumerCreation(client *c, robj *key, robj *groupname, sds consumername);
@@ -146,5 +261,17 @@ void streamGetEdgeID(stream *s, int first, int skip_tombstones, streamID *edge_i
 long long streamEstimateDistanceFromFirstEverEntry(stream *s, streamID *id);
 int64_t streamTrimByLength(stream *s, long long maxlen, int approx);
 int64_t streamTrimByID(stream *s, streamID minid, int approx);
+void streamSpillNodes(stream *s);
+unsigned char *streamNodeAcquire(void *node);
+void streamNodeRelease(void *node);
+void streamSpillCacheClear(void);
+size_t streamSpillCacheMemory(void);
+int streamPelLookup(streamCG *cg, streamID *id, streamNACK *nack);
+int streamPelInsert(streamCG *cg, streamNACK *nack);
+void streamPelUpdate(streamCG *cg, streamNACK *nack);
+int streamPelDelete(streamCG *cg, streamID *id, streamNACK *nack);
+void streamPelIteratorStart(streamPelIterator *it, streamCG *cg, streamID *start);
+int streamPelIteratorNext(streamPelIterator *it, streamNACK *nack);
+void streamPelIteratorStop(streamPelIterator *it);
 
 #endif
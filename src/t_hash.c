@@ -799,7 +799,7 @@ void hstrlenCommand(client *c) {
     addReplyLongLong(c,hashTypeGetValueLength(o,c->argv[2]->ptr));
 }
 
-static void addHashIteratorCursorToReply(client *c, hashTypeIterator *hi, int what) {
+static void addHashIteratorCursorToReply(replyWriter *w, hashTypeIterator *hi, int what) {
     if (hi->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *vstr = NULL;
         unsigned int vlen = UINT_MAX;
@@ -807,12 +807,12 @@ static void addHashIteratorCursorToReply(client *c, hashTypeIterator *hi, int wh
 
         hashTypeCurrentFromListpack(hi, what, &vstr, &vlen, &vll);
         if (vstr)
-            addReplyBulkCBuffer(c, vstr, vlen);
+            replyWriterBulkCBuffer(w, vstr, vlen);
         else
-            addReplyBulkLongLong(c, vll);
+            replyWriterBulkLongLong(w, vll);
     } else if (hi->encoding == OBJ_ENCODING_HT) {
         sds value = hashTypeCurrentFromHashTable(hi, what);
-        addReplyBulkCBuffer(c, value, sdslen(value));
+        replyWriterBulkCBuffer(w, value, sdslen(value));
     } else {
         serverPanic("Unknown hash encoding");
     }
@@ -837,19 +837,22 @@ void genericHgetallCommand(client *c, int flags) {
         addReplyArrayLen(c, length);
     }
 
+    replyWriter w;
+    replyWriterStart(&w, c);
     hi = hashTypeInitIterator(o);
     while (hashTypeNext(hi) != C_ERR) {
         if (flags & OBJ_HASH_KEY) {
-            addHashIteratorCursorToReply(c, hi, OBJ_HASH_KEY);
+            addHashIteratorCursorToReply(&w, hi, OBJ_HASH_KEY);
             count++;
         }
         if (flags & OBJ_HASH_VALUE) {
-            addHashIteratorCursorToReply(c, hi, OBJ_HASH_VALUE);
+            addHashIteratorCursorToReply(&w, hi, OBJ_HASH_VALUE);
             count++;
         }
     }
 
     hashTypeReleaseIterator(hi);
+    replyWriterEnd(&w);
 
     /* Make sure we returned the right number of elements. */
     if (flags & OBJ_HASH_KEY && flags & OBJ_HASH_VALUE) count /= 2;
@@ -989,13 +992,16 @@ void hrandfieldWithCountCommand(client *c, long l, int withvalues) {
     * elements inside the hash: simply return the whole hash. */
     if(count >= size) {
         hashTypeIterator *hi = hashTypeInitIterator(hash);
+        replyWriter w;
+        replyWriterStart(&w, c);
         while (hashTypeNext(hi) != C_ERR) {
             if (withvalues && c->resp > 2)
-                addReplyArrayLen(c,2);
-            addHashIteratorCursorToReply(c, hi, OBJ_HASH_KEY);
+                replyWriterArrayLen(&w,2);
+            addHashIteratorCursorToReply(&w, hi, OBJ_HASH_KEY);
             if (withvalues)
-                addHashIteratorCursorToReply(c, hi, OBJ_HASH_VALUE);
+                addHashIteratorCursorToReply(&w, hi, OBJ_HASH_VALUE);
         }
+        replyWriterEnd(&w);
         hashTypeReleaseIterator(hi);
         return;
     }
@@ -231,10 +231,93 @@ int listTypeDelRange(robj *subject, long start, long count) {
  * List Commands
  *----------------------------------------------------------------------------*/
 
+/* A pushed element handed by listHandoffPush() to a blocked client. */
+typedef struct listHandoff {
+    client *receiver;
+    robj *value;
+    int wherefrom;
+} listHandoff;
+
+/* When elements are pushed to a missing key with clients blocked by BLPOP
+ * or BRPOP on it, hand them directly to the clients, in the order they
+ * blocked and with the element each one would pop, instead of creating the
+ * list and serving the clients later via handleClientsBlockedOnKeys().
+ * The pushed elements are c->argv[*first] to c->argv[*last], that are
+ * updated to the ones left to push. The function stops at the first
+ * client blocked for the list by another command (BLMPOP, BLMOVE), that
+ * will be served as usual after the remaining elements are pushed.
+ *
+ * This is done only for commands called directly by clients: in MULTI/EXEC
+ * and scripts the clients can be served only after all the commands of the
+ * transaction were executed.
+ *
+ * Returns the number of elements handed, and the handoffs in '*handoffs',
+ * allocated by the function when needed, that the caller must complete
+ * calling listHandoffServe() after the push was notified. */
+static int listHandoffPush(client *c, int where, int *first, int *last, listHandoff **handoffs) {
+    int handed = 0;
+
+    if (!server.blocked_clients_by_type[BLOCKED_LIST] ||
+        server.in_nested_call != 1 ||
+        c->flags & (CLIENT_MODULE|CLIENT_MASTER)) return 0;
+
+    list *clients = dictFetchValue(c->db->blocking_keys,c->argv[1]);
+    if (clients == NULL) return 0;
+
+    listNode *ln;
+    listIter li;
+    listRewind(clients,&li);
+    while(*first <= *last && (ln = listNext(&li))) {
+        client *receiver = listNodeValue(ln);
+        if (receiver->btype != BLOCKED_LIST) continue;
+        if (receiver->bpop.target != NULL ||
+            (receiver->lastcmd->proc != blpopCommand &&
+             receiver->lastcmd->proc != brpopCommand)) break;
+
+        /* The head of the list is the last element pushed by LPUSH, and
+         * the first one pushed by RPUSH. */
+        int wherefrom = receiver->bpop.blockpos.wherefrom;
+        int head = (wherefrom == LIST_HEAD) == (where == LIST_TAIL);
+        if (*handoffs == NULL)
+            *handoffs = zmalloc(sizeof(listHandoff)*(*last-*first+1));
+        (*handoffs)[handed].receiver = receiver;
+        (*handoffs)[handed].value = c->argv[head ? (*first)++ : (*last)--];
+        (*handoffs)[handed].wherefrom = wherefrom;
+        handed++;
+    }
+    return handed;
+}
+
+/* Reply to the clients the elements were handed to by listHandoffPush(),
+ * and unblock them. */
+static void listHandoffServe(client *c, listHandoff *handoffs, int handed) {
+    for (int j = 0; j < handed; j++) {
+        client *receiver = handoffs[j].receiver;
+        int wherefrom = handoffs[j].wherefrom;
+
+        trackingFlushPendingInvalidations(receiver);
+        client *old_client = server.current_client;
+        server.current_client = receiver;
+        monotime replyTimer;
+        elapsedStart(&replyTimer);
+        addReplyArrayLen(receiver,2);
+        addReplyBulk(receiver,c->argv[1]);
+        addReplyBulk(receiver,handoffs[j].value);
+
+        /* Notify event. */
+        char *event = (wherefrom == LIST_HEAD) ? "lpop" : "rpop";
+        notifyKeyspaceEvent(NOTIFY_LIST,event,c->argv[1],c->db->id);
+        updateStatsOnUnblock(receiver, 0, elapsedUs(replyTimer), 0);
+        unblockClient(receiver);
+        server.current_client = old_client;
+    }
+}
+
 /* Implements LPUSH/RPUSH/LPUSHX/RPUSHX. 
  * 'xx': push if key exists. */
 void pushGenericCommand(client *c, int where, int xx) {
-    int j;
+    int j, first = 2, last = c->argc-1, handed = 0;
+    listHandoff *handoffs = NULL;
 
     robj *lobj = lookupKeyWrite(c->db, c->argv[1]);
     if (checkType(c,lobj,OBJ_LIST)) return;
@@ -244,22 +327,47 @@ void pushGenericCommand(client *c, int where, int xx) {
             return;
         }
 
-        lobj = createQuicklistObject();
-        quicklistSetOptions(lobj->ptr, server.list_max_listpack_size,
-                            server.list_compress_depth);
-        dbAdd(c->db,c->argv[1],lobj);
+        /* Hand the elements to the clients blocked for the key, if any. */
+        handed = listHandoffPush(c,where,&first,&last,&handoffs);
+        if (first <= last || !handed) {
+            lobj = createQuicklistObject();
+            quicklistSetOptions(lobj->ptr, server.list_max_listpack_size,
+                                server.list_compress_depth);
+            dbAdd(c->db,c->argv[1],lobj);
+        } else {
+            notifyKeyspaceEvent(NOTIFY_NEW,"new",c->argv[1],c->db->id);
+        }
     }
 
-    for (j = 2; j < c->argc; j++) {
+    for (j = first; j <= last; j++)
         listTypePush(lobj,c->argv[j],where);
-        server.dirty++;
-    }
+    server.dirty += c->argc-2;
 
-    addReplyLongLong(c, listTypeLength(lobj));
+    addReplyLongLong(c, handed + (lobj ? listTypeLength(lobj) : 0));
 
     char *event = (where == LIST_HEAD) ? "lpush" : "rpush";
     signalModifiedKey(c,c->db,c->argv[1]);
     notifyKeyspaceEvent(NOTIFY_LIST,event,c->argv[1],c->db->id);
+
+    if (handed) {
+        listHandoffServe(c,handoffs,handed);
+        if (first > last) {
+            /* Every element was handed: the key was never created, and
+             * there is nothing to propagate. */
+            notifyKeyspaceEvent(NOTIFY_GENERIC,"del",c->argv[1],c->db->id);
+            preventCommandPropagation(c);
+        } else {
+            /* Propagate the push of the elements left. */
+            int argc = last-first+3;
+            robj **argv = zmalloc(sizeof(robj*)*argc);
+            argv[0] = c->argv[0];
+            argv[1] = c->argv[1];
+            for (j = first; j <= last; j++) argv[j-first+2] = c->argv[j];
+            for (j = 0; j < argc; j++) incrRefCount(argv[j]);
+            replaceClientCommandVector(c,argc,argv);
+        }
+    }
+    zfree(handoffs);
 }
 
 /* LPUSH <key> <element> [<element> ...] */
@@ -445,17 +553,20 @@ void addListRangeReply(client *c, robj *o, long start, long end, int reverse) {
         int from = reverse ? end : start;
         int direction = reverse ? LIST_HEAD : LIST_TAIL;
         listTypeIterator *iter = listTypeInitIterator(o,from,direction);
+        replyWriter w;
 
+        replyWriterStart(&w,c);
         while(rangelen--) {
             listTypeEntry entry;
             serverAssert(listTypeNext(iter, &entry)); /* fail on corrupt data */
             quicklistEntry *qe = &entry.entry;
             if (qe->value) {
-                addReplyBulkCBuffer(c,qe->value,qe->sz);
+                replyWriterBulkCBuffer(&w,qe->value,qe->sz);
             } else {
-                addReplyBulkLongLong(c,qe->longval);
+                replyWriterBulkLongLong(&w,qe->longval);
             }
         }
+        replyWriterEnd(&w);
         listTypeReleaseIterator(iter);
     } else {
         serverPanic("Unknown list encoding");
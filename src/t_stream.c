@@ -53,9 +53,19 @@
  * will return NULL. */
 #define STREAM_LISTPACK_MAX_SIZE (1<<30)
 
+/* Consumer group PEL blocks: see the streamPEL structure for the layout. */
+#define STREAM_PEL_BLOCK_MAX_ENTRIES 64
+#define STREAM_PEL_HEADER_FIELDS 2  /* Master ms, min delivery time. */
+#define STREAM_PEL_ENTRY_FIELDS 5   /* ms delta, seq, delivery time delta,
+                                       delivery count, consumer ID. */
+#define STREAM_PEL_IDLE_KEY_LEN (sizeof(uint64_t)+sizeof(streamID))
+
 void streamFreeCG(streamCG *cg);
-void streamFreeNACK(streamNACK *na);
-size_t streamReplyWithRangeFromConsumerPEL(client *c, stream *s, streamID *start, streamID *end, size_t count, streamConsumer *consumer);
+static void streamFreeNode(void *node);
+static int streamFreeSpilledNode(streamSpilledNode *sn);
+static int streamSegmentRead(streamSegment *seg, off_t offset, unsigned char *buf, size_t bytes);
+static int streamSpillNode(stream *s, raxIterator *ri);
+size_t streamReplyWithRangeFromConsumerPEL(client *c, stream *s, streamID *start, streamID *end, size_t count, streamCG *group, streamConsumer *consumer);
 int streamParseStrictIDOrReply(client *c, robj *o, streamID *id, uint64_t missing_seq, int *seq_given);
 int streamParseIDOrReply(client *c, robj *o, streamID *id, uint64_t missing_seq);
 
@@ -76,12 +86,15 @@ stream *streamNew(void) {
     s->max_deleted_entry_id.ms = 0;
     s->entries_added = 0;
     s->cgroups = NULL; /* Created on demand to save memory when not used. */
+    s->spill = NULL;
     return s;
 }
 
-/* Free a stream, including the listpacks stored inside the radix tree. */
+/* Free a stream, including the listpacks stored inside the radix tree, and
+ * the nodes spilled to disk. */
 void freeStream(stream *s) {
-    raxFreeWithCallback(s->rax,(void(*)(void*))lpFree);
+    raxFreeWithCallback(s->rax,streamFreeNode);
+    zfree(s->spill);
     if (s->cgroups)
         raxFreeWithCallback(s->cgroups,(void(*)(void*))streamFreeCG);
     zfree(s);
@@ -152,7 +165,8 @@ void streamNextID(streamID *last_id, streamID *new_id) {
  * Duplicate a Stream object, with the guarantee that the returned object
  * has the same encoding as the original one.
  *
- * The resulting object always has refcount set to 1 */
+ * The resulting object always has refcount set to 1. NULL is returned if a
+ * node spilled to disk could not be read. */
 robj *streamDup(robj *o) {
     robj *sobj;
 
@@ -178,16 +192,48 @@ robj *streamDup(robj *o) {
     raxSeek(&ri, "^", NULL, 0);
     size_t lp_bytes = 0;      /* Total bytes in the listpack. */
     unsigned char *lp = NULL; /* listpack pointer. */
+    uint64_t unspilled = 0;   /* Spilled nodes copied in memory. */
     /* Get a reference to the listpack node. */
     while (raxNext(&ri)) {
+        void *new_node;
+        memcpy(rax_key, ri.key, sizeof(rax_key));
+        if (STREAM_NODE_IS_SPILLED(ri.data)) {
+            /* The spilled nodes are copied to segments of the new stream,
+             * so that each stream owns its segments and the disk space they
+             * use is accounted once, whatever stream is freed first. */
+            streamSpilledNode *sn = STREAM_SPILLED_NODE(ri.data);
+            new_node = zmalloc(sn->bytes);
+            if (sn->lp) {
+                memcpy(new_node, sn->lp, sn->bytes);
+            } else if (streamSegmentRead(sn->segment, sn->offset, new_node,
+                                         sn->bytes) == C_ERR)
+            {
+                zfree(new_node);
+                raxStop(&ri);
+                decrRefCount(sobj);
+                return NULL;
+            }
+            raxInsert(new_s->rax, (unsigned char *)&rax_key, sizeof(rax_key),
+                      new_node, NULL);
+
+            raxIterator new_ri;
+            raxStart(&new_ri, new_s->rax);
+            raxSeek(&new_ri, "=", (unsigned char *)&rax_key, sizeof(rax_key));
+            raxNext(&new_ri);
+            /* On error the node just stays in memory. */
+            if (streamSpillNode(new_s, &new_ri) == C_ERR) unspilled++;
+            raxStop(&new_ri);
+            continue;
+        }
         lp = ri.data;
         lp_bytes = lpBytes(lp);
-        unsigned char *new_lp = zmalloc(lp_bytes);
-        memcpy(new_lp, lp, lp_bytes);
-        memcpy(rax_key, ri.key, sizeof(rax_key));
+        new_node = zmalloc(lp_bytes);
+        memcpy(new_node, lp, lp_bytes);
         raxInsert(new_s->rax, (unsigned char *)&rax_key, sizeof(rax_key),
-                  new_lp, NULL);
+                  new_node, NULL);
     }
+    if (new_s->spill)
+        new_s->spill->loaded = (s->spill ? s->spill->loaded : 0) + unspilled;
     new_s->length = s->length;
     new_s->first_id = s->first_id;
     new_s->last_id = s->last_id;
@@ -209,18 +255,26 @@ robj *streamDup(robj *o) {
 
         serverAssert(new_cg != NULL);
 
-        /* Consumer Group PEL */
+        /* Consumer Group PEL: the blocks can be copied as they are, since
+         * the consumers keep their IDs in the new group. */
         raxIterator ri_cg_pel;
-        raxStart(&ri_cg_pel,cg->pel);
+        raxStart(&ri_cg_pel,cg->pel.blocks);
         raxSeek(&ri_cg_pel,"^",NULL,0);
-        while(raxNext(&ri_cg_pel)){
-            streamNACK *nack = ri_cg_pel.data;
-            streamNACK *new_nack = streamCreateNACK(NULL);
-            new_nack->delivery_time = nack->delivery_time;
-            new_nack->delivery_count = nack->delivery_count;
-            raxInsert(new_cg->pel, ri_cg_pel.key, sizeof(streamID), new_nack, NULL);
+        while(raxNext(&ri_cg_pel)) {
+            unsigned char *lp = ri_cg_pel.data;
+            size_t lp_bytes = lpBytes(lp);
+            unsigned char *new_lp = zmalloc(lp_bytes);
+            memcpy(new_lp, lp, lp_bytes);
+            raxInsert(new_cg->pel.blocks, ri_cg_pel.key, sizeof(streamID),
+                      new_lp, NULL);
         }
         raxStop(&ri_cg_pel);
+        raxStart(&ri_cg_pel,cg->pel.idle);
+        raxSeek(&ri_cg_pel,"^",NULL,0);
+        while(raxNext(&ri_cg_pel))
+            raxInsert(new_cg->pel.idle, ri_cg_pel.key, ri_cg_pel.key_len, NULL, NULL);
+        raxStop(&ri_cg_pel);
+        new_cg->pel.size = cg->pel.size;
 
         /* Consumers */
         raxIterator ri_consumers;
@@ -231,25 +285,24 @@ robj *streamDup(robj *o) {
             streamConsumer *new_consumer;
             new_consumer = zmalloc(sizeof(*new_consumer));
             new_consumer->name = sdsdup(consumer->name);
+            new_consumer->id = consumer->id;
             new_consumer->pel = raxNew();
             raxInsert(new_cg->consumers,(unsigned char *)new_consumer->name,
                         sdslen(new_consumer->name), new_consumer, NULL);
+            uint64_t idkey = htonu64(new_consumer->id);
+            raxInsert(new_cg->consumers_by_id,(unsigned char *)&idkey,
+                      sizeof(idkey), new_consumer, NULL);
             new_consumer->seen_time = consumer->seen_time;
 
             /* Consumer PEL */
             raxIterator ri_cpel;
             raxStart(&ri_cpel, consumer->pel);
             raxSeek(&ri_cpel, "^", NULL, 0);
-            while (raxNext(&ri_cpel)) {
-                streamNACK *new_nack = raxFind(new_cg->pel,ri_cpel.key,sizeof(streamID));
-
-                serverAssert(new_nack != raxNotFound);
-
-                new_nack->consumer = new_consumer;
-                raxInsert(new_consumer->pel,ri_cpel.key,sizeof(streamID),new_nack,NULL);
-            }
+            while (raxNext(&ri_cpel))
+                raxInsert(new_consumer->pel,ri_cpel.key,sizeof(streamID),NULL,NULL);
             raxStop(&ri_cpel);
         }
+        new_cg->last_consumer_id = cg->last_consumer_id;
         raxStop(&ri_consumers);
     }
     raxStop(&ri_cgroups);
@@ -401,7 +454,335 @@ void streamGetEdgeID(stream *s, int first, int skip_tombstones, streamID *edge_i
         streamID min_id = {0, 0}, max_id = {UINT64_MAX, UINT64_MAX};
         *edge_id = first ? max_id : min_id;
     }
+    streamIteratorStop(&si);
+}
+
+/* -----------------------------------------------------------------------
+ * Stream nodes spilled to disk
+ *
+ * Streams used as logs may retain a lot of history, of which only the most
+ * recent part is read. When stream-spill-after-nodes is set, the nodes of a
+ * stream but the most recent ones are appended to a segment file, and their
+ * listpack is replaced in the radix tree by a streamSpilledNode referencing
+ * its location. Reading such a node loads it back in a small LRU cache of
+ * listpacks shared by all the streams, while modifying it brings it back in
+ * memory for good.
+ * ----------------------------------------------------------------------- */
+
+/* Segments are not appended to anymore once they reach this size, so that
+ * the disk space is released in chunks while the stream is trimmed. */
+#define STREAM_SEGMENT_MAX_BYTES (64*1024*1024)
+
+static list *stream_spill_cache = NULL; /* Loaded nodes, most recent first. */
+static size_t stream_spill_cache_bytes = 0;
+
+/* Create a new segment file in the working directory. The file is unlinked
+ * right away: it only lives as long as its file descriptor. Returns NULL
+ * on error, or if stream-spill-max-segments segments are already open: the
+ * file descriptors they use are reserved by adjustOpenFilesLimit(), so that
+ * spilling never takes the ones of the clients or of the persistence. */
+static streamSegment *streamSegmentCreate(void) {
+    long long segments;
+    atomicGet(server.stream_segments,segments);
+    if (segments >= server.stream_spill_max_segments) {
+        errno = EMFILE;
+        return NULL;
+    }
+
+    char path[] = "temp-stream-segment-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1) return NULL;
+    unlink(path);
+    streamSegment *seg = zmalloc(sizeof(*seg));
+    seg->fd = fd;
+    seg->size = 0;
+    seg->nodes = 0;
+    atomicIncr(server.stream_segments,1);
+    return seg;
+}
+
+/* Close a segment, releasing its disk space. This may be called by the
+ * lazyfree threads as well. */
+static void streamSegmentClose(streamSegment *seg) {
+    close(seg->fd);
+    atomicDecr(server.stream_segments,1);
+    atomicDecr(server.stream_segments_bytes,seg->size);
+    zfree(seg);
+}
+
+/* Evict from the cache a loaded node, that must not be in use. */
+static void streamSpillCacheRemove(streamSpilledNode *sn) {
+    serverAssert(sn->pins == 0);
+    listDelNode(stream_spill_cache,sn->cache_node);
+    stream_spill_cache_bytes -= sn->bytes;
+    lpFree(sn->lp);
+    sn->lp = NULL;
+    sn->cache_node = NULL;
+}
+
+/* Evict the least recently used nodes not in use, until the cache is back
+ * to stream-spill-cache-nodes nodes. */
+static void streamSpillCacheTrim(void) {
+    listNode *ln = listLast(stream_spill_cache);
+    while (ln && listLength(stream_spill_cache) >
+                 (unsigned long)server.stream_spill_cache_nodes)
+    {
+        listNode *prev = listPrevNode(ln);
+        streamSpilledNode *sn = listNodeValue(ln);
+        if (sn->pins == 0) streamSpillCacheRemove(sn);
+        ln = prev;
+    }
+}
+
+/* Evict all the loaded nodes not in use. This is called before handing
+ * streams to the lazyfree threads, that must not touch the cache. */
+void streamSpillCacheClear(void) {
+    if (stream_spill_cache == NULL) return;
+    listIter li;
+    listNode *ln;
+    listRewind(stream_spill_cache,&li);
+    while ((ln = listNext(&li)) != NULL) {
+        streamSpilledNode *sn = listNodeValue(ln);
+        if (sn->pins == 0) streamSpillCacheRemove(sn);
+    }
+}
 
+/* Return the memory used by the listpacks loaded in the cache. */
+size_t streamSpillCacheMemory(void) {
+    return stream_spill_cache_bytes;
+}
+
+/* Read 'bytes' bytes at 'offset' of a segment into 'buf'. Returns C_ERR
+ * with errno set if the node could not be read, for instance because of a
+ * bad disk sector, in which case the error is logged. */
+static int streamSegmentRead(streamSegment *seg, off_t offset, unsigned char *buf, size_t bytes) {
+    static time_t last_log_time = 0;
+    size_t nread = 0;
+    while (nread < bytes) {
+        ssize_t n = pread(seg->fd,buf+nread,bytes-nread,offset+nread);
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR) continue;
+            if (n == 0) errno = EIO; /* Unexpected end of file. */
+            if (server.unixtime - last_log_time > 60) {
+                serverLog(LL_WARNING,
+                    "Error reading a stream node from its segment: %s",
+                    strerror(errno));
+                last_log_time = server.unixtime;
+            }
+            return C_ERR;
+        }
+        nread += n;
+    }
+    return C_OK;
+}
+
+/* Return the listpack of a stream node, that is the value of its radix tree
+ * key, loading it from its segment if the node was spilled to disk. Every
+ * call must be paired with a streamNodeRelease() call, once the listpack is
+ * not used anymore, since in the meantime it is not evicted from the cache.
+ * The listpack must not be modified: see streamLoadSpilledNode().
+ *
+ * NULL is returned, with errno set, if the node could not be read from
+ * disk. In this case streamNodeRelease() must not be called. */
+unsigned char *streamNodeAcquire(void *node) {
+    if (!STREAM_NODE_IS_SPILLED(node)) return node;
+    streamSpilledNode *sn = STREAM_SPILLED_NODE(node);
+
+    if (stream_spill_cache == NULL) stream_spill_cache = listCreate();
+    if (sn->lp) {
+        listDelNode(stream_spill_cache,sn->cache_node);
+    } else {
+        unsigned char *lp = zmalloc(sn->bytes);
+        if (streamSegmentRead(sn->segment,sn->offset,lp,sn->bytes) == C_ERR) {
+            zfree(lp);
+            return NULL;
+        }
+        sn->lp = lp;
+        stream_spill_cache_bytes += sn->bytes;
+        server.stat_stream_node_faults++;
+    }
+    listAddNodeHead(stream_spill_cache,sn);
+    sn->cache_node = listFirst(stream_spill_cache);
+    sn->pins++;
+    streamSpillCacheTrim();
+    return sn->lp;
+}
+
+/* Release a listpack obtained with streamNodeAcquire(). */
+void streamNodeRelease(void *node) {
+    if (!STREAM_NODE_IS_SPILLED(node)) return;
+    streamSpilledNode *sn = STREAM_SPILLED_NODE(node);
+    serverAssert(sn->pins > 0);
+    sn->pins--;
+    streamSpillCacheTrim();
+}
+
+/* Free a spilled node, closing its segment if it was the last node stored
+ * there. Returns 1 if the segment was closed, 0 otherwise. */
+static int streamFreeSpilledNode(streamSpilledNode *sn) {
+    streamSegment *seg = sn->segment;
+    int closed = 0;
+
+    if (sn->lp) streamSpillCacheRemove(sn);
+    if (--seg->nodes == 0) {
+        streamSegmentClose(seg);
+        closed = 1;
+    }
+    atomicDecr(server.stream_spilled_nodes,1);
+    zfree(sn);
+    return closed;
+}
+
+/* Free the value of a stream radix tree key, whether the node is in memory
+ * or spilled to disk. */
+static void streamFreeNode(void *node) {
+    if (STREAM_NODE_IS_SPILLED(node))
+        streamFreeSpilledNode(STREAM_SPILLED_NODE(node));
+    else
+        lpFree(node);
+}
+
+/* Remove from the stream bookkeeping the spilled node 'ri' points to,
+ * freeing it. The caller removes or replaces the radix tree key. */
+static void streamDropSpilledNode(stream *s, raxIterator *ri) {
+    streamSpilledNode *sn = STREAM_SPILLED_NODE(ri->data);
+    streamSegment *seg = sn->segment;
+    if (streamFreeSpilledNode(sn) && s->spill->segment == seg)
+        s->spill->segment = NULL;
+    s->spill->nodes--;
+}
+
+/* Load back in memory the spilled node 'ri' points to, because it is going
+ * to be modified. The node is not spilled anymore: its listpack, that is
+ * returned, is set as the value of its key. Returns NULL if the node could
+ * not be read from disk, in which case it is left as it is. */
+static unsigned char *streamLoadSpilledNode(stream *s, raxIterator *ri) {
+    streamSpilledNode *sn = STREAM_SPILLED_NODE(ri->data);
+    unsigned char *lp = streamNodeAcquire(ri->data);
+    if (lp == NULL) return NULL;
+
+    /* Take the listpack away from the cache before freeing the node. */
+    sn->pins--;
+    listDelNode(stream_spill_cache,sn->cache_node);
+    stream_spill_cache_bytes -= sn->bytes;
+    sn->lp = NULL;
+    sn->cache_node = NULL;
+    serverAssert(sn->pins == 0);
+
+    streamDropSpilledNode(s,ri);
+    s->spill->loaded++;
+    raxSetData(ri->node,ri->data = lp);
+    return lp;
+}
+
+/* Write the listpack of the node 'ri' points to at the end of the segment
+ * of the stream, replacing it with a spilled node. Returns C_ERR if the
+ * node could not be written, in which case it stays in memory. */
+static int streamSpillNode(stream *s, raxIterator *ri) {
+    static time_t last_log_time = 0;
+    unsigned char *lp = ri->data;
+    size_t bytes = lpBytes(lp);
+
+    if (s->spill == NULL) s->spill = zcalloc(sizeof(streamSpill));
+    streamSegment *seg = s->spill->segment;
+    if (seg && seg->size >= STREAM_SEGMENT_MAX_BYTES) seg = NULL;
+    if (seg == NULL && (seg = streamSegmentCreate()) == NULL) goto werr;
+
+    size_t nwritten = 0;
+    while (nwritten < bytes) {
+        ssize_t n = pwrite(seg->fd,lp+nwritten,bytes-nwritten,
+                           seg->size+nwritten);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            /* Don't leave a new segment open without nodes. */
+            if (seg->nodes == 0) streamSegmentClose(seg);
+            goto werr;
+        }
+        nwritten += n;
+    }
+
+    streamSpilledNode *sn = zmalloc(sizeof(*sn));
+    streamID master_id;
+    streamDecodeID(ri->key,&master_id);
+    sn->segment = seg;
+    sn->offset = seg->size;
+    sn->bytes = bytes;
+    sn->entries = lpGetInteger(lpFirst(lp));
+    lpGetEdgeStreamID(lp,0,&master_id,&sn->last_id);
+    sn->lp = NULL;
+    sn->cache_node = NULL;
+    sn->pins = 0;
+    seg->size += bytes;
+    seg->nodes++;
+    atomicIncr(server.stream_segments_bytes,bytes);
+    atomicIncr(server.stream_spilled_nodes,1);
+
+    s->spill->segment = seg;
+    s->spill->nodes++;
+    /* Nodes loaded back in memory may be spilled again: they are before
+     * the last node spilled. */
+    if (memcmp(ri->key,s->spill->last_key,sizeof(s->spill->last_key)) > 0)
+        memcpy(s->spill->last_key,ri->key,sizeof(s->spill->last_key));
+    raxSetData(ri->node,ri->data = (void*)((uintptr_t)sn|STREAM_NODE_SPILLED));
+    lpFree(lp);
+    return C_OK;
+
+werr:
+    if (server.unixtime - last_log_time > 60) {
+        long long segments;
+        atomicGet(server.stream_segments,segments);
+        if (seg == NULL && segments >= server.stream_spill_max_segments)
+            serverLog(LL_WARNING,"Unable to spill a stream node to disk: "
+                "stream-spill-max-segments segments are already open");
+        else
+            serverLog(LL_WARNING,"Unable to spill a stream node to disk: %s",
+                strerror(errno));
+        last_log_time = server.unixtime;
+    }
+    return C_ERR;
+}
+
+/* Spill to disk the oldest nodes of the stream, so that at most
+ * stream-spill-after-nodes nodes are left in memory. The nodes that were
+ * loaded back because modified are spilled again first. The last node is
+ * never spilled, since new entries are appended to it. Nothing is spilled
+ * when no segment file descriptors are reserved (stream-spill-max-segments
+ * is 0). This is called every time a node is added to the stream. */
+void streamSpillNodes(stream *s) {
+    uint64_t limit = server.stream_spill_after_nodes;
+    if (limit == 0 || server.stream_spill_max_segments == 0) return;
+    uint64_t spilled = s->spill ? s->spill->nodes : 0;
+    if (raxSize(s->rax) - spilled <= limit) return;
+
+    raxIterator ri;
+    uint64_t last_key[2];
+    raxStart(&ri,s->rax);
+    raxSeek(&ri,"$",NULL,0);
+    raxNext(&ri);
+    memcpy(last_key,ri.key,sizeof(last_key));
+    /* Nodes before the last one spilled are only visited when some were
+     * loaded back in memory. */
+    int rescan = s->spill && s->spill->loaded;
+    if (s->spill && s->spill->nodes && !rescan)
+        raxSeek(&ri,">",(unsigned char*)s->spill->last_key,
+                sizeof(s->spill->last_key));
+    else
+        raxSeek(&ri,"^",NULL,0);
+    while (raxSize(s->rax) - spilled > limit && raxNext(&ri)) {
+        if (memcmp(ri.key,last_key,sizeof(last_key)) == 0) break;
+        int loaded = rescan && memcmp(ri.key,s->spill->last_key,
+                                      sizeof(s->spill->last_key)) <= 0;
+        if (rescan && !loaded) {
+            /* All the nodes loaded back, if still there, were spilled. */
+            s->spill->loaded = 0;
+            rescan = 0;
+        }
+        if (STREAM_NODE_IS_SPILLED(ri.data)) continue;
+        if (streamSpillNode(s,&ri) == C_ERR) break;
+        if (loaded && s->spill->loaded) s->spill->loaded--;
+        spilled++;
+    }
+    raxStop(&ri);
 }
 
 /* Adds a new item into the stream 's' having the specified number of
@@ -479,8 +860,10 @@ int streamAppendItem(stream *s, robj **argv, int64_t numfields, streamID *added_
     size_t lp_bytes = 0;        /* Total bytes in the tail listpack. */
     unsigned char *lp = NULL;   /* Tail listpack pointer. */
 
-    if (!raxEOF(&ri)) {
-        /* Get a reference to the tail node listpack. */
+    if (!raxEOF(&ri) && !STREAM_NODE_IS_SPILLED(ri.data)) {
+        /* Get a reference to the tail node listpack. If the tail node was
+         * spilled to disk, which happens when the nodes after it are
+         * deleted, a new node is created instead. */
         lp = ri.data;
         lp_bytes = lpBytes(lp);
     }
@@ -548,6 +931,7 @@ int streamAppendItem(stream *s, robj **argv, int64_t numfields, streamID *added_
     }
 
     int flags = STREAM_ITEM_FLAG_NONE;
+    int new_node = lp == NULL;
     if (lp == NULL) {
         master_id = id;
         streamEncodeID(rax_key,&id);
@@ -661,6 +1045,9 @@ int streamAppendItem(stream *s, robj **argv, int64_t numfields, streamID *added_
     s->last_id = id;
     if (s->length == 1) s->first_id = id;
     if (added_id) *added_id = id;
+
+    /* The previous node is now sealed, and may be moved to disk. */
+    if (new_node) streamSpillNodes(s);
     return C_OK;
 }
 
@@ -730,8 +1117,12 @@ int64_t streamTrim(stream *s, streamAddTrimArgs *args) {
         if (trim_strategy == TRIM_STRATEGY_MAXLEN && s->length <= maxlen)
             break;
 
-        unsigned char *lp = ri.data, *p = lpFirst(lp);
-        int64_t entries = lpGetInteger(p);
+        /* Nodes spilled to disk are only loaded if trimmed partially. */
+        int spilled = STREAM_NODE_IS_SPILLED(ri.data);
+        streamSpilledNode *sn = spilled ? STREAM_SPILLED_NODE(ri.data) : NULL;
+        unsigned char *lp = spilled ? NULL : ri.data, *p = NULL;
+        int64_t entries = spilled ? (int64_t)sn->entries :
+                                    lpGetInteger(lpFirst(lp));
 
         /* Check if we exceeded the amount of work we could do */
         if (limit && (deleted + entries) > limit)
@@ -748,14 +1139,20 @@ int64_t streamTrim(stream *s, streamAddTrimArgs *args) {
 
             /* Read last ID. */
             streamID last_id;
-            lpGetEdgeStreamID(lp, 0, &master_id, &last_id);
+            if (spilled)
+                last_id = sn->last_id;
+            else
+                lpGetEdgeStreamID(lp, 0, &master_id, &last_id);
 
             /* We can remove the entire node id its last ID < 'id' */
             remove_node = streamCompareID(&last_id, id) < 0;
         }
 
         if (remove_node) {
-            lpFree(lp);
+            if (spilled)
+                streamDropSpilledNode(s,&ri);
+            else
+                lpFree(lp);
             raxRemove(s->rax,ri.key,ri.key_len,NULL);
             raxSeek(&ri,">=",ri.key,ri.key_len);
             s->length -= entries;
@@ -770,6 +1167,9 @@ int64_t streamTrim(stream *s, streamAddTrimArgs *args) {
         /* Now we have to trim entries from within 'lp' */
         int64_t deleted_from_lp = 0;
 
+        /* A node that can't be read from disk is left untouched. */
+        if (spilled && (lp = streamLoadSpilledNode(s,&ri)) == NULL) break;
+        p = lpFirst(lp);
         p = lpNext(lp, p); /* Skip deleted field. */
         p = lpNext(lp, p); /* Skip num-of-fields in the master entry. */
 
@@ -1092,10 +1492,61 @@ void streamIteratorStart(streamIterator *si, stream *s, streamID *start, streamI
         }
     }
     si->stream = s;
+    si->node = NULL;   /* No node acquired. */
     si->lp = NULL;     /* There is no current listpack right now. */
     si->lp_ele = NULL; /* Current listpack cursor. */
     si->rev = rev;     /* Direction, if non-zero reversed, from end to start. */
     si->skip_tombstones = 1;    /* By default tombstones aren't emitted. */
+    si->error = 0;     /* No node failed to be read from disk. */
+}
+
+/* Move the iterator to the next radix tree node, or to the previous one
+ * when iterating in reverse, releasing the current node if any. The
+ * listpack cursor is set to the lp-count of the master entry when going
+ * forward, or to the lp-count of the last entry when going backward.
+ * Return 0 if there are no more nodes to iterate, otherwise 1. If a node
+ * spilled to disk can't be read, the iteration terminates, and si->error
+ * is set to the errno of the failure. */
+static int streamIteratorNextNode(streamIterator *si) {
+    if (si->node) {
+        streamNodeRelease(si->node);
+        si->node = NULL;
+        si->lp = NULL;
+    }
+    if (!si->rev && !raxNext(&si->ri)) return 0;
+    else if (si->rev && !raxPrev(&si->ri)) return 0;
+    serverAssert(si->ri.key_len == sizeof(streamID));
+    /* Get the master ID. */
+    streamDecodeID(si->ri.key,&si->master_id);
+    /* Get the master fields count. */
+    si->node = si->ri.data;
+    si->lp = streamNodeAcquire(si->node);
+    if (si->lp == NULL) {
+        si->error = errno;
+        si->node = NULL;
+        return 0;
+    }
+    si->lp_ele = lpFirst(si->lp);           /* Seek items count */
+    si->lp_ele = lpNext(si->lp,si->lp_ele); /* Seek deleted count. */
+    si->lp_ele = lpNext(si->lp,si->lp_ele); /* Seek num fields. */
+    si->master_fields_count = lpGetInteger(si->lp_ele);
+    si->lp_ele = lpNext(si->lp,si->lp_ele); /* Seek first field. */
+    si->master_fields_start = si->lp_ele;
+    /* We are now pointing to the first field of the master entry.
+     * We need to seek either the first or the last entry depending
+     * on the direction of the iteration. */
+    if (!si->rev) {
+        /* If we are iterating in normal order, skip the master fields
+         * to seek the first actual entry. */
+        for (uint64_t i = 0; i < si->master_fields_count; i++)
+            si->lp_ele = lpNext(si->lp,si->lp_ele);
+    } else {
+        /* If we are iterating in reverse direction, just seek the
+         * last part of the last entry in the listpack (that is, the
+         * fields count). */
+        si->lp_ele = lpLast(si->lp);
+    }
+    return 1;
 }
 
 /* Return 1 and store the current item ID at 'id' if there are still
@@ -1107,33 +1558,7 @@ int streamIteratorGetID(streamIterator *si, streamID *id, int64_t *numfields) {
          * iteration or the previous listpack was completely iterated.
          * Go to the next node. */
         if (si->lp == NULL || si->lp_ele == NULL) {
-            if (!si->rev && !raxNext(&si->ri)) return 0;
-            else if (si->rev && !raxPrev(&si->ri)) return 0;
-            serverAssert(si->ri.key_len == sizeof(streamID));
-            /* Get the master ID. */
-            streamDecodeID(si->ri.key,&si->master_id);
-            /* Get the master fields count. */
-            si->lp = si->ri.data;
-            si->lp_ele = lpFirst(si->lp);           /* Seek items count */
-            si->lp_ele = lpNext(si->lp,si->lp_ele); /* Seek deleted count. */
-            si->lp_ele = lpNext(si->lp,si->lp_ele); /* Seek num fields. */
-            si->master_fields_count = lpGetInteger(si->lp_ele);
-            si->lp_ele = lpNext(si->lp,si->lp_ele); /* Seek first field. */
-            si->master_fields_start = si->lp_ele;
-            /* We are now pointing to the first field of the master entry.
-             * We need to seek either the first or the last entry depending
-             * on the direction of the iteration. */
-            if (!si->rev) {
-                /* If we are iterating in normal order, skip the master fields
-                 * to seek the first actual entry. */
-                for (uint64_t i = 0; i < si->master_fields_count; i++)
-                    si->lp_ele = lpNext(si->lp,si->lp_ele);
-            } else {
-                /* If we are iterating in reverse direction, just seek the
-                 * last part of the last entry in the listpack (that is, the
-                 * fields count). */
-                si->lp_ele = lpLast(si->lp);
-            }
+            if (!streamIteratorNextNode(si)) return 0;
         } else if (si->rev) {
             /* If we are iterating in the reverse order, and this is not
              * the first entry emitted for this listpack, then we already
@@ -1259,6 +1684,149 @@ void streamIteratorGetField(streamIterator *si, unsigned char **fieldptr, unsign
     si->lp_ele = lpNext(si->lp,si->lp_ele);
 }
 
+/* Initialize a batch of entries to be filled by streamIteratorGetBatch(). */
+void streamBatchInit(streamBatch *batch) {
+    batch->entries = NULL;
+    batch->count = 0;
+    batch->entries_size = 0;
+    batch->spans = NULL;
+    batch->spans_size = 0;
+}
+
+/* Release the memory used by a batch of entries, that can be reused after
+ * calling streamBatchInit() again. */
+void streamBatchFree(streamBatch *batch) {
+    zfree(batch->entries);
+    zfree(batch->spans);
+}
+
+/* Make sure the batch has room for 'count' spans. */
+static void streamBatchReserveSpans(streamBatch *batch, size_t count) {
+    if (count <= batch->spans_size) return;
+    batch->spans_size = batch->spans_size ? batch->spans_size*2 : 64;
+    if (batch->spans_size < count) batch->spans_size = count;
+    batch->spans = zrealloc(batch->spans,
+                            sizeof(listpackEntry)*batch->spans_size);
+}
+
+/* Decode the integer listpack elements of the header of a stream entry. */
+static unsigned char *streamDecodeIntegers(unsigned char *lp, unsigned char *p, int64_t *ints, unsigned long count) {
+    listpackEntry buf[3];
+    serverAssert(count <= 3);
+    p = lpBatchDecode(lp,p,buf,count);
+    for (unsigned long j = 0; j < count; j++) {
+        serverAssert(buf[j].sval == NULL);
+        ints[j] = buf[j].lval;
+    }
+    return p;
+}
+
+/* Decode up to 'max' entries in range from the current node of a forward
+ * iterator into 'batch', decoding every listpack element of an entry in a
+ * single pass, instead of seeking and decoding each of them separately as
+ * streamIteratorGetID() and streamIteratorGetField() do. The entries
+ * returned all belong to the same node, so that the spans stay valid while
+ * the node is acquired by the iterator, and the function returns their
+ * number, or 0 when the iteration terminated.
+ *
+ * Since the iterator is left after the last entry returned, batches can be
+ * mixed with calls to streamIteratorGetID(), but not with
+ * streamIteratorRemoveEntry(). */
+size_t streamIteratorGetBatch(streamIterator *si, streamBatch *batch, size_t max) {
+    int64_t master_fields = -1; /* Span of the master fields, if decoded. */
+    size_t spans = 0;
+
+    serverAssert(!si->rev);
+    batch->count = 0;
+    if (batch->entries_size < max && batch->entries_size < 128) {
+        batch->entries_size = max < 128 ? max : 128;
+        batch->entries = zrealloc(batch->entries,
+                                  sizeof(streamBatchEntry)*batch->entries_size);
+    }
+
+    while(batch->count < max) {
+        if (si->lp == NULL || si->lp_ele == NULL) {
+            /* Entries of different nodes are never mixed. */
+            if (batch->count) break;
+            if (!streamIteratorNextNode(si)) break;
+            master_fields = -1;
+            spans = 0;
+        }
+
+        /* Skip the previous entry lp-count field (or in case of the master
+         * entry, the zero term field). */
+        unsigned char *p = lpNext(si->lp,si->lp_ele);
+        if (p == NULL) {
+            si->lp_ele = NULL;
+            continue;
+        }
+
+        /* Decode the flags and the ID, encoded as difference between the
+         * master ID and this entry ID, then the number of fields if the
+         * entry does not have the same fields of the master entry. */
+        int64_t hdr[3], numfields;
+        unsigned char buf[sizeof(streamID)];
+        streamID id;
+        p = streamDecodeIntegers(si->lp,p,hdr,3);
+        int64_t flags = hdr[0];
+        int samefields = flags & STREAM_ITEM_FLAG_SAMEFIELDS;
+        id.ms = si->master_id.ms + hdr[1];
+        id.seq = si->master_id.seq + hdr[2];
+        streamEncodeID(buf,&id);
+        if (samefields) {
+            numfields = si->master_fields_count;
+        } else {
+            p = streamDecodeIntegers(si->lp,p,&numfields,1);
+        }
+        serverAssert(numfields>=0);
+        size_t elements = samefields ? numfields : numfields*2;
+
+        if (memcmp(buf,si->start_key,sizeof(streamID)) < 0 ||
+            (si->skip_tombstones && (flags & STREAM_ITEM_FLAG_DELETED)))
+        {
+            /* Discard the entry, seeking its lp-count. */
+            for (size_t i = 0; i < elements; i++) p = lpNext(si->lp,p);
+            si->lp_ele = p;
+            continue;
+        }
+        /* Stop without consuming the entry if we are out of range, so that
+         * the next call will stop again. */
+        if (memcmp(buf,si->end_key,sizeof(streamID)) > 0) break;
+
+        if (samefields && master_fields == -1) {
+            streamBatchReserveSpans(batch,spans+si->master_fields_count);
+            lpBatchDecode(si->lp,si->master_fields_start,batch->spans+spans,
+                          si->master_fields_count);
+            master_fields = spans;
+            spans += si->master_fields_count;
+        }
+        streamBatchReserveSpans(batch,spans+elements);
+        p = lpBatchDecode(si->lp,p,batch->spans+spans,elements);
+        serverAssert(p != NULL); /* The lp-count is always there. */
+
+        if (batch->count == batch->entries_size) {
+            batch->entries_size *= 2;
+            batch->entries = zrealloc(batch->entries,
+                                      sizeof(streamBatchEntry)*batch->entries_size);
+        }
+        streamBatchEntry *e = batch->entries+batch->count++;
+        e->id = id;
+        e->numfields = numfields;
+        if (samefields) {
+            e->fields = master_fields;
+            e->values = spans;
+            e->stride = 1;
+        } else {
+            e->fields = spans;
+            e->values = spans+1;
+            e->stride = 2;
+        }
+        spans += elements;
+        si->lp_ele = p;
+    }
+    return batch->count;
+}
+
 /* Remove the current entry from the stream: can be called after the
  * GetID() API or after any GetField() call, however we need to iterate
  * a valid entry while calling this function. Moreover the function
@@ -1270,9 +1838,19 @@ void streamIteratorGetField(streamIterator *si, unsigned char **fieldptr, unsign
  * automatically re-seek to the next entry, so the caller should continue
  * with GetID(). */
 void streamIteratorRemoveEntry(streamIterator *si, streamID *current) {
-    unsigned char *lp = si->lp;
     int64_t aux;
 
+    /* A node spilled to disk is loaded back in memory to be modified. */
+    if (STREAM_NODE_IS_SPILLED(si->node)) {
+        streamNodeRelease(si->node);
+        /* Loaded in the cache by the iterator, so it can't fail. */
+        unsigned char *lp = streamLoadSpilledNode(si->stream,&si->ri);
+        serverAssert(lp != NULL);
+        si->lp_flags = lp + (si->lp_flags - si->lp);
+        si->node = si->lp = lp;
+    }
+    unsigned char *lp = si->lp;
+
     /* We do not really delete the entry here. Instead we mark it as
      * deleted by flagging it, and also incrementing the count of the
      * deleted entries in the listpack header.
@@ -1322,21 +1900,29 @@ void streamIteratorRemoveEntry(streamIterator *si, streamID *current) {
      * deleted and valid goes over a certain limit. */
 }
 
-/* Stop the stream iterator. The only cleanup we need is to free the rax
- * iterator, since the stream iterator itself is supposed to be stack
- * allocated. */
+/* Stop the stream iterator. The only cleanup we need is to release the
+ * current node and to free the rax iterator, since the stream iterator
+ * itself is supposed to be stack allocated. */
 void streamIteratorStop(streamIterator *si) {
+    if (si->node) streamNodeRelease(si->node);
     raxStop(&si->ri);
 }
 
-/* Return 1 if `id` exists in `s` (and not marked as deleted) */
+/* Return 1 if `id` exists in `s` (and not marked as deleted), 0 if it does
+ * not, or -1 with errno set if the node holding it could not be read from
+ * disk. */
 int streamEntryExists(stream *s, streamID *id) {
     streamIterator si;
     streamIteratorStart(&si,s,id,id,0);
     streamID myid;
     int64_t numfields;
     int found = streamIteratorGetID(&si,&myid,&numfields);
+    int error = si.error;
     streamIteratorStop(&si);
+    if (error) {
+        errno = error;
+        return -1;
+    }
     if (!found)
         return 0;
     serverAssert(streamCompareID(id,&myid) == 0);
@@ -1344,7 +1930,8 @@ int streamEntryExists(stream *s, streamID *id) {
 }
 
 /* Delete the specified item ID from the stream, returning 1 if the item
- * was deleted 0 otherwise (if it does not exist). */
+ * was deleted 0 otherwise (if it does not exist). -1 is returned, with errno
+ * set, if the node holding it could not be read from disk. */
 int streamDeleteItem(stream *s, streamID *id) {
     int deleted = 0;
     streamIterator si;
@@ -1354,20 +1941,32 @@ int streamDeleteItem(stream *s, streamID *id) {
     if (streamIteratorGetID(&si,&myid,&numfields)) {
         streamIteratorRemoveEntry(&si,&myid);
         deleted = 1;
+    } else if (si.error) {
+        deleted = -1;
     }
+    int error = si.error;
     streamIteratorStop(&si);
+    if (deleted == -1) errno = error;
     return deleted;
 }
 
-/* Get the last valid (non-tombstone) streamID of 's'. */
-void streamLastValidID(stream *s, streamID *maxid)
+/* Get the last valid (non-tombstone) streamID of 's'. Returns C_ERR, with
+ * errno set, if a node could not be read from disk, otherwise C_OK. */
+int streamLastValidID(stream *s, streamID *maxid)
 {
     streamIterator si;
     streamIteratorStart(&si,s,NULL,NULL,1);
     int64_t numfields;
-    if (!streamIteratorGetID(&si,maxid,&numfields) && s->length)
-        serverPanic("Corrupt stream, length is %llu, but no max id", (unsigned long long)s->length);
+    int found = streamIteratorGetID(&si,maxid,&numfields);
+    int error = si.error;
     streamIteratorStop(&si);
+    if (error) {
+        errno = error;
+        return C_ERR;
+    }
+    if (!found && s->length)
+        serverPanic("Corrupt stream, length is %llu, but no max id", (unsigned long long)s->length);
+    return C_OK;
 }
 
 /* Maximum size for a stream ID string. In theory 20*2+1 should be enough,
@@ -1377,11 +1976,20 @@ void streamLastValidID(stream *s, streamID *maxid)
  * allocator's 48 bytes bin. */
 #define STREAM_ID_STR_LEN 44
 
+/* Format the ID as "<ms>-<seq>" in 'buf', that must be at least
+ * STREAM_ID_STR_LEN bytes, and return the length of the string. */
+static size_t streamFormatID(char *buf, streamID *id) {
+    size_t len = ull2string(buf,STREAM_ID_STR_LEN,id->ms);
+    buf[len++] = '-';
+    len += ull2string(buf+len,STREAM_ID_STR_LEN-len,id->seq);
+    return len;
+}
+
 sds createStreamIDString(streamID *id) {
     /* Optimization: pre-allocate a big enough buffer to avoid reallocs. */
     sds str = sdsnewlen(SDS_NOINIT, STREAM_ID_STR_LEN);
-    sdssetlen(str, 0);
-    return sdscatfmt(str,"%U-%U", id->ms,id->seq);
+    sdssetlen(str, streamFormatID(str,id));
+    return str;
 }
 
 /* Emit a reply in the client output buffer by formatting a Stream ID
@@ -1619,6 +2227,65 @@ void streamPropagateConsumerCreation(client *c, robj *key, robj *groupname, sds
     decrRefCount(argv[4]);
 }
 
+/* Update the consumer group after the entry 'id' was emitted by
+ * streamReplyWithRange(): see points 1 to 4 in the description of the
+ * function below. 'propagate_last_id' is set if the group last ID should be
+ * propagated. */
+static void streamDeliverToGroup(client *c, stream *s, streamID *id, streamCG *group, streamConsumer *consumer, int noack, streamPropInfo *spi, int *propagate_last_id) {
+    /* Update the group last_id if needed. */
+    if (streamCompareID(id,&group->last_id) > 0) {
+        if (group->entries_read != SCG_INVALID_ENTRIES_READ && !streamRangeHasTombstones(s,id,NULL)) {
+            /* A valid counter and no future tombstones mean we can 
+             * increment the read counter to keep tracking the group's
+             * progress. */
+            group->entries_read++;
+        } else if (s->entries_added) {
+            /* The group's counter may be invalid, so we try to obtain it. */
+            group->entries_read = streamEstimateDistanceFromFirstEverEntry(s,id);
+        }
+        group->last_id = *id;
+        /* Group last ID should be propagated only if NOACK was
+         * specified, otherwise the last id will be included
+         * in the propagation of XCLAIM itself. */
+        if (noack) *propagate_last_id = 1;
+    }
+
+    /* If a group is passed, we need to create an entry in the
+     * PEL (pending entries list) of this group *and* this consumer.
+     *
+     * Note that we cannot be sure about the fact the message is not
+     * already owned by another consumer, because the admin is able
+     * to change the consumer group last delivered ID using the
+     * XGROUP SETID command. So if we find that there is already
+     * a NACK for the entry, we need to associate it to the new
+     * consumer. */
+    if (!noack) {
+        /* Try to add a new NACK. Most of the time this will work and
+         * will not require extra lookups. We'll fix the problem later
+         * if we find that there is already a entry for this ID. */
+        streamNACK nack = {*id, mstime(), 1, consumer};
+
+        /* If the entry was already busy, reassign the entry to the
+         * new consumer, or update it if the consumer is the same as
+         * before. */
+        if (!streamPelInsert(group,&nack))
+            streamPelUpdate(group,&nack);
+
+        /* Propagate as XCLAIM. */
+        if (spi) {
+            robj *idarg = createObjectFromStreamID(id);
+            streamPropagateXCLAIM(c,spi->keyname,group,spi->groupname,idarg,&nack);
+            decrRefCount(idarg);
+        }
+    }
+}
+
+/* Reply with the error of a stream node that could not be read from disk. */
+static void addReplyStreamReadError(client *c, int error) {
+    addReplyErrorFormat(c,"Error reading the stream entries from disk: %s",
+                        strerror(error));
+}
+
 /* Send the stream items in the specified range to the client 'c'. The range
  * the client will receive is between start and end inclusive, if 'count' is
  * non zero, no more than 'count' elements are sent.
@@ -1671,6 +2338,7 @@ void streamPropagateConsumerCreation(client *c, robj *key, robj *groupname, sds
 #define STREAM_RWR_RAWENTRIES (1<<1)    /* Do not emit protocol for array
                                            boundaries, just the entries. */
 #define STREAM_RWR_HISTORY (1<<2)       /* Only serve consumer local PEL. */
+#define STREAM_RWR_BATCH_ENTRIES 128    /* Max entries decoded at once. */
 size_t streamReplyWithRange(client *c, stream *s, streamID *start, streamID *end, size_t count, int rev, streamCG *group, streamConsumer *consumer, int flags, streamPropInfo *spi) {
     void *arraylen_ptr = NULL;
     size_t arraylen = 0;
@@ -1687,102 +2355,94 @@ size_t streamReplyWithRange(client *c, stream *s, streamID *start, streamID *end
      * as delivered. */
     if (group && (flags & STREAM_RWR_HISTORY)) {
         return streamReplyWithRangeFromConsumerPEL(c,s,start,end,count,
-                                                   consumer);
+                                                   group,consumer);
     }
 
     if (!(flags & STREAM_RWR_RAWENTRIES))
         arraylen_ptr = addReplyDeferredLen(c);
     streamIteratorStart(&si,s,start,end,rev);
-    while(streamIteratorGetID(&si,&id,&numfields)) {
-        /* Update the group last_id if needed. */
-        if (group && streamCompareID(&id,&group->last_id) > 0) {
-            if (group->entries_read != SCG_INVALID_ENTRIES_READ && !streamRangeHasTombstones(s,&id,NULL)) {
-                /* A valid counter and no future tombstones mean we can 
-                 * increment the read counter to keep tracking the group's
-                 * progress. */
-                group->entries_read++;
-            } else if (s->entries_added) {
-                /* The group's counter may be invalid, so we try to obtain it. */
-                group->entries_read = streamEstimateDistanceFromFirstEverEntry(s,&id);
-            }
-            group->last_id = id;
-            /* Group last ID should be propagated only if NOACK was
-             * specified, otherwise the last id will be included
-             * in the propagation of XCLAIM itself. */
-            if (noack) propagate_last_id = 1;
-        }
-
-        /* Emit a two elements array for each item. The first is
-         * the ID, the second is an array of field-value pairs. */
-        addReplyArrayLen(c,2);
-        addReplyStreamID(c,&id);
-
-        addReplyArrayLen(c,numfields*2);
-
-        /* Emit the field-value pairs. */
-        while(numfields--) {
-            unsigned char *key, *value;
-            int64_t key_len, value_len;
-            streamIteratorGetField(&si,&key,&value,&key_len,&value_len);
-            addReplyBulkCBuffer(c,key,key_len);
-            addReplyBulkCBuffer(c,value,value_len);
-        }
-
-        /* If a group is passed, we need to create an entry in the
-         * PEL (pending entries list) of this group *and* this consumer.
-         *
-         * Note that we cannot be sure about the fact the message is not
-         * already owned by another consumer, because the admin is able
-         * to change the consumer group last delivered ID using the
-         * XGROUP SETID command. So if we find that there is already
-         * a NACK for the entry, we need to associate it to the new
-         * consumer. */
-        if (group && !noack) {
-            unsigned char buf[sizeof(streamID)];
-            streamEncodeID(buf,&id);
-
-            /* Try to add a new NACK. Most of the time this will work and
-             * will not require extra lookups. We'll fix the problem later
-             * if we find that there is already a entry for this ID. */
-            streamNACK *nack = streamCreateNACK(consumer);
-            int group_inserted =
-                raxTryInsert(group->pel,buf,sizeof(buf),nack,NULL);
-            int consumer_inserted =
-                raxTryInsert(consumer->pel,buf,sizeof(buf),nack,NULL);
-
-            /* Now we can check if the entry was already busy, and
-             * in that case reassign the entry to the new consumer,
-             * or update it if the consumer is the same as before. */
-            if (group_inserted == 0) {
-                streamFreeNACK(nack);
-                nack = raxFind(group->pel,buf,sizeof(buf));
-                serverAssert(nack != raxNotFound);
-                raxRemove(nack->consumer->pel,buf,sizeof(buf),NULL);
-                /* Update the consumer and NACK metadata. */
-                nack->consumer = consumer;
-                nack->delivery_time = mstime();
-                nack->delivery_count = 1;
-                /* Add the entry in the new consumer local PEL. */
-                raxInsert(consumer->pel,buf,sizeof(buf),nack,NULL);
-            } else if (group_inserted == 1 && consumer_inserted == 0) {
-                serverPanic("NACK half-created. Should not be possible.");
-            }
+    if (!rev) {
+        /* Going forward the entries of every node are decoded in batches,
+         * and written directly to the client output buffers. */
+        streamBatch batch;
+        replyWriter w;
+        char buf[STREAM_ID_STR_LEN];
+
+        streamBatchInit(&batch);
+        replyWriterStart(&w,c);
+        while(!count || arraylen < count) {
+            size_t max = STREAM_RWR_BATCH_ENTRIES;
+            if (count && count-arraylen < max) max = count-arraylen;
+            if (!streamIteratorGetBatch(&si,&batch,max)) break;
+
+            for (size_t i = 0; i < batch.count; i++) {
+                streamBatchEntry *e = batch.entries+i;
+                listpackEntry *field = batch.spans+e->fields;
+                listpackEntry *value = batch.spans+e->values;
+
+                /* Emit a two elements array for each item. The first is
+                 * the ID, the second is an array of field-value pairs. */
+                replyWriterArrayLen(&w,2);
+                replyWriterBulkCBuffer(&w,buf,streamFormatID(buf,&e->id));
+                replyWriterArrayLen(&w,e->numfields*2);
+                for (int64_t j = 0; j < e->numfields; j++) {
+                    if (field->sval)
+                        replyWriterBulkCBuffer(&w,field->sval,field->slen);
+                    else
+                        replyWriterBulkLongLong(&w,field->lval);
+                    if (value->sval)
+                        replyWriterBulkCBuffer(&w,value->sval,value->slen);
+                    else
+                        replyWriterBulkLongLong(&w,value->lval);
+                    field += e->stride;
+                    value += e->stride;
+                }
 
-            /* Propagate as XCLAIM. */
-            if (spi) {
-                robj *idarg = createObjectFromStreamID(&id);
-                streamPropagateXCLAIM(c,spi->keyname,group,spi->groupname,idarg,nack);
-                decrRefCount(idarg);
+                if (group)
+                    streamDeliverToGroup(c,s,&e->id,group,consumer,noack,spi,
+                                         &propagate_last_id);
             }
+            arraylen += batch.count;
         }
+        replyWriterEnd(&w);
+        streamBatchFree(&batch);
+    } else {
+        while(streamIteratorGetID(&si,&id,&numfields)) {
+            /* Emit a two elements array for each item. The first is
+             * the ID, the second is an array of field-value pairs. */
+            addReplyArrayLen(c,2);
+            addReplyStreamID(c,&id);
 
-        arraylen++;
-        if (count && count == arraylen) break;
+            addReplyArrayLen(c,numfields*2);
+
+            /* Emit the field-value pairs. */
+            while(numfields--) {
+                unsigned char *key, *value;
+                int64_t key_len, value_len;
+                streamIteratorGetField(&si,&key,&value,&key_len,&value_len);
+                addReplyBulkCBuffer(c,key,key_len);
+                addReplyBulkCBuffer(c,value,value_len);
+            }
+
+            if (group)
+                streamDeliverToGroup(c,s,&id,group,consumer,noack,spi,
+                                     &propagate_last_id);
+
+            arraylen++;
+            if (count && count == arraylen) break;
+        }
     }
 
     if (spi && propagate_last_id)
         streamPropagateGroupID(c,spi->keyname,group,spi->groupname);
 
+    /* The entries that could not be read from disk are replaced by an
+     * error, counted as an entry, so the callers emit a valid reply. */
+    if (si.error) {
+        addReplyStreamReadError(c,si.error);
+        arraylen++;
+    }
+
     streamIteratorStop(&si);
     if (arraylen_ptr) setDeferredArrayLen(c,arraylen_ptr,arraylen);
     return arraylen;
@@ -1801,7 +2461,7 @@ size_t streamReplyWithRange(client *c, stream *s, streamID *start, streamID *end
  * seek into the radix tree of the messages in order to emit the full message
  * to the client. However clients only reach this code path when they are
  * fetching the history of already retrieved messages, which is rare. */
-size_t streamReplyWithRangeFromConsumerPEL(client *c, stream *s, streamID *start, streamID *end, size_t count, streamConsumer *consumer) {
+size_t streamReplyWithRangeFromConsumerPEL(client *c, stream *s, streamID *start, streamID *end, size_t count, streamCG *group, streamConsumer *consumer) {
     raxIterator ri;
     unsigned char startkey[sizeof(streamID)];
     unsigned char endkey[sizeof(streamID)];
@@ -1827,9 +2487,11 @@ size_t streamReplyWithRangeFromConsumerPEL(client *c, stream *s, streamID *start
             addReplyStreamID(c,&thisid);
             addReplyNullArray(c);
         } else {
-            streamNACK *nack = ri.data;
-            nack->delivery_time = mstime();
-            nack->delivery_count++;
+            streamNACK nack;
+            serverAssert(streamPelLookup(group,&thisid,&nack));
+            nack.delivery_time = mstime();
+            nack.delivery_count++;
+            streamPelUpdate(group,&nack);
         }
         arraylen++;
     }
@@ -2331,10 +2993,12 @@ void xreadCommand(client *c) {
             } else if (s->length) {
                 /* We also want to serve a consumer in a consumer group
                  * synchronously in case the group top item delivered is smaller
-                 * than what the stream has inside. */
+                 * than what the stream has inside. If the stream can't be
+                 * read from disk, serving it replies with the error. */
                 streamID maxid, *last = &groups[i]->last_id;
-                streamLastValidID(s, &maxid);
-                if (streamCompareID(&maxid, last) > 0) {
+                if (streamLastValidID(s, &maxid) == C_ERR ||
+                    streamCompareID(&maxid, last) > 0)
+                {
                     serve_synchronously = 1;
                     *gt = *last;
                 }
@@ -2343,8 +3007,9 @@ void xreadCommand(client *c) {
             /* For consumers without a group, we serve synchronously if we can
              * actually provide at least one item from the stream. */
             streamID maxid;
-            streamLastValidID(s, &maxid);
-            if (streamCompareID(&maxid, gt) > 0) {
+            if (streamLastValidID(s, &maxid) == C_ERR ||
+                streamCompareID(&maxid, gt) > 0)
+            {
                 serve_synchronously = 1;
             }
         }
@@ -2403,8 +3068,6 @@ void xreadCommand(client *c) {
             addReplyNullArray(c);
             goto cleanup;
         }
-        blockForKeys(c, BLOCKED_STREAM, c->argv+streams_arg, streams_count,
-                     -1, timeout, NULL, NULL, ids);
         /* If no COUNT is given and we block, set a relatively small count:
          * in case the ID provided is too low, we do not want the server to
          * block just to serve this client a huge stream of messages. */
@@ -2413,7 +3076,8 @@ void xreadCommand(client *c) {
         /* If this is a XREADGROUP + GROUP we need to remember for which
          * group and consumer name we are blocking, so later when one of the
          * keys receive more data, we can call streamReplyWithRange() passing
-         * the right arguments. */
+         * the right arguments. This is done before blocking, since the
+         * clients blocked for a stream are indexed by group. */
         if (groupname) {
             incrRefCount(groupname);
             incrRefCount(consumername);
@@ -2424,6 +3088,8 @@ void xreadCommand(client *c) {
             c->bpop.xread_group = NULL;
             c->bpop.xread_consumer = NULL;
         }
+        blockForKeys(c, BLOCKED_STREAM, c->argv+streams_arg, streams_count,
+                     -1, timeout, NULL, NULL, ids);
         goto cleanup;
     }
 
@@ -2442,33 +3108,680 @@ cleanup: /* Cleanup. */
 }
 
 /* -----------------------------------------------------------------------
- * Low level implementation of consumer groups
+ * Consumer groups pending entries list
  * ----------------------------------------------------------------------- */
 
-/* Create a NACK entry setting the delivery count to 1 and the delivery
- * time to the current time. The NACK consumer will be set to the one
- * specified as argument of the function. */
-streamNACK *streamCreateNACK(streamConsumer *consumer) {
-    streamNACK *nack = zmalloc(sizeof(*nack));
-    nack->delivery_time = mstime();
-    nack->delivery_count = 1;
-    nack->consumer = consumer;
-    return nack;
+/* A PEL entry as stored inside a block, where the consumer owning it is
+ * referenced by ID, or is zero while the owner is not yet known (this only
+ * happens while loading the PEL from RDB). */
+typedef struct streamPelEntry {
+    streamID id;
+    mstime_t delivery_time;
+    uint64_t delivery_count;
+    uint64_t consumer_id;
+} streamPelEntry;
+
+/* Encode in 'buf' the key of a block in the delivery time index. The time is
+ * stored with the sign bit flipped, so that the negative times (that could
+ * be loaded from RDB) sort before the positive ones. */
+static void streamPelEncodeIdleKey(unsigned char *buf, mstime_t min_time, unsigned char *blockkey) {
+    uint64_t t = htonu64((uint64_t)min_time ^ (1ULL<<63));
+    memcpy(buf,&t,sizeof(t));
+    memcpy(buf+sizeof(t),blockkey,sizeof(streamID));
+}
+
+/* Return the minimum delivery time from a delivery time index key. */
+static mstime_t streamPelDecodeIdleKeyTime(unsigned char *buf) {
+    uint64_t t;
+    memcpy(&t,buf,sizeof(t));
+    return (mstime_t)(ntohu64(t) ^ (1ULL<<63));
+}
+
+/* Return the number of entries stored in a block. */
+static inline unsigned long streamPelBlockEntries(unsigned char *lp) {
+    return (lpLength(lp)-STREAM_PEL_HEADER_FIELDS)/STREAM_PEL_ENTRY_FIELDS;
+}
+
+/* Read the header of a block, returning its first entry. The 'min_time'
+ * argument can be NULL if the caller is not interested in it. */
+static unsigned char *streamPelBlockHeader(unsigned char *lp, uint64_t *master_ms, mstime_t *min_time) {
+    unsigned char *p = lpFirst(lp);
+    *master_ms = lpGetInteger(p);
+    p = lpNext(lp,p);
+    if (min_time) *min_time = lpGetInteger(p);
+    return lpNext(lp,p);
 }
 
-/* Free a NACK entry. */
-void streamFreeNACK(streamNACK *na) {
-    zfree(na);
+/* Decode the block entry at 'p' into 'e', returning the next entry of the
+ * block, or NULL if it was the last one. */
+static unsigned char *streamPelBlockGet(unsigned char *lp, unsigned char *p, uint64_t master_ms, streamPelEntry *e) {
+    e->id.ms = master_ms + (uint64_t)lpGetInteger(p);
+    p = lpNext(lp,p);
+    e->id.seq = (uint64_t)lpGetInteger(p);
+    p = lpNext(lp,p);
+    e->delivery_time = (mstime_t)(e->id.ms + (uint64_t)lpGetInteger(p));
+    p = lpNext(lp,p);
+    e->delivery_count = (uint64_t)lpGetInteger(p);
+    p = lpNext(lp,p);
+    e->consumer_id = (uint64_t)lpGetInteger(p);
+    return lpNext(lp,p);
 }
 
+/* Store in 'id' the ID of the last entry of a block, reading it backward
+ * from the end of the listpack. */
+static void streamPelBlockLastID(unsigned char *lp, uint64_t master_ms, streamID *id) {
+    unsigned char *p = lpLast(lp);
+    /* Skip the consumer, delivery count and delivery time fields. */
+    for (int j = 0; j < STREAM_PEL_ENTRY_FIELDS-2; j++)
+        p = lpPrev(lp,p);
+    id->seq = (uint64_t)lpGetInteger(p);
+    p = lpPrev(lp,p);
+    id->ms = master_ms + (uint64_t)lpGetInteger(p);
+}
+
+/* Seek the first entry of a block having an ID greater than or equal to 'id',
+ * setting '*found' to 1 if its ID is exactly 'id', and to 0 otherwise.
+ * NULL is returned if all the entries of the block have a smaller ID. */
+static unsigned char *streamPelBlockSeek(unsigned char *lp, streamID *id, int *found) {
+    uint64_t master_ms;
+    unsigned char *p = streamPelBlockHeader(lp,&master_ms,NULL);
+    *found = 0;
+
+    /* Don't scan the block if the ID is past its last entry. */
+    streamID last;
+    streamPelBlockLastID(lp,master_ms,&last);
+    if (streamCompareID(&last,id) < 0) return NULL;
+
+    while(p) {
+        streamID this;
+        unsigned char *entry = p;
+        this.ms = master_ms + (uint64_t)lpGetInteger(p);
+        p = lpNext(lp,p);
+        this.seq = (uint64_t)lpGetInteger(p);
+        int cmp = streamCompareID(&this,id);
+        if (cmp >= 0) {
+            *found = (cmp == 0);
+            return entry;
+        }
+        /* Skip the delivery time, count and consumer fields. */
+        for (int j = 0; j < STREAM_PEL_ENTRY_FIELDS-1; j++)
+            p = lpNext(lp,p);
+    }
+    return NULL;
+}
+
+/* Insert the entry 'e' in a block before the entry at 'p', or at the end of
+ * the block if 'p' is NULL. Returns the block, that may be reallocated. */
+static unsigned char *streamPelBlockInsert(unsigned char *lp, unsigned char *p, streamPelEntry *e) {
+    uint64_t master_ms;
+    streamPelBlockHeader(lp,&master_ms,NULL);
+    long long fields[STREAM_PEL_ENTRY_FIELDS] = {
+        (long long)(e->id.ms - master_ms),
+        (long long)e->id.seq,
+        (long long)((uint64_t)e->delivery_time - e->id.ms),
+        (long long)e->delivery_count,
+        (long long)e->consumer_id
+    };
+    if (p == NULL) {
+        for (int j = 0; j < STREAM_PEL_ENTRY_FIELDS; j++)
+            lp = lpAppendInteger(lp,fields[j]);
+    } else {
+        for (int j = STREAM_PEL_ENTRY_FIELDS-1; j >= 0; j--)
+            lp = lpInsertInteger(lp,fields[j],p,LP_BEFORE,&p);
+    }
+    return lp;
+}
+
+/* Create a new block, with 'e' as its only entry. */
+static unsigned char *streamPelBlockCreate(streamPelEntry *e) {
+    unsigned char *lp = lpNew(0);
+    lp = lpAppendInteger(lp,e->id.ms);
+    lp = lpAppendInteger(lp,e->delivery_time);
+    return streamPelBlockInsert(lp,NULL,e);
+}
+
+/* Return the minimum delivery time among the entries of a block. */
+static mstime_t streamPelBlockMinTime(unsigned char *lp) {
+    uint64_t master_ms;
+    unsigned char *p = streamPelBlockHeader(lp,&master_ms,NULL);
+    mstime_t min_time = LLONG_MAX;
+    while(p) {
+        streamPelEntry e;
+        p = streamPelBlockGet(lp,p,master_ms,&e);
+        if (e.delivery_time < min_time) min_time = e.delivery_time;
+    }
+    return min_time;
+}
+
+/* Add the block 'lp' having the specified key to the PEL, and to the
+ * delivery time index. */
+static void streamPelLinkBlock(streamPEL *pel, unsigned char *key, unsigned char *lp) {
+    uint64_t master_ms;
+    mstime_t min_time;
+    unsigned char idlekey[STREAM_PEL_IDLE_KEY_LEN];
+    streamPelBlockHeader(lp,&master_ms,&min_time);
+    streamPelEncodeIdleKey(idlekey,min_time,key);
+    raxInsert(pel->blocks,key,sizeof(streamID),lp,NULL);
+    raxInsert(pel->idle,idlekey,sizeof(idlekey),NULL,NULL);
+}
+
+/* Remove the block 'lp' having the specified key from the PEL, and from the
+ * delivery time index. The block itself is not freed. */
+static void streamPelUnlinkBlock(streamPEL *pel, unsigned char *key, unsigned char *lp) {
+    uint64_t master_ms;
+    mstime_t min_time;
+    unsigned char idlekey[STREAM_PEL_IDLE_KEY_LEN];
+    streamPelBlockHeader(lp,&master_ms,&min_time);
+    streamPelEncodeIdleKey(idlekey,min_time,key);
+    raxRemove(pel->blocks,key,sizeof(streamID),NULL);
+    raxRemove(pel->idle,idlekey,sizeof(idlekey),NULL);
+}
+
+/* Set the minimum delivery time of a block, both in its header and in the
+ * delivery time index. Returns the block, that may be reallocated: it's up
+ * to the caller to store the new pointer in the PEL. */
+static unsigned char *streamPelBlockSetMinTime(streamPEL *pel, unsigned char *key, unsigned char *lp, mstime_t min_time) {
+    unsigned char *p = lpNext(lp,lpFirst(lp));
+    mstime_t old_min_time = lpGetInteger(p);
+    if (old_min_time == min_time) return lp;
+
+    unsigned char idlekey[STREAM_PEL_IDLE_KEY_LEN];
+    streamPelEncodeIdleKey(idlekey,old_min_time,key);
+    raxRemove(pel->idle,idlekey,sizeof(idlekey),NULL);
+    streamPelEncodeIdleKey(idlekey,min_time,key);
+    raxInsert(pel->idle,idlekey,sizeof(idlekey),NULL,NULL);
+    return lpReplaceInteger(lp,&p,min_time);
+}
+
+/* Find the block that has, or would have, the entry with the specified ID,
+ * that is, the one with the greatest key smaller than or equal to the ID.
+ * The block is returned and its key is stored in 'key', unless the PEL is
+ * empty or the ID is smaller than the key of the first block: in this case
+ * NULL is returned. */
+static unsigned char *streamPelFindBlock(streamPEL *pel, streamID *id, unsigned char *key) {
+    unsigned char *lp = NULL;
+    raxIterator ri;
+    streamEncodeID(key,id);
+    raxStart(&ri,pel->blocks);
+    raxSeek(&ri,"<=",key,sizeof(streamID));
+    if (raxNext(&ri)) {
+        memcpy(key,ri.key,sizeof(streamID));
+        lp = ri.data;
+    }
+    raxStop(&ri);
+    return lp;
+}
+
+/* Split a full block in two halves: the second half is moved to a new block,
+ * having as key the ID of its first entry. */
+static void streamPelSplitBlock(streamPEL *pel, unsigned char *key, unsigned char *lp) {
+    uint64_t master_ms;
+    unsigned char *p = streamPelBlockHeader(lp,&master_ms,NULL);
+    unsigned long keep = streamPelBlockEntries(lp)/2;
+    for (unsigned long j = 0; j < keep*STREAM_PEL_ENTRY_FIELDS; j++)
+        p = lpNext(lp,p);
+
+    /* Copy the second half into the new block, keeping track of its
+     * minimum delivery time. */
+    unsigned char *newlp = NULL;
+    unsigned char newkey[sizeof(streamID)];
+    mstime_t min_time = LLONG_MAX;
+    while(p) {
+        streamPelEntry e;
+        p = streamPelBlockGet(lp,p,master_ms,&e);
+        if (newlp == NULL) {
+            newlp = streamPelBlockCreate(&e);
+            streamEncodeID(newkey,&e.id);
+        } else {
+            newlp = streamPelBlockInsert(newlp,NULL,&e);
+        }
+        if (e.delivery_time < min_time) min_time = e.delivery_time;
+    }
+    unsigned char *minp = lpNext(newlp,lpFirst(newlp));
+    newlp = lpReplaceInteger(newlp,&minp,min_time);
+    streamPelLinkBlock(pel,newkey,newlp);
+
+    /* Truncate the original block. */
+    lp = lpDeleteRange(lp,STREAM_PEL_HEADER_FIELDS+keep*STREAM_PEL_ENTRY_FIELDS,
+                       (streamPelBlockEntries(lp)-keep)*STREAM_PEL_ENTRY_FIELDS);
+    lp = streamPelBlockSetMinTime(pel,key,lp,streamPelBlockMinTime(lp));
+    raxInsert(pel->blocks,key,sizeof(streamID),lp,NULL);
+}
+
+/* Add the entry 'e' to the block 'lp' having the specified key, before the
+ * entry at 'p', or at the end of the block if 'p' is NULL. The block must
+ * not be full. */
+static void streamPelBlockAdd(streamPEL *pel, unsigned char *key, unsigned char *lp, unsigned char *p, streamPelEntry *e) {
+    mstime_t min_time;
+    uint64_t master_ms;
+    streamPelBlockHeader(lp,&master_ms,&min_time);
+    lp = streamPelBlockInsert(lp,p,e);
+    if (e->delivery_time < min_time)
+        lp = streamPelBlockSetMinTime(pel,key,lp,e->delivery_time);
+    raxInsert(pel->blocks,key,sizeof(streamID),lp,NULL);
+    pel->size++;
+}
+
+/* Add the entry 'e' to the PEL in a new block, keyed by its ID. */
+static void streamPelAddInNewBlock(streamPEL *pel, streamPelEntry *e) {
+    unsigned char key[sizeof(streamID)];
+    streamEncodeID(key,&e->id);
+    streamPelLinkBlock(pel,key,streamPelBlockCreate(e));
+    pel->size++;
+}
+
+/* Fast path of streamPelAdd(): entries are usually added in ID order, so
+ * if the ID of 'e' is greater than the one of the last entry of the PEL,
+ * the entry is appended to the last block, or to a new block if it is
+ * full, without seeking the block in the PEL and inside the block.
+ * Returns 1 if the entry was added, otherwise 0. */
+static int streamPelAppend(streamPEL *pel, streamPelEntry *e) {
+    unsigned char key[sizeof(streamID)];
+    unsigned char *lp = NULL;
+    raxIterator ri;
+    raxStart(&ri,pel->blocks);
+    raxSeek(&ri,"$",NULL,0);
+    if (raxNext(&ri)) {
+        memcpy(key,ri.key,sizeof(key));
+        lp = ri.data;
+    }
+    raxStop(&ri);
+    if (lp == NULL) return 0;
+
+    uint64_t master_ms;
+    streamID last;
+    streamPelBlockHeader(lp,&master_ms,NULL);
+    streamPelBlockLastID(lp,master_ms,&last);
+    if (streamCompareID(&e->id,&last) <= 0) return 0;
+
+    if (streamPelBlockEntries(lp) >= STREAM_PEL_BLOCK_MAX_ENTRIES)
+        streamPelAddInNewBlock(pel,e);
+    else
+        streamPelBlockAdd(pel,key,lp,NULL,e);
+    return 1;
+}
+
+/* Add the entry 'e' to the PEL. Returns 0 if an entry with the same ID
+ * already exists, otherwise 1 is returned. */
+static int streamPelAdd(streamPEL *pel, streamPelEntry *e) {
+    if (streamPelAppend(pel,e)) return 1;
+
+    unsigned char key[sizeof(streamID)];
+    unsigned char *lp = streamPelFindBlock(pel,&e->id,key);
+
+    if (lp == NULL) {
+        /* The ID is smaller than the ones of all the blocks: if the first
+         * block has room for it, lower its key, otherwise a new block is
+         * created in front of it. */
+        raxIterator ri;
+        raxStart(&ri,pel->blocks);
+        raxSeek(&ri,"^",NULL,0);
+        if (raxNext(&ri) &&
+            streamPelBlockEntries(ri.data) < STREAM_PEL_BLOCK_MAX_ENTRIES)
+        {
+            lp = ri.data;
+            memcpy(key,ri.key,sizeof(key));
+            streamPelUnlinkBlock(pel,key,lp);
+            streamEncodeID(key,&e->id);
+            streamPelLinkBlock(pel,key,lp);
+        }
+        raxStop(&ri);
+        if (lp == NULL) {
+            streamPelAddInNewBlock(pel,e);
+            return 1;
+        }
+    }
+
+    int found;
+    unsigned char *p = streamPelBlockSeek(lp,&e->id,&found);
+    if (found) return 0;
+    if (streamPelBlockEntries(lp) >= STREAM_PEL_BLOCK_MAX_ENTRIES) {
+        if (p == NULL) {
+            /* Rather than splitting a full block to add an entry past its
+             * end, start a new one. */
+            streamPelAddInNewBlock(pel,e);
+            return 1;
+        }
+        streamPelSplitBlock(pel,key,lp);
+        return streamPelAdd(pel,e);
+    }
+    streamPelBlockAdd(pel,key,lp,p,e);
+    return 1;
+}
+
+/* Set the delivery time, delivery count and consumer of the PEL entry having
+ * the ID of 'e'. The previous content of the entry is stored in 'old'.
+ * Returns 0 if there is no such entry, otherwise 1 is returned. */
+static int streamPelSet(streamPEL *pel, streamPelEntry *e, streamPelEntry *old) {
+    unsigned char key[sizeof(streamID)];
+    unsigned char *lp = streamPelFindBlock(pel,&e->id,key);
+    if (lp == NULL) return 0;
+    int found;
+    unsigned char *p = streamPelBlockSeek(lp,&e->id,&found);
+    if (!found) return 0;
+
+    uint64_t master_ms;
+    mstime_t min_time;
+    streamPelBlockHeader(lp,&master_ms,&min_time);
+    streamPelBlockGet(lp,p,master_ms,old);
+
+    /* Skip the ID and replace the other fields. */
+    p = lpNext(lp,lpNext(lp,p));
+    lp = lpReplaceInteger(lp,&p,(long long)((uint64_t)e->delivery_time - e->id.ms));
+    p = lpNext(lp,p);
+    lp = lpReplaceInteger(lp,&p,(long long)e->delivery_count);
+    p = lpNext(lp,p);
+    lp = lpReplaceInteger(lp,&p,(long long)e->consumer_id);
+
+    if (e->delivery_time < min_time) {
+        lp = streamPelBlockSetMinTime(pel,key,lp,e->delivery_time);
+    } else if (old->delivery_time == min_time &&
+               e->delivery_time != min_time)
+    {
+        lp = streamPelBlockSetMinTime(pel,key,lp,streamPelBlockMinTime(lp));
+    }
+    raxInsert(pel->blocks,key,sizeof(key),lp,NULL);
+    return 1;
+}
+
+/* Remove from the PEL the entry with the specified ID, storing its content
+ * in 'e' if not NULL. Returns 0 if there is no such entry, otherwise 1 is
+ * returned. */
+static int streamPelRemove(streamPEL *pel, streamID *id, streamPelEntry *e) {
+    unsigned char key[sizeof(streamID)];
+    unsigned char *lp = streamPelFindBlock(pel,id,key);
+    if (lp == NULL) return 0;
+    int found;
+    unsigned char *p = streamPelBlockSeek(lp,id,&found);
+    if (!found) return 0;
+
+    uint64_t master_ms;
+    mstime_t min_time;
+    streamPelEntry removed;
+    streamPelBlockHeader(lp,&master_ms,&min_time);
+    streamPelBlockGet(lp,p,master_ms,&removed);
+    if (e) *e = removed;
+    pel->size--;
+
+    if (streamPelBlockEntries(lp) == 1) {
+        streamPelUnlinkBlock(pel,key,lp);
+        lpFree(lp);
+        return 1;
+    }
+    lp = lpDeleteRangeWithEntry(lp,&p,STREAM_PEL_ENTRY_FIELDS);
+    if (removed.delivery_time == min_time)
+        lp = streamPelBlockSetMinTime(pel,key,lp,streamPelBlockMinTime(lp));
+    raxInsert(pel->blocks,key,sizeof(key),lp,NULL);
+    return 1;
+}
+
+/* Return the consumer of the group having the specified ID, or NULL if
+ * the ID is zero, that is, for PEL entries without an owner. */
+static streamConsumer *streamLookupConsumerByID(streamCG *cg, uint64_t id) {
+    if (id == 0) return NULL;
+    uint64_t key = htonu64(id);
+    streamConsumer *consumer = raxFind(cg->consumers_by_id,
+                                       (unsigned char*)&key,sizeof(key));
+    serverAssert(consumer != raxNotFound);
+    return consumer;
+}
+
+/* Fill 'nack' with the content of the PEL entry 'e'. */
+static void streamPelEntryToNACK(streamCG *cg, streamPelEntry *e, streamNACK *nack) {
+    nack->id = e->id;
+    nack->delivery_time = e->delivery_time;
+    nack->delivery_count = e->delivery_count;
+    nack->consumer = streamLookupConsumerByID(cg,e->consumer_id);
+}
+
+/* Fill the PEL entry 'e' with the content of 'nack'. */
+static void streamNACKToPelEntry(streamNACK *nack, streamPelEntry *e) {
+    e->id = nack->id;
+    e->delivery_time = nack->delivery_time;
+    e->delivery_count = nack->delivery_count;
+    e->consumer_id = nack->consumer ? nack->consumer->id : 0;
+}
+
+/* Lookup the entry with the specified ID in the PEL of the consumer group.
+ * If it is found, 1 is returned and its content is stored in 'nack' if
+ * not NULL, otherwise 0 is returned. */
+int streamPelLookup(streamCG *cg, streamID *id, streamNACK *nack) {
+    unsigned char key[sizeof(streamID)];
+    unsigned char *lp = streamPelFindBlock(&cg->pel,id,key);
+    if (lp == NULL) return 0;
+    int found;
+    unsigned char *p = streamPelBlockSeek(lp,id,&found);
+    if (!found) return 0;
+    if (nack) {
+        uint64_t master_ms;
+        streamPelEntry e;
+        streamPelBlockHeader(lp,&master_ms,NULL);
+        streamPelBlockGet(lp,p,master_ms,&e);
+        streamPelEntryToNACK(cg,&e,nack);
+    }
+    return 1;
+}
+
+/* Add the entry 'nack' to the PEL of the consumer group, and to the PEL of
+ * its consumer, if any. Returns 0 if an entry with the same ID already
+ * exists, otherwise 1 is returned. */
+int streamPelInsert(streamCG *cg, streamNACK *nack) {
+    streamPelEntry e;
+    streamNACKToPelEntry(nack,&e);
+    if (!streamPelAdd(&cg->pel,&e)) return 0;
+    if (nack->consumer) {
+        unsigned char buf[sizeof(streamID)];
+        streamEncodeID(buf,&nack->id);
+        raxInsert(nack->consumer->pel,buf,sizeof(buf),NULL,NULL);
+    }
+    return 1;
+}
+
+/* Update the entry of the PEL of the consumer group having the ID of 'nack',
+ * that must exist, with its content. If the consumer changed, the entry is
+ * also moved from the PEL of the old consumer to the one of the new. */
+void streamPelUpdate(streamCG *cg, streamNACK *nack) {
+    streamPelEntry e, old;
+    streamNACKToPelEntry(nack,&e);
+    serverAssert(streamPelSet(&cg->pel,&e,&old));
+    if (old.consumer_id != e.consumer_id) {
+        unsigned char buf[sizeof(streamID)];
+        streamEncodeID(buf,&nack->id);
+        streamConsumer *consumer = streamLookupConsumerByID(cg,old.consumer_id);
+        if (consumer) raxRemove(consumer->pel,buf,sizeof(buf),NULL);
+        if (nack->consumer)
+            raxInsert(nack->consumer->pel,buf,sizeof(buf),NULL,NULL);
+    }
+}
+
+/* Delete the entry with the specified ID from the PEL of the consumer group,
+ * and from the PEL of its consumer. If 'nack' is not NULL, the content of
+ * the deleted entry is stored in it. Returns 0 if there is no such entry,
+ * otherwise 1 is returned. */
+int streamPelDelete(streamCG *cg, streamID *id, streamNACK *nack) {
+    streamPelEntry e;
+    if (!streamPelRemove(&cg->pel,id,&e)) return 0;
+    streamConsumer *consumer = streamLookupConsumerByID(cg,e.consumer_id);
+    if (consumer) {
+        unsigned char buf[sizeof(streamID)];
+        streamEncodeID(buf,id);
+        raxRemove(consumer->pel,buf,sizeof(buf),NULL);
+    }
+    if (nack) streamPelEntryToNACK(cg,&e,nack);
+    return 1;
+}
+
+/* Initialize an iterator of the PEL of the consumer group, that will emit
+ * the entries having an ID greater than or equal to 'start', or all the
+ * entries if 'start' is NULL. */
+void streamPelIteratorStart(streamPelIterator *it, streamCG *cg, streamID *start) {
+    it->cg = cg;
+    it->lp = NULL;
+    it->lp_ele = NULL;
+    it->consumer_id = 0;
+    it->consumer = NULL;
+    raxStart(&it->ri,cg->pel.blocks);
+    if (start) {
+        unsigned char key[sizeof(streamID)];
+        it->start = *start;
+        streamEncodeID(key,start);
+        raxSeek(&it->ri,"<=",key,sizeof(key));
+        if (raxEOF(&it->ri)) raxSeek(&it->ri,"^",NULL,0);
+    } else {
+        it->start.ms = it->start.seq = 0;
+        raxSeek(&it->ri,"^",NULL,0);
+    }
+}
+
+/* Store the next entry of the iterated PEL in 'nack' and return 1, or
+ * return 0 if there are no more entries. */
+int streamPelIteratorNext(streamPelIterator *it, streamNACK *nack) {
+    while(1) {
+        if (it->lp_ele == NULL) {
+            if (!raxNext(&it->ri)) return 0;
+            it->lp = it->ri.data;
+            it->lp_ele = streamPelBlockHeader(it->lp,&it->master_ms,NULL);
+        }
+        streamPelEntry e;
+        it->lp_ele = streamPelBlockGet(it->lp,it->lp_ele,it->master_ms,&e);
+        if (streamCompareID(&e.id,&it->start) < 0) continue;
+
+        /* Consecutive entries are likely owned by the same consumer. */
+        if (e.consumer_id != it->consumer_id) {
+            it->consumer_id = e.consumer_id;
+            it->consumer = streamLookupConsumerByID(it->cg,e.consumer_id);
+        }
+        nack->id = e.id;
+        nack->delivery_time = e.delivery_time;
+        nack->delivery_count = e.delivery_count;
+        nack->consumer = it->consumer;
+        return 1;
+    }
+}
+
+/* Release the resources of a PEL iterator. */
+void streamPelIteratorStop(streamPelIterator *it) {
+    raxStop(&it->ri);
+}
+
+/* Store in 'id' the first or the last ID of the PEL of the consumer group,
+ * depending on 'first'. Returns 0 if the PEL is empty, otherwise 1. */
+static int streamPelEdgeID(streamCG *cg, int first, streamID *id) {
+    raxIterator ri;
+    raxStart(&ri,cg->pel.blocks);
+    raxSeek(&ri,first ? "^" : "$",NULL,0);
+    int found = raxNext(&ri);
+    if (found) {
+        uint64_t master_ms;
+        unsigned char *lp = ri.data;
+        unsigned char *p = streamPelBlockHeader(lp,&master_ms,NULL);
+        streamPelEntry e;
+        do {
+            p = streamPelBlockGet(lp,p,master_ms,&e);
+        } while(p && !first);
+        *id = e.id;
+    }
+    raxStop(&ri);
+    return found;
+}
+
+/* Compare the IDs of two NACKs, for qsort(). */
+static int streamNACKCompareID(const void *a, const void *b) {
+    return streamCompareID(&((streamNACK*)a)->id,&((streamNACK*)b)->id);
+}
+
+/* Return the budget, in entries, of streamPelCollectIdle() when called after
+ * scanning 'scanned' entries of the PEL did not find enough idle ones. The
+ * blocks found in the delivery time index are decoded as a whole, so this
+ * allows for up to a block per entry scanned. */
+static long long streamPelIdleBudget(long long scanned) {
+    if (scanned > LLONG_MAX/STREAM_PEL_BLOCK_MAX_ENTRIES) return LLONG_MAX;
+    return scanned*STREAM_PEL_BLOCK_MAX_ENTRIES;
+}
+
+/* Collect, in ID order, the entries of the PEL of the consumer group with an
+ * ID in the range 'start'-'end', delivered at or before 'maxtime', and owned
+ * by 'consumer' if it is not NULL. Only the blocks having such entries are
+ * visited, using the delivery time index. Before decoding any block, the
+ * index is walked to count the entries of the candidate blocks: when they
+ * are more than 'budget', -1 is returned and the caller should rather scan
+ * the PEL in ID order, since most entries are idle enough anyway. Otherwise
+ * the number of entries is returned, and '*nacks' is set to an array, that
+ * the caller should release with zfree(), holding them.
+ *
+ * The budget can be set to the number of entries the caller would check
+ * scanning the PEL. */
+static long streamPelCollectIdle(streamCG *cg, mstime_t maxtime, streamID *start, streamID *end, streamConsumer *consumer, long long budget, streamNACK **nacks) {
+    streamNACK *found = NULL;
+    long len = 0, alloc = 0;
+    unsigned char endkey[sizeof(streamID)];
+    raxIterator ri;
+
+    streamEncodeID(endkey,end);
+    raxStart(&ri,cg->pel.idle);
+
+    /* Count the entries of the candidate blocks. Every index key visited
+     * costs one too, so that skipping many blocks out of the range is
+     * bounded as well. */
+    long long cost = 0;
+    raxSeek(&ri,"^",NULL,0);
+    while(raxNext(&ri) && streamPelDecodeIdleKeyTime(ri.key) <= maxtime) {
+        unsigned char *blockkey = ri.key+sizeof(uint64_t);
+        cost++;
+        if (memcmp(blockkey,endkey,sizeof(endkey)) <= 0) {
+            unsigned char *lp = raxFind(cg->pel.blocks,blockkey,sizeof(streamID));
+            serverAssert(lp != raxNotFound);
+            cost += streamPelBlockEntries(lp);
+        }
+        if (cost > budget) {
+            raxStop(&ri);
+            return -1;
+        }
+    }
+
+    raxSeek(&ri,"^",NULL,0);
+    while(raxNext(&ri) && streamPelDecodeIdleKeyTime(ri.key) <= maxtime) {
+        /* The key of a block is not greater than its first ID. */
+        unsigned char *blockkey = ri.key+sizeof(uint64_t);
+        if (memcmp(blockkey,endkey,sizeof(endkey)) > 0) continue;
+
+        unsigned char *lp = raxFind(cg->pel.blocks,blockkey,sizeof(streamID));
+        uint64_t master_ms;
+        unsigned char *p = streamPelBlockHeader(lp,&master_ms,NULL);
+        while(p) {
+            streamPelEntry e;
+            p = streamPelBlockGet(lp,p,master_ms,&e);
+            if (e.delivery_time > maxtime ||
+                streamCompareID(&e.id,start) < 0 ||
+                streamCompareID(&e.id,end) > 0 ||
+                (consumer && e.consumer_id != consumer->id)) continue;
+            if (len == alloc) {
+                alloc = alloc ? alloc*2 : 16;
+                found = zrealloc(found,sizeof(streamNACK)*alloc);
+            }
+            streamPelEntryToNACK(cg,&e,found+len);
+            len++;
+        }
+    }
+    raxStop(&ri);
+
+    if (len) qsort(found,len,sizeof(streamNACK),streamNACKCompareID);
+    *nacks = found;
+    return len;
+}
+
+/* -----------------------------------------------------------------------
+ * Low level implementation of consumer groups
+ * ----------------------------------------------------------------------- */
+
 /* Free a consumer and associated data structures. Note that this function
  * will not reassign the pending messages associated with this consumer
  * nor will delete them from the stream, so when this function is called
  * to delete a consumer, and not when the whole stream is destroyed, the caller
  * should do some work before. */
 void streamFreeConsumer(streamConsumer *sc) {
-    raxFree(sc->pel); /* No value free callback: the PEL entries are shared
-                         between the consumer and the main stream PEL. */
+    raxFree(sc->pel); /* No value free callback: the PEL entries are stored
+                         in the consumer group PEL. */
     sdsfree(sc->name);
     zfree(sc);
 }
@@ -2483,8 +3796,12 @@ streamCG *streamCreateCG(stream *s, char *name, size_t namelen, streamID *id, lo
         return NULL;
 
     streamCG *cg = zmalloc(sizeof(*cg));
-    cg->pel = raxNew();
+    cg->pel.blocks = raxNew();
+    cg->pel.idle = raxNew();
+    cg->pel.size = 0;
     cg->consumers = raxNew();
+    cg->consumers_by_id = raxNew();
+    cg->last_consumer_id = 0;
     cg->last_id = *id;
     cg->entries_read = entries_read;
     raxInsert(s->cgroups,(unsigned char*)name,namelen,cg,NULL);
@@ -2493,8 +3810,10 @@ streamCG *streamCreateCG(stream *s, char *name, size_t namelen, streamID *id, lo
 
 /* Free a consumer group and all its associated data. */
 void streamFreeCG(streamCG *cg) {
-    raxFreeWithCallback(cg->pel,(void(*)(void*))streamFreeNACK);
+    raxFreeWithCallback(cg->pel.blocks,(void(*)(void*))lpFree);
+    raxFree(cg->pel.idle);
     raxFreeWithCallback(cg->consumers,(void(*)(void*))streamFreeConsumer);
+    raxFree(cg->consumers_by_id);
     zfree(cg);
 }
 
@@ -2523,8 +3842,12 @@ streamConsumer *streamCreateConsumer(streamCG *cg, sds name, robj *key, int dbid
         return NULL;
     }
     consumer->name = sdsdup(name);
+    consumer->id = ++cg->last_consumer_id;
     consumer->pel = raxNew();
     consumer->seen_time = mstime();
+    uint64_t idkey = htonu64(consumer->id);
+    raxInsert(cg->consumers_by_id,(unsigned char*)&idkey,sizeof(idkey),
+              consumer,NULL);
     if (dirty) server.dirty++;
     if (notify) notifyKeyspaceEvent(NOTIFY_STREAM,"xgroup-createconsumer",key,dbid);
     return consumer;
@@ -2550,15 +3873,17 @@ void streamDelConsumer(streamCG *cg, streamConsumer *consumer) {
     raxStart(&ri,consumer->pel);
     raxSeek(&ri,"^",NULL,0);
     while(raxNext(&ri)) {
-        streamNACK *nack = ri.data;
-        raxRemove(cg->pel,ri.key,ri.key_len,NULL);
-        streamFreeNACK(nack);
+        streamID id;
+        streamDecodeID(ri.key,&id);
+        streamPelRemove(&cg->pel,&id,NULL);
     }
     raxStop(&ri);
 
     /* Deallocate the consumer. */
+    uint64_t idkey = htonu64(consumer->id);
     raxRemove(cg->consumers,(unsigned char*)consumer->name,
               sdslen(consumer->name),NULL);
+    raxRemove(cg->consumers_by_id,(unsigned char*)&idkey,sizeof(idkey),NULL);
     streamFreeConsumer(consumer);
 }
 
@@ -2780,7 +4105,10 @@ void xsetidCommand(client *c) {
      * item, otherwise the fundamental ID monotonicity assumption is violated. */
     if (s->length > 0) {
         streamID maxid;
-        streamLastValidID(s,&maxid);
+        if (streamLastValidID(s,&maxid) == C_ERR) {
+            addReplyStreamReadError(c,errno);
+            return;
+        }
 
         if (streamCompareID(&id,&maxid) < 0) {
             addReplyError(c,"The ID specified in XSETID is smaller than the target stream top item");
@@ -2842,17 +4170,9 @@ void xackCommand(client *c) {
 
     int acknowledged = 0;
     for (int j = 3; j < c->argc; j++) {
-        unsigned char buf[sizeof(streamID)];
-        streamEncodeID(buf,&ids[j-3]);
-
-        /* Lookup the ID in the group PEL: it will have a reference to the
-         * NACK structure that will have a reference to the consumer, so that
-         * we are able to remove the entry from both PELs. */
-        streamNACK *nack = raxFind(group->pel,buf,sizeof(buf));
-        if (nack != raxNotFound) {
-            raxRemove(group->pel,buf,sizeof(buf),NULL);
-            raxRemove(nack->consumer->pel,buf,sizeof(buf),NULL);
-            streamFreeNACK(nack);
+        /* Remove the ID from the group PEL: the entry references the
+         * consumer, so that it is removed from its PEL as well. */
+        if (streamPelDelete(group,&ids[j-3],NULL)) {
             acknowledged++;
             server.dirty++;
         }
@@ -2862,6 +4182,43 @@ cleanup:
     if (ids != static_ids) zfree(ids);
 }
 
+/* Helper for XPENDING: emit the details of a pending entry. */
+static void addReplyPendingEntry(client *c, streamNACK *nack, mstime_t now) {
+    addReplyArrayLen(c,4);
+
+    /* Entry ID. */
+    addReplyStreamID(c,&nack->id);
+
+    /* Consumer name. */
+    addReplyBulkCBuffer(c,nack->consumer->name,sdslen(nack->consumer->name));
+
+    /* Milliseconds elapsed since last delivery. */
+    mstime_t elapsed = now - nack->delivery_time;
+    if (elapsed < 0) elapsed = 0;
+    addReplyLongLong(c,elapsed);
+
+    /* Number of deliveries. */
+    addReplyLongLong(c,nack->delivery_count);
+}
+
+/* Helper for XPENDING IDLE: reply with up to '*count' entries of the range
+ * 'start'-'end' idle for at least 'minidle', found using the delivery time
+ * index, and update '*count' and '*arraylen'. Returns 0, without replying,
+ * if the index would visit more than 'budget' entries, in which case the
+ * caller should keep scanning the range. */
+static int xpendingReplyIdle(client *c, streamCG *group, mstime_t now, mstime_t minidle, streamID *start, streamID *end, streamConsumer *consumer, long long budget, long long *count, size_t *arraylen) {
+    streamNACK *nacks;
+    long numnacks = streamPelCollectIdle(group,now-minidle,start,end,
+                                         consumer,budget,&nacks);
+    if (numnacks == -1) return 0;
+    for (long j = 0; j < numnacks && *count; j++, (*count)--) {
+        addReplyPendingEntry(c,nacks+j,now);
+        (*arraylen)++;
+    }
+    zfree(nacks);
+    return 1;
+}
+
 /* XPENDING <key> <group> [[IDLE <idle>] <start> <stop> <count> [<consumer>]]
  *
  * If start and stop are omitted, the command just outputs information about
@@ -2948,29 +4305,23 @@ void xpendingCommand(client *c) {
     if (justinfo) {
         addReplyArrayLen(c,4);
         /* Total number of messages in the PEL. */
-        addReplyLongLong(c,raxSize(group->pel));
+        addReplyLongLong(c,group->pel.size);
         /* First and last IDs. */
-        if (raxSize(group->pel) == 0) {
+        if (group->pel.size == 0) {
             addReplyNull(c); /* Start. */
             addReplyNull(c); /* End. */
             addReplyNullArray(c); /* Clients. */
         } else {
             /* Start. */
-            raxIterator ri;
-            raxStart(&ri,group->pel);
-            raxSeek(&ri,"^",NULL,0);
-            raxNext(&ri);
-            streamDecodeID(ri.key,&startid);
+            streamPelEdgeID(group,1,&startid);
             addReplyStreamID(c,&startid);
 
             /* End. */
-            raxSeek(&ri,"$",NULL,0);
-            raxNext(&ri);
-            streamDecodeID(ri.key,&endid);
+            streamPelEdgeID(group,0,&endid);
             addReplyStreamID(c,&endid);
-            raxStop(&ri);
 
             /* Consumers with pending messages. */
+            raxIterator ri;
             raxStart(&ri,group->consumers);
             raxSeek(&ri,"^",NULL,0);
             void *arraylen_ptr = addReplyDeferredLen(c);
@@ -2999,49 +4350,57 @@ void xpendingCommand(client *c) {
             }
         }
 
-        rax *pel = consumer ? consumer->pel : group->pel;
-        unsigned char startkey[sizeof(streamID)];
-        unsigned char endkey[sizeof(streamID)];
-        raxIterator ri;
         mstime_t now = mstime();
-
-        streamEncodeID(startkey,&startid);
-        streamEncodeID(endkey,&endid);
-        raxStart(&ri,pel);
-        raxSeek(&ri,">=",startkey,sizeof(startkey));
         void *arraylen_ptr = addReplyDeferredLen(c);
         size_t arraylen = 0;
 
-        while(count && raxNext(&ri) && memcmp(ri.key,endkey,ri.key_len) <= 0) {
-            streamNACK *nack = ri.data;
+        /* With IDLE, the range is scanned in ID order checking up to ten
+         * entries per entry to return: when this is not enough, few entries
+         * are idle enough, and the rest of the range is searched using the
+         * delivery time index instead. */
+        long long budget = LLONG_MAX;
+        if (minidle > 0 && count) budget = count > LLONG_MAX/10 ? LLONG_MAX : count*10;
+        uint64_t scanned = 0;
+        if (consumer) {
+            unsigned char startkey[sizeof(streamID)];
+            unsigned char endkey[sizeof(streamID)];
+            raxIterator ri;
 
-            if (minidle) {
-                mstime_t this_idle = now - nack->delivery_time;
-                if (this_idle < minidle) continue;
+            streamEncodeID(startkey,&startid);
+            streamEncodeID(endkey,&endid);
+            raxStart(&ri,consumer->pel);
+            raxSeek(&ri,">=",startkey,sizeof(startkey));
+            while(count && raxNext(&ri) && memcmp(ri.key,endkey,ri.key_len) <= 0) {
+                streamID id;
+                streamNACK nack;
+                streamDecodeID(ri.key,&id);
+                if (scanned++ == (uint64_t)budget &&
+                    xpendingReplyIdle(c,group,now,minidle,&id,&endid,consumer,
+                                      streamPelIdleBudget(budget),&count,&arraylen)) break;
+                serverAssert(streamPelLookup(group,&id,&nack));
+                if (minidle && now - nack.delivery_time < minidle) continue;
+                addReplyPendingEntry(c,&nack,now);
+                arraylen++;
+                count--;
             }
-
-            arraylen++;
-            count--;
-            addReplyArrayLen(c,4);
-
-            /* Entry ID. */
-            streamID id;
-            streamDecodeID(ri.key,&id);
-            addReplyStreamID(c,&id);
-
-            /* Consumer name. */
-            addReplyBulkCBuffer(c,nack->consumer->name,
-                                sdslen(nack->consumer->name));
-
-            /* Milliseconds elapsed since last delivery. */
-            mstime_t elapsed = now - nack->delivery_time;
-            if (elapsed < 0) elapsed = 0;
-            addReplyLongLong(c,elapsed);
-
-            /* Number of deliveries. */
-            addReplyLongLong(c,nack->delivery_count);
+            raxStop(&ri);
+        } else {
+            streamPelIterator it;
+            streamNACK nack;
+            streamPelIteratorStart(&it,group,&startid);
+            while(count && streamPelIteratorNext(&it,&nack) &&
+                  streamCompareID(&nack.id,&endid) <= 0)
+            {
+                if (scanned++ == (uint64_t)budget &&
+                    xpendingReplyIdle(c,group,now,minidle,&nack.id,&endid,NULL,
+                                      streamPelIdleBudget(budget),&count,&arraylen)) break;
+                if (minidle && now - nack.delivery_time < minidle) continue;
+                addReplyPendingEntry(c,&nack,now);
+                arraylen++;
+                count--;
+            }
+            streamPelIteratorStop(&it);
         }
-        raxStop(&ri);
         setDeferredArrayLen(c,arraylen_ptr,arraylen);
     }
 }
@@ -3220,24 +4579,29 @@ void xclaimCommand(client *c) {
     sds name = c->argv[3]->ptr;
     for (int j = 5; j <= last_id_arg; j++) {
         streamID id = ids[j-5];
-        unsigned char buf[sizeof(streamID)];
-        streamEncodeID(buf,&id);
 
         /* Lookup the ID in the group PEL. */
-        streamNACK *nack = raxFind(group->pel,buf,sizeof(buf));
-
-        /* Item must exist for us to transfer it to another consumer. */
-        if (!streamEntryExists(o->ptr,&id)) {
+        streamNACK nack;
+        int found = streamPelLookup(group,&id,&nack);
+
+        /* Item must exist for us to transfer it to another consumer. If we
+         * can't tell, the PEL is left untouched, and the entry is replaced
+         * by the error in the reply. */
+        int exists = streamEntryExists(o->ptr,&id);
+        if (exists == -1) {
+            addReplyStreamReadError(c,errno);
+            arraylen++;
+            continue;
+        }
+        if (!exists) {
             /* Clear this entry from the PEL, it no longer exists */
-            if (nack != raxNotFound) {
+            if (found) {
                 /* Propagate this change (we are going to delete the NACK). */
-                streamPropagateXCLAIM(c,c->argv[1],group,c->argv[2],c->argv[j],nack);
+                streamPropagateXCLAIM(c,c->argv[1],group,c->argv[2],c->argv[j],&nack);
                 propagate_last_id = 0; /* Will be propagated by XCLAIM itself. */
                 server.dirty++;
                 /* Release the NACK */
-                raxRemove(group->pel,buf,sizeof(buf),NULL);
-                raxRemove(nack->consumer->pel,buf,sizeof(buf),NULL);
-                streamFreeNACK(nack);
+                streamPelDelete(group,&id,NULL);
             }
             continue;
         }
@@ -3246,22 +4610,27 @@ void xclaimCommand(client *c) {
          * exists in the Stream. In such case, we'll create a new
          * entry in the PEL from scratch, so that XCLAIM can also
          * be used to create entries in the PEL. Useful for AOF
-         * and replication of consumer groups. */
-        if (force && nack == raxNotFound) {
+         * and replication of consumer groups. The NACK is added to
+         * the PEL below, once its consumer is known. */
+        int created = 0;
+        if (force && !found) {
             /* Create the NACK. */
-            nack = streamCreateNACK(NULL);
-            raxInsert(group->pel,buf,sizeof(buf),nack,NULL);
+            nack.id = id;
+            nack.delivery_time = now;
+            nack.delivery_count = 1;
+            nack.consumer = NULL;
+            created = 1;
         }
 
-        if (nack != raxNotFound) {
+        if (found || created) {
             /* We need to check if the minimum idle time requested
              * by the caller is satisfied by this entry.
              *
              * Note that the nack could be created by FORCE, in this
              * case there was no pre-existing entry and minidle should
-             * be ignored, but in that case nack->consumer is NULL. */
-            if (nack->consumer && minidle) {
-                mstime_t this_idle = now - nack->delivery_time;
+             * be ignored. */
+            if (!created && minidle) {
+                mstime_t this_idle = now - nack.delivery_time;
                 if (this_idle < minidle) continue;
             }
 
@@ -3270,26 +4639,21 @@ void xclaimCommand(client *c) {
             {
                 consumer = streamCreateConsumer(group,name,c->argv[1],c->db->id,SCC_DEFAULT);
             }
-            if (nack->consumer != consumer) {
-                /* Remove the entry from the old consumer.
-                 * Note that nack->consumer is NULL if we created the
-                 * NACK above because of the FORCE option. */
-                if (nack->consumer)
-                    raxRemove(nack->consumer->pel,buf,sizeof(buf),NULL);
-            }
-            nack->delivery_time = deliverytime;
+            nack.delivery_time = deliverytime;
             /* Set the delivery attempts counter if given, otherwise
              * autoincrement unless JUSTID option provided */
             if (retrycount >= 0) {
-                nack->delivery_count = retrycount;
+                nack.delivery_count = retrycount;
             } else if (!justid) {
-                nack->delivery_count++;
-            }
-            if (nack->consumer != consumer) {
-                /* Add the entry in the new consumer local PEL. */
-                raxInsert(consumer->pel,buf,sizeof(buf),nack,NULL);
-                nack->consumer = consumer;
+                nack.delivery_count++;
             }
+            /* Update the entry, moving it to the new consumer local PEL
+             * if needed. */
+            nack.consumer = consumer;
+            if (created)
+                streamPelInsert(group,&nack);
+            else
+                streamPelUpdate(group,&nack);
             /* Send the reply for this entry. */
             if (justid) {
                 addReplyStreamID(c,&id);
@@ -3299,7 +4663,7 @@ void xclaimCommand(client *c) {
             arraylen++;
 
             /* Propagate this change. */
-            streamPropagateXCLAIM(c,c->argv[1],group,c->argv[2],c->argv[j],nack);
+            streamPropagateXCLAIM(c,c->argv[1],group,c->argv[2],c->argv[j],&nack);
             propagate_last_id = 0; /* Will be propagated by XCLAIM itself. */
             server.dirty++;
         }
@@ -3386,102 +4750,124 @@ void xautoclaimCommand(client *c) {
 
     /* Do the actual claiming. */
     streamConsumer *consumer = NULL;
-    long long attempts = count*10;
+    long long attempts = count > LLONG_MAX/10 ? LLONG_MAX : count*10;
 
     addReplyArrayLen(c, 3); /* We add another reply later */
     void *endidptr = addReplyDeferredLen(c); /* reply[0] */
     void *arraylenptr = addReplyDeferredLen(c); /* reply[1] */
 
-    unsigned char startkey[sizeof(streamID)];
-    streamEncodeID(startkey,&startid);
-    raxIterator ri;
-    raxStart(&ri,group->pel);
-    raxSeek(&ri,">=",startkey,sizeof(startkey));
     size_t arraylen = 0;
     mstime_t now = mstime();
     sds name = c->argv[3]->ptr;
-    streamID *deleted_ids = zmalloc(count * sizeof(streamID));
-    int deleted_id_num = 0;
-    while (attempts-- && count && raxNext(&ri)) {
-        streamNACK *nack = ri.data;
 
-        streamID id;
-        streamDecodeID(ri.key, &id);
+    /* Find, in ID order, the entries to claim, idle for at least 'minidle',
+     * and the ones to remove from the PEL since they were deleted from the
+     * stream, whatever their idle time. The PEL is scanned from the start
+     * ID, up to 'attempts' entries, and the cursor is the entry following
+     * the last one we scan. If this is not enough to find 'count' entries
+     * to claim, few entries are idle enough: the rest of them are found
+     * using the delivery time index, which only visits the idle ones, and
+     * the cursor is the first one we don't claim. */
+    streamNACK *nacks;
+    long numnacks = 0, processed;
+    streamID endid = {0,0};
+    int indexed = 0;
+    streamPelIterator it;
+    streamNACK nack;
+    long long claimable = count;
+    uint64_t maxnacks = group->pel.size;
+    if ((uint64_t)attempts < maxnacks) maxnacks = attempts;
+    nacks = zmalloc(sizeof(streamNACK)*maxnacks);
+    streamPelIteratorStart(&it,group,&startid);
+    while (attempts-- && claimable && streamPelIteratorNext(&it,&nack)) {
+        if (streamEntryExists(o->ptr,&nack.id)) {
+            if (minidle && now - nack.delivery_time < minidle) continue;
+            claimable--;
+        }
+        nacks[numnacks++] = nack;
+    }
+    /* We need to return the next entry as a cursor for the next
+     * XAUTOCLAIM call */
+    if (streamPelIteratorNext(&it,&nack)) endid = nack.id;
+    streamPelIteratorStop(&it);
+
+    if (minidle && claimable && (endid.ms || endid.seq)) {
+        streamNACK *idle;
+        streamID maxid = {UINT64_MAX,UINT64_MAX};
+        long numidle = streamPelCollectIdle(group,now-minidle,&endid,&maxid,
+                                            NULL,streamPelIdleBudget(maxnacks),&idle);
+        if (numidle > 0) {
+            nacks = zrealloc(nacks,sizeof(streamNACK)*(numnacks+numidle));
+            memcpy(nacks+numnacks,idle,sizeof(streamNACK)*numidle);
+            numnacks += numidle;
+        }
+        if (numidle != -1) {
+            indexed = 1;
+            endid.ms = endid.seq = 0;
+            zfree(idle);
+        }
+    }
 
-        /* Item must exist for us to transfer it to another consumer. */
-        if (!streamEntryExists(o->ptr,&id)) {
+    streamID *deleted_ids = zmalloc(numnacks * sizeof(streamID));
+    int deleted_id_num = 0;
+    for (processed = 0; processed < numnacks && count; processed++) {
+        streamNACK *nack = nacks+processed;
+        robj *idstr = createObjectFromStreamID(&nack->id);
+
+        /* Item must exist for us to transfer it to another consumer. If we
+         * can't tell, the PEL is left untouched, and the entry is replaced
+         * by the error in the reply. */
+        int exists = streamEntryExists(o->ptr,&nack->id);
+        if (exists == -1) {
+            addReplyStreamReadError(c,errno);
+            decrRefCount(idstr);
+            arraylen++;
+            count--;
+            continue;
+        }
+        if (!exists) {
             /* Propagate this change (we are going to delete the NACK). */
-            robj *idstr = createObjectFromStreamID(&id);
             streamPropagateXCLAIM(c,c->argv[1],group,c->argv[2],idstr,nack);
             decrRefCount(idstr);
             server.dirty++;
             /* Clear this entry from the PEL, it no longer exists */
-            raxRemove(group->pel,ri.key,ri.key_len,NULL);
-            raxRemove(nack->consumer->pel,ri.key,ri.key_len,NULL);
-            streamFreeNACK(nack);
+            streamPelDelete(group,&nack->id,NULL);
             /* Remember the ID for later */
-            deleted_ids[deleted_id_num++] = id;
-            raxSeek(&ri,">=",ri.key,ri.key_len);
+            deleted_ids[deleted_id_num++] = nack->id;
             continue;
         }
 
-        if (minidle) {
-            mstime_t this_idle = now - nack->delivery_time;
-            if (this_idle < minidle)
-                continue;
-        }
-
         if (consumer == NULL &&
             (consumer = streamLookupConsumer(group,name,SLC_DEFAULT)) == NULL)
         {
             consumer = streamCreateConsumer(group,name,c->argv[1],c->db->id,SCC_DEFAULT);
         }
-        if (nack->consumer != consumer) {
-            /* Remove the entry from the old consumer.
-             * Note that nack->consumer is NULL if we created the
-             * NACK above because of the FORCE option. */
-            if (nack->consumer)
-                raxRemove(nack->consumer->pel,ri.key,ri.key_len,NULL);
-        }
 
         /* Update the consumer and idle time. */
         nack->delivery_time = now;
         /* Increment the delivery attempts counter unless JUSTID option provided */
         if (!justid)
             nack->delivery_count++;
-
-        if (nack->consumer != consumer) {
-            /* Add the entry in the new consumer local PEL. */
-            raxInsert(consumer->pel,ri.key,ri.key_len,nack,NULL);
-            nack->consumer = consumer;
-        }
+        /* Move the entry to the new consumer local PEL if needed. */
+        nack->consumer = consumer;
+        streamPelUpdate(group,nack);
 
         /* Send the reply for this entry. */
         if (justid) {
-            addReplyStreamID(c,&id);
+            addReplyStreamID(c,&nack->id);
         } else {
-            serverAssert(streamReplyWithRange(c,o->ptr,&id,&id,1,0,NULL,NULL,STREAM_RWR_RAWENTRIES,NULL) == 1);
+            serverAssert(streamReplyWithRange(c,o->ptr,&nack->id,&nack->id,1,0,NULL,NULL,STREAM_RWR_RAWENTRIES,NULL) == 1);
         }
         arraylen++;
         count--;
 
         /* Propagate this change. */
-        robj *idstr = createObjectFromStreamID(&id);
         streamPropagateXCLAIM(c,c->argv[1],group,c->argv[2],idstr,nack);
         decrRefCount(idstr);
         server.dirty++;
     }
-
-    /* We need to return the next entry as a cursor for the next XAUTOCLAIM call */
-    raxNext(&ri);
-
-    streamID endid;
-    if (raxEOF(&ri)) {
-        endid.ms = endid.seq = 0;
-    } else {
-        streamDecodeID(ri.key, &endid);
-    }
-    raxStop(&ri);
+    if (indexed && processed < numnacks) endid = nacks[processed].id;
+    zfree(nacks);
 
     setDeferredArrayLen(c,arraylenptr,arraylen);
     setDeferredReplyStreamID(c,endidptr,&endid);
@@ -3519,12 +4905,18 @@ void xdelCommand(client *c) {
         if (streamParseStrictIDOrReply(c,c->argv[j],&ids[j-2],0,NULL) != C_OK) goto cleanup;
     }
 
-    /* Actually apply the command. */
-    int deleted = 0;
+    /* Actually apply the command. If an entry can't be read from disk, we
+     * stop there, and only the IDs processed so far are propagated. */
+    int deleted = 0, error = 0, processed;
     int first_entry = 0;
-    for (int j = 2; j < c->argc; j++) {
-        streamID *id = &ids[j-2];
-        if (streamDeleteItem(s,id)) {
+    for (processed = 2; processed < c->argc; processed++) {
+        streamID *id = &ids[processed-2];
+        int res = streamDeleteItem(s,id);
+        if (res == -1) {
+            error = errno;
+            break;
+        }
+        if (res) {
             /* We want to know if the first entry in the stream was deleted
              * so we can later set the new one. */
             if (streamCompareID(id,&s->first_id) == 0) {
@@ -3553,8 +4945,19 @@ void xdelCommand(client *c) {
         signalModifiedKey(c,c->db,c->argv[1]);
         notifyKeyspaceEvent(NOTIFY_STREAM,"xdel",c->argv[1],c->db->id);
         server.dirty += deleted;
+        if (error) {
+            robj **argv = zmalloc(sizeof(robj*)*processed);
+            for (int j = 0; j < processed; j++) {
+                argv[j] = c->argv[j];
+                incrRefCount(argv[j]);
+            }
+            replaceClientCommandVector(c,processed,argv);
+        }
     }
-    addReplyLongLong(c,deleted);
+    if (error)
+        addReplyStreamReadError(c,error);
+    else
+        addReplyLongLong(c,deleted);
 cleanup:
     if (ids != static_ids) zfree(ids);
 }
@@ -3730,39 +5133,38 @@ void xinfoReplyWithStreamInfo(client *c, stream *s) {
 
                 /* Group PEL count */
                 addReplyBulkCString(c,"pel-count");
-                addReplyLongLong(c,raxSize(cg->pel));
+                addReplyLongLong(c,cg->pel.size);
 
                 /* Group PEL */
                 addReplyBulkCString(c,"pending");
                 long long arraylen_cg_pel = 0;
                 void *arrayptr_cg_pel = addReplyDeferredLen(c);
-                raxIterator ri_cg_pel;
-                raxStart(&ri_cg_pel,cg->pel);
-                raxSeek(&ri_cg_pel,"^",NULL,0);
-                while(raxNext(&ri_cg_pel) && (!count || arraylen_cg_pel < count)) {
-                    streamNACK *nack = ri_cg_pel.data;
+                streamPelIterator it_cg_pel;
+                streamNACK nack;
+                streamPelIteratorStart(&it_cg_pel,cg,NULL);
+                while((!count || arraylen_cg_pel < count) &&
+                      streamPelIteratorNext(&it_cg_pel,&nack))
+                {
                     addReplyArrayLen(c,4);
 
                     /* Entry ID. */
-                    streamID id;
-                    streamDecodeID(ri_cg_pel.key,&id);
-                    addReplyStreamID(c,&id);
+                    addReplyStreamID(c,&nack.id);
 
                     /* Consumer name. */
-                    serverAssert(nack->consumer); /* assertion for valgrind (avoid NPD) */
-                    addReplyBulkCBuffer(c,nack->consumer->name,
-                                        sdslen(nack->consumer->name));
+                    serverAssert(nack.consumer); /* assertion for valgrind (avoid NPD) */
+                    addReplyBulkCBuffer(c,nack.consumer->name,
+                                        sdslen(nack.consumer->name));
 
                     /* Last delivery. */
-                    addReplyLongLong(c,nack->delivery_time);
+                    addReplyLongLong(c,nack.delivery_time);
 
                     /* Number of deliveries. */
-                    addReplyLongLong(c,nack->delivery_count);
+                    addReplyLongLong(c,nack.delivery_count);
 
                     arraylen_cg_pel++;
                 }
                 setDeferredArrayLen(c,arrayptr_cg_pel,arraylen_cg_pel);
-                raxStop(&ri_cg_pel);
+                streamPelIteratorStop(&it_cg_pel);
 
                 /* Consumers */
                 addReplyBulkCString(c,"consumers");
@@ -3794,19 +5196,19 @@ void xinfoReplyWithStreamInfo(client *c, stream *s) {
                     raxStart(&ri_cpel,consumer->pel);
                     raxSeek(&ri_cpel,"^",NULL,0);
                     while(raxNext(&ri_cpel) && (!count || arraylen_cpel < count)) {
-                        streamNACK *nack = ri_cpel.data;
                         addReplyArrayLen(c,3);
 
                         /* Entry ID. */
                         streamID id;
                         streamDecodeID(ri_cpel.key,&id);
+                        serverAssert(streamPelLookup(cg,&id,&nack));
                         addReplyStreamID(c,&id);
 
                         /* Last delivery. */
-                        addReplyLongLong(c,nack->delivery_time);
+                        addReplyLongLong(c,nack.delivery_time);
 
                         /* Number of deliveries. */
-                        addReplyLongLong(c,nack->delivery_count);
+                        addReplyLongLong(c,nack.delivery_count);
 
                         arraylen_cpel++;
                     }
@@ -3911,7 +5313,7 @@ NULL
             addReplyBulkCString(c,"consumers");
             addReplyLongLong(c,raxSize(cg->consumers));
             addReplyBulkCString(c,"pending");
-            addReplyLongLong(c,raxSize(cg->pel));
+            addReplyLongLong(c,cg->pel.size);
             addReplyBulkCString(c,"last-delivered-id");
             addReplyStreamID(c,&cg->last_id);
             addReplyBulkCString(c,"entries-read");
@@ -2877,6 +2877,7 @@ struct zrange_result_handler {
     robj                                *dstkey;
     robj                                *dstobj;
     void                                *userdata;
+    replyWriter                          writer;
     int                                  withscores;
     int                                  should_emit_array_length;
     zrangeResultBeginFunction            beginResultEmission;
@@ -2899,22 +2900,23 @@ static void zrangeResultBeginClient(zrange_result_handler *handler, long length)
         }
         addReplyArrayLen(handler->client, length);
         handler->userdata = NULL;
-        return;
+    } else {
+        handler->userdata = addReplyDeferredLen(handler->client);
     }
-    handler->userdata = addReplyDeferredLen(handler->client);
+    replyWriterStart(&handler->writer, handler->client);
 }
 
 static void zrangeResultEmitCBufferToClient(zrange_result_handler *handler,
     const void *value, size_t value_length_in_bytes, double score)
 {
     if (handler->should_emit_array_length) {
-        addReplyArrayLen(handler->client, 2);
+        replyWriterArrayLen(&handler->writer, 2);
     }
 
-    addReplyBulkCBuffer(handler->client, value, value_length_in_bytes);
+    replyWriterBulkCBuffer(&handler->writer, value, value_length_in_bytes);
 
     if (handler->withscores) {
-        addReplyDouble(handler->client, score);
+        replyWriterDouble(&handler->writer, score);
     }
 }
 
@@ -2922,19 +2924,21 @@ static void zrangeResultEmitLongLongToClient(zrange_result_handler *handler,
     long long value, double score)
 {
     if (handler->should_emit_array_length) {
-        addReplyArrayLen(handler->client, 2);
+        replyWriterArrayLen(&handler->writer, 2);
     }
 
-    addReplyBulkLongLong(handler->client, value);
+    replyWriterBulkLongLong(&handler->writer, value);
 
     if (handler->withscores) {
-        addReplyDouble(handler->client, score);
+        replyWriterDouble(&handler->writer, score);
     }
 }
 
 static void zrangeResultFinalizeClient(zrange_result_handler *handler,
     size_t result_count)
 {
+    replyWriterEnd(&handler->writer);
+
     /* If the reply size was know at start there's nothing left to do */
     if (!handler->userdata)
         return;
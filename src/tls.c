@@ -43,6 +43,9 @@
 #include <openssl/decoder.h>
 #endif
 #include <sys/uio.h>
+#ifdef HAVE_SENDFILE
+#include <sys/sendfile.h>
+#endif
 
 #define REDIS_TLS_PROTO_TLSv1       (1<<0)
 #define REDIS_TLS_PROTO_TLSv1_1     (1<<1)
@@ -235,6 +238,11 @@ static SSL_CTX *createSSLContext(redisTLSContextConfig *ctx_config, int protocol
     SSL_CTX_set_options(ctx, SSL_OP_NO_COMPRESSION);
 #endif
 
+#ifdef SSL_OP_ENABLE_KTLS
+    if (ctx_config->ktls)
+        SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+
     SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE|SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
     SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER|SSL_VERIFY_FAIL_IF_NO_PEER_CERT, NULL);
 
@@ -444,6 +452,9 @@ typedef enum {
 #define TLS_CONN_FLAG_READ_WANT_WRITE   (1<<0)
 #define TLS_CONN_FLAG_WRITE_WANT_READ   (1<<1)
 #define TLS_CONN_FLAG_FD_SET            (1<<2)
+#define TLS_CONN_FLAG_KTLS_SEND         (1<<3)
+#define TLS_CONN_FLAG_POSTPONE_UPDATE_STATE (1<<4)
+#define TLS_CONN_FLAG_HANDSHAKE_ASYNC   (1<<5)
 
 typedef struct tls_connection {
     connection c;
@@ -451,6 +462,10 @@ typedef struct tls_connection {
     SSL *ssl;
     char *ssl_error;
     listNode *pending_list_node;
+    /* Result of the last handshake step run by a handshake thread. */
+    int handshake_ret;
+    int handshake_err;
+    WantIOType handshake_want;
 } tls_connection;
 
 static connection *createTLSConnection(int client_side) {
@@ -549,6 +564,7 @@ static int handleSSLReturnCode(tls_connection *conn, int ret_value, WantIOType *
 }
 
 void registerSSLEvent(tls_connection *conn, WantIOType want) {
+    if (conn->flags & TLS_CONN_FLAG_HANDSHAKE_ASYNC) return;
     int mask = aeGetFileEvents(server.el, conn->c.fd);
 
     switch (want) {
@@ -569,6 +585,8 @@ void registerSSLEvent(tls_connection *conn, WantIOType want) {
 }
 
 void updateSSLEvent(tls_connection *conn) {
+    if (conn->flags & (TLS_CONN_FLAG_POSTPONE_UPDATE_STATE|
+                       TLS_CONN_FLAG_HANDSHAKE_ASYNC)) return;
     int mask = aeGetFileEvents(server.el, conn->c.fd);
     int need_read = conn->c.read_handler || (conn->flags & TLS_CONN_FLAG_WRITE_WANT_READ);
     int need_write = conn->c.write_handler || (conn->flags & TLS_CONN_FLAG_READ_WANT_WRITE);
@@ -584,6 +602,164 @@ void updateSSLEvent(tls_connection *conn) {
         aeDeleteFileEvent(server.el, conn->c.fd, AE_WRITABLE);
 }
 
+/* Called once the handshake completed: if OpenSSL handed the encryption of
+ * the records we send to the kernel, writes can bypass OpenSSL and use the
+ * socket directly. From now on all the writes must do so, otherwise a
+ * record partially written by SSL_write() could be interleaved with our
+ * data. */
+static void tlsCheckKTLS(tls_connection *conn) {
+#if defined(SSL_OP_ENABLE_KTLS) && defined(BIO_get_ktls_send)
+    if (BIO_get_ktls_send(SSL_get_wbio(conn->ssl)))
+        conn->flags |= TLS_CONN_FLAG_KTLS_SEND;
+#else
+    UNUSED(conn);
+#endif
+}
+
+/* If SSL has pending that, already read from the socket, we're at risk of
+ * not calling the read handler again, make sure to add it to a list of
+ * pending connection that should be handled anyway. */
+static void updatePendingData(tls_connection *conn) {
+    if (conn->flags & TLS_CONN_FLAG_POSTPONE_UPDATE_STATE) return;
+
+    if (conn->ssl && SSL_pending(conn->ssl) > 0) {
+        if (!conn->pending_list_node) {
+            listAddNodeTail(pending_list, conn);
+            conn->pending_list_node = listLast(pending_list);
+        }
+    } else if (conn->pending_list_node) {
+        listDelNode(pending_list, conn->pending_list_node);
+        conn->pending_list_node = NULL;
+    }
+}
+
+/* TLS handshakes, that are CPU intensive, can be executed by a pool of
+ * threads (see tls-handshake-threads), so that many clients connecting at
+ * the same time don't block the event loop. Every time the socket of a
+ * connection in the accepting state is ready, the file events are removed
+ * and a thread calls SSL_accept(): the main thread is notified via a pipe
+ * and continues from the result as if SSL_accept() was called by
+ * tlsHandleEvent(). While a handshake step is running the connection can't
+ * be closed, closing it is deferred until the step completes. */
+static pthread_t *handshake_threads = NULL;
+static pthread_mutex_t handshake_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t handshake_cond = PTHREAD_COND_INITIALIZER;
+static list *handshake_jobs = NULL;     /* Connections waiting for a thread. */
+static list *handshake_done = NULL;     /* Connections with a result. */
+static int handshake_pipe[2] = {-1, -1};
+
+static void *tlsHandshakeThreadMain(void *arg) {
+    UNUSED(arg);
+    redis_set_thread_title("tls_handshake");
+
+    while(1) {
+        pthread_mutex_lock(&handshake_mutex);
+        while (listLength(handshake_jobs) == 0)
+            pthread_cond_wait(&handshake_cond, &handshake_mutex);
+        listNode *ln = listFirst(handshake_jobs);
+        tls_connection *conn = listNodeValue(ln);
+        listDelNode(handshake_jobs, ln);
+        pthread_mutex_unlock(&handshake_mutex);
+
+        ERR_clear_error();
+        conn->handshake_ret = SSL_accept(conn->ssl);
+        conn->handshake_want = 0;
+        conn->handshake_err = conn->handshake_ret <= 0 ?
+            handleSSLReturnCode(conn, conn->handshake_ret, &conn->handshake_want) : 0;
+
+        pthread_mutex_lock(&handshake_mutex);
+        listAddNodeTail(handshake_done, conn);
+        pthread_mutex_unlock(&handshake_mutex);
+        if (write(handshake_pipe[1], "A", 1) != 1) {
+            /* Pipe is non-blocking, write() may fail if it's full. */
+        }
+    }
+    return NULL;
+}
+
+/* Called by the event loop when handshake threads completed some step. */
+static void tlsHandshakeDoneHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
+    UNUSED(el);
+    UNUSED(fd);
+    UNUSED(privdata);
+    UNUSED(mask);
+    char buf[128];
+    list *done;
+
+    while (read(handshake_pipe[0], buf, sizeof(buf)) == sizeof(buf));
+
+    pthread_mutex_lock(&handshake_mutex);
+    done = handshake_done;
+    handshake_done = listCreate();
+    pthread_mutex_unlock(&handshake_mutex);
+
+    while (listLength(done)) {
+        listNode *ln = listFirst(done);
+        tls_connection *conn = listNodeValue(ln);
+        listDelNode(done, ln);
+
+        conn->flags &= ~TLS_CONN_FLAG_HANDSHAKE_ASYNC;
+        connDecrRefs((connection *) conn);
+        if (conn->c.flags & CONN_FLAG_CLOSE_SCHEDULED) {
+            if (!connHasRefs((connection *) conn)) connClose((connection *) conn);
+            continue;
+        }
+
+        if (conn->handshake_ret <= 0) {
+            if (!conn->handshake_err) {
+                registerSSLEvent(conn, conn->handshake_want);
+                continue;
+            }
+            /* If not handled, it's an error */
+            conn->c.state = CONN_STATE_ERROR;
+        } else {
+            conn->c.state = CONN_STATE_CONNECTED;
+            tlsCheckKTLS(conn);
+        }
+
+        if (!callHandler((connection *) conn, conn->c.conn_handler)) continue;
+        conn->c.conn_handler = NULL;
+        updateSSLEvent(conn);
+    }
+    listRelease(done);
+}
+
+static void tlsStartHandshakeThreads(void) {
+    handshake_jobs = listCreate();
+    handshake_done = listCreate();
+    if (anetPipe(handshake_pipe, O_CLOEXEC|O_NONBLOCK, O_CLOEXEC|O_NONBLOCK) == -1) {
+        serverLog(LL_WARNING, "Can't create the pipe for TLS handshake threads: %s",
+            strerror(errno));
+        exit(1);
+    }
+    if (aeCreateFileEvent(server.el, handshake_pipe[0], AE_READABLE,
+                          tlsHandshakeDoneHandler, NULL) == AE_ERR)
+    {
+        serverPanic("Unrecoverable error registering the TLS handshake pipe");
+    }
+    handshake_threads = zmalloc(sizeof(pthread_t) * server.tls_handshake_threads);
+    for (int j = 0; j < server.tls_handshake_threads; j++) {
+        if (pthread_create(&handshake_threads[j], NULL, tlsHandshakeThreadMain, NULL) != 0) {
+            serverLog(LL_WARNING, "Fatal: Can't initialize TLS handshake threads.");
+            exit(1);
+        }
+    }
+}
+
+/* Hand the next step of the handshake of 'conn' to the handshake threads. */
+static void tlsSubmitHandshake(tls_connection *conn) {
+    if (handshake_threads == NULL) tlsStartHandshakeThreads();
+
+    aeDeleteFileEvent(server.el, conn->c.fd, AE_READABLE|AE_WRITABLE);
+    conn->flags |= TLS_CONN_FLAG_HANDSHAKE_ASYNC;
+    connIncrRefs((connection *) conn);
+
+    pthread_mutex_lock(&handshake_mutex);
+    listAddNodeTail(handshake_jobs, conn);
+    pthread_cond_signal(&handshake_cond);
+    pthread_mutex_unlock(&handshake_mutex);
+}
+
 static void tlsHandleEvent(tls_connection *conn, int mask) {
     int ret, conn_error;
 
@@ -621,6 +797,7 @@ static void tlsHandleEvent(tls_connection *conn, int mask) {
                     conn->c.state = CONN_STATE_ERROR;
                 } else {
                     conn->c.state = CONN_STATE_CONNECTED;
+                    tlsCheckKTLS(conn);
                 }
             }
 
@@ -628,6 +805,10 @@ static void tlsHandleEvent(tls_connection *conn, int mask) {
             conn->c.conn_handler = NULL;
             break;
         case CONN_STATE_ACCEPTING:
+            if (server.tls_handshake_threads) {
+                tlsSubmitHandshake(conn);
+                return;
+            }
             ret = SSL_accept(conn->ssl);
             if (ret <= 0) {
                 WantIOType want = 0;
@@ -644,6 +825,7 @@ static void tlsHandleEvent(tls_connection *conn, int mask) {
                 conn->c.state = CONN_STATE_ERROR;
             } else {
                 conn->c.state = CONN_STATE_CONNECTED;
+                tlsCheckKTLS(conn);
             }
 
             if (!callHandler((connection *) conn, conn->c.conn_handler)) return;
@@ -687,20 +869,7 @@ static void tlsHandleEvent(tls_connection *conn, int mask) {
                 if (!callHandler((connection *) conn, conn->c.read_handler)) return;
             }
 
-            /* If SSL has pending that, already read from the socket, we're at
-             * risk of not calling the read handler again, make sure to add it
-             * to a list of pending connection that should be handled anyway. */
-            if ((mask & AE_READABLE)) {
-                if (SSL_pending(conn->ssl) > 0) {
-                    if (!conn->pending_list_node) {
-                        listAddNodeTail(pending_list, conn);
-                        conn->pending_list_node = listLast(pending_list);
-                    }
-                } else if (conn->pending_list_node) {
-                    listDelNode(pending_list, conn->pending_list_node);
-                    conn->pending_list_node = NULL;
-                }
-            }
+            if ((mask & AE_READABLE)) updatePendingData(conn);
 
             break;
         }
@@ -721,6 +890,12 @@ static void tlsEventHandler(struct aeEventLoop *el, int fd, void *clientData, in
 static void connTLSClose(connection *conn_) {
     tls_connection *conn = (tls_connection *) conn_;
 
+    /* A handshake thread is using the connection, we'll close it once done. */
+    if (conn->flags & TLS_CONN_FLAG_HANDSHAKE_ASYNC) {
+        conn->c.flags |= CONN_FLAG_CLOSE_SCHEDULED;
+        return;
+    }
+
     if (conn->ssl) {
         SSL_free(conn->ssl);
         conn->ssl = NULL;
@@ -748,6 +923,14 @@ static int connTLSAccept(connection *_conn, ConnectionCallbackFunc accept_handle
 
     /* Try to accept */
     conn->c.conn_handler = accept_handler;
+
+    /* The ClientHello is often already queued on a new connection, so even
+     * the first step of the handshake is expensive: leave it to the
+     * handshake threads too. */
+    if (server.tls_handshake_threads) {
+        tlsSubmitHandshake(conn);
+        return C_OK;
+    }
     ret = SSL_accept(conn->ssl);
 
     if (ret <= 0) {
@@ -762,6 +945,7 @@ static int connTLSAccept(connection *_conn, ConnectionCallbackFunc accept_handle
     }
 
     conn->c.state = CONN_STATE_CONNECTED;
+    tlsCheckKTLS(conn);
     if (!callHandler((connection *) conn, conn->c.conn_handler)) return C_OK;
     conn->c.conn_handler = NULL;
 
@@ -783,11 +967,23 @@ static int connTLSConnect(connection *conn_, const char *addr, int port, const c
     return C_OK;
 }
 
+/* Handle the result of a write to the socket of a connection using kTLS,
+ * like connSocketWrite() does. */
+static ssize_t handleKTLSWriteResult(tls_connection *conn, ssize_t ret) {
+    if (ret < 0 && errno != EAGAIN) {
+        conn->c.last_errno = errno;
+        if (errno != EINTR) conn->c.state = CONN_STATE_ERROR;
+    }
+    return ret;
+}
+
 static int connTLSWrite(connection *conn_, const void *data, size_t data_len) {
     tls_connection *conn = (tls_connection *) conn_;
     int ret, ssl_err;
 
     if (conn->c.state != CONN_STATE_CONNECTED) return -1;
+    if (conn->flags & TLS_CONN_FLAG_KTLS_SEND)
+        return handleKTLSWriteResult(conn, write(conn->c.fd, data, data_len));
     ERR_clear_error();
     ret = SSL_write(conn->ssl, data, data_len);
     /* If system call was interrupted, there's no need to go through the full
@@ -821,6 +1017,14 @@ static int connTLSWrite(connection *conn_, const void *data, size_t data_len) {
 }
 
 static int connTLSWritev(connection *conn_, const struct iovec *iov, int iovcnt) {
+    tls_connection *conn = (tls_connection *) conn_;
+
+    /* With kTLS the kernel builds the records: no need to copy the buffers. */
+    if (conn->flags & TLS_CONN_FLAG_KTLS_SEND) {
+        if (conn->c.state != CONN_STATE_CONNECTED) return -1;
+        return handleKTLSWriteResult(conn, writev(conn->c.fd, iov, iovcnt));
+    }
+
     if (iovcnt == 1) return connTLSWrite(conn_, iov[0].iov_base, iov[0].iov_len);
 
     /* Accumulate the amount of bytes of each buffer and check if it exceeds NET_MAX_WRITES_PER_EVENT. */
@@ -857,6 +1061,18 @@ static int connTLSWritev(connection *conn_, const struct iovec *iov, int iovcnt)
     return connTLSWrite(conn_, buf, iov_bytes_len);
 }
 
+static ssize_t connTLSSendfile(connection *conn_, int fd, off_t offset, size_t count) {
+#ifdef HAVE_SENDFILE
+    tls_connection *conn = (tls_connection *) conn_;
+
+    if (conn->flags & TLS_CONN_FLAG_KTLS_SEND) {
+        if (conn->c.state != CONN_STATE_CONNECTED) return -1;
+        return handleKTLSWriteResult(conn, sendfile(conn->c.fd, fd, &offset, count));
+    }
+#endif
+    return connGenericSendfile(conn_, fd, offset, count);
+}
+
 static int connTLSRead(connection *conn_, void *buf, size_t buf_len) {
     tls_connection *conn = (tls_connection *) conn_;
     int ret;
@@ -952,6 +1168,7 @@ static int connTLSBlockingConnect(connection *conn_, const char *addr, int port,
     unsetBlockingTimeout(conn);
 
     conn->c.state = CONN_STATE_CONNECTED;
+    tlsCheckKTLS(conn);
     return C_OK;
 }
 
@@ -1007,6 +1224,21 @@ exit:
     return nread;
 }
 
+static void connTLSPostponeUpdateState(connection *conn_, int postpone) {
+    tls_connection *conn = (tls_connection *) conn_;
+    if (postpone)
+        conn->flags |= TLS_CONN_FLAG_POSTPONE_UPDATE_STATE;
+    else
+        conn->flags &= ~TLS_CONN_FLAG_POSTPONE_UPDATE_STATE;
+}
+
+static void connTLSUpdateState(connection *conn_) {
+    tls_connection *conn = (tls_connection *) conn_;
+    if (conn->c.state != CONN_STATE_CONNECTED) return;
+    updatePendingData(conn);
+    updateSSLEvent(conn);
+}
+
 static int connTLSGetType(connection *conn_) {
     (void) conn_;
 
@@ -1021,6 +1253,7 @@ ConnectionType CT_TLS = {
     .read = connTLSRead,
     .write = connTLSWrite,
     .writev = connTLSWritev,
+    .sendfile = connTLSSendfile,
     .close = connTLSClose,
     .set_write_handler = connTLSSetWriteHandler,
     .set_read_handler = connTLSSetReadHandler,
@@ -1028,7 +1261,9 @@ ConnectionType CT_TLS = {
     .sync_write = connTLSSyncWrite,
     .sync_read = connTLSSyncRead,
     .sync_readline = connTLSSyncReadLine,
-    .get_type = connTLSGetType
+    .get_type = connTLSGetType,
+    .postpone_update_state = connTLSPostponeUpdateState,
+    .update_state = connTLSUpdateState
 };
 
 int tlsHasPendingData() {
@@ -31,8 +31,13 @@
 #include "server.h"
 
 /* The tracking table is constituted by a radix tree of keys, each pointing
- * to a radix tree of client IDs, used to track the clients that may have
- * certain keys in their local, client side, cache.
+ * to an intset of client tracking slots, used to track the clients that may
+ * have certain keys in their local, client side, cache. Every client in
+ * tracking mode gets a small slot number, that is recycled when tracking is
+ * disabled: this takes a couple of bytes per client per key, instead of a
+ * radix tree of 64 bit client IDs. Stale slots are removed lazily, so a
+ * client that gets a recycled slot may receive some invalidation message
+ * for keys it never fetched, that is harmless.
  *
  * When a client enables tracking with "CLIENT TRACKING on", each key served to
  * the client is remembered in the table mapping the keys to the client IDs.
@@ -43,11 +48,14 @@
  * them when invalidation messages are received. */
 rax *TrackingTable = NULL;
 rax *PrefixTable = NULL;
-uint64_t TrackingTableTotalItems = 0; /* Total number of IDs stored across
+uint64_t TrackingTableTotalItems = 0; /* Total number of slots stored across
                                          the whole tracking table. This gives
                                          an hint about the total memory we
                                          are using server side for CSC. */
 robj *TrackingChannelName;
+client **TrackingSlots = NULL;  /* Slot -> client in tracking mode. */
+int TrackingSlotsSize = 0;
+list *TrackingFreeSlots = NULL; /* Slots to reuse, oldest released first. */
 
 /* This is the structure that we have as value of the PrefixTable, and
  * represents the list of keys modified, and the list of clients that need
@@ -58,6 +66,8 @@ typedef struct bcastState {
                        prefix. */
 } bcastState;
 
+sds trackingBuildBroadcastReply(client *c, rax *keys);
+
 /* Remove the tracking state from the client 'c'. Note that there is not much
  * to do for us here, if not to decrement the counter of the clients in
  * tracking mode, because we just store the ID of the client in the tracking
@@ -89,6 +99,18 @@ void disableTracking(client *c) {
         c->client_tracking_prefixes = NULL;
     }
 
+    /* Invalidation messages not yet delivered are discarded: the client is
+     * no longer caching keys. */
+    trackingDiscardPendingInvalidations(c);
+
+    /* Release the tracking slot. */
+    if (c->client_tracking_slot != -1) {
+        TrackingSlots[c->client_tracking_slot] = NULL;
+        listAddNodeTail(TrackingFreeSlots,
+                        (void*)(uintptr_t)c->client_tracking_slot);
+        c->client_tracking_slot = -1;
+    }
+
     /* Clear flags and adjust the count. */
     if (c->flags & CLIENT_TRACKING) {
         server.tracking_clients--;
@@ -191,6 +213,21 @@ void enableTracking(client *c, uint64_t redirect_to, uint64_t options, robj **pr
         TrackingTable = raxNew();
         PrefixTable = raxNew();
         TrackingChannelName = createStringObject("__redis__:invalidate",20);
+        TrackingFreeSlots = listCreate();
+    }
+
+    /* Assign a slot to the client, reusing a released one if possible. */
+    if (c->client_tracking_slot == -1) {
+        if (listLength(TrackingFreeSlots)) {
+            listNode *ln = listFirst(TrackingFreeSlots);
+            c->client_tracking_slot = (uintptr_t)listNodeValue(ln);
+            listDelNode(TrackingFreeSlots,ln);
+        } else {
+            c->client_tracking_slot = TrackingSlotsSize++;
+            TrackingSlots = zrealloc(TrackingSlots,
+                                     sizeof(client*)*TrackingSlotsSize);
+        }
+        TrackingSlots[c->client_tracking_slot] = c;
     }
 
     /* For broadcasting, set the list of prefixes in the client. */
@@ -240,15 +277,16 @@ void trackingRememberKeys(client *c) {
     for(int j = 0; j < numkeys; j++) {
         int idx = keys[j].pos;
         sds sdskey = c->argv[idx]->ptr;
-        rax *ids = raxFind(TrackingTable,(unsigned char*)sdskey,sdslen(sdskey));
-        if (ids == raxNotFound) {
-            ids = raxNew();
-            int inserted = raxTryInsert(TrackingTable,(unsigned char*)sdskey,
-                                        sdslen(sdskey),ids, NULL);
-            serverAssert(inserted == 1);
-        }
-        if (raxTryInsert(ids,(unsigned char*)&c->id,sizeof(c->id),NULL,NULL))
-            TrackingTableTotalItems++;
+        intset *slots = raxFind(TrackingTable,(unsigned char*)sdskey,sdslen(sdskey));
+        int newkey = slots == raxNotFound;
+        intset *newslots;
+        uint8_t added;
+        if (newkey) slots = intsetNew();
+        newslots = intsetAdd(slots,c->client_tracking_slot,&added);
+        if (newkey || newslots != slots)
+            raxInsert(TrackingTable,(unsigned char*)sdskey,sdslen(sdskey),
+                      newslots,NULL);
+        if (added) TrackingTableTotalItems++;
     }
     getKeysFreeResult(&result);
 }
@@ -363,16 +401,13 @@ void trackingInvalidateKey(client *c, robj *keyobj, int bcast) {
     if (bcast && raxSize(PrefixTable) > 0)
         trackingRememberKeyToBroadcast(c,(char *)key,keylen);
 
-    rax *ids = raxFind(TrackingTable,key,keylen);
-    if (ids == raxNotFound) return;
+    intset *slots = raxFind(TrackingTable,key,keylen);
+    if (slots == raxNotFound) return;
 
-    raxIterator ri;
-    raxStart(&ri,ids);
-    raxSeek(&ri,"^",NULL,0);
-    while(raxNext(&ri)) {
-        uint64_t id;
-        memcpy(&id,ri.key,sizeof(id));
-        client *target = lookupClientByID(id);
+    for (uint32_t j = 0; j < intsetLen(slots); j++) {
+        int64_t slot;
+        intsetGet(slots,j,&slot);
+        client *target = TrackingSlots[slot];
         /* Note that if the client is in BCAST mode, we don't want to
          * send invalidation messages that were pending in the case
          * previously the client was not in BCAST mode. This can happen if
@@ -393,41 +428,69 @@ void trackingInvalidateKey(client *c, robj *keyobj, int bcast) {
             continue;
         }
 
-        /* If target is current client, we need schedule key invalidation.
-         * As the invalidation messages may be interleaved with command
-         * response and should after command response */
-        if (target == server.current_client){
-            incrRefCount(keyobj);
-            listAddNodeTail(server.tracking_pending_keys, keyobj);
-        } else {
-            sendTrackingMessage(target,(char *)keyobj->ptr,sdslen(keyobj->ptr),0);
+        /* The invalidation is not sent right away: the keys invalidated
+         * for every client are coalesced, and sent as a single message
+         * later, see trackingFlushPendingInvalidations(). */
+        if (target->client_tracking_pending_keys == NULL) {
+            target->client_tracking_pending_keys = raxNew();
+            listAddNodeTail(server.tracking_pending_clients,target);
+            target->client_tracking_pending_node =
+                listLast(server.tracking_pending_clients);
         }
+        raxInsert(target->client_tracking_pending_keys,key,keylen,NULL,NULL);
     }
-    raxStop(&ri);
 
-    /* Free the tracking table: we'll create the radix tree and populate it
+    /* Free the tracking table: we'll create the intset and populate it
      * again if more keys will be modified in this caching slot. */
-    TrackingTableTotalItems -= raxSize(ids);
-    raxFree(ids);
+    TrackingTableTotalItems -= intsetLen(slots);
+    zfree(slots);
     raxRemove(TrackingTable,(unsigned char*)key,keylen,NULL);
 }
 
-void trackingHandlePendingKeyInvalidations() {
-    if (!listLength(server.tracking_pending_keys)) return;
+/* Remove the client 'c' from the clients with pending invalidations, and
+ * return its pending keys. */
+static rax *trackingDetachPendingInvalidations(client *c) {
+    rax *keys = c->client_tracking_pending_keys;
+    serverAssert(c->client_tracking_pending_node != NULL);
+    listDelNode(server.tracking_pending_clients,c->client_tracking_pending_node);
+    c->client_tracking_pending_node = NULL;
+    c->client_tracking_pending_keys = NULL;
+    return keys;
+}
+
+/* Send to the client 'c' a single invalidation message with all the keys
+ * invalidated for it since the last call. */
+void trackingFlushPendingInvalidations(client *c) {
+    if (c->client_tracking_pending_keys == NULL) return;
 
-    listNode *ln;
-    listIter li;
+    rax *keys = trackingDetachPendingInvalidations(c);
+    sds proto = trackingBuildBroadcastReply(NULL,keys);
+    sendTrackingMessage(c,proto,sdslen(proto),1);
+    sdsfree(proto);
+    raxFree(keys);
+}
+
+/* Forget the invalidation messages pending for the client 'c'. */
+void trackingDiscardPendingInvalidations(client *c) {
+    if (c->client_tracking_pending_keys == NULL) return;
+    raxFree(trackingDetachPendingInvalidations(c));
+}
+
+/* Invalidations for the current client are sent after the reply of the
+ * command, so that they are not interleaved with the reply. */
+void trackingHandlePendingKeyInvalidations(void) {
+    if (server.current_client)
+        trackingFlushPendingInvalidations(server.current_client);
+}
 
-    listRewind(server.tracking_pending_keys,&li);
-    while ((ln = listNext(&li)) != NULL) {
-        robj *key = listNodeValue(ln);
-        /* current_client maybe freed, so we need to send invalidation
-         * message only when current_client is still alive */
-        if (server.current_client != NULL)
-            sendTrackingMessage(server.current_client,(char *)key->ptr,sdslen(key->ptr),0);
-        decrRefCount(key);
+/* Send the pending invalidation messages to all the clients: called before
+ * returning to the event loop, so that every client gets at most a message
+ * per event loop cycle, listing all the keys invalidated for it. */
+void trackingFlushAllPendingInvalidations(void) {
+    while (listLength(server.tracking_pending_clients)) {
+        client *c = listNodeValue(listFirst(server.tracking_pending_clients));
+        trackingFlushPendingInvalidations(c);
     }
-    listEmpty(server.tracking_pending_keys);
 }
 
 /* This function is called when one or all the Redis databases are
@@ -437,8 +500,8 @@ void trackingHandlePendingKeyInvalidations() {
  * in order to avoid flooding clients with many invalidation messages 
  * for all the keys they may hold.
  */
-void freeTrackingRadixTreeCallback(void *rt) {
-    raxFree(rt);
+void freeTrackingRadixTreeCallback(void *slots) {
+    zfree(slots);
 }
 
 void freeTrackingRadixTree(rax *rt) {
@@ -448,6 +511,7 @@ void freeTrackingRadixTree(rax *rt) {
 /* A RESP NULL is sent to indicate that all keys are invalid */
 void trackingInvalidateKeysOnFlush(int async) {
     if (server.tracking_clients) {
+        trackingFlushAllPendingInvalidations();
         listNode *ln;
         listIter li;
         listRewind(server.clients,&li);
@@ -582,11 +582,350 @@ int double2ll(double d, long long *out) {
     return 0;
 }
 
+/* -----------------------------------------------------------------------------
+ * Shortest double to string conversion.
+ *
+ * This is the Grisu2 algorithm by Florian Loitsch ("Printing Floating-Point
+ * Numbers Quickly and Accurately with Integers", PLDI 2010): the double is
+ * scaled by a cached power of ten so that the digits can be generated with
+ * 64 bit integer arithmetic only, stopping as soon as the digits identify the
+ * double, which is much faster than snprintf("%.17g"). The result always
+ * converts back to the same double with strtod(3), and it is the shortest
+ * such representation in all but a tiny fraction of the cases, where it is
+ * one digit longer.
+ * -------------------------------------------------------------------------- */
+
+/* A floating point number: frac * 2^exp. */
+typedef struct diyFp {
+    uint64_t frac;
+    int exp;
+} diyFp;
+
+#define DIYFP_HIDDEN_BIT (1ULL<<52)
+#define DIYFP_FRAC_MASK (DIYFP_HIDDEN_BIT-1)
+#define DIYFP_EXP_BIAS (1023+52)
+
+/* The range the binary exponent of the scaled numbers must fall in, so that
+ * both the integral and the fractional part fit 64 bits. */
+#define DIYFP_MIN_EXP (-60)
+#define DIYFP_MAX_EXP (-32)
+
+/* Normalized powers of ten from 10^-348 to 10^340, in steps of 8. */
+#define CACHED_POW10_FIRST (-348)
+#define CACHED_POW10_STEP 8
+static const diyFp cachedPow10[] = {
+    {0xfa8fd5a0081c0288ULL,-1220}, {0xbaaee17fa23ebf76ULL,-1193},
+    {0x8b16fb203055ac76ULL,-1166}, {0xcf42894a5dce35eaULL,-1140},
+    {0x9a6bb0aa55653b2dULL,-1113}, {0xe61acf033d1a45dfULL,-1087},
+    {0xab70fe17c79ac6caULL,-1060}, {0xff77b1fcbebcdc4fULL,-1034},
+    {0xbe5691ef416bd60cULL,-1007}, {0x8dd01fad907ffc3cULL, -980},
+    {0xd3515c2831559a83ULL, -954}, {0x9d71ac8fada6c9b5ULL, -927},
+    {0xea9c227723ee8bcbULL, -901}, {0xaecc49914078536dULL, -874},
+    {0x823c12795db6ce57ULL, -847}, {0xc21094364dfb5637ULL, -821},
+    {0x9096ea6f3848984fULL, -794}, {0xd77485cb25823ac7ULL, -768},
+    {0xa086cfcd97bf97f4ULL, -741}, {0xef340a98172aace5ULL, -715},
+    {0xb23867fb2a35b28eULL, -688}, {0x84c8d4dfd2c63f3bULL, -661},
+    {0xc5dd44271ad3cdbaULL, -635}, {0x936b9fcebb25c996ULL, -608},
+    {0xdbac6c247d62a584ULL, -582}, {0xa3ab66580d5fdaf6ULL, -555},
+    {0xf3e2f893dec3f126ULL, -529}, {0xb5b5ada8aaff80b8ULL, -502},
+    {0x87625f056c7c4a8bULL, -475}, {0xc9bcff6034c13053ULL, -449},
+    {0x964e858c91ba2655ULL, -422}, {0xdff9772470297ebdULL, -396},
+    {0xa6dfbd9fb8e5b88fULL, -369}, {0xf8a95fcf88747d94ULL, -343},
+    {0xb94470938fa89bcfULL, -316}, {0x8a08f0f8bf0f156bULL, -289},
+    {0xcdb02555653131b6ULL, -263}, {0x993fe2c6d07b7facULL, -236},
+    {0xe45c10c42a2b3b06ULL, -210}, {0xaa242499697392d3ULL, -183},
+    {0xfd87b5f28300ca0eULL, -157}, {0xbce5086492111aebULL, -130},
+    {0x8cbccc096f5088ccULL, -103}, {0xd1b71758e219652cULL,  -77},
+    {0x9c40000000000000ULL,  -50}, {0xe8d4a51000000000ULL,  -24},
+    {0xad78ebc5ac620000ULL,    3}, {0x813f3978f8940984ULL,   30},
+    {0xc097ce7bc90715b3ULL,   56}, {0x8f7e32ce7bea5c70ULL,   83},
+    {0xd5d238a4abe98068ULL,  109}, {0x9f4f2726179a2245ULL,  136},
+    {0xed63a231d4c4fb27ULL,  162}, {0xb0de65388cc8ada8ULL,  189},
+    {0x83c7088e1aab65dbULL,  216}, {0xc45d1df942711d9aULL,  242},
+    {0x924d692ca61be758ULL,  269}, {0xda01ee641a708deaULL,  295},
+    {0xa26da3999aef774aULL,  322}, {0xf209787bb47d6b85ULL,  348},
+    {0xb454e4a179dd1877ULL,  375}, {0x865b86925b9bc5c2ULL,  402},
+    {0xc83553c5c8965d3dULL,  428}, {0x952ab45cfa97a0b3ULL,  455},
+    {0xde469fbd99a05fe3ULL,  481}, {0xa59bc234db398c25ULL,  508},
+    {0xf6c69a72a3989f5cULL,  534}, {0xb7dcbf5354e9beceULL,  561},
+    {0x88fcf317f22241e2ULL,  588}, {0xcc20ce9bd35c78a5ULL,  614},
+    {0x98165af37b2153dfULL,  641}, {0xe2a0b5dc971f303aULL,  667},
+    {0xa8d9d1535ce3b396ULL,  694}, {0xfb9b7cd9a4a7443cULL,  720},
+    {0xbb764c4ca7a44410ULL,  747}, {0x8bab8eefb6409c1aULL,  774},
+    {0xd01fef10a657842cULL,  800}, {0x9b10a4e5e9913129ULL,  827},
+    {0xe7109bfba19c0c9dULL,  853}, {0xac2820d9623bf429ULL,  880},
+    {0x80444b5e7aa7cf85ULL,  907}, {0xbf21e44003acdd2dULL,  933},
+    {0x8e679c2f5e44ff8fULL,  960}, {0xd433179d9c8cb841ULL,  986},
+    {0x9e19db92b4e31ba9ULL, 1013}, {0xeb96bf6ebadf77d9ULL, 1039},
+    {0xaf87023b9bf0ee6bULL, 1066},
+};
+#define CACHED_POW10_COUNT ((int)(sizeof(cachedPow10)/sizeof(cachedPow10[0])))
+
+static const uint32_t pow10u32[] = {
+    1000000000, 100000000, 10000000, 1000000, 100000, 10000, 1000, 100, 10, 1
+};
+
+/* Multiply two numbers, rounding the 128 bit product to its upper half. */
+static diyFp diyFpMultiply(diyFp a, diyFp b) {
+    const uint64_t mask = 0xffffffffULL;
+    uint64_t ah = a.frac >> 32, al = a.frac & mask;
+    uint64_t bh = b.frac >> 32, bl = b.frac & mask;
+    uint64_t ahbh = ah*bh, ahbl = ah*bl, albh = al*bh, albl = al*bl;
+    uint64_t mid = (albl >> 32) + (ahbl & mask) + (albh & mask);
+    mid += 1ULL << 31; /* Round. */
+    diyFp r = {ahbh + (ahbl >> 32) + (albh >> 32) + (mid >> 32),
+               a.exp + b.exp + 64};
+    return r;
+}
+
+/* Return the cached power of ten that scales a number with the binary
+ * exponent 'exp' into [DIYFP_MIN_EXP, DIYFP_MAX_EXP], setting '*k' to its
+ * decimal exponent. */
+static diyFp diyFpCachedPow10(int exp, int *k) {
+    /* Estimate the decimal exponent, log10(2) ~= 0.30103, then adjust it:
+     * a step of 8 decimal digits is less than the range width. */
+    int estimate = (int)ceil((DIYFP_MIN_EXP - exp - 1) * 0.30102999566398114);
+    int idx = (estimate - CACHED_POW10_FIRST) / CACHED_POW10_STEP;
+    if (idx < 0) idx = 0;
+    if (idx >= CACHED_POW10_COUNT) idx = CACHED_POW10_COUNT-1;
+    while (1) {
+        int scaled = exp + cachedPow10[idx].exp + 64;
+        if (scaled < DIYFP_MIN_EXP) idx++;
+        else if (scaled > DIYFP_MAX_EXP) idx--;
+        else break;
+    }
+    *k = CACHED_POW10_FIRST + idx * CACHED_POW10_STEP;
+    return cachedPow10[idx];
+}
+
+/* Move the last digit towards 'w', the scaled number, as long as the digits
+ * stay within the rounding interval of size 'delta'. 'rest' is the distance
+ * from the digits to the upper bound, 'wdist' the distance from 'w' to it,
+ * and 'ten_kappa' the weight of the last digit. */
+static void grisu2Round(char *digits, int len, uint64_t delta, uint64_t rest,
+                        uint64_t ten_kappa, uint64_t wdist)
+{
+    while (rest < wdist && delta - rest >= ten_kappa &&
+           (rest + ten_kappa < wdist || wdist - rest > rest + ten_kappa - wdist))
+    {
+        digits[len-1]--;
+        rest += ten_kappa;
+    }
+}
+
+/* Generate the shortest digits of 'upper' such that the number is still
+ * above 'upper' - 'delta'. The three numbers have the same exponent. */
+static int grisu2DigitGen(diyFp w, diyFp upper, uint64_t delta, char *digits, int *k) {
+    const int shift = -upper.exp;
+    const uint64_t one = 1ULL << shift;
+    uint64_t wdist = upper.frac - w.frac;
+    uint32_t integral = (uint32_t)(upper.frac >> shift);
+    uint64_t fractional = upper.frac & (one-1);
+    int len = 0, kappa = 10;
+
+    for (int j = 0; j < 10; j++) {
+        uint32_t div = pow10u32[j];
+        uint32_t digit = integral / div;
+        integral %= div;
+        kappa--;
+        if (digit || len) digits[len++] = '0' + digit;
+        uint64_t rest = ((uint64_t)integral << shift) + fractional;
+        if (rest <= delta) {
+            *k += kappa;
+            grisu2Round(digits,len,delta,rest,(uint64_t)div << shift,wdist);
+            return len;
+        }
+    }
+
+    uint64_t unit = 1;
+    while (1) {
+        fractional *= 10;
+        delta *= 10;
+        unit *= 10;
+        kappa--;
+        uint32_t digit = (uint32_t)(fractional >> shift);
+        if (digit || len) digits[len++] = '0' + digit;
+        fractional &= one-1;
+        if (fractional < delta) {
+            *k += kappa;
+            grisu2Round(digits,len,delta,fractional,one,wdist*unit);
+            return len;
+        }
+    }
+}
+
+/* Write to 'digits' (at least 18 bytes) the decimal digits of the positive,
+ * finite and non zero double 'v', without a null term, returning how many
+ * they are, and set '*k' so that 'v' is about digits * 10^k. */
+static int grisu2(double v, char *digits, int *k) {
+    uint64_t bits;
+    memcpy(&bits,&v,sizeof(bits));
+
+    diyFp w;
+    int biased = (int)((bits >> 52) & 0x7ff);
+    w.frac = bits & DIYFP_FRAC_MASK;
+    if (biased) {
+        w.frac += DIYFP_HIDDEN_BIT;
+        w.exp = biased - DIYFP_EXP_BIAS;
+    } else {
+        w.exp = 1 - DIYFP_EXP_BIAS;
+    }
+
+    /* The boundaries are halfway to the adjacent doubles. The lower one is
+     * closer when 'v' is a power of two, since the exponent changes. */
+    diyFp upper = {(w.frac << 1) + 1, w.exp - 1};
+    while (!(upper.frac & (DIYFP_HIDDEN_BIT << 1))) {
+        upper.frac <<= 1;
+        upper.exp--;
+    }
+    upper.frac <<= 64 - 54;
+    upper.exp -= 64 - 54;
+    diyFp lower;
+    if (w.frac == DIYFP_HIDDEN_BIT && biased > 1) {
+        lower.frac = (w.frac << 2) - 1;
+        lower.exp = w.exp - 2;
+    } else {
+        lower.frac = (w.frac << 1) - 1;
+        lower.exp = w.exp - 1;
+    }
+    lower.frac <<= lower.exp - upper.exp;
+    lower.exp = upper.exp;
+
+    while (!(w.frac & (1ULL << 63))) {
+        w.frac <<= 1;
+        w.exp--;
+    }
+
+    int mk;
+    diyFp c = diyFpCachedPow10(upper.exp,&mk);
+    w = diyFpMultiply(w,c);
+    upper = diyFpMultiply(upper,c);
+    lower = diyFpMultiply(lower,c);
+    /* The products may be off by one unit: stay inside the interval. */
+    upper.frac--;
+    lower.frac++;
+
+    *k = -mk;
+    int len = grisu2DigitGen(w,upper,upper.frac - lower.frac,digits,k);
+    while (len > 1 && digits[len-1] == '0') {
+        len--;
+        (*k)++;
+    }
+    return len;
+}
+
+/* Format the digits as %g would do with a precision of 17, that is, with an
+ * exponent only when it is less than -4 or greater than 16, unless 'fixed' is
+ * true. 'buf' should have room for MAX_SHORTEST_D2STRING_CHARS bytes, and for
+ * all the digits and zeros when 'fixed' is true. Returns the length, without
+ * adding a null term. */
+static int formatShortestDigits(char *buf, const char *digits, int len, int k, int fixed) {
+    int exp10 = len + k - 1; /* Exponent of the first digit. */
+    char *p = buf;
+
+    if (!fixed && (exp10 < -4 || exp10 > 16)) {
+        *p++ = digits[0];
+        if (len > 1) {
+            *p++ = '.';
+            memcpy(p,digits+1,len-1);
+            p += len-1;
+        }
+        *p++ = 'e';
+        *p++ = exp10 < 0 ? '-' : '+';
+        if (exp10 < 0) exp10 = -exp10;
+        if (exp10 >= 100) {
+            *p++ = '0' + exp10/100;
+            exp10 %= 100;
+        }
+        *p++ = '0' + exp10/10;
+        *p++ = '0' + exp10%10;
+    } else if (k >= 0) {
+        memcpy(p,digits,len);
+        p += len;
+        memset(p,'0',k);
+        p += k;
+    } else if (exp10 >= 0) {
+        memcpy(p,digits,exp10+1);
+        p += exp10+1;
+        *p++ = '.';
+        memcpy(p,digits+exp10+1,len-exp10-1);
+        p += len-exp10-1;
+    } else {
+        *p++ = '0';
+        *p++ = '.';
+        memset(p,'0',-exp10-1);
+        p += -exp10-1;
+        memcpy(p,digits,len);
+        p += len;
+    }
+    return p - buf;
+}
+
+/* Write the shortest representation of the double 'value' that strtod(3)
+ * converts back to the same double, in the same format of "%.17g". Returns
+ * the number of bytes written, or zero if 'len' is less than
+ * MAX_SHORTEST_D2STRING_CHARS. The output is null terminated. */
+int shortestd2string(char *buf, size_t len, double value) {
+    char digits[24];
+    int k, l = 0;
+
+    if (len < MAX_SHORTEST_D2STRING_CHARS) return 0;
+    if (isnan(value)) {
+        memcpy(buf,"nan",3);
+        l = 3;
+    } else if (isinf(value)) {
+        /* Libc in odd systems (Hi Solaris!) will format infinite in a
+         * different way, so better to handle it in an explicit way. */
+        if (value < 0) buf[l++] = '-';
+        memcpy(buf+l,"inf",3);
+        l += 3;
+    } else if (value == 0) {
+        if (signbit(value)) buf[l++] = '-';
+        buf[l++] = '0';
+    } else {
+        if (value < 0) {
+            buf[l++] = '-';
+            value = -value;
+        }
+        int dlen = grisu2(value,digits,&k);
+        l += formatShortestDigits(buf+l,digits,dlen,k,0);
+    }
+    buf[l] = '\0';
+    return l;
+}
+
+/* Write the shortest representation of the long double 'value' in the format
+ * of ld2string() LD_STR_HUMAN mode, if it is a double whose digits fit the
+ * 17 integral and 17 fractional digits that mode uses. Otherwise, or if 'len'
+ * is less than MAX_SHORTEST_D2STRING_CHARS, zero is returned. */
+static int shortestHumanLd2string(char *buf, size_t len, long double value) {
+    double d = (double)value;
+    char digits[24];
+    int k, l = 0;
+
+    if ((long double)d != value || len < MAX_SHORTEST_D2STRING_CHARS) return 0;
+    if (d == 0) {
+        /* No "-0" in human friendly mode. */
+        buf[l++] = '0';
+    } else {
+        if (d < 0) {
+            buf[l++] = '-';
+            d = -d;
+        }
+        int dlen = grisu2(d,digits,&k);
+        if (k < -17 || dlen + k > 17) return 0;
+        l += formatShortestDigits(buf+l,digits,dlen,k,1);
+    }
+    buf[l] = '\0';
+    return l;
+}
+
 /* Convert a double to a string representation. Returns the number of bytes
- * required. The representation should always be parsable by strtod(3).
+ * required. The representation is the shortest one parsed by strtod(3) back
+ * into the same double, see shortestd2string().
  * This function does not support human-friendly formatting like ld2string
- * does. It is intended mainly to be used inside t_zset.c when writing scores
- * into a listpack representing a sorted set. */
+ * does. It is used for the double replies, and inside t_zset.c when writing
+ * scores into a listpack representing a sorted set. */
 int d2string(char *buf, size_t len, double value) {
     if (isnan(value)) {
         len = snprintf(buf,len,"nan");
@@ -607,7 +946,7 @@ int d2string(char *buf, size_t len, double value) {
         if (double2ll(value, &lvalue))
             len = ll2string(buf,len,lvalue);
         else
-            len = snprintf(buf,len,"%.17g",value);
+            len = shortestd2string(buf,len,value);
     }
 
     return len;
@@ -661,6 +1000,10 @@ int ld2string(char *buf, size_t len, long double value, ld2string_mode mode) {
             if (l+1 > len) return 0; /* No room. */
             break;
         case LD_STR_HUMAN:
+            /* Long doubles holding a double, like the ones used for the
+             * scores or the coordinates, get their shortest representation. */
+            if ((l = shortestHumanLd2string(buf,len,value)) > 0) break;
+
             /* We use 17 digits precision since with 128 bit floats that precision
              * after rounding is able to represent most small decimal numbers in a
              * way that is "non surprising" for the user (that is, most small
@@ -925,6 +1268,7 @@ sds makePath(char *path, char *filename) {
 
 #ifdef REDIS_TEST
 #include <assert.h>
+#include "testhelp.h"
 
 static void test_string2ll(void) {
     char buf[32];
@@ -1071,15 +1415,117 @@ static void test_ll2string(void) {
     assert(!strcmp(buf, "9223372036854775807"));
 }
 
+static void test_shortestd2string(int accurate) {
+    char buf[MAX_SHORTEST_D2STRING_CHARS], ref[32];
+    struct {
+        double value;
+        const char *expected;
+    } cases[] = {
+        {0.0, "0"}, {-0.0, "-0"}, {1.0, "1"}, {-1.5, "-1.5"},
+        {1.1, "1.1"}, {0.1+0.2, "0.30000000000000004"}, {1.0/3, "0.3333333333333333"},
+        {0.0001, "0.0001"}, {0.00001, "1e-05"},
+        {1e16, "10000000000000000"}, {1e17, "1e+17"}, {123456789012345678.0, "1.2345678901234568e+17"},
+        /* 1e23 is halfway between two doubles: Grisu2 is not the shortest. */
+        {1e23, "9.999999999999999e+22"}, {1.7976931348623157e308, "1.7976931348623157e+308"},
+        {2.2250738585072014e-308, "2.2250738585072014e-308"}, {5e-324, "5e-324"},
+        {1.5e300, "1.5e+300"}, {-3.25e-200, "-3.25e-200"},
+        {INFINITY, "inf"}, {-INFINITY, "-inf"}, {NAN, "nan"}
+    };
+
+    for (size_t j = 0; j < sizeof(cases)/sizeof(cases[0]); j++) {
+        int len = shortestd2string(buf,sizeof(buf),cases[j].value);
+        assert(len == (int)strlen(cases[j].expected));
+        assert(!strcmp(buf,cases[j].expected));
+    }
+    assert(shortestd2string(buf,MAX_SHORTEST_D2STRING_CHARS-1,1.5) == 0);
+
+    /* Random doubles and short decimals must convert back to the same
+     * double, never longer than "%.17g", and with the exact digits typed
+     * for the decimals up to 15 digits, when Grisu2 finds the shortest. */
+    long iterations = accurate ? 100000000 : 1000000;
+    long longer = 0;
+    uint64_t seed = 0x2545f4914f6cdd1dULL;
+    for (long j = 0; j < iterations; j++) {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        double value;
+        memcpy(&value,&seed,sizeof(value));
+        if (!isfinite(value)) continue;
+        int len = shortestd2string(buf,sizeof(buf),value);
+        double parsed = strtod(buf,NULL);
+        assert(!memcmp(&parsed,&value,sizeof(value)));
+        assert(len <= snprintf(ref,sizeof(ref),"%.17g",value));
+
+        double decimal = (double)(long long)(seed % 1000000000000000ULL) /
+                         pow(10,(double)(seed >> 60));
+        shortestd2string(buf,sizeof(buf),decimal);
+        parsed = strtod(buf,NULL);
+        assert(parsed == decimal);
+        snprintf(ref,sizeof(ref),"%.15g",decimal);
+        if (strcmp(buf,ref)) longer++;
+    }
+    /* Grisu2 is not the shortest for about one double in a thousand. */
+    assert(longer < iterations / 500);
+
+    /* Human friendly long doubles, the last one is too big for the shortest
+     * representation. */
+    char hbuf[MAX_LONG_DOUBLE_CHARS];
+    assert(ld2string(hbuf,sizeof(hbuf),0.1,LD_STR_HUMAN) == 3);
+    assert(!strcmp(hbuf,"0.1"));
+    assert(ld2string(hbuf,sizeof(hbuf),-13.361389338970184,LD_STR_HUMAN) == 19);
+    assert(!strcmp(hbuf,"-13.361389338970184"));
+    assert(ld2string(hbuf,sizeof(hbuf),-0.0,LD_STR_HUMAN) == 1);
+    assert(!strcmp(hbuf,"0"));
+    assert(ld2string(hbuf,sizeof(hbuf),1e-5,LD_STR_HUMAN) == 7);
+    assert(!strcmp(hbuf,"0.00001"));
+    assert(ld2string(hbuf,sizeof(hbuf),1e17,LD_STR_HUMAN) == 18);
+    assert(!strcmp(hbuf,"100000000000000000"));
+}
+
+static long long test_ustime(void) {
+    struct timeval tv;
+    gettimeofday(&tv,NULL);
+    return ((long long)tv.tv_sec)*1000000+tv.tv_usec;
+}
+
+static void benchmark_shortestd2string(void) {
+    char buf[MAX_SHORTEST_D2STRING_CHARS];
+    const long iterations = 1000000;
+    double values[1024];
+    long long start, elapsed;
+    size_t total = 0;
+
+    for (int j = 0; j < 1024; j++)
+        values[j] = (double)rand() / (rand()+1) * 1000;
+
+    start = test_ustime();
+    for (long j = 0; j < iterations; j++)
+        total += snprintf(buf,sizeof(buf),"%.17g",values[j & 1023]);
+    elapsed = test_ustime()-start;
+    printf("snprintf(%%.17g): %ld doubles in %lld usec\n",iterations,elapsed);
+
+    start = test_ustime();
+    for (long j = 0; j < iterations; j++)
+        total += shortestd2string(buf,sizeof(buf),values[j & 1023]);
+    elapsed = test_ustime()-start;
+    printf("shortestd2string: %ld doubles in %lld usec\n",iterations,elapsed);
+    assert(total > 0);
+}
+
 #define UNUSED(x) (void)(x)
 int utilTest(int argc, char **argv, int flags) {
     UNUSED(argc);
     UNUSED(argv);
-    UNUSED(flags);
+
+    int accurate = (flags & REDIS_TEST_ACCURATE);
 
     test_string2ll();
     test_string2l();
     test_ll2string();
+    test_shortestd2string(accurate);
+    /* The benchmark only prints timings, run it with --accurate. */
+    if (accurate) benchmark_shortestd2string();
     return 0;
 }
 #endif
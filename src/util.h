@@ -47,6 +47,10 @@
  * Since it uses %g and not %f, some 40 chars should be enough. */
 #define MAX_D2STRING_CHARS 128
 
+/* The maximum number of characters needed by shortestd2string(), that never
+ * writes more than 17 digits, the sign, the point and the exponent. */
+#define MAX_SHORTEST_D2STRING_CHARS 32
+
 /* Bytes needed for long -> str + '\0' */
 #define LONG_STR_SIZE      21
 
@@ -75,6 +79,7 @@ int string2d(const char *s, size_t slen, double *dp);
 int trimDoubleString(char *buf, size_t len);
 int d2string(char *buf, size_t len, double value);
 int ld2string(char *buf, size_t len, long double value, ld2string_mode mode);
+int shortestd2string(char *buf, size_t len, double value);
 int double2ll(double d, long long *out);
 int yesnotoi(char *s);
 sds getAbsolutePath(char *filename);
@@ -632,4 +632,38 @@ tags {"aof external:skip"} {
         } result
         assert_match "*Failed to truncate AOF*to timestamp*because it is not the last file*" $result
     }
+
+    # Values set while replaying the AOF are compacted right away, not
+    # queued until the load is over.
+    create_aof $aof_dirpath $aof_file {
+        for {set j 0} {$j < 100000} {incr j} {
+            append_to_aof [formatCommand set "key:$j" $j]
+        }
+    }
+
+    create_aof_manifest $aof_dirpath $aof_manifest_file {
+        append_to_manifest "file appendonly.aof.1.incr.aof seq 1 type i\n"
+    }
+
+    start_server_aof [list dir $server_path compact-values yes] {
+        test {AOF loading compacts values as they are loaded} {
+            set c [redis [dict get $srv host] [dict get $srv port] 0 $::tls]
+            wait_done_loading $c
+            assert_equal 100000 [$c dbsize]
+            assert_equal 4242 [$c get key:4242]
+            assert_equal int [$c object encoding key:4242]
+
+            # The peak is sampled when the load completes: a queue of all
+            # the loaded keys would show up as about 40 bytes per key.
+            set used [status $c used_memory]
+            set peak [status $c used_memory_peak]
+            assert_lessthan [expr {$peak - $used}] [expr {100000*10}]
+
+            # The main dict overhead matches the one of a RDB load, where
+            # every value is compacted.
+            set overhead [dict get [$c memory stats] db.0 overhead.hashtable.main]
+            $c debug reload
+            assert_equal $overhead [dict get [$c memory stats] db.0 overhead.hashtable.main]
+        } {} {needs:debug}
+    }
 }
@@ -195,6 +195,56 @@ start_server {tags {"expire"}} {
         }
     }
 
+    test {Active expire reclaims all the expired keys with mixed TTLs} {
+        r flushdb
+        # Many keys in the same few buckets of the expire index, so that
+        # buckets are converted into sets, mixed with long lived keys and
+        # keys whose TTL is modified or removed before expiring.
+        for {set j 0} {$j < 1000} {incr j} {
+            r psetex short:$j 100 a
+            r setex long:$j 1000 a
+        }
+        for {set j 0} {$j < 100} {incr j} {
+            r pexpire short:$j 200
+            r persist long:$j
+            r del short:[expr {$j+100}]
+        }
+        r set persisted a px 100
+        r persist persisted
+        wait_for_condition 50 100 {
+            [r dbsize] eq 1001
+        } fail {
+            "Keys did not actively expire."
+        }
+        assert_equal 0 [r exists short:0 short:999]
+        assert_equal 1000 [llength [r keys long:*]]
+        assert_equal -1 [r ttl long:0]
+        assert_range [r ttl long:999] 900 1000
+        r flushdb
+    }
+
+    test {Active expire works after SWAPDB and FLUSHALL ASYNC} {
+        r flushall
+        r select 10
+        r psetex foo 100 a
+        r swapdb 9 10
+        r select 9
+        assert_equal 1 [r dbsize]
+        wait_for_condition 50 100 {
+            [r dbsize] eq 0
+        } fail {
+            "Keys did not actively expire after SWAPDB."
+        }
+        r psetex foo 5000 a
+        r flushall async
+        r psetex bar 100 a
+        wait_for_condition 50 100 {
+            [r dbsize] eq 0
+        } fail {
+            "Keys did not actively expire after FLUSHALL ASYNC."
+        }
+    } {} {singledb:skip}
+
     test {Redis should lazy expire keys} {
         r flushdb
         r debug set-active-expire 0
@@ -216,6 +216,12 @@ start_server {tags {"introspection"}} {
             logfile
             dir
             socket-mark-id
+            maxmemory-eviction-engine
+            lazyfree-threads
+            memory-prefix-delimiter
+            compact-values
+            tls-handshake-threads
+            stream-spill-max-segments
         }
 
         if {!$::tls} {
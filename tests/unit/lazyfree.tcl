@@ -87,4 +87,64 @@ start_server {tags {"lazyfree"}} {
         }
         assert_equal [s lazyfreed_objects] 0
     } {} {needs:config-resetstat}
+
+    test "lazy free falls back to incremental freeing when the queue is full" {
+        r config resetstat
+        r config set lazyfree-max-pending-jobs 1
+        set args {}
+        for {set i 0} {$i < 20000} {incr i} {
+            lappend args $i
+        }
+        # long elements, so that the list is made of enough quicklist nodes
+        r rpush mylist {*}[lmap x $args {string repeat $x 20}]
+        r sadd myset {*}$args
+        r zadd myzset {*}[join [lmap x $args {list $x $x}]]
+        r hset myhash {*}[join [lmap x $args {list $x $x}]]
+
+        # The first object is queued to the lazyfree thread, the others are
+        # released by the main thread while the queue is busy. INFO is called
+        # in the transaction, before any incremental cycle can run.
+        r multi
+        r unlink myset
+        r unlink mylist
+        r unlink myzset
+        r unlink myhash
+        r info memory
+        set res [r exec]
+        assert_equal 3 [getInfoProperty [lindex $res 4] lazyfree_incremental_objects]
+        assert_equal 0 [r dbsize]
+
+        wait_for_condition 100 100 {
+            [s lazyfree_pending_objects] == 0
+        } else {
+            fail "lazyfree isn't done"
+        }
+        assert_equal 0 [s lazyfree_incremental_objects]
+        assert_equal 0 [s lazyfree_pending_jobs]
+        assert_equal 4 [s lazyfreed_objects]
+        r config set lazyfree-max-pending-jobs 0
+    } {OK} {needs:config-resetstat}
+}
+
+start_server {tags {"lazyfree"} overrides {lazyfree-threads 4}} {
+    test "UNLINK reclaims memory with multiple lazyfree threads" {
+        r config resetstat
+        set args {}
+        for {set i 0} {$i < 10000} {incr i} {
+            lappend args $i
+        }
+        for {set j 0} {$j < 20} {incr j} {
+            r sadd "set$j" {*}$args
+        }
+        for {set j 0} {$j < 20} {incr j} {
+            r unlink "set$j"
+        }
+        wait_for_condition 50 100 {
+            [s lazyfree_pending_objects] == 0
+        } else {
+            fail "lazyfree isn't done"
+        }
+        assert_equal 20 [s lazyfreed_objects]
+        assert_equal 0 [s lazyfree_pending_jobs]
+    } {} {needs:config-resetstat}
 }
@@ -341,7 +341,7 @@ proc test_slave_buffers {test_name cmd_count payload_len limit_memory pipeline}
             set orig_used [s -1 used_memory]
             set orig_client_buf [s -1 mem_clients_normal]
             set orig_mem_not_counted_for_evict [s -1 mem_not_counted_for_evict]
-            set orig_used_no_repl [expr {$orig_used - $orig_mem_not_counted_for_evict}]
+            set orig_used_no_repl [expr {$orig_used - $orig_mem_not_counted_for_evict - [s -1 mem_reply_buffer_pool]}]
             set limit [expr {$orig_used - $orig_mem_not_counted_for_evict + 32*1024}]
 
             if {$limit_memory==1} {
@@ -371,13 +371,15 @@ proc test_slave_buffers {test_name cmd_count payload_len limit_memory pipeline}
             set slave_buf [s -1 mem_clients_slaves]
             set client_buf [s -1 mem_clients_normal]
             set mem_not_counted_for_evict [s -1 mem_not_counted_for_evict]
-            set used_no_repl [expr {$new_used - $mem_not_counted_for_evict - [slave_query_buffer $master]}]
+            set used_no_repl [expr {$new_used - $mem_not_counted_for_evict - [slave_query_buffer $master] - [s -1 mem_reply_buffer_pool]}]
             # we need to exclude replies buffer and query buffer of replica from used memory.
             # removing the replica (output) buffers is done so that we are able to measure any other
             # changes to the used memory and see that they're insignificant (the test's purpose is to check that
             # the replica buffers are counted correctly, so the used memory growth after deducting them
             # should be nearly 0).
             # we remove the query buffers because on slow test platforms, they can accumulate many ACKs.
+            # the free reply buffers kept in the pool are removed as well, since they only depend on the
+            # replies of the pipelined commands.
             set delta [expr {($used_no_repl - $client_buf) - ($orig_used_no_repl - $orig_client_buf)}]
 
             assert {[$master dbsize] == 100}
@@ -391,7 +393,7 @@ proc test_slave_buffers {test_name cmd_count payload_len limit_memory pipeline}
             set killed_mem_not_counted_for_evict [getInfoProperty $info_str mem_not_counted_for_evict]
             set killed_slave_buf [s -1 mem_clients_slaves]
             # we need to exclude replies buffer and query buffer of slave from used memory after kill slave
-            set killed_used_no_repl [expr {$killed_used - $killed_mem_not_counted_for_evict - [slave_query_buffer $master]}]
+            set killed_used_no_repl [expr {$killed_used - $killed_mem_not_counted_for_evict - [slave_query_buffer $master] - [s -1 mem_reply_buffer_pool]}]
             set delta_no_repl [expr {$killed_used_no_repl - $used_no_repl}]
             assert {[$master dbsize] == 100}
             assert {$killed_slave_buf == 0}
@@ -571,3 +573,189 @@ start_server {tags {"maxmemory" "external:skip"}} {
         r config set maxmemory-policy noeviction
     }
 }
+
+start_server {tags {"maxmemory" "external:skip"} overrides {maxmemory-eviction-engine ordered}} {
+    foreach policy {allkeys-lru allkeys-lfu} {
+        test "Ordered eviction engine - is the memory limit honoured? (policy $policy)" {
+            # Run the commands of the test once, so that what the server
+            # allocates on first use is not taken for the keys' memory.
+            r config set maxmemory 0
+            r config set maxmemory-policy $policy
+            r set [randomKey] x
+            r flushall
+            set used [s used_memory]
+            set limit [expr {$used+100*1024}]
+            r config set maxmemory $limit
+            r config set maxmemory-policy $policy
+            set numkeys 0
+            while 1 {
+                r set [randomKey] x
+                incr numkeys
+                if {[s used_memory]+4096 > $limit} {
+                    assert {$numkeys > 10}
+                    break
+                }
+            }
+            for {set j 0} {$j < $numkeys} {incr j} {
+                r set [randomKey] x
+            }
+            assert {[s used_memory] < ($limit+4096)}
+            assert {[s evicted_keys] > 0}
+            r config set maxmemory 0
+        }
+
+        test "Ordered eviction engine - accessed keys are not evicted (policy $policy)" {
+            r flushall
+            r config set maxmemory-policy $policy
+            for {set j 0} {$j < 100} {incr j} {
+                r set hot:$j [string repeat x 100]
+            }
+            for {set j 0} {$j < 1000} {incr j} {
+                r set cold:$j [string repeat x 100]
+            }
+            # The LRU clock resolution is one second: make sure accessing
+            # the hot keys is seen as an access after they were created.
+            after 1100
+            for {set k 0} {$k < 10} {incr k} {
+                for {set j 0} {$j < 100} {incr j} {
+                    r get hot:$j
+                }
+            }
+            r config set maxmemory [expr {[s used_memory]-50*1024}]
+            for {set j 0} {$j < 500} {incr j} {
+                r set new:$j [string repeat x 100]
+            }
+            r config set maxmemory 0
+            assert {[s evicted_keys] > 0}
+            assert_equal 100 [llength [r keys hot:*]]
+        }
+    }
+
+    test "Ordered eviction engine - keys can be evicted after SWAPDB, FLUSHALL and DEBUG RELOAD" {
+        r flushall
+        r config set maxmemory-policy allkeys-lru
+        r select 9
+        populate 1000
+        r swapdb 9 10
+        r flushall async
+        populate 1000
+        r debug reload
+        r config set maxmemory 1
+        wait_for_condition 100 10 {
+            [r dbsize] eq 0
+        } else {
+            fail "Not all keys have been evicted"
+        }
+        r config set maxmemory 0
+        r config set maxmemory-policy noeviction
+    } {OK} {needs:debug singledb:skip}
+}
+
+start_server {tags {"maxmemory" "external:skip"}} {
+    test "Proactive eviction keeps the memory under the low watermark" {
+        r config set maxmemory-policy allkeys-lru
+        r config set lazyfree-lazy-eviction no
+        r flushall
+        r config resetstat
+        for {set j 0} {$j < 5000} {incr j} {
+            r set key:$j [string repeat x 100]
+        }
+        set used [s used_memory]
+        set limit [expr {int($used*1.5)}]
+        r config set maxmemory $limit
+        assert_equal 0 [s evicted_keys]
+        r config set maxmemory-eviction-headroom 50
+        # Leave some margin for the buffers of the test client, that are
+        # counted as used memory.
+        set target [expr {$limit - ($limit/100)*50 + 64*1024}]
+        wait_for_condition 100 50 {
+            [s used_memory] <= $target
+        } else {
+            fail "Proactive eviction did not reach the low watermark"
+        }
+        assert {[s evicted_keys_proactive] > 0}
+        assert_equal [s evicted_keys] [s evicted_keys_proactive]
+        assert_equal 0 [s inline_eviction_cycles]
+        assert {[r dbsize] < 4000}
+    }
+
+    test "Eviction before commands is tracked when proactive eviction is enabled" {
+        r config set maxmemory [expr {[s used_memory]/2}]
+        assert {[s inline_eviction_cycles] > 0}
+        r config set maxmemory-eviction-headroom 0
+        r config set maxmemory 0
+        r config set maxmemory-policy noeviction
+    }
+
+    test "Proactive eviction of values released in background" {
+        r flushall
+        r config resetstat
+        # Every victim is big enough to be released by the lazyfree thread.
+        set members {}
+        for {set j 0} {$j < 200} {incr j} {
+            lappend members [string repeat $j 10]
+        }
+        r sadd set:0 {*}$members
+        for {set j 1} {$j < 300} {incr j} {
+            r copy set:0 set:$j
+        }
+        set used [s used_memory]
+        set limit [expr {int($used*1.5)}]
+        r config set maxmemory-policy allkeys-lru
+        r config set maxmemory $limit
+        r config set maxmemory-eviction-headroom 50
+        set target [expr {$limit - ($limit/100)*50 + 64*1024}]
+        # Not bound to one key per cron tick while the values are released.
+        wait_for_condition 50 100 {
+            [s used_memory] <= $target
+        } else {
+            fail "Proactive eviction did not reach the low watermark"
+        }
+        assert {[s evicted_keys_proactive] > 50}
+        assert {[s lazyfreed_objects] > 0}
+        assert_equal 0 [s inline_eviction_cycles]
+        r config set maxmemory-eviction-headroom 0
+        r config set maxmemory 0
+        r config set maxmemory-policy noeviction
+    } {OK} {needs:config-resetstat}
+}
+
+start_server {tags {"maxmemory" "external:skip"}} {
+    test "Admission filter protects frequently accessed keys from one-off keys" {
+        r config set maxmemory-policy allkeys-lfu
+        r config set maxmemory-admission-filter yes
+        r config set maxmemory [expr {[s used_memory]+10*1024*1024}]
+        wait_for_condition 50 100 {
+            [s mem_admission_filter] > 0
+        } else {
+            fail "Admission filter not created"
+        }
+
+        for {set j 0} {$j < 200} {incr j} {
+            r set hot:$j [string repeat x 100]
+        }
+        for {set k 0} {$k < 10} {incr k} {
+            for {set j 0} {$j < 200} {incr j} {
+                r get hot:$j
+            }
+        }
+
+        # Keys accessed only once, like a scan of the backing store.
+        r config set maxmemory [expr {[s used_memory]+100*1024}]
+        for {set j 0} {$j < 5000} {incr j} {
+            r set scan:$j [string repeat x 100]
+        }
+        assert {[s evicted_keys] > 0}
+        assert {[s admission_rejected_keys] > 0}
+        assert_equal 200 [llength [r keys hot:*]]
+
+        r config set maxmemory 0
+        wait_for_condition 50 100 {
+            [s mem_admission_filter] == 0
+        } else {
+            fail "Admission filter not released"
+        }
+        r config set maxmemory-admission-filter no
+        r config set maxmemory-policy noeviction
+    }
+}
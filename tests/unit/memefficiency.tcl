@@ -36,6 +36,171 @@ start_server {tags {"memefficiency external:skip"}} {
     }
 }
 
+start_server {tags {"memefficiency external:skip"} overrides {memory-prefix-delimiter :}} {
+    proc prefix_usage {prefix} {
+        set total 0
+        foreach k [r keys "$prefix*"] {
+            incr total [r memory usage $k]
+        }
+        return $total
+    }
+
+    test "MEMORY PREFIXES accounts keys and memory per prefix" {
+        r flushall
+        for {set j 0} {$j < 100} {incr j} {
+            r set "user:$j" [string repeat x 100]
+        }
+        r hset "session:1" a b c d
+        r set nodelimiter foo
+
+        set prefixes [r memory prefixes]
+        assert_equal {{} session: user:} [lsort [dict keys $prefixes]]
+        assert_equal 100 [dict get $prefixes user: keys]
+        assert_equal [prefix_usage user:] [dict get $prefixes user: bytes]
+        assert_equal 1 [dict get $prefixes {} keys]
+        assert_equal [r memory usage nodelimiter] [dict get $prefixes {} bytes]
+    }
+
+    test "MEMORY PREFIXES tracks values modified in place" {
+        set before [dict get [r memory prefixes] session: bytes]
+        for {set j 0} {$j < 1000} {incr j} {
+            r hset "session:1" "field:$j" [string repeat x 50]
+        }
+        set after [dict get [r memory prefixes] session: bytes]
+        assert {$after > $before + 50000}
+        assert_equal [r memory usage session:1] $after
+
+        r append user:1 [string repeat y 1000]
+        assert_equal [prefix_usage user:] [dict get [r memory prefixes] user: bytes]
+    }
+
+    test "MEMORY PREFIXES updates of large values only sample them" {
+        r xgroup create queue:1 g $ mkstream
+        set rd [redis_deferring_client]
+        for {set j 0} {$j < 20000} {incr j} {
+            $rd xgroup createconsumer queue:1 g "consumer:$j"
+            $rd hset queue:2 "field:$j" [string repeat x 20]
+        }
+        for {set j 0} {$j < 40000} {incr j} {
+            $rd read
+        }
+        $rd close
+
+        r config resetstat
+        for {set j 0} {$j < 1000} {incr j} {
+            r xadd queue:1 * item $j
+            r hset queue:2 "new:$j" [string repeat x 20]
+        }
+        assert_equal [prefix_usage queue:] [dict get [r memory prefixes] queue: bytes]
+        # Walking the 20000 consumers at every XADD takes hundreds of
+        # microseconds.
+        if {!$::valgrind} {
+            regexp {usec_per_call=([0-9.]+)} [getInfoProperty [r info commandstats] cmdstat_xadd] -> usec
+            assert_lessthan $usec 100
+        }
+        r del queue:1 queue:2
+    }
+
+    test "MEMORY PREFIXES forgets prefixes without keys" {
+        for {set j 0} {$j < 100} {incr j} {
+            r del "user:$j"
+        }
+        r rename session:1 nodelimiter2
+        assert_equal {{}} [dict keys [r memory prefixes]]
+        assert_equal 2 [dict get [r memory prefixes] {} keys]
+        r flushdb
+        assert_equal {} [r memory prefixes]
+    }
+
+    test "MEMORY PREFIXES follows SWAPDB and DEBUG RELOAD" {
+        r select 10
+        r set "a:1" foo
+        r swapdb 9 10
+        assert_equal {} [r memory prefixes]
+        r select 9
+        assert_equal 1 [dict get [r memory prefixes] a: keys]
+        r debug reload
+        assert_equal 1 [dict get [r memory prefixes] a: keys]
+        assert_equal [r memory usage a:1] [dict get [r memory prefixes] a: bytes]
+        r flushall
+    } {OK} {needs:debug}
+}
+
+start_server {tags {"memefficiency external:skip"}} {
+    test "MEMORY PREFIXES is an error when accounting is disabled" {
+        assert_error "*memory-prefix-delimiter*" {r memory prefixes}
+    }
+}
+
+start_server {tags {"memefficiency external:skip"} overrides {compact-values yes}} {
+    test "Compact values save memory" {
+        r flushall
+        set base [s used_memory]
+        for {set j 0} {$j < 10000} {incr j} {
+            r set "key:$j" [expr {100000+$j}]
+        }
+        set compact [expr {[s used_memory]-$base}]
+        r flushall
+        set base [s used_memory]
+        for {set j 0} {$j < 10000} {incr j} {
+            r set "key:$j" "[expr {100000+$j}]xx"
+        }
+        set regular [expr {[s used_memory]-$base}]
+        assert {$regular - $compact >= 10000*16}
+    }
+
+    test "Compact values behave like regular strings" {
+        r flushall
+        r set int 12345
+        r set neg -2147483648
+        r set str abc
+        r set empty ""
+        assert_equal int [r object encoding int]
+        assert_equal embstr [r object encoding str]
+        assert_equal 12346 [r incr int]
+        assert_equal -2147483649 [r decr neg]
+        assert_equal 4 [r append str d]
+        assert_equal 0 [r strlen empty]
+        assert_equal abcd [r getdel str]
+        assert_equal 0 [r exists str]
+        r setrange empty 2 x
+        assert_equal "\x00\x00x" [r get empty]
+        r multi
+        r incr int
+        r get int
+        assert_equal {12347 12347} [r exec]
+        assert_equal 12348 [r eval {redis.call('incr',KEYS[1]); return redis.call('get',KEYS[1])} 1 int]
+    }
+
+    test "Compact values survive DEBUG RELOAD and SWAPDB" {
+        r flushall
+        for {set j 0} {$j < 100} {incr j} {
+            r set "key:$j" $j
+            r set "str:$j" "s$j"
+        }
+        set digest [debug_digest]
+        r debug reload
+        assert_equal $digest [debug_digest]
+        assert_equal s42 [r get str:42]
+        r swapdb 9 10
+        assert_equal 0 [r dbsize]
+        r select 10
+        assert_equal 42 [r get key:42]
+        r select 9
+    } {OK} {needs:debug}
+
+    test "Compact values keep the LFU counter" {
+        r flushall
+        r config set maxmemory-policy allkeys-lfu
+        r set foo 1
+        for {set j 0} {$j < 100} {incr j} {
+            r get foo
+        }
+        assert {[r object freq foo] > 5}
+        r config set maxmemory-policy noeviction
+    } {OK} {needs:config-maxmemory}
+}
+
 run_solo {defrag} {
 start_server {tags {"defrag external:skip"} overrides {appendonly yes auto-aof-rewrite-percentage 0 save ""}} {
     if {[string match {*jemalloc*} [s mem_allocator]] && [r debug mallctl arenas.page] <= 8192} {
@@ -573,6 +738,75 @@ start_server {tags {"defrag external:skip"} overrides {appendonly yes auto-aof-r
                 r save ;# saving an rdb iterates over all the data / pointers
             }
         }
+
+        test "Active defrag threaded string values" {
+            start_server {tags {"defrag"} overrides {save ""}} {
+                r config set hz 100
+                r config set activedefrag no
+                r config set active-defrag-threaded yes
+                r config set active-defrag-threshold-lower 5
+                r config set active-defrag-cycle-min 65
+                r config set active-defrag-cycle-max 75
+                r config set active-defrag-ignore-bytes 2mb
+                r config set maxmemory 0
+
+                # values of 1500 bytes are RAW strings above the threaded threshold
+                set keys 40000
+                populate $keys asdf 1500
+                set rd [redis_deferring_client]
+                for {set j 0} {$j < $keys} {incr j 2} {
+                    $rd del "asdf$j"
+                }
+                for {set j 0} {$j < $keys} {incr j 2} {
+                    $rd read ; # Discard replies
+                }
+                $rd close
+
+                after 120 ;# serverCron only updates the info once in 100ms
+                set frag [s allocator_frag_ratio]
+                if {$::verbose} {
+                    puts "frag $frag"
+                }
+                assert {$frag >= 1.4}
+
+                set digest [debug_digest]
+                catch {r config set activedefrag yes} e
+                if {[r config get activedefrag] eq "activedefrag yes"} {
+                    wait_for_condition 50 100 {
+                        [s active_defrag_running] ne 0
+                    } else {
+                        fail "defrag not started."
+                    }
+                    wait_for_condition 500 100 {
+                        [s active_defrag_running] eq 0
+                    } else {
+                        after 120 ;# serverCron only updates the info once in 100ms
+                        puts [r info memory]
+                        puts [r info stats]
+                        fail "defrag didn't stop."
+                    }
+
+                    after 120 ;# serverCron only updates the info once in 100ms
+                    set frag [s allocator_frag_ratio]
+                    if {$::verbose} {
+                        puts "frag $frag"
+                        puts "hits: [s active_defrag_hits]"
+                        puts "misses: [s active_defrag_misses]"
+                    }
+                    assert {$frag < 1.1}
+                }
+
+                # verify the data isn't corrupted or changed
+                set newdigest [debug_digest]
+                assert {$digest eq $newdigest}
+
+                # writes and flushes with jobs possibly still in flight
+                r append asdf1 x
+                assert_equal 1501 [r strlen asdf1]
+                r flushall async
+                assert_equal 0 [r dbsize]
+            }
+        }
     }
 }
 } ;# run_solo
@@ -225,6 +225,73 @@ start_server {tags {"protocol network"}} {
         assert_equal [r exec] 2
     }
 
+    test "test bulk arguments over proto-big-arg-len" {
+        r flushdb
+        r config set proto-big-arg-len 1024
+        set val [string repeat abcd 1000]
+
+        # The bulk is received in pieces, so it is read into its own buffer.
+        set fd [r channel]
+        set proto "*3\r\n\$3\r\nSET\r\n\$3\r\nkey\r\n\$[string length $val]\r\n"
+        puts -nonewline $fd $proto[string range $val 0 999]
+        flush $fd
+        after 100
+        puts -nonewline $fd "[string range $val 1000 end]\r\n"
+        flush $fd
+        assert_equal OK [r read]
+        assert_equal $val [r get key]
+
+        # Pipelined bulks end up in the same query buffer and are copied.
+        r multi
+        for {set j 0} {$j < 10} {incr j} {
+            r set key$j $j$val
+        }
+        r exec
+        for {set j 0} {$j < 10} {incr j} {
+            assert_equal $j$val [r get key$j]
+        }
+        r config set proto-big-arg-len 32kb
+    }
+
+    test "test range replies with elements of mixed sizes" {
+        # Small elements are written in place, while the ones bigger than a
+        # reply block, and the integers, take different paths.
+        r hello 2
+        r flushdb
+        set elements {}
+        for {set j 0} {$j < 3000} {incr j} {
+            if {$j % 500 == 0} {
+                set ele [string repeat $j 10000]
+            } elseif {$j % 3 == 0} {
+                set ele $j
+            } else {
+                set ele "element:$j"
+            }
+            lappend elements $ele
+            r rpush list $ele
+            r hset hash field:$j $ele
+            r zadd zset [expr {$j * 1.5}] $ele
+        }
+        assert_equal $elements [r lrange list 0 -1]
+        assert_equal [lrange $elements 1000 1999] [r lrange list 1000 1999]
+        set hash [r hgetall hash]
+        assert_equal 6000 [llength $hash]
+        assert_equal [lindex $elements 2500] [dict get $hash field:2500]
+        assert_equal [lsort $elements] [lsort [r hvals hash]]
+
+        set withscores [r zrange zset 0 -1 withscores]
+        assert_equal 6000 [llength $withscores]
+        assert_equal [lindex $elements 1000] [lindex $withscores 2000]
+        assert_equal 1500 [lindex $withscores 2001]
+        # Reply length unknown in advance, so it is deferred.
+        assert_equal [lrange $elements 0 99] [r zrangebyscore zset -inf (150]
+
+        r hello 3
+        set withscores [r zrange zset 0 -1 withscores]
+        assert_equal 3000 [llength $withscores]
+        assert_equal [list [lindex $elements 2999] 4498.5] [lindex $withscores end]
+        r hello 2
+    }
 }
 
 start_server {tags {"regression"}} {
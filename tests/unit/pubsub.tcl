@@ -191,6 +191,81 @@ start_server {tags {"pubsub network"}} {
         $rd1 close
     }
 
+    test "PUBLISH matches patterns with and without literal prefixes" {
+        set rd1 [redis_deferring_client]
+        set patterns {news.* news.sport.* n?ws.* *.sport.* news.sport.football
+                      {news.\*} {[nm]ews.*} news news.sport.f*l news.s*}
+        assert_equal [llength $patterns] [lindex [psubscribe $rd1 $patterns] end]
+
+        foreach {channel matched} {
+            news.sport.football {news.* news.sport.* n?ws.* *.sport.* news.sport.football {[nm]ews.*} news.sport.f*l news.s*}
+            news.* {news.* n?ws.* {news.\*} {[nm]ews.*}}
+            mews.tech {{[nm]ews.*}}
+            news {news}
+            other {}
+        } {
+            assert_equal [llength $matched] [r publish $channel hello]
+            set got {}
+            foreach _ $matched {
+                lappend got [lindex [$rd1 read] 1]
+            }
+            assert_equal [lsort $matched] [lsort $got]
+        }
+
+        # Unsubscribed patterns are removed from the index.
+        punsubscribe $rd1 {news.* news.sport.* news.s*}
+        assert_equal 5 [r publish news.sport.football hello]
+        punsubscribe $rd1
+        assert_equal 0 [r publish news.sport.football hello]
+        $rd1 close
+    }
+
+    test "PUBLISH big messages to RESP2 and RESP3 subscribers" {
+        set rd1 [redis_deferring_client]
+        set rd2 [redis_deferring_client]
+        $rd2 hello 3
+        $rd2 read ; # Discard the hello reply
+        assert_equal {1} [subscribe $rd1 {big.chan}]
+        assert_equal {2} [psubscribe $rd1 {big.*}]
+        assert_equal {1} [subscribe $rd2 {big.chan}]
+
+        # Many messages, so that some are queued in the reply list.
+        for {set j 0} {$j < 20} {incr j} {
+            assert_equal 3 [r publish big.chan [string repeat $j 20000]]
+        }
+        for {set j 0} {$j < 20} {incr j} {
+            set msg [string repeat $j 20000]
+            assert_equal [list message big.chan $msg] [$rd1 read]
+            assert_equal [list pmessage big.* big.chan $msg] [$rd1 read]
+            assert_equal [list message big.chan $msg] [$rd2 read]
+        }
+
+        # clean up clients
+        $rd1 close
+        $rd2 close
+    }
+
+    test "Output buffer limits apply to big PUBLISH messages" {
+        r config set client-output-buffer-limit {pubsub 100000 0 0}
+        set rd1 [redis_deferring_client]
+        assert_equal {1} [subscribe $rd1 {big.chan}]
+
+        # Queue the messages in a single transaction, so that the client
+        # can't drain its output buffer meanwhile.
+        r multi
+        for {set j 0} {$j < 10} {incr j} {
+            r publish big.chan [string repeat x 20000]
+        }
+        r exec
+        wait_for_condition 50 10 {
+            [r publish big.chan hello] == 0
+        } else {
+            fail "subscriber not disconnected"
+        }
+        catch {$rd1 close}
+        r config set client-output-buffer-limit {pubsub 32mb 8mb 60}
+    } {OK}
+
     test "PUNSUBSCRIBE and UNSUBSCRIBE should always reply" {
         # Make sure we are not subscribed to any channel at all.
         r punsubscribe
@@ -404,3 +479,80 @@ start_server {tags {"pubsub network"}} {
         $rd1 close
     }
 }
+
+start_server {tags {"pubsub network"} overrides {io-threads 3 io-threads-fanout-min-clients 1}} {
+    test "PUBLISH delivers messages using the IO threads" {
+        set clients {}
+        for {set j 0} {$j < 10} {incr j} {
+            set rd [redis_deferring_client]
+            if {$j % 2} {
+                $rd hello 3
+                $rd read ; # Discard the hello reply
+            }
+            $rd subscribe fanout.chan
+            $rd psubscribe fanout.*
+            $rd read
+            $rd read
+            lappend clients $rd
+        }
+
+        # Small and big messages, many of them, so that some are queued in
+        # the reply list of the subscribers.
+        for {set j 0} {$j < 20} {incr j} {
+            set msg [string repeat $j [expr {$j % 2 ? 20000 : 10}]]
+            assert_equal 20 [r publish fanout.chan $msg]
+        }
+        foreach rd $clients {
+            for {set j 0} {$j < 20} {incr j} {
+                set msg [string repeat $j [expr {$j % 2 ? 20000 : 10}]]
+                assert_equal [list message fanout.chan $msg] [$rd read]
+                assert_equal [list pmessage fanout.* fanout.chan $msg] [$rd read]
+            }
+            $rd close
+        }
+    }
+
+    test "PUBLISH using the IO threads to a RESP3 publisher and slow clients" {
+        r config set client-output-buffer-limit {pubsub 100000 0 0}
+        set rd1 [redis_deferring_client]
+        set rd2 [redis_deferring_client]
+        $rd1 subscribe fanout.chan
+        $rd1 read
+        $rd2 subscribe fanout.chan
+        $rd2 read
+
+        # The publisher is subscribed itself, and gets the message before
+        # the reply of PUBLISH.
+        set rr [redis_client]
+        $rr hello 3
+        $rr subscribe fanout.chan
+        $rr readraw 1
+        assert_equal {>3} [$rr publish fanout.chan hello]
+        assert_equal {$7} [$rr read]
+        assert_equal {message} [$rr read]
+        assert_equal {$11} [$rr read]
+        assert_equal {fanout.chan} [$rr read]
+        assert_equal {$5} [$rr read]
+        assert_equal {hello} [$rr read]
+        assert_equal {:3} [$rr read]
+        $rr close
+        assert_equal [list message fanout.chan hello] [$rd1 read]
+        assert_equal [list message fanout.chan hello] [$rd2 read]
+
+        # Subscribers that can't drain their output buffer are disconnected,
+        # once the socket buffers are full too.
+        r multi
+        for {set j 0} {$j < 200} {incr j} {
+            r publish fanout.chan [string repeat x 50000]
+        }
+        r exec
+        wait_for_condition 50 10 {
+            [r publish fanout.chan hello] == 0
+        } else {
+            fail "subscribers not disconnected"
+        }
+        $rd1 close
+        $rd2 close
+        r config set client-output-buffer-limit {pubsub 33554432 8388608 60}
+    }
+}
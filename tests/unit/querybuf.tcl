@@ -20,15 +20,36 @@ proc client_query_buffer {name} {
 start_server {tags {"querybuf slow"}} {
     # The test will run at least 2s to check if client query
     # buffer will be resized when client idle 2s.
-    test "query buffer resized correctly" {
+    test "clients with no pending input use the shared query buffer" {
         set rd [redis_client]
         $rd client setname test_client
+        assert_equal 0 [client_query_buffer test_client]
+        # The client executing the command sees the shared buffer.
+        assert_match {*qbuf=26 qbuf-free=*} [r client info]
+        $rd close
+    }
+
+    test "query buffer resized correctly" {
+        set rd [redis_deferring_client]
+        $rd client setname test_client
+        $rd read
+        # A partial command makes the client keep its own query buffer.
+        $rd write "*3\r\n\$3\r\nset\r\n\$1\r\nx\r\n"
+        $rd flush
+        wait_for_condition 100 10 {
+            [client_query_buffer test_client] > 0
+        } else {
+            fail "client has no query buffer"
+        }
         set orig_test_client_qbuf [client_query_buffer test_client]
         # Make sure query buff has less than the peak resize threshold (PROTO_RESIZE_THRESHOLD) 32k
         # but at least the basic IO reading buffer size (PROTO_IOBUF_LEN) 16k
         assert {$orig_test_client_qbuf >= 16384 && $orig_test_client_qbuf < 32768}
+        $rd write "\$1\r\ny\r\n"
+        $rd flush
+        assert_equal OK [$rd read]
 
-        # Check that the initial query buffer is resized after 2 sec
+        # Check that the query buffer is released after 2 sec
         wait_for_condition 1000 10 {
             [client_idle_sec test_client] >= 3 && [client_query_buffer test_client] == 0
         } else {
@@ -37,6 +58,30 @@ start_server {tags {"querybuf slow"}} {
         $rd close
     }
 
+    test "idle client after a partial read gives the query buffer back" {
+        set rd [redis_deferring_client]
+        $rd client setname test_client
+        $rd read
+        # Write the command a few bytes at a time, so that it takes many
+        # reads, some of which (with TLS) return no data at all.
+        foreach chunk [list "*1\r\n" "\$4\r\n" "pi" "ng\r\n"] {
+            $rd write $chunk
+            $rd flush
+            after 20
+        }
+        assert_equal PONG [$rd read]
+        wait_for_condition 1000 10 {
+            [client_idle_sec test_client] >= 3 && [client_query_buffer test_client] == 0
+        } else {
+            fail "query buffer was not released"
+        }
+        # The next command reads into the shared buffer again.
+        $rd ping
+        assert_equal PONG [$rd read]
+        assert_equal 0 [client_query_buffer test_client]
+        $rd close
+    }
+
     test "query buffer resized correctly when not idle" {
         # Memory will increase by more than 32k due to client query buffer.
         set rd [redis_client]
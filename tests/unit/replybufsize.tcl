@@ -43,5 +43,20 @@ start_server {tags {"replybufsize"}} {
         
         $tc close
     } {0} {needs:debug}
+
+    test {reply buffers are given back to the pool once written} {
+        r config set reply-buffer-pool-size 4mb
+        r set bigval [string repeat x 32768]
+        for {set j 0} {$j < 10} {incr j} {
+            set rr [redis_client]
+            assert_equal 32768 [string length [$rr get bigval]]
+            $rr close
+        }
+        assert {[s mem_reply_buffer_pool] > 0}
+
+        r config set reply-buffer-pool-size 0
+        assert_equal 0 [s mem_reply_buffer_pool]
+        r config set reply-buffer-pool-size 4mb
+    }
 }
     
\ No newline at end of file
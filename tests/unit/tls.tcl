@@ -1,3 +1,5 @@
+source tests/support/benchmark.tcl
+
 start_server {tags {"tls"}} {
     if {$::tls} {
         package require tls
@@ -140,6 +142,22 @@ start_server {tags {"tls"}} {
             $rd close
         }
 
+        test {TLS: tls-ktls works with or without kernel support} {
+            r CONFIG SET tls-ktls yes
+
+            # kTLS is enabled, when supported, for the new connections, that
+            # otherwise keep using OpenSSL for the records.
+            set rd [redis [srv 0 host] [srv 0 port] 0 1]
+            set big [string repeat x 1000000]
+            $rd SET bigkey $big
+            assert_equal $big [$rd GET bigkey]
+            assert_equal [lrepeat 100 $big] [$rd MGET {*}[lrepeat 100 bigkey]]
+            $rd close
+
+            r CONFIG SET tls-ktls no
+            r DEL bigkey
+        }
+
         test {TLS: Working with an encrypted keyfile} {
             # Create an encrypted version
             set keyfile [lindex [r config get tls-key-file] 1]
@@ -156,3 +174,27 @@ start_server {tags {"tls"}} {
         }
     }
 }
+
+if {$::tls} {
+    start_server {tags {"tls"} overrides {tls-handshake-threads 2 io-threads 2 io-threads-do-reads yes}} {
+        test {TLS: handshakes in threads and I/O threads} {
+            # Many clients connecting at the same time, and a reply big
+            # enough to be written in more than a single event. The
+            # benchmark opens all its clients at once, so the handshakes
+            # run concurrently.
+            r SET bigkey [string repeat x 500000]
+            r CONFIG RESETSTAT
+            set cmd [redisbenchmark [srv 0 host] [srv 0 port] "-c 50 -n 500 --threads 4 -q GET bigkey"]
+            if {[catch {exec {*}$cmd} err]} {
+                fail "redis-benchmark failed: [lindex [split $err "\n"] 0]"
+            }
+            assert_morethan_equal [s total_connections_received] 50
+            assert_match {*calls=500,*} [cmdrstat get r]
+            wait_for_condition 50 100 {
+                [s connected_clients] == 1
+            } else {
+                fail "The benchmark clients are still connected"
+            }
+        }
+    }
+}
@@ -419,6 +419,28 @@ start_server {tags {"tracking network"}} {
         assert_equal $res {invalidate a{t}}
     }
 
+    test {Invalidations are coalesced in a single message per client} {
+        r CLIENT TRACKING off
+        r HELLO 3
+        r CLIENT TRACKING on
+        r MSET a{t} 1 b{t} 2 c{t} 3
+        r MGET a{t} b{t} c{t}
+        # Keys modified in the same event loop cycle, some of them twice.
+        set rw [redis_client]
+        $rw MULTI
+        $rw INCR a{t}
+        $rw INCR b{t}
+        $rw INCR a{t}
+        $rw INCR b{t}
+        $rw EXEC
+        $rw close
+        set res [r read]
+        assert_equal [lindex $res 0] {invalidate}
+        assert_equal [lsort [lindex $res 1]] {a{t} b{t}}
+        # The invalidation precedes the reply of the next command.
+        assert_equal [r GET c{t}] {3}
+    }
+
     test {Tracking invalidation message of eviction keys should be before response} {
         # Get the current memory limit and calculate a new limit.
         r CLIENT TRACKING off
@@ -468,6 +490,56 @@ start_server {tags {"tracking network"}} {
         assert_equal [$rd read] {invalidate list2{t}}
     }
 
+    test {Invalidation precedes the reply of a client served while blocked} {
+        set rd2 [redis_deferring_client]
+        $rd2 HELLO 3
+        $rd2 read
+        $rd2 CLIENT TRACKING on
+        $rd2 read
+        r SET tracked{t} 1
+        $rd2 GET tracked{t}
+        assert_equal {1} [$rd2 read]
+
+        # Served by handleClientsBlockedOnKeys() after EXEC.
+        $rd2 BLPOP list3{t} 0
+        wait_for_blocked_clients_count 1
+        r MULTI
+        r SET tracked{t} 2
+        r RPUSH list3{t} a
+        r EXEC
+        assert_equal {invalidate tracked{t}} [$rd2 read]
+        assert_equal {list3{t} a} [$rd2 read]
+
+        # Handed the element directly by RPUSH, in the same event loop
+        # cycle as the change.
+        $rd2 GET tracked{t}
+        assert_equal {2} [$rd2 read]
+        $rd2 BLPOP list3{t} 0
+        wait_for_blocked_clients_count 1
+        set rw [redis_deferring_client]
+        $rw write [formatCommand SET tracked{t} 3]
+        $rw write [formatCommand RPUSH list3{t} b]
+        $rw flush
+        assert_equal {OK} [$rw read]
+        assert_equal {1} [$rw read]
+        assert_equal {invalidate tracked{t}} [$rd2 read]
+        assert_equal {list3{t} b} [$rd2 read]
+
+        # Pub/Sub messages.
+        $rd2 GET tracked{t}
+        assert_equal {3} [$rd2 read]
+        $rd2 SUBSCRIBE ch
+        $rd2 read
+        r MULTI
+        r SET tracked{t} 4
+        r PUBLISH ch hello
+        r EXEC
+        assert_equal {invalidate tracked{t}} [$rd2 read]
+        assert_equal {message ch hello} [$rd2 read]
+        $rw close
+        $rd2 close
+    }
+
     test {Tracking gets notification on tracking table key eviction} {
         r CLIENT TRACKING off
         r CLIENT TRACKING on REDIRECT $redir_id NOLOOP
@@ -480,14 +552,14 @@ start_server {tags {"tracking network"}} {
         # since we disabled/enabled tracking multiple time with the same
         # ID, and tracking does not do ID cleanups for performance reasons.
         # So we check that eventually we'll receive one or the other key,
-        # otherwise the test will die for timeout.
+        # otherwise the test will die for timeout. The keys evicted in the
+        # same event loop cycle are sent in a single message.
         while 1 {
             set keys [lindex [$rd_redirection read] 2]
-            if {$keys eq {key1{t}} || $keys eq {key2{t}}} break
+            if {{key1{t}} in $keys || {key2{t}} in $keys} break
         }
-        # We should receive an expire notification for one of
-        # the two keys (only one must remain)
-        assert {$keys eq {key1{t}} || $keys eq {key2{t}}}
+        # Only one key must remain in the tracking table.
+        assert_equal 1 [s tracking_total_keys]
     }
 
     test {Invalidation message received for flushall} {
@@ -536,13 +608,16 @@ start_server {tags {"tracking network"}} {
             r GET key$i
         }
         r config set tracking-table-max-keys $TRACKING_TABLE_MAX_KEYS
-        # If not enough keys are evicted, we won't get enough invalidation
-        # messages, and "$rd_redirection read" will block.
-        # If too many keys are evicted, we will get too many invalidation
-        # messages, and the assert will fail.
-        for {set i 0} {$i < $NUM_OF_KEYS_TO_TEST - $TRACKING_TABLE_MAX_KEYS} {incr i} {
-            $rd_redirection read
+        # If not enough keys are evicted, we won't get enough invalidated
+        # keys, and "$rd_redirection read" will block.
+        # If too many keys are evicted, we will get too many invalidated
+        # keys, and the assert will fail. The keys evicted in the same event
+        # loop cycle are sent in a single message.
+        set evicted 0
+        while {$evicted < $NUM_OF_KEYS_TO_TEST - $TRACKING_TABLE_MAX_KEYS} {
+            incr evicted [llength [lindex [$rd_redirection read] 2]]
         }
+        assert_equal [expr {$NUM_OF_KEYS_TO_TEST - $TRACKING_TABLE_MAX_KEYS}] $evicted
         $rd_redirection PING
         assert {[$rd_redirection read] eq {pong {}}}
     }
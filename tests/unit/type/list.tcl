@@ -1305,6 +1305,61 @@ foreach {pop} {BLPOP BLMPOP_LEFT} {
         close_replication_stream $repl
     } {} {needs:repl}
 
+    test {LPUSH and RPUSH hand the elements to clients blocked by BLPOP and BRPOP} {
+        set rd1 [redis_deferring_client]
+        set rd2 [redis_deferring_client]
+        set rd3 [redis_deferring_client]
+        r del mylist{t} dst{t}
+        set repl [attach_to_replication_stream]
+
+        # The list would be "c b a": the first client pops its head and the
+        # second its tail, while the element left is pushed.
+        $rd1 blpop mylist{t} 0
+        $rd2 brpop mylist{t} 0
+        wait_for_blocked_clients_count 2
+        assert_equal 3 [r lpush mylist{t} a b c]
+        assert_equal {mylist{t} c} [$rd1 read]
+        assert_equal {mylist{t} a} [$rd2 read]
+        assert_equal {b} [r lrange mylist{t} 0 -1]
+        r del mylist{t}
+
+        # Every element is handed, so the key is never created.
+        $rd1 brpop mylist{t} 0
+        $rd2 blpop mylist{t} 0
+        wait_for_blocked_clients_count 2
+        assert_equal 2 [r rpush mylist{t} x y]
+        assert_equal {mylist{t} y} [$rd1 read]
+        assert_equal {mylist{t} x} [$rd2 read]
+        assert_equal 0 [r exists mylist{t}]
+
+        # A client blocked by BLMOVE stops the handoff, and is served with
+        # the following clients after the push.
+        $rd1 blpop mylist{t} 0
+        wait_for_blocked_clients_count 1
+        $rd2 blmove mylist{t} dst{t} left right 0
+        wait_for_blocked_clients_count 2
+        $rd3 blpop mylist{t} 0
+        wait_for_blocked_clients_count 3
+        assert_equal 3 [r rpush mylist{t} 1 2 3]
+        assert_equal {mylist{t} 1} [$rd1 read]
+        assert_equal 2 [$rd2 read]
+        assert_equal {mylist{t} 3} [$rd3 read]
+        assert_equal {2} [r lrange dst{t} 0 -1]
+        $rd1 close
+        $rd2 close
+        $rd3 close
+
+        assert_replication_stream $repl {
+            {select *}
+            {lpush mylist{t} b}
+            {del mylist{t}}
+            {rpush mylist{t} 2 3}
+            {lmove mylist{t} dst{t} left right}
+            {lpop mylist{t}}
+        }
+        close_replication_stream $repl
+    } {} {needs:repl}
+
     test {LPUSHX, RPUSHX - generic} {
         r del xlist
         assert_equal 0 [r lpushx xlist a]
@@ -404,6 +404,47 @@ start_server {
         assert_equal [s total_error_replies] 1
     }
 
+    test {Blocking XREADGROUP: only as many consumers as new entries are served} {
+        r del mystream
+        r XGROUP CREATE mystream mygroup $ MKSTREAM
+        r XGROUP CREATE mystream othergroup $
+        set clients {}
+        for {set j 1} {$j <= 5} {incr j} {
+            set rd [redis_deferring_client]
+            $rd XREADGROUP GROUP mygroup consumer$j COUNT 1 BLOCK 0 STREAMS mystream ">"
+            lappend clients $rd
+        }
+        set other [redis_deferring_client]
+        $other XREADGROUP GROUP othergroup other BLOCK 0 STREAMS mystream ">"
+        set reader [redis_deferring_client]
+        $reader XREAD BLOCK 0 STREAMS mystream $
+        wait_for_blocked_clients_count 7
+
+        # The first three consumers of mygroup get an entry each, in the
+        # order they blocked, while the others keep waiting. The consumer
+        # of othergroup and the XREAD client get all the entries.
+        r MULTI
+        r XADD mystream 1 f v1
+        r XADD mystream 2 f v2
+        r XADD mystream 3 f v3
+        r EXEC
+        for {set j 1} {$j <= 3} {incr j} {
+            assert_equal "{mystream {{$j-0 {f v$j}}}}" [[lindex $clients $j-1] read]
+        }
+        assert_equal {1-0 2-0 3-0} [lmap e [lindex [$other read] 0 1] {lindex $e 0}]
+        assert_equal {1-0 2-0 3-0} [lmap e [lindex [$reader read] 0 1] {lindex $e 0}]
+        wait_for_blocked_clients_count 2
+        assert_equal {1 1 1} [lmap c [r XINFO CONSUMERS mystream mygroup] {dict get $c pending}]
+
+        r XADD mystream 4 f v4
+        assert_equal "{mystream {{4-0 {f v4}}}}" [[lindex $clients 3] read]
+        wait_for_blocked_clients_count 1
+        r XADD mystream 5 f v5
+        assert_equal "{mystream {{5-0 {f v5}}}}" [[lindex $clients 4] read]
+        wait_for_blocked_clients_count 0
+        foreach rd [concat $clients $other $reader] {$rd close}
+    }
+
     test {RENAME can unblock XREADGROUP with data} {
         r del mystream{t}
         r XGROUP CREATE mystream{t} mygroup $ MKSTREAM
@@ -676,6 +717,28 @@ start_server {
         assert_equal [r XPENDING x grp - + 10 Alice] {}
     }
 
+    test {XAUTOCLAIM removes deleted entries whatever their idle time} {
+        r DEL x
+        for {set j 1} {$j <= 1000} {incr j} {
+            r XADD x $j-0 f v
+        }
+        r XGROUP CREATE x grp 0
+        r XREADGROUP GROUP grp Alice COUNT 1000 STREAMS x >
+        r XCLAIM x grp Alice 0 1-0 500-0 IDLE 3600000 JUSTID
+        r XDEL x 2-0 501-0
+
+        # The PEL scan clears the deleted entries it meets even if they are
+        # not idle enough, past the scanned entries the delivery time index
+        # only finds the idle ones.
+        assert_equal {2-0 1-0 {}} [r XAUTOCLAIM x grp Bob 3000000 - COUNT 1 JUSTID]
+        assert_equal {0-0 500-0 2-0} [r XAUTOCLAIM x grp Bob 3000000 2-0 COUNT 1 JUSTID]
+        assert_equal 999 [lindex [r XPENDING x grp] 0]
+
+        # The entries claimed above are not idle anymore.
+        assert_equal {0-0 {} 501-0} [r XAUTOCLAIM x grp Bob 3000000 - COUNT 1000 JUSTID]
+        assert_equal 998 [lindex [r XPENDING x grp] 0]
+    }
+
     test {XCLAIM with trimming} {
         r DEL x
         r config set stream-node-max-entries 2
@@ -714,6 +777,103 @@ start_server {
         assert_equal [r XPENDING x grp - + 10 Alice] {}
     }
 
+    test {XAUTOCLAIM and XPENDING IDLE with few idle entries in a big PEL} {
+        r DEL x
+        set ids {}
+        for {set j 0} {$j < 1000} {incr j} {
+            lappend ids [r XADD x * item $j]
+        }
+        r XGROUP CREATE x grp 0
+        r XREADGROUP GROUP grp Alice COUNT 1000 STREAMS x >
+        set idle {}
+        for {set j 0} {$j < 1000} {incr j 100} {
+            r XCLAIM x grp Alice 0 [lindex $ids $j] IDLE 3600000 JUSTID
+            lappend idle [lindex $ids $j]
+        }
+
+        set pending [r XPENDING x grp IDLE 3000000 - + 100]
+        assert_equal $idle [lmap entry $pending {lindex $entry 0}]
+        assert {[lindex $pending 0 2] >= 3600000}
+        set pending [r XPENDING x grp IDLE 3000000 [lindex $idle 2] + 3 Alice]
+        assert_equal [lrange $idle 2 4] [lmap entry $pending {lindex $entry 0}]
+        assert_equal {} [r XPENDING x grp IDLE 3000000 - + 10 Bob]
+
+        set reply [r XAUTOCLAIM x grp Bob 3000000 - COUNT 5 JUSTID]
+        assert_equal [list [lindex $idle 5] [lrange $idle 0 4] {}] $reply
+        set reply [r XAUTOCLAIM x grp Bob 3000000 [lindex $reply 0] COUNT 5 JUSTID]
+        assert_equal [list 0-0 [lrange $idle 5 9] {}] $reply
+        assert_equal {} [r XPENDING x grp IDLE 3000000 - + 100]
+        assert_equal 10 [llength [r XPENDING x grp - + 100 Bob]]
+        assert_equal 990 [llength [r XPENDING x grp - + 1000 Alice]]
+    }
+
+    test {XAUTOCLAIM reports more deleted entries than COUNT} {
+        r DEL x
+        for {set j 1} {$j <= 30} {incr j} {
+            r XADD x $j-0 f v
+        }
+        r XGROUP CREATE x grp 0
+        r XREADGROUP GROUP grp Alice STREAMS x >
+        for {set j 1} {$j <= 20} {incr j} {
+            r XDEL x $j-0
+        }
+        # The scan stops after 10 entries per entry to claim.
+        set reply [r XAUTOCLAIM x grp Bob 0 - COUNT 1]
+        assert_equal {11-0 {} {1-0 2-0 3-0 4-0 5-0 6-0 7-0 8-0 9-0 10-0}} $reply
+        assert_equal 20 [lindex [r XPENDING x grp] 0]
+    }
+
+    test {Consumer group PEL is consistent after random claims and acks} {
+        r DEL x
+        set ids {}
+        for {set j 1} {$j < 1000} {incr j} {
+            lappend ids [r XADD x [expr {$j/3}]-[expr {$j%3}] f v]
+        }
+        r XGROUP CREATE x grp $
+        set consumers {Alice Bob Charlie}
+        # The model maps every pending ID to its consumer and idle flag.
+        set model {}
+        for {set j 0} {$j < 3000} {incr j} {
+            set id [lindex $ids [randomInt [llength $ids]]]
+            if {[randomInt 3] == 0} {
+                r XACK x grp $id
+                dict unset model $id
+            } else {
+                set consumer [lindex $consumers [randomInt 3]]
+                set isidle [randomInt 2]
+                r XCLAIM x grp $consumer 0 $id IDLE [expr {$isidle ? 3600000 : 0}] FORCE JUSTID
+                dict set model $id [list $consumer $isidle]
+            }
+        }
+
+        foreach reload {0 1} {
+            if {$reload} {r DEBUG RELOAD}
+            set pending [lsort -dictionary [dict keys $model]]
+            set idle [lmap id $pending {
+                if {[lindex [dict get $model $id] 1]} {set id} else continue
+            }]
+            set reply [r XPENDING x grp - + 10000]
+            assert_equal $pending [lmap entry $reply {lindex $entry 0}]
+            foreach entry $reply {
+                assert_equal [lindex [dict get $model [lindex $entry 0]] 0] [lindex $entry 1]
+            }
+            assert_equal [llength $pending] [lindex [r XPENDING x grp] 0]
+            assert_equal [lindex $pending 0] [lindex [r XPENDING x grp] 1]
+            assert_equal [lindex $pending end] [lindex [r XPENDING x grp] 2]
+            foreach consumer $consumers {
+                set owned [lmap id $pending {
+                    if {[lindex [dict get $model $id] 0] eq $consumer} {set id} else continue
+                }]
+                set reply [r XPENDING x grp - + 10000 $consumer]
+                assert_equal $owned [lmap entry $reply {lindex $entry 0}]
+            }
+            foreach count {1 5 10000} {
+                set reply [r XPENDING x grp IDLE 3000000 - + $count]
+                assert_equal [lrange $idle 0 [expr {$count-1}]] [lmap entry $reply {lindex $entry 0}]
+            }
+        }
+    } {} {needs:debug}
+
     test {XINFO FULL output} {
         r del x
         r XADD x 100 a 1
@@ -318,6 +318,44 @@ start_server {
         assert_match {ERR*} $e
     }
 
+    test {XRANGE with entries of mixed sizes and encodings} {
+        # Entries with the master entry fields or their own fields, integer
+        # encoded fields and values, and values bigger than a reply block.
+        r del mixedstream
+        set entries {}
+        for {set j 1} {$j <= 1000} {incr j} {
+            if {$j % 250 == 0} {
+                set fields [list big [string repeat x 20000]]
+            } elseif {$j % 3 == 0} {
+                set fields [list $j [expr {$j * -1000}] other value:$j]
+            } else {
+                set fields [list item $j value value:$j]
+            }
+            r xadd mixedstream $j-1 {*}$fields
+            lappend entries [list $j-1 $fields]
+        }
+        foreach j {10 11 500} {
+            r xdel mixedstream $j-1
+            set entries [lsearch -all -inline -not -index 0 $entries $j-1]
+        }
+        assert_equal $entries [r xrange mixedstream - +]
+        assert_equal [lreverse $entries] [r xrevrange mixedstream + -]
+        assert_equal [lrange $entries 7 106] [r xrange mixedstream 8 + COUNT 100]
+        set idx [lsearch -index 0 $entries 204-1]
+        assert_equal [lrange $entries $idx [expr {$idx+99}]] \
+            [lindex [r xread COUNT 100 STREAMS mixedstream 203-1] 0 1]
+        assert_equal {} [r xread COUNT 100 STREAMS mixedstream 1000-1]
+        set all {}
+        set last_id -
+        while 1 {
+            set elements [r xrange mixedstream $last_id + COUNT 33]
+            if {[llength $elements] == 0} break
+            lappend all {*}$elements
+            set last_id [streamNextID [lindex $elements end 0]]
+        }
+        assert_equal $entries $all
+    }
+
     test {XREAD with non empty stream} {
         set res [r XREAD COUNT 1 STREAMS mystream 0-0]
         assert {[lrange [lindex $res 0 1 0 1] 0 1] eq {item 0}}
@@ -894,6 +932,168 @@ start_server {tags {"stream needs:debug"} overrides {appendonly yes aof-use-rdb-
     }
 }
 
+start_server {tags {"stream needs:debug external:skip"} overrides {appendonly yes stream-node-max-entries 10 stream-spill-after-nodes 3 stream-spill-cache-nodes 2 stream-spill-max-segments 64}} {
+    proc stream_spill_stat {field} {
+        getInfoProperty [r info stats] $field
+    }
+
+    test {XRANGE and XREVRANGE read the entries spilled to disk} {
+        r del mystream
+        set entries {}
+        for {set j 1} {$j <= 1000} {incr j} {
+            r xadd mystream $j-1 item $j
+            lappend entries [list $j-1 [list item $j]]
+        }
+        # 100 nodes, the last 3 are kept in memory.
+        assert_equal 97 [stream_spill_stat stream_spilled_nodes]
+        assert_equal 1 [stream_spill_stat stream_segments]
+
+        assert_equal $entries [r xrange mystream - +]
+        assert_equal [lreverse $entries] [r xrevrange mystream + -]
+        assert_equal [lrange $entries 494 504] [r xrange mystream 495 505]
+        assert_equal [lrange $entries 10 12] [r xrange mystream (10-1 + COUNT 3]
+        assert_equal [list [list mystream [lrange $entries 500 502]]] \
+            [r xread COUNT 3 STREAMS mystream 500-1]
+        assert_equal [lindex $entries 0] [dict get [r xinfo stream mystream] first-entry]
+        assert {[stream_spill_stat stream_node_faults] > 0}
+        assert {[getInfoProperty [r info memory] mem_stream_spill_cache] > 0}
+    }
+
+    test {Entries spilled to disk can be deleted and trimmed} {
+        r xdel mystream 42-1
+        set entries [lreplace $entries 41 41]
+        assert_equal 96 [stream_spill_stat stream_spilled_nodes]
+        assert_equal $entries [r xrange mystream - +]
+
+        # Removing whole nodes doesn't load them, trimming inside a node does.
+        r xtrim mystream MINID 205-1
+        set entries [lrange $entries 203 end]
+        assert_equal $entries [r xrange mystream - +]
+        assert_equal [lindex $entries 0] [dict get [r xinfo stream mystream] first-entry]
+        assert_equal 76 [stream_spill_stat stream_spilled_nodes]
+        assert_equal 796 [r xlen mystream]
+    }
+
+    test {Streams with entries spilled to disk survive COPY and reloads} {
+        set digest [r debug digest-value mystream]
+        set bytes [stream_spill_stat stream_segments_bytes]
+        r copy mystream mycopy
+        assert_equal $digest [r debug digest-value mycopy]
+        assert_equal 152 [stream_spill_stat stream_spilled_nodes]
+        assert_equal 2 [stream_spill_stat stream_segments]
+        # The copy only writes the nodes still in the stream to its segment.
+        assert {[stream_spill_stat stream_segments_bytes] < 2*$bytes}
+        r xadd mycopy 2000-1 item 2000
+        r del mycopy
+
+        r debug reload
+        assert_equal $digest [r debug digest-value mystream]
+        assert {[stream_spill_stat stream_spilled_nodes] > 70}
+
+        r bgrewriteaof
+        waitForBgrewriteaof r
+        r debug loadaof
+        assert_equal $digest [r debug digest-value mystream]
+        assert_equal $entries [r xrange mystream - +]
+    }
+
+    test {New entries go to a new node when the tail node is spilled} {
+        # Delete the entries of the nodes in memory, so that the last node
+        # left is on disk.
+        foreach entry [r xrange mystream 971-1 +] {
+            r xdel mystream [lindex $entry 0]
+        }
+        set entries [lrange $entries 0 end-30]
+        r xadd mystream 2000-1 item 2000
+        lappend entries {2000-1 {item 2000}}
+        assert_equal $entries [r xrange mystream - +]
+        assert_equal [lreverse $entries] [r xrevrange mystream + -]
+    }
+
+    test {Nodes loaded back in memory are spilled again} {
+        # Deleting an entry loads its node back in memory.
+        r xdel mystream [lindex $entries 0 0]
+        set entries [lrange $entries 1 end]
+        for {set j 2001} {$j <= 2030} {incr j} {
+            r xadd mystream $j-1 item $j
+            lappend entries [list $j-1 [list item $j]]
+        }
+        # The first node is back on disk, so reading it is a fault.
+        set faults [stream_spill_stat stream_node_faults]
+        assert_equal [lrange $entries 0 0] [r xrange mystream - + COUNT 1]
+        assert_equal [expr {$faults+1}] [stream_spill_stat stream_node_faults]
+        assert_equal $entries [r xrange mystream - +]
+    }
+
+    test {Trimming a stream releases its segments} {
+        r xtrim mystream MAXLEN 0
+        assert_equal 0 [stream_spill_stat stream_spilled_nodes]
+        assert_equal 0 [stream_spill_stat stream_segments]
+        assert_equal 0 [stream_spill_stat stream_segments_bytes]
+        r del mystream
+    }
+}
+
+start_server {tags {"stream external:skip"} overrides {stream-node-max-entries 10 stream-spill-after-nodes 3}} {
+    test {Streams are not spilled when no segment is reserved} {
+        for {set j 1} {$j <= 100} {incr j} {
+            r xadd s1 $j-1 item $j
+        }
+        assert_equal 0 [getInfoProperty [r info stats] stream_segments]
+        assert_equal 0 [getInfoProperty [r info stats] stream_spilled_nodes]
+        assert_equal 100 [llength [r xrange s1 - +]]
+    }
+}
+
+start_server {tags {"stream external:skip"} overrides {stream-node-max-entries 10 stream-spill-after-nodes 3 stream-spill-cache-nodes 2 stream-spill-max-segments 1}} {
+    proc stream_spill_stat {field} {
+        getInfoProperty [r info stats] $field
+    }
+
+    test {Streams are not spilled past stream-spill-max-segments} {
+        for {set j 1} {$j <= 100} {incr j} {
+            r xadd s1 $j-1 item $j
+            r xadd s2 $j-1 item $j
+        }
+        # Only the first stream got a segment, the second stays in memory.
+        assert_equal 1 [stream_spill_stat stream_segments]
+        assert_equal 7 [stream_spill_stat stream_spilled_nodes]
+        assert_equal 100 [llength [r xrange s2 - +]]
+        assert_equal 100 [llength [r xrange s1 - +]]
+    }
+
+    test {Reading entries that can't be read from disk replies with an error} {
+        if {[file isdirectory /proc/[srv 0 pid]/fd]} {
+            r xgroup create s1 g 0
+            assert_equal 5 [llength [lindex [r xreadgroup group g c1 count 5 streams s1 >] 0 1]]
+            # Push the nodes just read out of the spill cache.
+            assert_equal 31 [llength [r xrange s1 30-1 60-1]]
+            # Truncate the segment file, unlinked but still open.
+            foreach fd [glob -nocomplain /proc/[srv 0 pid]/fd/*] {
+                if {[string match {*temp-stream-segment-*} [file readlink $fd]]} {
+                    close [open $fd w]
+                }
+            }
+            catch {r xrange s1 - +} e
+            assert_match {*Error reading the stream entries from disk*} $e
+            assert_error {*Error reading the stream*} {r copy s1 s1copy}
+            # Entries that can't be read are neither deleted nor dropped
+            # from the PEL.
+            assert_error {*Error reading the stream*} {r xdel s1 1-1}
+            catch {r xclaim s1 g c2 0 1-1} e
+            assert_match {*Error reading the stream*} $e
+            catch {r xautoclaim s1 g c2 0 0} e
+            assert_match {*Error reading the stream*} $e
+            assert_equal 5 [lindex [r xpending s1 g] 0]
+            assert_equal 100 [r xlen s1]
+            # The server is still up, and the entries in memory are fine.
+            assert_equal {{100-1 {item 100}}} [r xrevrange s1 + - COUNT 1]
+            r del s1 s2
+            assert_equal 0 [stream_spill_stat stream_segments]
+        }
+    }
+}
+
 start_server {tags {"stream"}} {
     test {XGROUP HELP should not have unexpected options} {
         catch {r XGROUP help xxx} e
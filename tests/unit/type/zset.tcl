@@ -1516,10 +1516,19 @@ start_server {tags {"zset"}} {
 
             assert_encoding $encoding zscoretest
             for {set i 0} {$i < $elements} {incr i} {
-                assert_equal [lindex $aux $i] [r zscore zscoretest $i]
+                # Replies have the shortest representation of the same double.
+                assert {[lindex $aux $i] == [r zscore zscoretest $i]}
             }
         }
 
+        test "ZSCORE replies with the shortest representation - $encoding" {
+            r del zscoretest
+            r zadd zscoretest 1.1 a 0.1 b 1e-5 c -2.5e+300 d
+            r zincrby zscoretest 0.2 b
+            assert_encoding $encoding zscoretest
+            assert_equal {1.1 0.30000000000000004 1e-05 -2.5e+300} [r zmscore zscoretest a b c d]
+        }
+
         test "ZMSCORE - $encoding" {
             r del zscoretest
             set aux {}
@@ -1531,7 +1540,7 @@ start_server {tags {"zset"}} {
 
             assert_encoding $encoding zscoretest
             for {set i 0} {$i < $elements} {incr i} {
-                assert_equal [lindex $aux $i] [r zmscore zscoretest $i]
+                assert {[lindex $aux $i] == [r zmscore zscoretest $i]}
             }
         }
 
@@ -1547,7 +1556,7 @@ start_server {tags {"zset"}} {
             r debug reload
             assert_encoding $encoding zscoretest
             for {set i 0} {$i < $elements} {incr i} {
-                assert_equal [lindex $aux $i] [r zscore zscoretest $i]
+                assert {[lindex $aux $i] == [r zscore zscoretest $i]}
             }
         } {} {needs:debug}
 
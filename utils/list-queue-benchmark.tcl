@@ -0,0 +1,75 @@
+#!/usr/bin/env tclsh8.5
+# Work queue benchmark: many consumers wait for jobs with BLPOP on the same
+# key, while a producer pushes jobs one at a time with LPUSH, keeping a few
+# of them in flight. The throughput reported is the number of jobs popped
+# by the consumers per second, so it includes the cost of unblocking them,
+# together with the server CPU time used for every job.
+#
+# Usage, against a server with no data to preserve (the key is overwritten):
+#
+#   ./redis-server
+#   tclsh ../utils/list-queue-benchmark.tcl 127.0.0.1 6379 1000
+#
+# Released under the BSD license like Redis itself
+
+source [file join [file dirname [info script]] ../tests/support/redis.tcl]
+
+if {[llength $argv] < 3} {
+    puts stderr "Usage: $argv0 <host> <port> <consumers> \[jobs\] \[pipeline\]"
+    exit 1
+}
+lassign $argv host port consumers jobs pipeline
+if {$jobs eq {}} {set jobs 100000}
+if {$pipeline eq {}} {set pipeline 16}
+
+# Return the CPU time used by the server so far, in microseconds.
+proc cputime r {
+    set info [$r info cpu]
+    regexp {used_cpu_sys:([0-9.]+)} $info - sys
+    regexp {used_cpu_user:([0-9.]+)} $info - user
+    expr {($sys+$user)*1000000}
+}
+
+# Read the [key job] reply of BLPOP, then wait for the next job.
+proc consume rd {
+    global popped jobs
+    $rd read
+    if {[incr popped] == $jobs} {set ::done 1}
+    $rd blpop bench:queue 0
+}
+
+# Read the LPUSH reply, and push the next job if any.
+proc produce rd {
+    global pushed replies jobs
+    $rd read
+    incr replies
+    if {$pushed < $jobs} {
+        $rd lpush bench:queue job:[incr pushed]
+    }
+}
+
+set r [redis $host $port]
+$r del bench:queue
+
+for {set j 0} {$j < $consumers} {incr j} {
+    set rd [redis $host $port 1]
+    fileevent [$rd channel] readable [list consume $rd]
+    $rd blpop bench:queue 0
+}
+after 1000
+
+set popped 0
+set pushed 0
+set replies 0
+set producer [redis $host $port 1]
+set start [clock milliseconds]
+set cpu [cputime $r]
+fileevent [$producer channel] readable [list produce $producer]
+for {set j 0} {$j < $pipeline && $pushed < $jobs} {incr j} {
+    $producer lpush bench:queue job:[incr pushed]
+}
+vwait done
+set elapsed [expr {[clock milliseconds]-$start}]
+set cpu [expr {([cputime $r]-$cpu)/$jobs}]
+puts "$consumers consumers: [expr {$jobs*1000/$elapsed}] jobs per second,\
+[format %.2f $cpu] server usec per job"
@@ -0,0 +1,93 @@
+# Replay a key access trace against a running Redis instance configured
+# with maxmemory, and report the cache hit ratio and the CPU consumed by
+# the server. Running it once with maxmemory-eviction-engine set to
+# "sampling" and once with "ordered" allows to compare the two engines.
+#
+# The trace is a text file with one key per line. Every line is replayed
+# as a GET, and on a miss the key is SET, like a read-through cache would
+# do. Instead of a trace file, "zipf" generates a Zipf distributed trace,
+# and "zipf-scan" the same trace interleaved with bursts of keys accessed
+# only once, like scans of the backing store, that are useful to evaluate
+# the effects of maxmemory-admission-filter.
+
+require 'rubygems'
+require 'redis'
+
+def zipf_trace(keys,accesses,skew)
+    weights = (1..keys).map{|i| 1.0/(i**skew)}
+    total = weights.inject(:+)
+    cdf = []
+    acc = 0
+    weights.each{|w| acc += w/total; cdf << acc}
+    (0...accesses).map{
+        x = rand
+        idx = (0...keys).bsearch{|i| cdf[i] >= x} || keys-1
+        "key:#{idx}"
+    }
+end
+
+# Insert every 'every' accesses a burst of 'len' keys never seen before.
+def add_scans(trace,every,len)
+    out = []
+    scan = 0
+    trace.each_with_index{|k,i|
+        if i > 0 && i % every == 0
+            len.times{ out << "scan:#{scan}"; scan += 1 }
+        end
+        out << k
+    }
+    out
+end
+
+def cpu_used(r)
+    info = r.info("cpu")
+    info["used_cpu_sys"].to_f + info["used_cpu_user"].to_f
+end
+
+if ARGV.length < 2
+    puts "Usage: ruby trace-replay.rb <maxmemory> <policy> [trace-file|zipf|zipf-scan]"
+    puts "Example: ruby trace-replay.rb 10mb allkeys-lru /tmp/trace.txt"
+    exit 1
+end
+
+maxmemory,policy,tracefile = ARGV
+tracefile ||= "zipf"
+if tracefile == "zipf"
+    trace = zipf_trace(100000,1000000,0.9)
+elsif tracefile == "zipf-scan"
+    trace = add_scans(zipf_trace(100000,1000000,0.9),50000,20000)
+else
+    trace = File.readlines(tracefile).map(&:chomp)
+end
+value = "x"*100
+
+r = Redis.new
+r.flushall
+r.config("SET","maxmemory",maxmemory)
+r.config("SET","maxmemory-policy",policy)
+r.config("RESETSTAT")
+engine = r.config("GET","maxmemory-eviction-engine")[1]
+admission = r.config("GET","maxmemory-admission-filter")[1]
+
+hits = 0
+start_cpu = cpu_used(r)
+trace.each_slice(100){|slice|
+    res = r.pipelined{|p| slice.each{|k| p.get(k)}}
+    misses = []
+    res.each_with_index{|v,i|
+        if v then hits += 1 else misses << slice[i] end
+    }
+    r.pipelined{|p| misses.each{|k| p.set(k,value)}} if misses.length > 0
+}
+cpu = cpu_used(r)-start_cpu
+
+stats = r.info("stats")
+puts "engine:       #{engine}"
+puts "policy:       #{policy}"
+puts "admission:    #{admission}"
+puts "accesses:     #{trace.length}"
+puts "hit ratio:    #{(hits*100.0/trace.length).round(2)}%"
+puts "keys in memory: #{r.dbsize}"
+puts "evicted keys: #{stats["evicted_keys"]}"
+puts "rejected keys: #{stats["admission_rejected_keys"]}"
+puts "server cpu:   #{cpu.round(3)} sec"
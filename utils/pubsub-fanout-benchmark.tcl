@@ -0,0 +1,109 @@
+#!/usr/bin/env tclsh8.5
+# Pub/Sub fan-out benchmark: connects many subscribers to a single channel,
+# then measures PUBLISH throughput and latency with redis-benchmark.
+#
+# Run the server with and without I/O threads to compare, for instance:
+#
+#   ./redis-server --io-threads 4
+#   tclsh ../utils/pubsub-fanout-benchmark.tcl 127.0.0.1 6379 100000
+#
+# Subscribers are spread across worker processes of at most 1000 clients
+# each, since the Tcl event loop can't watch more file descriptors.
+#
+# Released under the BSD license like Redis itself
+
+set ::received 0
+
+proc drain fd {
+    incr ::received [string length [read $fd]]
+    if {[eof $fd]} {
+        puts stderr "Subscriber disconnected"
+        exit 1
+    }
+}
+
+proc wait_received bytes {
+    while {$::received < $bytes} {
+        after 10 {set ::tick 1}
+        vwait ::tick
+    }
+}
+
+# Worker: connect the subscribers, tell the parent once they are ready, then
+# drain their messages until the parent sends the number of expected bytes.
+proc worker {host port subscribers} {
+    for {set j 0} {$j < $subscribers} {incr j} {
+        set fd [socket $host $port]
+        fconfigure $fd -translation binary -blocking 0
+        puts -nonewline $fd "*2\r\n\$9\r\nSUBSCRIBE\r\n\$6\r\nfanout\r\n"
+        flush $fd
+        fileevent $fd readable [list drain $fd]
+    }
+    set confirmation "*3\r\n\$9\r\nsubscribe\r\n\$6\r\nfanout\r\n:1\r\n"
+    wait_received [expr {$subscribers * [string length $confirmation]}]
+    set ::received 0
+    puts ready
+    flush stdout
+
+    fconfigure stdin -blocking 0
+    fileevent stdin readable {
+        if {[gets stdin line] > 0} {set ::expected $line}
+    }
+    vwait ::expected
+    wait_received [expr {$subscribers * $::expected}]
+    puts done
+    flush stdout
+}
+
+if {[lindex $argv 0] eq {--worker}} {
+    worker {*}[lrange $argv 1 end]
+    exit 0
+}
+
+if {[llength $argv] < 3} {
+    puts stderr "Usage: $argv0 <host> <port> <subscribers> \[requests\] \[datasize\] \[benchmark-path\]"
+    exit 1
+}
+lassign $argv host port subscribers requests datasize benchmark
+if {$requests eq {}} {set requests 10000}
+if {$datasize eq {}} {set datasize 16}
+if {$benchmark eq {}} {set benchmark ./redis-benchmark}
+
+puts "Connecting $subscribers subscribers..."
+set workers {}
+for {set j 0} {$j < $subscribers} {incr j 1000} {
+    set n [expr {min(1000, $subscribers - $j)}]
+    set fd [open "|[info nameofexecutable] [info script] --worker $host $port $n" r+]
+    lappend workers $fd
+}
+foreach fd $workers {
+    if {[gets $fd] ne {ready}} {
+        puts stderr "Worker failed"
+        exit 1
+    }
+}
+
+puts "Publishing $requests messages of $datasize bytes..."
+set payload [string repeat x $datasize]
+set start [clock milliseconds]
+set output [exec $benchmark -h $host -p $port -n $requests -c 1 -q \
+                publish fanout $payload]
+foreach line [split $output "\r"] {
+    if {[string match {*requests per second*} $line]} {
+        set result [string trim $line]
+    }
+}
+puts $result
+
+# Wait for the subscribers to receive all the messages.
+set msg "*3\r\n\$7\r\nmessage\r\n\$6\r\nfanout\r\n\$$datasize\r\n$payload\r\n"
+foreach fd $workers {
+    puts $fd [expr {$requests * [string length $msg]}]
+    flush $fd
+}
+foreach fd $workers {
+    gets $fd
+    close $fd
+}
+set elapsed [expr {[clock milliseconds] - $start}]
+puts "Delivered to $subscribers subscribers in $elapsed ms"
@@ -0,0 +1,83 @@
+#!/usr/bin/env tclsh8.5
+# Pattern matching benchmark: a subscriber listens to many patterns that
+# share a long literal prefix with the channel, while a publisher sends
+# messages to a channel with a long name. The throughput reported is the
+# number of PUBLISH calls per second, together with the server CPU time
+# used for every one of them.
+#
+# Usage, against a server with no other subscribers:
+#
+#   ./redis-server
+#   tclsh ../utils/pubsub-pattern-benchmark.tcl 127.0.0.1 6379 1000 256
+#
+# Released under the BSD license like Redis itself
+
+source [file join [file dirname [info script]] ../tests/support/redis.tcl]
+
+if {[llength $argv] < 4} {
+    puts stderr "Usage: $argv0 <host> <port> <patterns> <channel-len> \[messages\] \[pipeline\]"
+    exit 1
+}
+lassign $argv host port patterns chanlen messages pipeline
+if {$messages eq {}} {set messages 100000}
+if {$pipeline eq {}} {set pipeline 16}
+
+# Return the CPU time used by the server so far, in microseconds.
+proc cputime r {
+    set info [$r info cpu]
+    regexp {used_cpu_sys:([0-9.]+)} $info - sys
+    regexp {used_cpu_user:([0-9.]+)} $info - user
+    expr {($sys+$user)*1000000}
+}
+
+# Discard the messages received by the subscriber, we only care about the
+# server side cost of matching the patterns.
+proc drain fd {
+    read $fd
+    if {[eof $fd]} {set ::done 1}
+}
+
+# Read the PUBLISH reply, and publish the next message if any.
+proc produce rd {
+    global published replies messages channel
+    $rd read
+    if {[incr replies] == $messages} {set ::done 1}
+    if {$published < $messages} {
+        incr published
+        $rd publish $channel msg
+    }
+}
+
+# The channel is made of the letters of the alphabet, so that every prefix
+# of it is the literal prefix of one of the patterns.
+set channel {}
+for {set j 0} {$j < $chanlen} {incr j} {
+    append channel [format %c [expr {97+$j%26}]]
+}
+
+set r [redis $host $port]
+set subscriber [redis $host $port 1]
+for {set j 0} {$j < $patterns} {incr j} {
+    $subscriber psubscribe \
+        "[string range $channel 0 [expr {$j%$chanlen-1}]]\[0-9\]$j*"
+    $subscriber read
+}
+fconfigure [$subscriber channel] -blocking 0
+fileevent [$subscriber channel] readable [list drain [$subscriber channel]]
+
+set producer [redis $host $port 1]
+set published 0
+set replies 0
+set start [clock milliseconds]
+set cpu [cputime $r]
+fileevent [$producer channel] readable [list produce $producer]
+for {set j 0} {$j < $pipeline && $published < $messages} {incr j} {
+    incr published
+    $producer publish $channel msg
+}
+vwait done
+set elapsed [expr {[clock milliseconds]-$start}]
+set cpu [expr {([cputime $r]-$cpu)/$messages}]
+puts "$patterns patterns, $chanlen bytes channel:\
+[expr {$messages*1000/$elapsed}] publish per second,\
+[format %.2f $cpu] server usec per publish"
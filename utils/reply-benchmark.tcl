@@ -0,0 +1,56 @@
+#!/usr/bin/env tclsh8.5
+# Reply generation benchmark: creates a list, a hash, a sorted set and a
+# stream of many small elements, then measures with redis-benchmark the
+# throughput of the commands replying with the whole collection, and the
+# time spent by the server on every call, from INFO commandstats.
+#
+# Usage, against a server with no data to preserve (keys are overwritten):
+#
+#   ./redis-server
+#   tclsh ../utils/reply-benchmark.tcl 127.0.0.1 6379 1000
+#
+# Released under the BSD license like Redis itself
+
+source [file join [file dirname [info script]] ../tests/support/redis.tcl]
+
+if {[llength $argv] < 3} {
+    puts stderr "Usage: $argv0 <host> <port> <elements> \[requests\] \[benchmark-path\]"
+    exit 1
+}
+lassign $argv host port elements requests benchmark
+if {$requests eq {}} {set requests 10000}
+if {$benchmark eq {}} {set benchmark ./redis-benchmark}
+
+# Populate the keys with a pipeline, then wait for the replies.
+set r [redis $host $port]
+set rd [redis $host $port 1]
+$r del bench:list bench:hash bench:zset bench:stream
+for {set j 0} {$j < $elements} {incr j} {
+    $rd rpush bench:list element:$j
+    $rd hset bench:hash field:$j $j
+    $rd zadd bench:zset [expr {$j * 1.5}] member:$j
+    $rd xadd bench:stream * item $j value element:$j
+}
+for {set j 0} {$j < $elements*4} {incr j} {
+    $rd read
+}
+$rd close
+
+foreach cmd [list \
+    {lrange bench:list 0 -1} \
+    {hgetall bench:hash} \
+    {zrange bench:zset 0 -1} \
+    {zrange bench:zset 0 -1 withscores} \
+    {xrange bench:stream - +} \
+    {xrevrange bench:stream + -} \
+    [list xread count $elements streams bench:stream 0] \
+] {
+    $r config resetstat
+    set output [exec $benchmark -h $host -p $port -n $requests -c 1 -q {*}$cmd]
+    foreach line [split $output "\r"] {
+        if {[regexp {([0-9.]+) requests per second} $line - rps]} break
+    }
+    regexp "cmdstat_[lindex $cmd 0]:\[^\r\]*usec_per_call=(\[0-9.\]+)" [$r info commandstats] - usec
+    puts "[format %-40s $cmd] $rps requests per second, $usec usec per call"
+}
+$r close
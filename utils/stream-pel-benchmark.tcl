@@ -0,0 +1,71 @@
+#!/usr/bin/env tclsh8.5
+# Consumer group benchmark: fills a stream, then consumes it with XREADGROUP,
+# adding every entry to the PEL of the group, and finally acknowledges all
+# the entries with XACK, in the order they were delivered. The throughput of
+# the two phases is reported in entries per second, together with the server
+# CPU time used for every entry.
+#
+# Usage, against a server with no data to preserve (the key is overwritten):
+#
+#   ./redis-server
+#   tclsh ../utils/stream-pel-benchmark.tcl 127.0.0.1 6379 1000000
+#
+# Released under the BSD license like Redis itself
+
+source [file join [file dirname [info script]] ../tests/support/redis.tcl]
+
+if {[llength $argv] < 3} {
+    puts stderr "Usage: $argv0 <host> <port> <entries> \[count\]"
+    exit 1
+}
+lassign $argv host port entries count
+if {$count eq {}} {set count 100}
+
+# Return the CPU time used by the server so far, in microseconds.
+proc cputime r {
+    set info [$r info cpu]
+    regexp {used_cpu_sys:([0-9.]+)} $info - sys
+    regexp {used_cpu_user:([0-9.]+)} $info - user
+    expr {($sys+$user)*1000000}
+}
+
+proc report {name start cpu} {
+    global r entries
+    set elapsed [expr {max(1,[clock milliseconds]-$start)}]
+    set cpu [expr {([cputime $r]-$cpu)/$entries}]
+    puts "$name: [expr {$entries*1000/$elapsed}] entries per second,\
+    [format %.2f $cpu] server usec per entry"
+}
+
+set r [redis $host $port]
+set rd [redis $host $port 1]
+
+# The entries have IDs 1-1 ... 1-<entries>, so that XACK doesn't need to
+# parse the replies of XREADGROUP.
+$r del bench:stream
+for {set j 1} {$j <= $entries} {incr j} {
+    $rd xadd bench:stream 1-$j f v
+    if {$j % 1000 == 0} {
+        for {set k 0} {$k < 1000} {incr k} {$rd read}
+    }
+}
+for {set k 0} {$k < $entries % 1000} {incr k} {$rd read}
+$r xgroup create bench:stream group 0
+
+set start [clock milliseconds]
+set cpu [cputime $r]
+for {set j 0} {$j < $entries} {incr j $count} {
+    $r xreadgroup group group consumer count $count streams bench:stream >
+}
+report XREADGROUP $start $cpu
+
+set start [clock milliseconds]
+set cpu [cputime $r]
+for {set j 1} {$j <= $entries} {incr j $count} {
+    set ids {}
+    for {set k $j} {$k < $j+$count && $k <= $entries} {incr k} {
+        lappend ids 1-$k
+    }
+    $r xack bench:stream group {*}$ids
+}
+report XACK $start $cpu